@@ -0,0 +1,239 @@
+/*
+ * Copyright (c) 2016 Intel Corporation. All Rights Reserved.
+ *
+ * Permission is hereby granted, free of charge, to any person obtaining a
+ * copy of this software and associated documentation files (the
+ * "Software"), to deal in the Software without restriction, including
+ * without limitation the rights to use, copy, modify, merge, publish,
+ * distribute, sub license, and/or sell copies of the Software, and to
+ * permit persons to whom the Software is furnished to do so, subject to
+ * the following conditions:
+ *
+ * The above copyright notice and this permission notice (including the
+ * next paragraph) shall be included in all copies or substantial portions
+ * of the Software.
+ *
+ * THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND, EXPRESS
+ * OR IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF
+ * MERCHANTABILITY, FITNESS FOR A PARTICULAR PURPOSE AND NON-INFRINGEMENT.
+ * IN NO EVENT SHALL PRECISION INSIGHT AND/OR ITS SUPPLIERS BE LIABLE FOR
+ * ANY CLAIM, DAMAGES OR OTHER LIABILITY, WHETHER IN AN ACTION OF CONTRACT,
+ * TORT OR OTHERWISE, ARISING FROM, OUT OF OR IN CONNECTION WITH THE
+ * SOFTWARE OR THE USE OR OTHER DEALINGS IN THE SOFTWARE.
+ */
+
+/*
+ * Bitstream writer for the packed headers of the encode tests
+ *
+ * Bits are collected MSB first in a 64-bit cache and stored four bytes
+ * at a time. The buffer is either allocated (bitstream_start(), freed by
+ * the caller) or provided by the caller (bitstream_start_buffer(), never
+ * reallocated: writes past its end are dropped and flagged in overflow).
+ * After bitstream_end(), buffer holds bit_offset bits, the last byte
+ * padded with zeros.
+ *
+ * With bitstream_emulation_prevention() enabled, an
+ * emulation_prevention_three_byte is inserted as the bytes are stored,
+ * bit_offset then counts it (set has_emulation_bytes for packed headers).
+ */
+#ifndef BITSTREAM_H
+#define BITSTREAM_H
+
+#include <stdlib.h>
+#include <string.h>
+#include <assert.h>
+
+#define BITSTREAM_ALLOCATE_STEPPING     4096    /* in bytes */
+
+struct __bitstream {
+    unsigned char *buffer;
+    int bit_offset;             /* bits written, stored and cached */
+    int max_size;               /* size of buffer in bytes */
+    int pos;                    /* bytes stored */
+    unsigned long long cache;   /* bits not stored yet, right aligned */
+    int cache_bits;
+    int external;               /* buffer from bitstream_start_buffer() */
+    int overflow;
+    int emulation;              /* insert emulation prevention bytes */
+    int zero_bytes;             /* trailing 0x00 bytes stored */
+};
+
+typedef struct __bitstream bitstream;
+
+static inline void
+bitstream_start_buffer(bitstream *bs, unsigned char *buffer, int size)
+{
+    memset(bs, 0, sizeof(*bs));
+    bs->buffer = buffer;
+    bs->max_size = size;
+    bs->external = 1;
+}
+
+static inline void
+bitstream_start(bitstream *bs)
+{
+    memset(bs, 0, sizeof(*bs));
+    bs->max_size = BITSTREAM_ALLOCATE_STEPPING;
+    bs->buffer = (unsigned char *)malloc(bs->max_size);
+}
+
+/* room for n more bytes, emulation prevention bytes included */
+static inline int
+bitstream_reserve(bitstream *bs, int n)
+{
+    if (bs->pos + n <= bs->max_size)
+        return 1;
+
+    if (bs->external || bs->buffer == NULL) {
+        bs->overflow = 1;
+        return 0;
+    }
+
+    while (bs->pos + n > bs->max_size)
+        bs->max_size += bs->max_size;
+    bs->buffer = (unsigned char *)realloc(bs->buffer, bs->max_size);
+    if (bs->buffer == NULL) {
+        bs->overflow = 1;
+        return 0;
+    }
+    return 1;
+}
+
+static inline void
+bitstream_store_byte_ep(bitstream *bs, unsigned char byte)
+{
+    if (bs->zero_bytes >= 2 && byte <= 3) {
+        bs->buffer[bs->pos++] = 3;
+        bs->bit_offset += 8;
+        bs->zero_bytes = 0;
+    }
+    bs->buffer[bs->pos++] = byte;
+    bs->zero_bytes = byte ? 0 : bs->zero_bytes + 1;
+}
+
+/* store the whole bytes of the cache */
+static inline void
+bitstream_flush(bitstream *bs)
+{
+    int n = bs->cache_bits >> 3, i;
+
+    if (!n || !bitstream_reserve(bs, bs->emulation ? n + n / 2 + 1 : n)) {
+        bs->cache_bits &= 7;
+        return;
+    }
+
+    bs->cache_bits -= n * 8;
+    for (i = n - 1; i >= 0; i--) {
+        unsigned char byte = bs->cache >> (bs->cache_bits + i * 8);
+
+        if (bs->emulation)
+            bitstream_store_byte_ep(bs, byte);
+        else
+            bs->buffer[bs->pos++] = byte;
+    }
+}
+
+static inline void
+bitstream_put_ui(bitstream *bs, unsigned int val, int size_in_bits)
+{
+    if (!size_in_bits)
+        return;
+
+    assert(size_in_bits <= 32);
+    if (size_in_bits < 32)
+        val &= ((1u << size_in_bits) - 1);
+
+    bs->cache = (bs->cache << size_in_bits) | val;
+    bs->cache_bits += size_in_bits;
+    bs->bit_offset += size_in_bits;
+
+    if (bs->cache_bits < 32)
+        return;
+
+    /* store 4 bytes, at most 31 bits stay in the cache */
+    if (!bs->emulation && bitstream_reserve(bs, 4)) {
+        unsigned int word = bs->cache >> (bs->cache_bits - 32);
+
+        bs->buffer[bs->pos] = word >> 24;
+        bs->buffer[bs->pos + 1] = word >> 16;
+        bs->buffer[bs->pos + 2] = word >> 8;
+        bs->buffer[bs->pos + 3] = word;
+        bs->pos += 4;
+        bs->cache_bits -= 32;
+    } else
+        bitstream_flush(bs);
+}
+
+/* Exp-Golomb ue(v): the codeNum + 1 with as many leading zeros as bits after its MSB */
+static inline void
+bitstream_put_ue(bitstream *bs, unsigned int val)
+{
+    unsigned long long code = (unsigned long long)val + 1;
+    int size_in_bits = 64 - __builtin_clzll(code);
+
+    if (2 * size_in_bits - 1 <= 32)
+        bitstream_put_ui(bs, code, 2 * size_in_bits - 1);
+    else {
+        bitstream_put_ui(bs, 0, size_in_bits - 1); // leading zero
+        bitstream_put_ui(bs, code >> 1, size_in_bits - 1);
+        bitstream_put_ui(bs, code & 1, 1);
+    }
+}
+
+static inline void
+bitstream_put_se(bitstream *bs, int val)
+{
+    unsigned int new_val;
+
+    if (val <= 0)
+        new_val = -2 * val;
+    else
+        new_val = 2 * val - 1;
+
+    bitstream_put_ue(bs, new_val);
+}
+
+static inline void
+bitstream_byte_aligning(bitstream *bs, int bit)
+{
+    int bit_offset = (bs->bit_offset & 0x7);
+    int bit_left = 8 - bit_offset;
+    int new_val;
+
+    if (!bit_offset)
+        return;
+
+    assert(bit == 0 || bit == 1);
+
+    if (bit)
+        new_val = (1 << bit_left) - 1;
+    else
+        new_val = 0;
+
+    bitstream_put_ui(bs, new_val, bit_left);
+}
+
+/*
+ * enable emulation prevention for the bytes written from now on,
+ * normally right after the NAL unit header
+ */
+static inline void
+bitstream_emulation_prevention(bitstream *bs, int enable)
+{
+    bitstream_flush(bs);
+    bs->emulation = enable;
+    bs->zero_bytes = 0;
+}
+
+static inline void
+bitstream_end(bitstream *bs)
+{
+    int bit_left = (8 - (bs->cache_bits & 7)) & 7;
+
+    /* pad the last byte, bit_offset doesn't count the padding */
+    bs->cache <<= bit_left;
+    bs->cache_bits += bit_left;
+    bitstream_flush(bs);
+}
+
+#endif /* BITSTREAM_H */
@@ -0,0 +1,211 @@
+/*
+ * Copyright (c) 2016 Intel Corporation. All Rights Reserved.
+ *
+ * Permission is hereby granted, free of charge, to any person obtaining a
+ * copy of this software and associated documentation files (the
+ * "Software"), to deal in the Software without restriction, including
+ * without limitation the rights to use, copy, modify, merge, publish,
+ * distribute, sub license, and/or sell copies of the Software, and to
+ * permit persons to whom the Software is furnished to do so, subject to
+ * the following conditions:
+ *
+ * The above copyright notice and this permission notice (including the
+ * next paragraph) shall be included in all copies or substantial portions
+ * of the Software.
+ *
+ * THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND, EXPRESS
+ * OR IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF
+ * MERCHANTABILITY, FITNESS FOR A PARTICULAR PURPOSE AND NON-INFRINGEMENT.
+ * IN NO EVENT SHALL PRECISION INSIGHT AND/OR ITS SUPPLIERS BE LIABLE FOR
+ * ANY CLAIM, DAMAGES OR OTHER LIABILITY, WHETHER IN AN ACTION OF CONTRACT,
+ * TORT OR OTHERWISE, ARISING FROM, OUT OF OR IN CONNECTION WITH THE
+ * SOFTWARE OR THE USE OR OTHER DEALINGS IN THE SOFTWARE.
+ */
+
+/*
+ * Coded data output of the encode tests
+ *
+ * The sink is a file, "-" for stdout or "unix:<path>" for a Unix stream
+ * socket a packager listens on. When streaming to stdout, the messages
+ * of the tool are moved to stderr so they don't end up in the stream,
+ * tools printing before the sink is opened call coded_sink_stdout() first.
+ *
+ * coded_sink_write_coded() hands the header written by the application
+ * (if any) and every VACodedBufferSegment of a mapped coded buffer to one
+ * writev(), the data goes out of the mapped buffer without a copy.
+ */
+#ifndef CODED_SINK_H
+#define CODED_SINK_H
+
+#include <stdio.h>
+#include <string.h>
+#include <errno.h>
+#include <fcntl.h>
+#include <signal.h>
+#include <unistd.h>
+#include <sys/types.h>
+#include <sys/socket.h>
+#include <sys/uio.h>
+#include <sys/un.h>
+
+#define CODED_SINK_IOV_MAX      64      /* more segments take several writev() */
+
+struct coded_sink {
+    int fd;
+    unsigned long long bytes;           /* written */
+    unsigned int writes;                /* writev() calls */
+};
+
+static int coded_sink_stdout_fd = -1;
+
+/* keep the real stdout for the stream, printf() goes to stderr from now on */
+static inline int
+coded_sink_stdout(void)
+{
+    if (coded_sink_stdout_fd >= 0)
+        return 0;
+
+    fflush(stdout);
+    coded_sink_stdout_fd = dup(STDOUT_FILENO);
+    if (coded_sink_stdout_fd < 0 || dup2(STDERR_FILENO, STDOUT_FILENO) < 0)
+        return -1;
+
+    return 0;
+}
+
+/* 0 on success, -1 with errno set */
+static inline int
+coded_sink_open(struct coded_sink *sink, const char *name)
+{
+    memset(sink, 0, sizeof(*sink));
+    sink->fd = -1;
+
+    if (!strcmp(name, "-")) {
+        if (coded_sink_stdout())
+            return -1;
+        /* only one sink gets the stream */
+        sink->fd = coded_sink_stdout_fd;
+        coded_sink_stdout_fd = -1;
+    } else if (!strncmp(name, "unix:", 5)) {
+        struct sockaddr_un addr;
+
+        if (strlen(name + 5) >= sizeof(addr.sun_path)) {
+            errno = ENAMETOOLONG;
+            return -1;
+        }
+        memset(&addr, 0, sizeof(addr));
+        addr.sun_family = AF_UNIX;
+        strcpy(addr.sun_path, name + 5);
+
+        sink->fd = socket(AF_UNIX, SOCK_STREAM, 0);
+        if (sink->fd < 0)
+            return -1;
+        if (connect(sink->fd, (struct sockaddr *)&addr, sizeof(addr)) < 0) {
+            close(sink->fd);
+            sink->fd = -1;
+            return -1;
+        }
+    } else {
+        sink->fd = open(name, O_WRONLY | O_CREAT | O_TRUNC, 0666);
+        return sink->fd < 0 ? -1 : 0;
+    }
+
+    /* a reader going away is a write error, not a signal */
+    signal(SIGPIPE, SIG_IGN);
+
+    return 0;
+}
+
+/* all of iov, the caller's iov is consumed, returns the bytes or -1 */
+static inline long long
+coded_sink_writev(struct coded_sink *sink, struct iovec *iov, int iov_num)
+{
+    long long total = 0;
+    ssize_t n;
+
+    while (iov_num > 0) {
+        n = writev(sink->fd, iov, iov_num);
+        if (n < 0) {
+            if (errno == EINTR)
+                continue;
+            return -1;
+        }
+        sink->writes++;
+        sink->bytes += n;
+        total += n;
+
+        /* a pipe or socket may take part of it */
+        while (iov_num > 0 && (size_t)n >= iov->iov_len) {
+            n -= iov->iov_len;
+            iov++;
+            iov_num--;
+        }
+        if (iov_num > 0) {
+            iov->iov_base = (unsigned char *)iov->iov_base + n;
+            iov->iov_len -= n;
+        }
+    }
+
+    return total;
+}
+
+static inline long long
+coded_sink_write(struct coded_sink *sink, const void *data, unsigned int size)
+{
+    struct iovec iov;
+
+    iov.iov_base = (void *)data;
+    iov.iov_len = size;
+
+    return coded_sink_writev(sink, &iov, 1);
+}
+
+/*
+ * header (header_size may be 0) and the segment chain of a mapped coded
+ * buffer, returns the bytes written or -1
+ */
+static inline long long
+coded_sink_write_coded(struct coded_sink *sink, const void *header, unsigned int header_size,
+                       VACodedBufferSegment *segment)
+{
+    struct iovec iov[CODED_SINK_IOV_MAX];
+    long long total = 0, n;
+    int iov_num = 0;
+
+    if (header_size) {
+        iov[iov_num].iov_base = (void *)header;
+        iov[iov_num].iov_len = header_size;
+        iov_num++;
+    }
+
+    for (; segment; segment = (VACodedBufferSegment *)segment->next) {
+        if (!segment->size)
+            continue;
+        if (iov_num == CODED_SINK_IOV_MAX) {
+            n = coded_sink_writev(sink, iov, iov_num);
+            if (n < 0)
+                return -1;
+            total += n;
+            iov_num = 0;
+        }
+        iov[iov_num].iov_base = segment->buf;
+        iov[iov_num].iov_len = segment->size;
+        iov_num++;
+    }
+
+    n = coded_sink_writev(sink, iov, iov_num);
+    if (n < 0)
+        return -1;
+
+    return total + n;
+}
+
+static inline void
+coded_sink_close(struct coded_sink *sink)
+{
+    if (sink->fd >= 0)
+        close(sink->fd);
+    sink->fd = -1;
+}
+
+#endif /* CODED_SINK_H */
@@ -32,13 +32,19 @@
 #endif
 #include "va_display.h"
 
-static int drm_fd = -1;
+/* one DRM fd per open display, so a test can use several of them */
+#define DRM_DISPLAY_MAX 64
+
+static struct {
+    VADisplay va_dpy;
+    int fd;
+} drm_displays[DRM_DISPLAY_MAX];
 
 static VADisplay
 va_open_display_drm(void)
 {
     VADisplay va_dpy;
-    int i;
+    int i, n, drm_fd;
 
     static const char *drm_device_paths[] = {
         "/dev/dri/renderD128",
@@ -46,17 +52,26 @@ va_open_display_drm(void)
         NULL
     };
 
+    for (n = 0; n < DRM_DISPLAY_MAX; n++) {
+        if (!drm_displays[n].va_dpy)
+            break;
+    }
+    if (n == DRM_DISPLAY_MAX)
+        return NULL;
+
     for (i = 0; drm_device_paths[i]; i++) {
         drm_fd = open(drm_device_paths[i], O_RDWR);
         if (drm_fd < 0)
             continue;
 
         va_dpy = vaGetDisplayDRM(drm_fd);
-        if (va_dpy)
+        if (va_dpy) {
+            drm_displays[n].va_dpy = va_dpy;
+            drm_displays[n].fd = drm_fd;
             return va_dpy;
+        }
 
         close(drm_fd);
-        drm_fd = -1;
     }
     return NULL;
 }
@@ -64,13 +79,18 @@ va_open_display_drm(void)
 static void
 va_close_display_drm(VADisplay va_dpy)
 {
-    if (drm_fd < 0)
-        return;
+    int n;
 
-    close(drm_fd);
-    drm_fd = -1;
-}
+    for (n = 0; n < DRM_DISPLAY_MAX; n++) {
+        if (drm_displays[n].va_dpy != va_dpy)
+            continue;
 
+        close(drm_displays[n].fd);
+        drm_displays[n].va_dpy = NULL;
+        drm_displays[n].fd = -1;
+        return;
+    }
+}
 
 static VAStatus
 va_put_surface_drm(
@@ -41,12 +41,15 @@
 #include <fcntl.h>
 #include <assert.h>
 #include <time.h>
+#include <limits.h>
 
 #include <pthread.h>
 
 #include <va/va.h>
 #include <va/va_enc_h264.h>
 #include "va_display.h"
+#include "time_us.h"
+#include "../bitstream.h"
 
 #define NAL_REF_IDC_NONE        0
 #define NAL_REF_IDC_LOW         1
@@ -78,12 +81,15 @@
         exit(1);                                                        \
     }
 
+#include "../packed_header.h"
+#include "../coded_sink.h"
+#include "../yuv_input.h"
+
 static VADisplay va_dpy;
 
 static int picture_width, picture_width_in_mbs;
 static int picture_height, picture_height_in_mbs;
 static int frame_size;
-static unsigned char *newImageBuffer = 0;
 
 static int qp_value = 26;
 
@@ -94,37 +100,148 @@ static int ip_period = 1;
 
 #define MAX_SLICES      32
 
+#define MIN(a, b) ((a)>(b)?(b):(a))
+#define MAX(a, b) ((a)>(b)?(a):(b))
+
 
 static  unsigned int MaxFrameNum = (1<<12);
 static  unsigned int MaxPicOrderCntLsb = (1<<8);
 static  unsigned int Log2MaxFrameNum = 12;
 static  unsigned int Log2MaxPicOrderCntLsb = 8;
 
-static int
-build_packed_pic_buffer(unsigned char **header_buffer);
+static void
+build_packed_pic_buffer(struct packed_header *header);
 
-static int
-build_packed_seq_buffer(unsigned char **header_buffer);
+static void
+build_packed_seq_buffer(struct packed_header *header);
 
-static int 
-build_packed_sei_pic_timing(unsigned int cpb_removal_length,
+static void
+build_packed_sei_pic_timing(struct packed_header *header,
+				unsigned int cpb_removal_length,
+				unsigned int cpb_removal_delay,
 				unsigned int dpb_output_length,
-				unsigned char **sei_buffer);
+				unsigned int *cpb_removal_offset);
 
-static int
-build_packed_idr_sei_buffer_timing(unsigned int init_cpb_removal_delay_length,
+static void
+build_packed_idr_sei_buffer_timing(struct packed_header *header,
+				unsigned int init_cpb_removal_delay_length,
 				unsigned int cpb_removal_length,
+				unsigned int cpb_removal_delay,
 				unsigned int dpb_output_length,
-				unsigned char **sei_buffer);
+				unsigned int *cpb_removal_offset);
+
+#define INPUT_SURFACE_MAX       16
+static int num_input_surfaces = 4;
 
-struct upload_thread_param
+/*
+ * The upload worker reads the frames in encoding order into a ring of
+ * input surfaces, frame n goes to input surface n % num_input_surfaces.
+ * It runs ahead of the encoder until all the surfaces are in use. The
+ * source frames come from the readahead ring of the input, a stream
+ * (pipe, stdin) ends at the first frame the worker doesn't find.
+ */
+struct upload_queue
 {
-    FILE *yuv_fp;
-    VASurfaceID surface_id;
+    struct yuv_input *input;
+    pthread_t thread;
+    pthread_mutex_t mutex;
+    pthread_cond_t cond;
+    unsigned long long uploaded;        /* frames in the input surfaces */
+    unsigned long long released;        /* frames encoded, their surfaces are free */
+    unsigned long long frames;          /* of the input, once end is set */
+    int end;
+    int stop;
+    unsigned long long wait_us;         /* the encoder waited for an upload */
+};
+
+#define CODED_FRAME_MAX         16
+static int num_coded_frames = 4;
+
+/* what encoding a frame changes, restored to encode it again */
+struct encode_state
+{
+    VAPictureH264 ReferenceFrames[16];
+    VAPictureH264 CurrentCurrPic;
+    unsigned int numShortTerm;
+    int current_frame_num;
+    unsigned long long current_IDR_display;
+    VAEncPictureParameterBufferH264 pic_param;
+    unsigned long long idr_frame_num;
+    unsigned long long prev_idr_cpb_removal;
+    unsigned long long current_idr_cpb_removal;
+};
+
+/*
+ * Coded buffer sizes follow the frames: per frame type, the 90th
+ * percentile of the recent coded sizes plus half of it or the rate
+ * control budget of a frame (CODED_I_BUDGET of them for I frames),
+ * never below the biggest recent frame, rounded up to a power of two.
+ * Buffers go back to a pool when their frame is written and the
+ * smallest big enough is reused.
+ */
+#define CODED_SIZE_HISTORY      32
+#define CODED_SIZE_SAMPLES_MIN  4       /* keep the initial size until then */
+#define CODED_SIZE_MIN          4096
+#define CODED_I_BUDGET          4
+#define CODED_POOL_MAX          CODED_FRAME_MAX
+
+struct coded_size_history
+{
+    int size[CODED_SIZE_HISTORY];
+    int num;
+    int next;
+};
+
+struct coded_frame
+{
+    VABufferID coded_buf;
+    int coded_size;
+    int slice_type;
+    struct encode_state state;          /* before the frame was encoded */
+};
+
+/*
+ * The output thread syncs, maps and writes the coded frames in encoding
+ * order while up to num_coded_frames are being encoded, frame n uses
+ * coded frame n % num_coded_frames. If a coded buffer overflows, the
+ * frames after it are dropped as well and the encoder restarts from that
+ * frame with a bigger buffer, which gives the serial bitstream with CQP.
+ *
+ * Under CBR the driver's rate control has already counted the frames
+ * submitted after the overflowed one, they are kept: an overflowed B
+ * frame, which nothing refers to, is encoded again alone before the
+ * output goes on, and the I/P coded buffers are sized for a raw frame so
+ * that the frames referring to them never have to be dropped. Should one
+ * overflow nevertheless, the encoder restarts from it as with CQP.
+ */
+struct output_queue
+{
+    struct coded_sink sink;
+    pthread_t thread;
+    pthread_mutex_t mutex;
+    pthread_cond_t cond;
+    struct coded_frame frame[CODED_FRAME_MAX];
+    unsigned long long submitted;       /* frames encoded */
+    unsigned long long written;         /* frames written or dropped */
+    int overflow;                       /* written - 1 overflowed, drop the others */
+    unsigned long long overflow_frame;
+    int redo;                           /* CBR: written overflowed, the encoder codes it again */
+    int stop;
+    unsigned long long wait_us;         /* the encoder waited for a coded buffer */
+    unsigned int overflows;
+    unsigned int reencoded;             /* frames encoded again after an overflow */
+
+    struct coded_size_history history[2];       /* I, P/B frames */
+    VABufferID pool[CODED_POOL_MAX];    /* free coded buffers */
+    int pool_size[CODED_POOL_MAX];
+    int pool_num;
+    unsigned long long coded_bytes;     /* in the coded buffers, free ones included */
+    unsigned long long coded_bytes_peak;
+    unsigned int coded_allocs;
 };
 
 static void 
-upload_yuv_to_surface(FILE *yuv_fp, VASurfaceID surface_id);
+upload_yuv_to_surface(const unsigned char *frame, VASurfaceID surface_id);
 
 static struct {
     VAProfile profile;
@@ -138,22 +255,30 @@ static struct {
     VABufferID pic_param_buf_id;                /* Picture level parameter */
     VABufferID slice_param_buf_id[MAX_SLICES];  /* Slice level parameter, multil slices */
     VABufferID codedbuf_buf_id;                 /* Output buffer, compressed data */
-    VABufferID packed_seq_header_param_buf_id;
-    VABufferID packed_seq_buf_id;
+    VABufferID packed_seq_header_param_buf_id;  /* packed headers of the current picture, */
+    VABufferID packed_seq_buf_id;               /* owned by the templates below */
     VABufferID packed_pic_header_param_buf_id;
     VABufferID packed_pic_buf_id;
     VABufferID packed_sei_header_param_buf_id;   /* the SEI buffer */
     VABufferID packed_sei_buf_id;
     VABufferID misc_parameter_hrd_buf_id;
 
+    /* packed header templates, rebuilt when the parameter sets change */
+    struct packed_header packed_seq;
+    struct packed_header packed_pic;
+    struct packed_header packed_idr_sei;        /* buffering period + pic timing */
+    struct packed_header packed_sei;            /* pic timing */
+    unsigned int idr_sei_cpb_removal_offset;    /* bit offset of cpb_removal_delay */
+    unsigned int sei_cpb_removal_offset;
+
     int num_slices;
     int codedbuf_i_size;
     int codedbuf_pb_size;
     int current_input_surface;
     int rate_control_method;
-    struct upload_thread_param upload_thread_param;
-    pthread_t upload_thread_id;
-    int upload_thread_value;
+    int encode_again;                   /* a B frame encoded again alone, into SID_RECON_PICTURE */
+    struct upload_queue upload;
+    struct output_queue output;
     int i_initial_cpb_removal_delay;
     int i_initial_cpb_removal_delay_offset;
     int i_initial_cpb_removal_delay_length;
@@ -243,16 +368,15 @@ static void destory_encode_pipe()
  *  The encode pipe resource define 
  *
  ***************************************************/
-#define SID_INPUT_PICTURE_0                     0
-#define SID_INPUT_PICTURE_1                     1
-#define SID_REFERENCE_PICTURE_L0                2
-#define SID_REFERENCE_PICTURE_L1                3
-#define SID_RECON_PICTURE                       4
+#define SID_REFERENCE_PICTURE_L0                0
+#define SID_REFERENCE_PICTURE_L1                1
+#define SID_RECON_PICTURE                       2
 #define SID_NUMBER                              SID_RECON_PICTURE + 1
 
 #define SURFACE_NUM 16 /* 16 surfaces for reference */
 
 static  VASurfaceID surface_ids[SID_NUMBER];
+static  VASurfaceID input_surface[INPUT_SURFACE_MAX];
 static  VASurfaceID ref_surface[SURFACE_NUM];
 
 static  unsigned long long current_frame_display = 0;
@@ -264,6 +388,7 @@ static  VAPictureH264 CurrentCurrPic;
 
 static int frame_number;
 static unsigned long long enc_frame_number;
+static int input_frame_display(unsigned long long encoding_order, unsigned long long frames);
 static int current_frame_type;
 static int current_frame_num;
 static unsigned int current_poc;
@@ -275,16 +400,89 @@ static  unsigned int numShortTerm = 0;
 static void *
 upload_thread_function(void *data)
 {
-    struct upload_thread_param *param = data;
+    struct upload_queue *queue = data;
+    unsigned char *frame;
+    unsigned long long f;
+
+    for (f = 0; ; f++) {
+        pthread_mutex_lock(&queue->mutex);
+        while (!queue->stop && f - queue->released >= (unsigned long long)num_input_surfaces)
+            pthread_cond_wait(&queue->cond, &queue->mutex);
+        pthread_mutex_unlock(&queue->mutex);
+        if (queue->stop)
+            break;
 
-    upload_yuv_to_surface(param->yuv_fp, param->surface_id);
+        /* there are as many frames to encode as frames in the input */
+        if (yuv_input_frame(queue->input, f) == NULL)
+            break;
+        frame = yuv_input_frame(queue->input, input_frame_display(f, ~0ULL));
+        if (frame == NULL) /* an anchor past the end, the input has ended by now */
+            frame = yuv_input_frame(queue->input, input_frame_display(f, queue->input->frames));
+        assert(frame);
+        upload_yuv_to_surface(frame, input_surface[f % num_input_surfaces]);
+
+        pthread_mutex_lock(&queue->mutex);
+        queue->uploaded = f + 1;
+        pthread_cond_broadcast(&queue->cond);
+        pthread_mutex_unlock(&queue->mutex);
+    }
+
+    pthread_mutex_lock(&queue->mutex);
+    queue->frames = f;
+    queue->end = 1;
+    pthread_cond_broadcast(&queue->cond);
+    pthread_mutex_unlock(&queue->mutex);
 
     return NULL;
 }
 
-static void alloc_encode_resource(FILE *yuv_fp)
+/* frame_number once frame f is uploaded, the frames of the input if it ended before f */
+static int upload_frames(struct upload_queue *queue, unsigned long long f)
+{
+    unsigned long long begin = time_us_monotonic();
+    int frames = frame_number;
+
+    pthread_mutex_lock(&queue->mutex);
+    while (queue->uploaded <= f && !queue->end)
+        pthread_cond_wait(&queue->cond, &queue->mutex);
+    if (queue->uploaded <= f)
+        frames = queue->frames;
+    pthread_mutex_unlock(&queue->mutex);
+    queue->wait_us += time_us_monotonic() - begin;
+
+    return frames;
+}
+
+/* the input surface of frame f, once it is uploaded */
+static int upload_wait(struct upload_queue *queue, unsigned long long f)
+{
+    unsigned long long begin = time_us_monotonic();
+
+    pthread_mutex_lock(&queue->mutex);
+    while (queue->uploaded <= f)
+        pthread_cond_wait(&queue->cond, &queue->mutex);
+    pthread_mutex_unlock(&queue->mutex);
+    queue->wait_us += time_us_monotonic() - begin;
+
+    return f % num_input_surfaces;
+}
+
+/* the input surface of frame f may be reused */
+static void upload_release(struct upload_queue *queue, unsigned long long f)
+{
+    pthread_mutex_lock(&queue->mutex);
+    queue->released = f + 1;
+    pthread_cond_broadcast(&queue->cond);
+    pthread_mutex_unlock(&queue->mutex);
+}
+
+static void *output_thread_function(void *data);
+static int avcenc_destroy_buffers(VABufferID *va_buffers, unsigned int num_va_buffers);
+
+static void alloc_encode_resource(struct yuv_input *input)
 {
     VAStatus va_status;
+    int i;
 
     // Create surface
     va_status = vaCreateSurfaces(
@@ -306,67 +504,130 @@ static void alloc_encode_resource(FILE *yuv_fp)
 
     CHECK_VASTATUS(va_status, "vaCreateSurfaces");
 
+    // Create the input surfaces
+    va_status = vaCreateSurfaces(
+        va_dpy,
+        VA_RT_FORMAT_YUV420, picture_width, picture_height,
+        input_surface, num_input_surfaces,
+        NULL, 0
+    );
 
-    newImageBuffer = (unsigned char *)malloc(frame_size);
+    CHECK_VASTATUS(va_status, "vaCreateSurfaces");
 
-    /* firstly upload YUV data to SID_INPUT_PICTURE_1 */
-    avcenc_context.upload_thread_param.yuv_fp = yuv_fp;
-    avcenc_context.upload_thread_param.surface_id = surface_ids[SID_INPUT_PICTURE_1];
+    /* the upload worker fills the input surfaces until the end of the clip */
+    avcenc_context.upload.input = input;
+    pthread_mutex_init(&avcenc_context.upload.mutex, NULL);
+    pthread_cond_init(&avcenc_context.upload.cond, NULL);
+    if (pthread_create(&avcenc_context.upload.thread, NULL,
+                       upload_thread_function, &avcenc_context.upload)) {
+        fprintf(stderr, "FATAL error!!!\n");
+        exit(1);
+    }
 
-    avcenc_context.upload_thread_value = pthread_create(&avcenc_context.upload_thread_id,
-                                                        NULL,
-                                                        upload_thread_function, 
-                                                        (void*)&avcenc_context.upload_thread_param);
+    /* the coded buffers are created with the first frame using them */
+    for (i = 0; i < CODED_FRAME_MAX; i++)
+        avcenc_context.output.frame[i].coded_buf = VA_INVALID_ID;
+    pthread_mutex_init(&avcenc_context.output.mutex, NULL);
+    pthread_cond_init(&avcenc_context.output.cond, NULL);
+    if (pthread_create(&avcenc_context.output.thread, NULL,
+                       output_thread_function, &avcenc_context.output)) {
+        fprintf(stderr, "FATAL error!!!\n");
+        exit(1);
+    }
 }
 
 static void release_encode_resource()
 {
-    pthread_join(avcenc_context.upload_thread_id, NULL);
-    free(newImageBuffer);
+    int i;
+
+    pthread_mutex_lock(&avcenc_context.output.mutex);
+    avcenc_context.output.stop = 1;
+    pthread_cond_broadcast(&avcenc_context.output.cond);
+    pthread_mutex_unlock(&avcenc_context.output.mutex);
+    pthread_join(avcenc_context.output.thread, NULL);
+    pthread_mutex_destroy(&avcenc_context.output.mutex);
+    pthread_cond_destroy(&avcenc_context.output.cond);
+    for (i = 0; i < CODED_FRAME_MAX; i++)
+        avcenc_destroy_buffers(&avcenc_context.output.frame[i].coded_buf, 1);
+    avcenc_destroy_buffers(avcenc_context.output.pool, avcenc_context.output.pool_num);
+
+    pthread_mutex_lock(&avcenc_context.upload.mutex);
+    avcenc_context.upload.stop = 1;
+    pthread_cond_broadcast(&avcenc_context.upload.cond);
+    pthread_mutex_unlock(&avcenc_context.upload.mutex);
+    pthread_join(avcenc_context.upload.thread, NULL);
+    pthread_mutex_destroy(&avcenc_context.upload.mutex);
+    pthread_cond_destroy(&avcenc_context.upload.cond);
+
+    packed_header_release(&avcenc_context.packed_seq);
+    packed_header_release(&avcenc_context.packed_pic);
+    packed_header_release(&avcenc_context.packed_idr_sei);
+    packed_header_release(&avcenc_context.packed_sei);
 
     // Release all the surfaces resource
     vaDestroySurfaces(va_dpy, surface_ids, SID_NUMBER);
+    vaDestroySurfaces(va_dpy, input_surface, num_input_surfaces);
     // Release all the reference surfaces
     vaDestroySurfaces(va_dpy, ref_surface, SURFACE_NUM);
 }
 
 static void avcenc_update_sei_param(int is_idr)
 {
-	VAEncPackedHeaderParameterBuffer packed_header_param_buffer;
-	unsigned int length_in_bits;
-	unsigned char *packed_sei_buffer = NULL;
-	VAStatus va_status;
-
-        if (is_idr)
-	    length_in_bits = build_packed_idr_sei_buffer_timing(
+	struct {
+	    int i_initial_cpb_removal_delay;
+	    int i_initial_cpb_removal_delay_offset;
+	    int i_initial_cpb_removal_delay_length;
+	    int i_cpb_removal_delay_length;
+	    int i_dpb_output_delay_length;
+	} key;
+	struct packed_header *header;
+	unsigned int *cpb_removal_offset;
+	unsigned int cpb_removal_delay;
+	VABufferID buffers[2];
+
+	memset(&key, 0, sizeof(key));
+	key.i_initial_cpb_removal_delay = avcenc_context.i_initial_cpb_removal_delay;
+	key.i_initial_cpb_removal_delay_offset = avcenc_context.i_initial_cpb_removal_delay_offset;
+	key.i_initial_cpb_removal_delay_length = avcenc_context.i_initial_cpb_removal_delay_length;
+	key.i_cpb_removal_delay_length = avcenc_context.i_cpb_removal_delay_length;
+	key.i_dpb_output_delay_length = avcenc_context.i_dpb_output_delay_length;
+
+        if (is_idr) {
+	    header = &avcenc_context.packed_idr_sei;
+	    cpb_removal_offset = &avcenc_context.idr_sei_cpb_removal_offset;
+	    cpb_removal_delay = avcenc_context.current_cpb_removal - avcenc_context.prev_idr_cpb_removal;
+	} else {
+	    header = &avcenc_context.packed_sei;
+	    cpb_removal_offset = &avcenc_context.sei_cpb_removal_offset;
+	    cpb_removal_delay = avcenc_context.current_cpb_removal - avcenc_context.current_idr_cpb_removal;
+	}
+
+	/* only the pic timing delays change from one picture to the next */
+	if (packed_header_lookup(header, &key, sizeof(key))) {
+	    packed_header_patch(header, *cpb_removal_offset,
+				cpb_removal_delay,
+				avcenc_context.i_cpb_removal_delay_length);
+	    packed_header_patch(header,
+				*cpb_removal_offset + avcenc_context.i_cpb_removal_delay_length,
+				avcenc_context.current_dpb_removal_delta,
+				avcenc_context.i_dpb_output_delay_length);
+	} else if (is_idr)
+	    build_packed_idr_sei_buffer_timing(header,
 				avcenc_context.i_initial_cpb_removal_delay_length,
 				avcenc_context.i_cpb_removal_delay_length,
+				cpb_removal_delay,
 				avcenc_context.i_dpb_output_delay_length,
-				&packed_sei_buffer);
-       else
-	    length_in_bits = build_packed_sei_pic_timing(
+				cpb_removal_offset);
+	else
+	    build_packed_sei_pic_timing(header,
 				avcenc_context.i_cpb_removal_delay_length,
+				cpb_removal_delay,
 				avcenc_context.i_dpb_output_delay_length,
-				&packed_sei_buffer);
-
-	packed_header_param_buffer.type = VAEncPackedHeaderH264_SEI;
-	packed_header_param_buffer.bit_length = length_in_bits;
-	packed_header_param_buffer.has_emulation_bytes = 0;
-
-	va_status = vaCreateBuffer(va_dpy,
-				avcenc_context.context_id,
-				VAEncPackedHeaderParameterBufferType,
-				sizeof(packed_header_param_buffer), 1, &packed_header_param_buffer,
-				&avcenc_context.packed_sei_header_param_buf_id);
-	CHECK_VASTATUS(va_status,"vaCreateBuffer");
-
-	va_status = vaCreateBuffer(va_dpy,
-				avcenc_context.context_id,
-				VAEncPackedHeaderDataBufferType,
-				(length_in_bits + 7) / 8, 1, packed_sei_buffer,
-				&avcenc_context.packed_sei_buf_id);
-	CHECK_VASTATUS(va_status,"vaCreateBuffer");
-	free(packed_sei_buffer);
+				cpb_removal_offset);
+
+	packed_header_buffers(va_dpy, avcenc_context.context_id, header, buffers);
+	avcenc_context.packed_sei_header_param_buf_id = buffers[0];
+	avcenc_context.packed_sei_buf_id = buffers[1];
 	return;
 }
 
@@ -492,7 +753,11 @@ static void avcenc_update_picture_parameter(int slice_type, int is_idr)
     // Picture level
     pic_param = &avcenc_context.pic_param;
 
-    pic_param->CurrPic.picture_id = ref_surface[current_slot];
+    /* the slot of a B frame encoded again may belong to a frame after it by now */
+    if (avcenc_context.encode_again)
+        pic_param->CurrPic.picture_id = surface_ids[SID_RECON_PICTURE];
+    else
+        pic_param->CurrPic.picture_id = ref_surface[current_slot];
     pic_param->CurrPic.frame_idx = current_frame_num;
     pic_param->CurrPic.flags = 0;
 
@@ -529,21 +794,16 @@ static void avcenc_update_picture_parameter(int slice_type, int is_idr)
 #define VA_FOURCC_I420          0x30323449
 #endif
 
-static void upload_yuv_to_surface(FILE *yuv_fp, VASurfaceID surface_id)
+static void upload_yuv_to_surface(const unsigned char *frame, VASurfaceID surface_id)
 {
     VAImage surface_image;
     VAStatus va_status;
     void *surface_p = NULL;
-    unsigned char *y_src, *u_src, *v_src;
+    const unsigned char *y_src, *u_src, *v_src;
     unsigned char *y_dst, *u_dst, *v_dst;
     int y_size = picture_width * picture_height;
     int u_size = (picture_width >> 1) * (picture_height >> 1);
     int row, col;
-    size_t n_items;
-
-    do {
-        n_items = fread(newImageBuffer, frame_size, 1, yuv_fp);
-    } while (n_items != 1);
 
     va_status = vaDeriveImage(va_dpy, surface_id, &surface_image);
     CHECK_VASTATUS(va_status,"vaDeriveImage");
@@ -551,9 +811,9 @@ static void upload_yuv_to_surface(FILE *yuv_fp, VASurfaceID surface_id)
     vaMapBuffer(va_dpy, surface_image.buf, &surface_p);
     assert(VA_STATUS_SUCCESS == va_status);
         
-    y_src = newImageBuffer;
-    u_src = newImageBuffer + y_size; /* UV offset for NV12 */
-    v_src = newImageBuffer + y_size + u_size;
+    y_src = frame;
+    u_src = frame + y_size; /* UV offset for NV12 */
+    v_src = frame + y_size + u_size;
 
     y_dst = surface_p + surface_image.offsets[0];
     u_dst = surface_p + surface_image.offsets[1]; /* UV offset for NV12 */
@@ -695,71 +955,87 @@ static int update_ReferenceFrames(void)
     return 0;
 }
 
-static int begin_picture(FILE *yuv_fp, int frame_num, int display_num, int slice_type, int is_idr)
+static void encode_state_save(struct encode_state *state)
 {
-    VAStatus va_status;
+    memcpy(state->ReferenceFrames, ReferenceFrames, sizeof(ReferenceFrames));
+    state->CurrentCurrPic = CurrentCurrPic;
+    state->numShortTerm = numShortTerm;
+    state->current_frame_num = current_frame_num;
+    state->current_IDR_display = current_IDR_display;
+    state->pic_param = avcenc_context.pic_param;
+    state->idr_frame_num = avcenc_context.idr_frame_num;
+    state->prev_idr_cpb_removal = avcenc_context.prev_idr_cpb_removal;
+    state->current_idr_cpb_removal = avcenc_context.current_idr_cpb_removal;
+}
 
-    if (avcenc_context.upload_thread_value != 0) {
-        fprintf(stderr, "FATAL error!!!\n");
-        exit(1);
-    }
-    
-    pthread_join(avcenc_context.upload_thread_id, NULL);
+static void encode_state_restore(const struct encode_state *state)
+{
+    memcpy(ReferenceFrames, state->ReferenceFrames, sizeof(ReferenceFrames));
+    CurrentCurrPic = state->CurrentCurrPic;
+    numShortTerm = state->numShortTerm;
+    current_frame_num = state->current_frame_num;
+    current_IDR_display = state->current_IDR_display;
+    avcenc_context.pic_param = state->pic_param;
+    avcenc_context.idr_frame_num = state->idr_frame_num;
+    avcenc_context.prev_idr_cpb_removal = state->prev_idr_cpb_removal;
+    avcenc_context.current_idr_cpb_removal = state->current_idr_cpb_removal;
+}
 
-    avcenc_context.upload_thread_value = -1;
+static int begin_picture(int display_num, int slice_type, int is_idr)
+{
+    VAStatus va_status;
 
-    if (avcenc_context.current_input_surface == SID_INPUT_PICTURE_0)
-        avcenc_context.current_input_surface = SID_INPUT_PICTURE_1;
-    else
-        avcenc_context.current_input_surface = SID_INPUT_PICTURE_0;
+    avcenc_context.current_input_surface = upload_wait(&avcenc_context.upload, enc_frame_number);
 
     if (is_idr) {
-        VAEncPackedHeaderParameterBuffer packed_header_param_buffer;
-        unsigned int length_in_bits, offset_in_bytes;
-        unsigned char *packed_seq_buffer = NULL, *packed_pic_buffer = NULL;
+        struct {
+            VAEncSequenceParameterBufferH264 seq_param;
+            VAProfile profile;
+            int constraint_set_flag;
+            int frame_bit_rate;
+            int frame_rate;
+            int i_initial_cpb_removal_delay_length;
+            int i_cpb_removal_delay_length;
+            int i_dpb_output_delay_length;
+            int time_offset_length;
+        } seq_key;
+        VAEncPictureParameterBufferH264 pic_key;
+        VABufferID buffers[2];
 
         assert(slice_type == SLICE_TYPE_I);
-        length_in_bits = build_packed_seq_buffer(&packed_seq_buffer);
-        offset_in_bytes = 0;
-        packed_header_param_buffer.type = VAEncPackedHeaderSequence;
-        packed_header_param_buffer.bit_length = length_in_bits;
-        packed_header_param_buffer.has_emulation_bytes = 0;
-        va_status = vaCreateBuffer(va_dpy,
-                                   avcenc_context.context_id,
-                                   VAEncPackedHeaderParameterBufferType,
-                                   sizeof(packed_header_param_buffer), 1, &packed_header_param_buffer,
-                                   &avcenc_context.packed_seq_header_param_buf_id);
-        CHECK_VASTATUS(va_status,"vaCreateBuffer");
-
-        va_status = vaCreateBuffer(va_dpy,
-                                   avcenc_context.context_id,
-                                   VAEncPackedHeaderDataBufferType,
-                                   (length_in_bits + 7) / 8, 1, packed_seq_buffer,
-                                   &avcenc_context.packed_seq_buf_id);
-        CHECK_VASTATUS(va_status,"vaCreateBuffer");
-
-        length_in_bits = build_packed_pic_buffer(&packed_pic_buffer);
-        offset_in_bytes = 0;
-        packed_header_param_buffer.type = VAEncPackedHeaderPicture;
-        packed_header_param_buffer.bit_length = length_in_bits;
-        packed_header_param_buffer.has_emulation_bytes = 0;
-
-        va_status = vaCreateBuffer(va_dpy,
-                                   avcenc_context.context_id,
-                                   VAEncPackedHeaderParameterBufferType,
-                                   sizeof(packed_header_param_buffer), 1, &packed_header_param_buffer,
-                                   &avcenc_context.packed_pic_header_param_buf_id);
-        CHECK_VASTATUS(va_status,"vaCreateBuffer");
-
-        va_status = vaCreateBuffer(va_dpy,
-                                   avcenc_context.context_id,
-                                   VAEncPackedHeaderDataBufferType,
-                                   (length_in_bits + 7) / 8, 1, packed_pic_buffer,
-                                   &avcenc_context.packed_pic_buf_id);
-        CHECK_VASTATUS(va_status,"vaCreateBuffer");
-
-        free(packed_seq_buffer);
-        free(packed_pic_buffer);
+
+        memset(&seq_key, 0, sizeof(seq_key));
+        memcpy(&seq_key.seq_param, &avcenc_context.seq_param, sizeof(seq_key.seq_param));
+        seq_key.profile = avcenc_context.profile;
+        seq_key.constraint_set_flag = avcenc_context.constraint_set_flag;
+        seq_key.frame_bit_rate = frame_bit_rate;
+        seq_key.frame_rate = frame_rate;
+        seq_key.i_initial_cpb_removal_delay_length = avcenc_context.i_initial_cpb_removal_delay_length;
+        seq_key.i_cpb_removal_delay_length = avcenc_context.i_cpb_removal_delay_length;
+        seq_key.i_dpb_output_delay_length = avcenc_context.i_dpb_output_delay_length;
+        seq_key.time_offset_length = avcenc_context.time_offset_length;
+        if (!packed_header_lookup(&avcenc_context.packed_seq, &seq_key, sizeof(seq_key)))
+            build_packed_seq_buffer(&avcenc_context.packed_seq);
+
+        packed_header_buffers(va_dpy, avcenc_context.context_id, &avcenc_context.packed_seq, buffers);
+        avcenc_context.packed_seq_header_param_buf_id = buffers[0];
+        avcenc_context.packed_seq_buf_id = buffers[1];
+
+        /* the PPS doesn't depend on the picture being encoded */
+        memcpy(&pic_key, &avcenc_context.pic_param, sizeof(pic_key));
+        memset(&pic_key.CurrPic, 0, sizeof(pic_key.CurrPic));
+        memset(pic_key.ReferenceFrames, 0, sizeof(pic_key.ReferenceFrames));
+        pic_key.coded_buf = 0;
+        pic_key.frame_num = 0;
+        pic_key.last_picture = 0;
+        pic_key.pic_fields.bits.idr_pic_flag = 0;
+        pic_key.pic_fields.bits.reference_pic_flag = 0;
+        if (!packed_header_lookup(&avcenc_context.packed_pic, &pic_key, sizeof(pic_key)))
+            build_packed_pic_buffer(&avcenc_context.packed_pic);
+
+        packed_header_buffers(va_dpy, avcenc_context.context_id, &avcenc_context.packed_pic, buffers);
+        avcenc_context.packed_pic_header_param_buf_id = buffers[0];
+        avcenc_context.packed_pic_buf_id = buffers[1];
     }
 
     /* sequence parameter set */
@@ -836,7 +1112,7 @@ int avcenc_render_picture()
 
     va_status = vaBeginPicture(va_dpy,
                                avcenc_context.context_id,
-                               surface_ids[avcenc_context.current_input_surface]);
+                               input_surface[avcenc_context.current_input_surface]);
     CHECK_VASTATUS(va_status,"vaBeginPicture");
     
     va_status = vaRenderPicture(va_dpy,
@@ -888,23 +1164,13 @@ static void end_picture()
     avcenc_destroy_buffers(&avcenc_context.packed_sei_header_param_buf_id, 1);
     avcenc_destroy_buffers(&avcenc_context.packed_sei_buf_id, 1);
     avcenc_destroy_buffers(&avcenc_context.slice_param_buf_id[0], avcenc_context.num_slices);
-    avcenc_destroy_buffers(&avcenc_context.codedbuf_buf_id, 1);
+    avcenc_context.codedbuf_buf_id = VA_INVALID_ID;     /* owned by the output queue */
     avcenc_destroy_buffers(&avcenc_context.misc_parameter_hrd_buf_id, 1);
 
     memset(avcenc_context.slice_param, 0, sizeof(avcenc_context.slice_param));
     avcenc_context.num_slices = 0;
 }
 
-#define BITSTREAM_ALLOCATE_STEPPING     4096
-
-struct __bitstream {
-    unsigned int *buffer;
-    int bit_offset;
-    int max_size_in_dword;
-};
-
-typedef struct __bitstream bitstream;
-
 #if 0
 static int 
 get_coded_bitsteam_length(unsigned char *buffer, int buffer_length)
@@ -923,113 +1189,6 @@ get_coded_bitsteam_length(unsigned char *buffer, int buffer_length)
 }
 #endif
 
-static unsigned int 
-va_swap32(unsigned int val)
-{
-    unsigned char *pval = (unsigned char *)&val;
-
-    return ((pval[0] << 24)     |
-            (pval[1] << 16)     |
-            (pval[2] << 8)      |
-            (pval[3] << 0));
-}
-
-static void
-bitstream_start(bitstream *bs)
-{
-    bs->max_size_in_dword = BITSTREAM_ALLOCATE_STEPPING;
-    bs->buffer = calloc(bs->max_size_in_dword * sizeof(int), 1);
-    bs->bit_offset = 0;
-}
-
-static void
-bitstream_end(bitstream *bs)
-{
-    int pos = (bs->bit_offset >> 5);
-    int bit_offset = (bs->bit_offset & 0x1f);
-    int bit_left = 32 - bit_offset;
-
-    if (bit_offset) {
-        bs->buffer[pos] = va_swap32((bs->buffer[pos] << bit_left));
-    }
-}
- 
-static void
-bitstream_put_ui(bitstream *bs, unsigned int val, int size_in_bits)
-{
-    int pos = (bs->bit_offset >> 5);
-    int bit_offset = (bs->bit_offset & 0x1f);
-    int bit_left = 32 - bit_offset;
-
-    if (!size_in_bits)
-        return;
-
-    bs->bit_offset += size_in_bits;
-
-    if (bit_left > size_in_bits) {
-        bs->buffer[pos] = (bs->buffer[pos] << size_in_bits | val);
-    } else {
-        size_in_bits -= bit_left;
-        bs->buffer[pos] = (bs->buffer[pos] << bit_left) | (val >> size_in_bits);
-        bs->buffer[pos] = va_swap32(bs->buffer[pos]);
-
-        if (pos + 1 == bs->max_size_in_dword) {
-            bs->max_size_in_dword += BITSTREAM_ALLOCATE_STEPPING;
-            bs->buffer = realloc(bs->buffer, bs->max_size_in_dword * sizeof(unsigned int));
-        }
-
-        bs->buffer[pos + 1] = val;
-    }
-}
-
-static void
-bitstream_put_ue(bitstream *bs, unsigned int val)
-{
-    int size_in_bits = 0;
-    int tmp_val = ++val;
-
-    while (tmp_val) {
-        tmp_val >>= 1;
-        size_in_bits++;
-    }
-
-    bitstream_put_ui(bs, 0, size_in_bits - 1); // leading zero
-    bitstream_put_ui(bs, val, size_in_bits);
-}
-
-static void
-bitstream_put_se(bitstream *bs, int val)
-{
-    unsigned int new_val;
-
-    if (val <= 0)
-        new_val = -2 * val;
-    else
-        new_val = 2 * val - 1;
-
-    bitstream_put_ue(bs, new_val);
-}
-
-static void
-bitstream_byte_aligning(bitstream *bs, int bit)
-{
-    int bit_offset = (bs->bit_offset & 0x7);
-    int bit_left = 8 - bit_offset;
-    int new_val;
-
-    if (!bit_offset)
-        return;
-
-    assert(bit == 0 || bit == 1);
-
-    if (bit)
-        new_val = (1 << bit_left) - 1;
-    else
-        new_val = 0;
-
-    bitstream_put_ui(bs, new_val, bit_left);
-}
-
 static void 
 rbsp_trailing_bits(bitstream *bs)
 {
@@ -1223,50 +1382,49 @@ build_header(FILE *avc_fp)
 }
 #endif
 
-static int
-build_packed_pic_buffer(unsigned char **header_buffer)
+static void
+build_packed_pic_buffer(struct packed_header *header)
 {
     bitstream bs;
 
-    bitstream_start(&bs);
+    packed_header_start(header, &bs);
     nal_start_code_prefix(&bs);
     nal_header(&bs, NAL_REF_IDC_HIGH, NAL_PPS);
     pps_rbsp(&bs);
-    bitstream_end(&bs);
-
-    *header_buffer = (unsigned char *)bs.buffer;
-    return bs.bit_offset;
+    packed_header_end(header, &bs);
 }
 
-static int
-build_packed_seq_buffer(unsigned char **header_buffer)
+static void
+build_packed_seq_buffer(struct packed_header *header)
 {
     bitstream bs;
 
-    bitstream_start(&bs);
+    packed_header_start(header, &bs);
     nal_start_code_prefix(&bs);
     nal_header(&bs, NAL_REF_IDC_HIGH, NAL_SPS);
     sps_rbsp(&bs);
-    bitstream_end(&bs);
-
-    *header_buffer = (unsigned char *)bs.buffer;
-    return bs.bit_offset;
+    packed_header_end(header, &bs);
 }
 
-static int 
-build_packed_idr_sei_buffer_timing(unsigned int init_cpb_removal_delay_length,
+/*
+ * the SEI builders return the bit offset of cpb_removal_delay in
+ * cpb_removal_offset, dpb_output_delay follows it
+ */
+static void
+build_packed_idr_sei_buffer_timing(struct packed_header *header,
+				unsigned int init_cpb_removal_delay_length,
 				unsigned int cpb_removal_length,
+				unsigned int cpb_removal_delay,
 				unsigned int dpb_output_length,
-				unsigned char **sei_buffer)
+				unsigned int *cpb_removal_offset)
 {
-    unsigned char *byte_buf;
+    unsigned char sei_bp_buffer[16], sei_pic_buffer[16];
     int bp_byte_size, i, pic_byte_size;
-    unsigned int cpb_removal_delay;
 
     bitstream nal_bs;
     bitstream sei_bp_bs, sei_pic_bs;
 
-    bitstream_start(&sei_bp_bs);
+    bitstream_start_buffer(&sei_bp_bs, sei_bp_buffer, sizeof(sei_bp_buffer));
     bitstream_put_ue(&sei_bp_bs, 0);       /*seq_parameter_set_id*/
     /* SEI buffer period info */
     /* NALHrdBpPresentFlag == 1 */
@@ -1281,13 +1439,12 @@ build_packed_idr_sei_buffer_timing(unsigned int init_cpb_removal_delay_length,
     bp_byte_size = (sei_bp_bs.bit_offset + 7) / 8;
     
     /* SEI pic timing info */
-    bitstream_start(&sei_pic_bs);
+    bitstream_start_buffer(&sei_pic_bs, sei_pic_buffer, sizeof(sei_pic_buffer));
     /* The info of CPB and DPB delay is controlled by CpbDpbDelaysPresentFlag,
      * which is derived as 1 if one of the following conditions is true:
      * nal_hrd_parameters_present_flag is present in the bitstream and is equal to 1,
      * vcl_hrd_parameters_present_flag is present in the bitstream and is equal to 1,
      */
-    cpb_removal_delay = (avcenc_context.current_cpb_removal - avcenc_context.prev_idr_cpb_removal);
     bitstream_put_ui(&sei_pic_bs, cpb_removal_delay, cpb_removal_length); 
     bitstream_put_ui(&sei_pic_bs, avcenc_context.current_dpb_removal_delta,
                      dpb_output_length);
@@ -1301,7 +1458,7 @@ build_packed_idr_sei_buffer_timing(unsigned int init_cpb_removal_delay_length,
     bitstream_end(&sei_pic_bs);
     pic_byte_size = (sei_pic_bs.bit_offset + 7) / 8;
     
-    bitstream_start(&nal_bs);
+    packed_header_start(header, &nal_bs);
     nal_start_code_prefix(&nal_bs);
     nal_header(&nal_bs, NAL_REF_IDC_NONE, NAL_SEI);
 
@@ -1309,48 +1466,41 @@ build_packed_idr_sei_buffer_timing(unsigned int init_cpb_removal_delay_length,
     bitstream_put_ui(&nal_bs, 0, 8);
     bitstream_put_ui(&nal_bs, bp_byte_size, 8);
     
-    byte_buf = (unsigned char *)sei_bp_bs.buffer;
     for(i = 0; i < bp_byte_size; i++) {
-        bitstream_put_ui(&nal_bs, byte_buf[i], 8);
+        bitstream_put_ui(&nal_bs, sei_bp_buffer[i], 8);
     }
-    free(byte_buf);
 	/* write the SEI pic timing data */
     bitstream_put_ui(&nal_bs, 0x01, 8);
     bitstream_put_ui(&nal_bs, pic_byte_size, 8);
     
-    byte_buf = (unsigned char *)sei_pic_bs.buffer;
+    *cpb_removal_offset = nal_bs.bit_offset;
     for(i = 0; i < pic_byte_size; i++) {
-        bitstream_put_ui(&nal_bs, byte_buf[i], 8);
+        bitstream_put_ui(&nal_bs, sei_pic_buffer[i], 8);
     }
-    free(byte_buf);
 
     rbsp_trailing_bits(&nal_bs);
-    bitstream_end(&nal_bs);
-
-    *sei_buffer = (unsigned char *)nal_bs.buffer; 
-   
-    return nal_bs.bit_offset;
+    packed_header_end(header, &nal_bs);
 }
 
-static int
-build_packed_sei_pic_timing(unsigned int cpb_removal_length,
+static void
+build_packed_sei_pic_timing(struct packed_header *header,
+				unsigned int cpb_removal_length,
+				unsigned int cpb_removal_delay,
 				unsigned int dpb_output_length,
-				unsigned char **sei_buffer)
+				unsigned int *cpb_removal_offset)
 {
-    unsigned char *byte_buf;
+    unsigned char sei_pic_buffer[16];
     int i, pic_byte_size;
-    unsigned int cpb_removal_delay;
 
     bitstream nal_bs;
     bitstream sei_pic_bs;
 
-    bitstream_start(&sei_pic_bs);
+    bitstream_start_buffer(&sei_pic_bs, sei_pic_buffer, sizeof(sei_pic_buffer));
     /* The info of CPB and DPB delay is controlled by CpbDpbDelaysPresentFlag,
      * which is derived as 1 if one of the following conditions is true:
      * nal_hrd_parameters_present_flag is present in the bitstream and is equal to 1,
      * vcl_hrd_parameters_present_flag is present in the bitstream and is equal to 1,
      */
-    cpb_removal_delay = (avcenc_context.current_cpb_removal - avcenc_context.current_idr_cpb_removal);
     bitstream_put_ui(&sei_pic_bs, cpb_removal_delay, cpb_removal_length);
     bitstream_put_ui(&sei_pic_bs, avcenc_context.current_dpb_removal_delta,
                      dpb_output_length);
@@ -1365,7 +1515,7 @@ build_packed_sei_pic_timing(unsigned int cpb_removal_length,
     bitstream_end(&sei_pic_bs);
     pic_byte_size = (sei_pic_bs.bit_offset + 7) / 8;
 
-    bitstream_start(&nal_bs);
+    packed_header_start(header, &nal_bs);
     nal_start_code_prefix(&nal_bs);
     nal_header(&nal_bs, NAL_REF_IDC_NONE, NAL_SEI);
 
@@ -1373,18 +1523,13 @@ build_packed_sei_pic_timing(unsigned int cpb_removal_length,
     bitstream_put_ui(&nal_bs, 0x01, 8);
     bitstream_put_ui(&nal_bs, pic_byte_size, 8);
 
-    byte_buf = (unsigned char *)sei_pic_bs.buffer;
+    *cpb_removal_offset = nal_bs.bit_offset;
     for(i = 0; i < pic_byte_size; i++) {
-        bitstream_put_ui(&nal_bs, byte_buf[i], 8);
+        bitstream_put_ui(&nal_bs, sei_pic_buffer[i], 8);
     }
-    free(byte_buf);
 
     rbsp_trailing_bits(&nal_bs);
-    bitstream_end(&nal_bs);
-
-    *sei_buffer = (unsigned char *)nal_bs.buffer;
-
-    return nal_bs.bit_offset;
+    packed_header_end(header, &nal_bs);
 }
 
 #if 0
@@ -1465,11 +1610,11 @@ slice_data(bitstream *bs)
     VAStatus va_status;
     VASurfaceStatus surface_status;
 
-    va_status = vaSyncSurface(va_dpy, surface_ids[avcenc_context.current_input_surface]);
+    va_status = vaSyncSurface(va_dpy, input_surface[avcenc_context.current_input_surface]);
     CHECK_VASTATUS(va_status,"vaSyncSurface");
 
     surface_status = 0;
-    va_status = vaQuerySurfaceStatus(va_dpy, surface_ids[avcenc_context.current_input_surface], &surface_status);
+    va_status = vaQuerySurfaceStatus(va_dpy, input_surface[avcenc_context.current_input_surface], &surface_status);
     CHECK_VASTATUS(va_status,"vaQuerySurfaceStatus");
 
     va_status = vaMapBuffer(va_dpy, avcenc_context.codedbuf_buf_id, (void **)(&coded_buffer_segment));
@@ -1499,45 +1644,299 @@ build_nal_slice(FILE *avc_fp, int frame_num, int display_frame, int slice_type,
 #endif
 
 static int
-store_coded_buffer(FILE *avc_fp, int slice_type)
+store_coded_buffer(struct coded_sink *sink, VASurfaceID surface_id, VABufferID coded_buf)
 {
     VACodedBufferSegment *coded_buffer_segment;
-    unsigned char *coded_mem;
-    int slice_data_length;
+    long long slice_data_length;
     VAStatus va_status;
     VASurfaceStatus surface_status;
-    size_t w_items;
 
-    va_status = vaSyncSurface(va_dpy, surface_ids[avcenc_context.current_input_surface]);
+    va_status = vaSyncSurface(va_dpy, surface_id);
     CHECK_VASTATUS(va_status,"vaSyncSurface");
 
     surface_status = 0;
-    va_status = vaQuerySurfaceStatus(va_dpy, surface_ids[avcenc_context.current_input_surface], &surface_status);
+    va_status = vaQuerySurfaceStatus(va_dpy, surface_id, &surface_status);
     CHECK_VASTATUS(va_status,"vaQuerySurfaceStatus");
 
-    va_status = vaMapBuffer(va_dpy, avcenc_context.codedbuf_buf_id, (void **)(&coded_buffer_segment));
+    va_status = vaMapBuffer(va_dpy, coded_buf, (void **)(&coded_buffer_segment));
     CHECK_VASTATUS(va_status,"vaMapBuffer");
-    coded_mem = coded_buffer_segment->buf;
 
     if (coded_buffer_segment->status & VA_CODED_BUF_STATUS_SLICE_OVERFLOW_MASK) {
-        if (slice_type == SLICE_TYPE_I)
-            avcenc_context.codedbuf_i_size *= 2;
-        else
-            avcenc_context.codedbuf_pb_size *= 2;
-
-        vaUnmapBuffer(va_dpy, avcenc_context.codedbuf_buf_id);
+        vaUnmapBuffer(va_dpy, coded_buf);
         return -1;
     }
 
-    slice_data_length = coded_buffer_segment->size;
+    /* all the segments of the frame in one writev() */
+    slice_data_length = coded_sink_write_coded(sink, NULL, 0, coded_buffer_segment);
+    if (slice_data_length < 0) {
+        perror("Write the coded data");
+        exit(1);
+    }
 
-    do {
-        w_items = fwrite(coded_mem, slice_data_length, 1, avc_fp);
-    } while (w_items != 1);
+    vaUnmapBuffer(va_dpy, coded_buf);
 
-    vaUnmapBuffer(va_dpy, avcenc_context.codedbuf_buf_id);
+    return slice_data_length;
+}
 
-    return 0;
+static int coded_size_class(int size)
+{
+    int class_size = CODED_SIZE_MIN;
+
+    while (class_size < size)
+        class_size *= 2;
+
+    return class_size;
+}
+
+static int compare_int(const void *a, const void *b)
+{
+    return *(const int *)a - *(const int *)b;
+}
+
+/* a frame of slice_type took size bytes, called with the output mutex held */
+static void coded_size_update(struct output_queue *queue, int slice_type, int size)
+{
+    struct coded_size_history *history = &queue->history[slice_type != SLICE_TYPE_I];
+    int sorted[CODED_SIZE_HISTORY], p90, budget = 0, estimate;
+
+    history->size[history->next] = size;
+    history->next = (history->next + 1) % CODED_SIZE_HISTORY;
+    if (history->num < CODED_SIZE_HISTORY)
+        history->num++;
+    if (history->num < CODED_SIZE_SAMPLES_MIN)
+        return;
+
+    memcpy(sorted, history->size, history->num * sizeof(int));
+    qsort(sorted, history->num, sizeof(int), compare_int);
+    p90 = sorted[history->num * 9 / 10];
+
+    if (frame_bit_rate > 0)
+        budget = frame_bit_rate * 1000 / 8 / frame_rate;
+    if (slice_type == SLICE_TYPE_I)
+        budget *= CODED_I_BUDGET;
+
+    estimate = coded_size_class(MAX(p90 + MAX(p90 / 2, budget), sorted[history->num - 1]));
+    if (slice_type == SLICE_TYPE_I)
+        avcenc_context.codedbuf_i_size = estimate;
+    else
+        avcenc_context.codedbuf_pb_size = estimate;
+}
+
+/* free the pooled buffers too small or much too big for the frames now */
+static void coded_pool_trim(struct output_queue *queue)
+{
+    int min_size = MIN(avcenc_context.codedbuf_i_size, avcenc_context.codedbuf_pb_size);
+    int max_size = 2 * coded_size_class(MAX(avcenc_context.codedbuf_i_size, avcenc_context.codedbuf_pb_size));
+    int i = 0;
+
+    while (i < queue->pool_num) {
+        if (queue->pool_size[i] >= min_size && queue->pool_size[i] <= max_size) {
+            i++;
+            continue;
+        }
+        queue->coded_bytes -= queue->pool_size[i];
+        avcenc_destroy_buffers(&queue->pool[i], 1);
+        queue->pool_num--;
+        queue->pool[i] = queue->pool[queue->pool_num];
+        queue->pool_size[i] = queue->pool_size[queue->pool_num];
+    }
+}
+
+/* the smallest free coded buffer of at least size bytes, called with the output mutex held */
+static void coded_buffer_get(struct output_queue *queue, int size, VABufferID *coded_buf, int *coded_size)
+{
+    VAStatus va_status;
+    int i, best = -1;
+
+    for (i = 0; i < queue->pool_num; i++)
+        if (queue->pool_size[i] >= size && (best < 0 || queue->pool_size[i] < queue->pool_size[best]))
+            best = i;
+
+    if (best >= 0) {
+        *coded_buf = queue->pool[best];
+        *coded_size = queue->pool_size[best];
+        queue->pool_num--;
+        queue->pool[best] = queue->pool[queue->pool_num];
+        queue->pool_size[best] = queue->pool_size[queue->pool_num];
+        return;
+    }
+
+    coded_pool_trim(queue);
+    size = coded_size_class(size);
+    va_status = vaCreateBuffer(va_dpy,
+                               avcenc_context.context_id,
+                               VAEncCodedBufferType,
+                               size, 1, NULL,
+                               coded_buf);
+    CHECK_VASTATUS(va_status,"vaCreateBuffer");
+    *coded_size = size;
+
+    queue->coded_allocs++;
+    queue->coded_bytes += size;
+    queue->coded_bytes_peak = MAX(queue->coded_bytes_peak, queue->coded_bytes);
+}
+
+/* back to the pool, called with the output mutex held */
+static void coded_buffer_put(struct output_queue *queue, VABufferID *coded_buf, int *coded_size)
+{
+    if (*coded_buf == VA_INVALID_ID)
+        return;
+
+    if (queue->pool_num == CODED_POOL_MAX) {
+        avcenc_destroy_buffers(coded_buf, 1);
+        queue->coded_bytes -= *coded_size;
+    } else {
+        queue->pool[queue->pool_num] = *coded_buf;
+        queue->pool_size[queue->pool_num] = *coded_size;
+        queue->pool_num++;
+        *coded_buf = VA_INVALID_ID;
+    }
+    *coded_size = 0;
+    coded_pool_trim(queue);
+}
+
+static void *
+output_thread_function(void *data)
+{
+    struct output_queue *queue = data;
+    struct coded_frame *frame;
+    unsigned long long f;
+    VASurfaceID surface_id;
+    VAStatus va_status;
+    int drop, ret;
+
+    while (1) {
+        pthread_mutex_lock(&queue->mutex);
+        while (!queue->stop && queue->written == queue->submitted)
+            pthread_cond_wait(&queue->cond, &queue->mutex);
+        if (queue->written == queue->submitted) {
+            pthread_mutex_unlock(&queue->mutex);
+            break;
+        }
+        f = queue->written;
+        drop = queue->overflow;
+        pthread_mutex_unlock(&queue->mutex);
+
+        surface_id = input_surface[f % num_input_surfaces];
+        frame = &queue->frame[f % num_coded_frames];
+        if (drop) {
+            /* encoded from an overflowed reference, it will be encoded again */
+            va_status = vaSyncSurface(va_dpy, surface_id);
+            CHECK_VASTATUS(va_status,"vaSyncSurface");
+            ret = 0;
+        } else {
+            ret = store_coded_buffer(&queue->sink, surface_id, frame->coded_buf);
+            if (ret >= 0)
+                upload_release(&avcenc_context.upload, f);
+        }
+
+        pthread_mutex_lock(&queue->mutex);
+        if (ret < 0) {
+            /* at least twice as big, for the next CODED_SIZE_HISTORY frames of the type */
+            coded_size_update(queue, frame->slice_type, 2 * frame->coded_size);
+            if (frame->slice_type == SLICE_TYPE_I)
+                avcenc_context.codedbuf_i_size = MAX(avcenc_context.codedbuf_i_size, 2 * frame->coded_size);
+            else
+                avcenc_context.codedbuf_pb_size = MAX(avcenc_context.codedbuf_pb_size, 2 * frame->coded_size);
+            printf("\ncoded buffer overflow: frame %llu (%s), %d bytes\n", f,
+                   frame->slice_type == SLICE_TYPE_I ? "I" : "P/B", frame->coded_size);
+            if (avcenc_context.rate_control_method == VA_RC_CBR && frame->slice_type == SLICE_TYPE_B) {
+                /* the frames after it stay, write it once it is encoded again */
+                coded_buffer_put(queue, &frame->coded_buf, &frame->coded_size);
+                queue->redo = 1;
+                pthread_cond_broadcast(&queue->cond);
+                while (queue->redo)
+                    pthread_cond_wait(&queue->cond, &queue->mutex);
+                pthread_mutex_unlock(&queue->mutex);
+                continue;
+            }
+            queue->overflow = 1;
+            queue->overflow_frame = f;
+        } else if (!drop)
+            coded_size_update(queue, frame->slice_type, ret);
+        coded_buffer_put(queue, &frame->coded_buf, &frame->coded_size);
+        queue->written = f + 1;
+        pthread_cond_broadcast(&queue->cond);
+        pthread_mutex_unlock(&queue->mutex);
+    }
+
+    return NULL;
+}
+
+static void encode_frame(int f);
+
+/* CBR: encode the overflowed B frame again, in between the frames after it */
+static void output_redo(struct output_queue *queue, unsigned long long f)
+{
+    struct encode_state state;
+
+    encode_state_save(&state);
+    encode_state_restore(&queue->frame[f % num_coded_frames].state);
+    avcenc_context.encode_again = 1;
+    encode_frame(f);
+    avcenc_context.encode_again = 0;
+    encode_state_restore(&state);
+
+    pthread_mutex_lock(&queue->mutex);
+    queue->overflows++;
+    queue->reencoded++;
+    queue->redo = 0;
+    pthread_cond_broadcast(&queue->cond);
+    pthread_mutex_unlock(&queue->mutex);
+}
+
+/*
+ * wait for the coded frame of frame f (or for all the frames to be
+ * written when f is frame_number), returns the frame to encode next:
+ * f or the frame to encode again after an overflow
+ */
+static int output_reserve(struct output_queue *queue, int f)
+{
+    unsigned long long begin = time_us_monotonic(), redo_frame;
+    struct coded_frame *frame;
+
+    pthread_mutex_lock(&queue->mutex);
+    for (;;) {
+        while (!queue->overflow && !queue->redo &&
+               (f < frame_number ? f - queue->written >= (unsigned long long)num_coded_frames : queue->written < f))
+            pthread_cond_wait(&queue->cond, &queue->mutex);
+        if (!queue->redo)
+            break;
+        redo_frame = queue->written;
+        pthread_mutex_unlock(&queue->mutex);
+        output_redo(queue, redo_frame);
+        pthread_mutex_lock(&queue->mutex);
+    }
+
+    if (queue->overflow) {
+        while (queue->written < queue->submitted)
+            pthread_cond_wait(&queue->cond, &queue->mutex);
+
+        f = queue->overflow_frame;
+        frame = &queue->frame[f % num_coded_frames];
+        encode_state_restore(&frame->state);
+
+        queue->overflows++;
+        queue->reencoded += queue->submitted - f;
+        queue->submitted = queue->written = f;
+        queue->overflow = 0;
+    }
+    pthread_mutex_unlock(&queue->mutex);
+    queue->wait_us += time_us_monotonic() - begin;
+
+    if (f < frame_number)
+        encode_state_save(&queue->frame[f % num_coded_frames].state);
+
+    return f;
+}
+
+static void output_submit(struct output_queue *queue, unsigned long long f)
+{
+    pthread_mutex_lock(&queue->mutex);
+    /* a B frame encoded again comes after the frames following it */
+    queue->submitted = MAX(queue->submitted, f + 1);
+    pthread_cond_broadcast(&queue->cond);
+    pthread_mutex_unlock(&queue->mutex);
 }
 
 /*
@@ -1601,83 +2000,147 @@ static void encoding2display_order(
     }
 }
 
+/* the frame of the input encoded at encoding_order, out of frames */
+static int input_frame_display(unsigned long long encoding_order, unsigned long long frames)
+{
+    unsigned long long display;
+    int type;
+
+    encoding2display_order(encoding_order, intra_period, ip_period, &display, &type);
+    if (display >= frames)
+        display = frames - 1;
+
+    return display;
+}
+
 
 static void
-encode_picture(FILE *yuv_fp, FILE *avc_fp,
-               int frame_num, int display_num,
+encode_picture(int display_num,
                int is_idr,
                int slice_type, int next_is_bpic,
                int next_display_num)
 {
-    VAStatus va_status;
-    int ret = 0, codedbuf_size;
+    struct output_queue *queue = &avcenc_context.output;
+    struct coded_frame *frame = &queue->frame[enc_frame_number % num_coded_frames];
+    int codedbuf_size;
     
-    begin_picture(yuv_fp, frame_num, display_num, slice_type, is_idr);
+    begin_picture(display_num, slice_type, is_idr);
+
+    /* coded buffer, from the pool when one is big enough */
+    pthread_mutex_lock(&queue->mutex);
+    if (SLICE_TYPE_I == slice_type) {
+        codedbuf_size = avcenc_context.codedbuf_i_size;
+    } else {
+        codedbuf_size = avcenc_context.codedbuf_pb_size;
+    }
+    /* under CBR the frames referring to an I/P frame are kept when it overflows */
+    if (avcenc_context.rate_control_method == VA_RC_CBR && slice_type != SLICE_TYPE_B)
+        codedbuf_size = MAX(codedbuf_size, picture_width * picture_height * 3 / 2);
+    coded_buffer_get(queue, codedbuf_size, &frame->coded_buf, &frame->coded_size);
+    pthread_mutex_unlock(&queue->mutex);
+    avcenc_context.codedbuf_buf_id = frame->coded_buf;
+    frame->slice_type = slice_type;
 
-    //if (next_display_num < frame_number) {
-    if (1) {
-        int index;
+    /* Update the RefPicList */
+    update_RefPicList();
 
-        /* prepare for next frame */
-        if (avcenc_context.current_input_surface == SID_INPUT_PICTURE_0)
-            index = SID_INPUT_PICTURE_1;
-        else
-            index = SID_INPUT_PICTURE_0;
-        if ( next_display_num >= frame_number )
-            next_display_num = frame_number - 1;
-        fseeko(yuv_fp, (off_t)frame_size * next_display_num, SEEK_SET);
+    /* picture parameter set */
+    avcenc_update_picture_parameter(slice_type, is_idr);
 
-        avcenc_context.upload_thread_param.yuv_fp = yuv_fp;
-        avcenc_context.upload_thread_param.surface_id = surface_ids[index];
+    /* slice parameter */
+    avcenc_update_slice_parameter(slice_type);
 
-        avcenc_context.upload_thread_value = pthread_create(&avcenc_context.upload_thread_id,
-                                                            NULL,
-                                                            upload_thread_function, 
-                                                            (void*)&avcenc_context.upload_thread_param);
-    }
+    if (avcenc_context.rate_control_method == VA_RC_CBR)
+        avcenc_update_sei_param(is_idr);
 
-    do {
-        avcenc_destroy_buffers(&avcenc_context.codedbuf_buf_id, 1);
-        avcenc_destroy_buffers(&avcenc_context.pic_param_buf_id, 1);
+    avcenc_render_picture();
 
+    /* the output thread writes it */
+    output_submit(&avcenc_context.output, enc_frame_number);
 
-        if (SLICE_TYPE_I == slice_type) {
-            codedbuf_size = avcenc_context.codedbuf_i_size;
-        } else {
-            codedbuf_size = avcenc_context.codedbuf_pb_size;
-        }
+    end_picture(slice_type, next_is_bpic);
+}
+
+/* frame f in encoding order */
+static void encode_frame(int f)
+{
+    unsigned long long next_frame_display;
+    int next_frame_type;
 
-        /* coded buffer */
-        va_status = vaCreateBuffer(va_dpy,
-                                   avcenc_context.context_id,
-                                   VAEncCodedBufferType,
-                                   codedbuf_size, 1, NULL,
-                                   &avcenc_context.codedbuf_buf_id);
-        CHECK_VASTATUS(va_status,"vaCreateBuffer");
+    enc_frame_number = f;
 
-        /* Update the RefPicList */
-        update_RefPicList();
+    encoding2display_order(enc_frame_number, intra_period, ip_period,
+                           &current_frame_display, &current_frame_type);
 
-        /* picture parameter set */
-        avcenc_update_picture_parameter(slice_type, is_idr);
+    encoding2display_order(enc_frame_number + 1, intra_period, ip_period,
+                           &next_frame_display, &next_frame_type);
 
-        /* slice parameter */
-        avcenc_update_slice_parameter(slice_type);
+    if (current_frame_type == FRAME_IDR) {
+        numShortTerm = 0;
+        current_frame_num = 0;
+        current_IDR_display = current_frame_display;
+        if (avcenc_context.rate_control_method == VA_RC_CBR) {
+            unsigned long long frame_interval;
 
-	if (avcenc_context.rate_control_method == VA_RC_CBR)
-		avcenc_update_sei_param(is_idr);
+            frame_interval = enc_frame_number - avcenc_context.idr_frame_num;
 
-        avcenc_render_picture();
+            /* Based on the H264 spec the removal time of the IDR access
+             * unit is derived as the following:
+             * the removal time of previous IDR unit + Tc * cpb_removal_delay(n)
+             */
+            avcenc_context.current_cpb_removal = avcenc_context.prev_idr_cpb_removal +
+				frame_interval * 2;
+            avcenc_context.idr_frame_num = enc_frame_number;
+            avcenc_context.current_idr_cpb_removal = avcenc_context.current_cpb_removal;
+            if (ip_period)
+                avcenc_context.current_dpb_removal_delta = (ip_period + 1) * 2;
+            else
+                avcenc_context.current_dpb_removal_delta = 2;
+        }
+    } else {
+        if (avcenc_context.rate_control_method == VA_RC_CBR) {
+            unsigned long long frame_interval;
 
-        ret = store_coded_buffer(avc_fp, slice_type);
-    } while (ret);
+            frame_interval = enc_frame_number - avcenc_context.idr_frame_num;
 
-    end_picture(slice_type, next_is_bpic);
+            /* Based on the H264 spec the removal time of the non-IDR access
+             * unit is derived as the following:
+             * the removal time of current IDR unit + Tc * cpb_removal_delay(n)
+             */
+            avcenc_context.current_cpb_removal = avcenc_context.current_idr_cpb_removal +
+				frame_interval * 2;
+            if (current_frame_type == SLICE_TYPE_I ||
+                current_frame_type == SLICE_TYPE_P) {
+                if (ip_period)
+                    avcenc_context.current_dpb_removal_delta = (ip_period + 1) * 2;
+                else
+                    avcenc_context.current_dpb_removal_delta = 2;
+            } else
+               avcenc_context.current_dpb_removal_delta = 2;
+        }
+    }
+
+    /* use the simple mechanism to calc the POC */
+    current_poc = (current_frame_display - current_IDR_display) * 2;
+
+    encode_picture(current_frame_display,
+                  (current_frame_type == FRAME_IDR) ? 1 : 0,
+                  (current_frame_type == FRAME_IDR) ? SLICE_TYPE_I : current_frame_type,
+                  (next_frame_type == SLICE_TYPE_B) ? 1 : 0,
+            next_frame_display);
+    if ((current_frame_type == FRAME_IDR) &&
+        (avcenc_context.rate_control_method == VA_RC_CBR)) {
+       /* after one IDR frame is written, it needs to update the
+        * prev_idr_cpb_removal for next IDR
+        */
+       avcenc_context.prev_idr_cpb_removal = avcenc_context.current_idr_cpb_removal;
+    }
 }
 
 static void show_help()
 {
-    printf("Usage: avnenc <width> <height> <input_yuvfile> <output_avcfile> [qp=qpvalue|fb=framebitrate] [mode=0(I frames only)/1(I and P frames)/2(I, P and B frames)\n");
+    printf("Usage: avnenc <width> <height> <input_yuvfile(raw I420 or Y4M, - for stdin; for Y4M the width/height are taken from its header)> <output_avcfile(- for stdout, unix:<path> for a Unix socket)> [qp=qpvalue|fb=framebitrate] [mode=0(I frames only)/1(I and P frames)/2(I, P and B frames)] [inputs=2..%d(input surfaces uploaded ahead, default 4)] [inflight=1..%d(frames encoded ahead of the output, at most inputs, default 4)]\n",
+           INPUT_SURFACE_MAX, CODED_FRAME_MAX);
 }
 
 static void avcenc_context_seq_param_init(VAEncSequenceParameterBufferH264 *seq_param,
@@ -1815,10 +2278,13 @@ static void avcenc_context_init(int width, int height)
     avcenc_context.misc_parameter_hrd_buf_id = VA_INVALID_ID;
     avcenc_context.codedbuf_i_size = width * height;
     avcenc_context.codedbuf_pb_size = width * height;
-    avcenc_context.current_input_surface = SID_INPUT_PICTURE_0;
-    avcenc_context.upload_thread_value = -1;
+    avcenc_context.current_input_surface = 0;
     avcenc_context.packed_sei_header_param_buf_id = VA_INVALID_ID;
     avcenc_context.packed_sei_buf_id = VA_INVALID_ID;
+    packed_header_init(&avcenc_context.packed_seq, VAEncPackedHeaderSequence);
+    packed_header_init(&avcenc_context.packed_pic, VAEncPackedHeaderPicture);
+    packed_header_init(&avcenc_context.packed_idr_sei, VAEncPackedHeaderH264_SEI);
+    packed_header_init(&avcenc_context.packed_sei, VAEncPackedHeaderH264_SEI);
 
     if (qp_value == -1)
         avcenc_context.rate_control_method = VA_RC_CBR;
@@ -1842,9 +2308,7 @@ static void avcenc_context_init(int width, int height)
 int main(int argc, char *argv[])
 {
     int f;
-    FILE *yuv_fp;
-    FILE *avc_fp;
-    off_t file_size;
+    struct yuv_input input;
     int mode_value;
     struct timeval tpstart,tpend; 
     float  timeuse;
@@ -1852,15 +2316,40 @@ int main(int argc, char *argv[])
     va_init_display_args(&argc, argv);
 
     //TODO may be we should using option analytics library
-    if(argc != 5 && argc != 6 && argc != 7) {
+    if(argc < 5 || argc > 9) {
         show_help();
         return -1;
     }
 
+    while (argc >= 6) {
+        if (sscanf(argv[argc - 1], "inputs=%d", &num_input_surfaces) == 1) {
+            if (num_input_surfaces < 2 || num_input_surfaces > INPUT_SURFACE_MAX) {
+                show_help();
+                return -1;
+            }
+        } else if (sscanf(argv[argc - 1], "inflight=%d", &num_coded_frames) == 1) {
+            if (num_coded_frames < 1 || num_coded_frames > CODED_FRAME_MAX) {
+                show_help();
+                return -1;
+            }
+        } else
+            break;
+        argc--;
+    }
+    if (argc > 7) {
+        show_help();
+        return -1;
+    }
+    /* the progress goes to stderr when the stream is written to stdout */
+    if (!strcmp(argv[4], "-"))
+        coded_sink_stdout();
+
+    /* a frame keeps its input surface until it is written */
+    if (num_coded_frames > num_input_surfaces)
+        num_coded_frames = num_input_surfaces;
+
     picture_width = atoi(argv[1]);
     picture_height = atoi(argv[2]);
-    picture_width_in_mbs = (picture_width + 15) / 16;
-    picture_height_in_mbs = (picture_height + 15) / 16;
 
     if (argc == 6 || argc == 7) {
         qp_value = -1;
@@ -1899,108 +2388,58 @@ int main(int argc, char *argv[])
         }
     }
 
-    yuv_fp = fopen(argv[3],"rb");
-    if ( yuv_fp == NULL){
+    if (yuv_input_open(&input, argv[3], picture_width, picture_height, 0)) {
         printf("Can't open input YUV file\n");
         return -1;
     }
-    fseeko(yuv_fp, (off_t)0, SEEK_END);
-    file_size = ftello(yuv_fp);
-    frame_size = picture_width * picture_height +  ((picture_width * picture_height) >> 1) ;
+    /* a Y4M header has the geometry and the frame rate */
+    picture_width = input.width;
+    picture_height = input.height;
+    picture_width_in_mbs = (picture_width + 15) / 16;
+    picture_height_in_mbs = (picture_height + 15) / 16;
+    if (input.fps_num)
+        frame_rate = (input.fps_num + input.fps_den / 2) / input.fps_den;
+    frame_size = input.frame_size;
 
-    if ( (file_size < frame_size) || (file_size % frame_size) ) {
-        fclose(yuv_fp);
+    if (input.frame_stride && input.frames == 0) {
+        yuv_input_close(&input);
         printf("The YUV file's size is not correct\n");
         return -1;
     }
-    frame_number = file_size / frame_size;
-    fseeko(yuv_fp, (off_t)0, SEEK_SET);
+    /* the length of a stream is known at its end */
+    frame_number = input.frames ? input.frames : INT_MAX;
 
-    avc_fp = fopen(argv[4], "wb");	
-    if ( avc_fp == NULL) {
-        fclose(yuv_fp);
-        printf("Can't open output avc file\n");
+    /* the worker looks back at the B frames before the anchor it just read */
+    if (yuv_input_start(&input, ip_period + 1, num_input_surfaces)) {
+        yuv_input_close(&input);
+        printf("Can't start reading the input\n");
         return -1;
-    }	
+    }
+
     gettimeofday(&tpstart,NULL);	
     avcenc_context_init(picture_width, picture_height);
+    if (coded_sink_open(&avcenc_context.output.sink, argv[4])) {
+        yuv_input_close(&input);
+        printf("Can't open output avc file\n");
+        return -1;
+    }
     create_encode_pipe();
-    alloc_encode_resource(yuv_fp);
+    alloc_encode_resource(&input);
 
     enc_frame_number = 0;
-    for ( f = 0; f < frame_number; f++) {		//picture level loop
-        unsigned long long next_frame_display;
-        int next_frame_type;
-
-        enc_frame_number = f;
-
-        encoding2display_order(enc_frame_number, intra_period, ip_period,
-                               &current_frame_display, &current_frame_type);
-
-        encoding2display_order(enc_frame_number + 1, intra_period, ip_period,
-                               &next_frame_display, &next_frame_type);
-
-        if (current_frame_type == FRAME_IDR) {
-            numShortTerm = 0;
-            current_frame_num = 0;
-            current_IDR_display = current_frame_display;
-            if (avcenc_context.rate_control_method == VA_RC_CBR) {
-                unsigned long long frame_interval;
-
-                frame_interval = enc_frame_number - avcenc_context.idr_frame_num;
-
-                /* Based on the H264 spec the removal time of the IDR access
-                 * unit is derived as the following:
-                 * the removal time of previous IDR unit + Tc * cpb_removal_delay(n)
-                 */
-                avcenc_context.current_cpb_removal = avcenc_context.prev_idr_cpb_removal +
-				frame_interval * 2;
-                avcenc_context.idr_frame_num = enc_frame_number;
-                avcenc_context.current_idr_cpb_removal = avcenc_context.current_cpb_removal;
-                if (ip_period)
-                    avcenc_context.current_dpb_removal_delta = (ip_period + 1) * 2;
-                else
-                    avcenc_context.current_dpb_removal_delta = 2;
-            }
-        } else {
-            if (avcenc_context.rate_control_method == VA_RC_CBR) {
-                unsigned long long frame_interval;
-
-                frame_interval = enc_frame_number - avcenc_context.idr_frame_num;
-
-                /* Based on the H264 spec the removal time of the non-IDR access
-                 * unit is derived as the following:
-                 * the removal time of current IDR unit + Tc * cpb_removal_delay(n)
-                 */
-                avcenc_context.current_cpb_removal = avcenc_context.current_idr_cpb_removal +
-				frame_interval * 2;
-                if (current_frame_type == SLICE_TYPE_I ||
-                    current_frame_type == SLICE_TYPE_P) {
-                    if (ip_period)
-                        avcenc_context.current_dpb_removal_delta = (ip_period + 1) * 2;
-                    else
-                        avcenc_context.current_dpb_removal_delta = 2;
-                } else
-                   avcenc_context.current_dpb_removal_delta = 2;
-            }
-        }
+    for (f = 0; ; f++) {	//picture level loop
+        /* f goes back to an overflowed frame, the output queue restores the state */
+        f = output_reserve(&avcenc_context.output, f);
+        /* the length of a stream is known at its end, the last frames may overflow yet */
+        frame_number = upload_frames(&avcenc_context.upload, f);
+        if (f >= frame_number && (f = output_reserve(&avcenc_context.output, f)) >= frame_number)
+            break;
 
-        /* use the simple mechanism to calc the POC */
-        current_poc = (current_frame_display - current_IDR_display) * 2;
-
-        encode_picture(yuv_fp, avc_fp, frame_number, current_frame_display,
-                      (current_frame_type == FRAME_IDR) ? 1 : 0,
-                      (current_frame_type == FRAME_IDR) ? SLICE_TYPE_I : current_frame_type,
-                      (next_frame_type == SLICE_TYPE_B) ? 1 : 0,
-                next_frame_display);
-        if ((current_frame_type == FRAME_IDR) &&
-            (avcenc_context.rate_control_method == VA_RC_CBR)) {
-           /* after one IDR frame is written, it needs to update the
-            * prev_idr_cpb_removal for next IDR
-            */
-           avcenc_context.prev_idr_cpb_removal = avcenc_context.current_idr_cpb_removal;
-        }
-        printf("\r %d/%d ...", f, frame_number);
+        encode_frame(f);
+        if (frame_number == INT_MAX)
+            printf("\r %d ...", f);
+        else
+            printf("\r %d/%d ...", f, frame_number);
         fflush(stdout);
     }
 
@@ -2009,11 +2448,19 @@ int main(int argc, char *argv[])
     timeuse/=1000000;
     printf("\ndone!\n");
     printf("encode %d frames in %f secondes, FPS is %.1f\n",frame_number, timeuse, frame_number/timeuse);
+    printf("upload %d frames ahead, the encoder waited %.1f ms for them, the upload waited %.1f ms for the input\n",
+           num_input_surfaces, avcenc_context.upload.wait_us / 1000.0, input.wait_us / 1000.0);
+    printf("output %d frames in flight, the encoder waited %.1f ms for a coded buffer, %u overflows, %u frames encoded again\n",
+           num_coded_frames, avcenc_context.output.wait_us / 1000.0,
+           avcenc_context.output.overflows, avcenc_context.output.reencoded);
+    printf("coded buffers: %u created, %llu KB at most, last sizes %d KB (I) %d KB (P/B)\n",
+           avcenc_context.output.coded_allocs, avcenc_context.output.coded_bytes_peak / 1024,
+           avcenc_context.codedbuf_i_size / 1024, avcenc_context.codedbuf_pb_size / 1024);
     release_encode_resource();
     destory_encode_pipe();
 
-    fclose(yuv_fp);
-    fclose(avc_fp);
+    yuv_input_close(&input);
+    coded_sink_close(&avcenc_context.output.sink);
 
     return 0;
 }
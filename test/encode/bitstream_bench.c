@@ -0,0 +1,379 @@
+/*
+ * Copyright (c) 2016 Intel Corporation. All Rights Reserved.
+ *
+ * Permission is hereby granted, free of charge, to any person obtaining a
+ * copy of this software and associated documentation files (the
+ * "Software"), to deal in the Software without restriction, including
+ * without limitation the rights to use, copy, modify, merge, publish,
+ * distribute, sub license, and/or sell copies of the Software, and to
+ * permit persons to whom the Software is furnished to do so, subject to
+ * the following conditions:
+ *
+ * The above copyright notice and this permission notice (including the
+ * next paragraph) shall be included in all copies or substantial portions
+ * of the Software.
+ *
+ * THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND, EXPRESS
+ * OR IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF
+ * MERCHANTABILITY, FITNESS FOR A PARTICULAR PURPOSE AND NON-INFRINGEMENT.
+ * IN NO EVENT SHALL PRECISION INSIGHT AND/OR ITS SUPPLIERS BE LIABLE FOR
+ * ANY CLAIM, DAMAGES OR OTHER LIABILITY, WHETHER IN AN ACTION OF CONTRACT,
+ * TORT OR OTHERWISE, ARISING FROM, OUT OF OR IN CONNECTION WITH THE
+ * SOFTWARE OR THE USE OR OTHER DEALINGS IN THE SOFTWARE.
+ */
+
+/*
+ * Microbenchmark of the packed header writer in ../bitstream.h
+ *
+ * Writes SPS/PPS/slice header like NAL units and reports headers per
+ * second for the previous word-at-a-time writer, the shared writer with
+ * an allocated and with a caller-provided buffer, and with emulation
+ * prevention. The outputs are compared before timing.
+ *
+ * ./bitstream_bench [headers]
+ */
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+
+#include "../bitstream.h"
+
+#define HEADER_BUFFER_SIZE 256
+
+/* the writer the encode tests used before bitstream.h */
+struct legacy_bitstream {
+    unsigned int *buffer;
+    int bit_offset;
+    int max_size_in_dword;
+};
+
+static unsigned int
+legacy_swap32(unsigned int val)
+{
+    unsigned char *pval = (unsigned char *)&val;
+
+    return ((pval[0] << 24)     |
+            (pval[1] << 16)     |
+            (pval[2] << 8)      |
+            (pval[3] << 0));
+}
+
+static void
+legacy_start(struct legacy_bitstream *bs)
+{
+    bs->max_size_in_dword = 4096;
+    bs->buffer = calloc(bs->max_size_in_dword * sizeof(int), 1);
+    bs->bit_offset = 0;
+}
+
+static void
+legacy_end(struct legacy_bitstream *bs)
+{
+    int pos = (bs->bit_offset >> 5);
+    int bit_offset = (bs->bit_offset & 0x1f);
+    int bit_left = 32 - bit_offset;
+
+    if (bit_offset)
+        bs->buffer[pos] = legacy_swap32((bs->buffer[pos] << bit_left));
+}
+
+static void
+legacy_put_ui(struct legacy_bitstream *bs, unsigned int val, int size_in_bits)
+{
+    int pos = (bs->bit_offset >> 5);
+    int bit_offset = (bs->bit_offset & 0x1f);
+    int bit_left = 32 - bit_offset;
+
+    if (!size_in_bits)
+        return;
+
+    bs->bit_offset += size_in_bits;
+
+    if (bit_left > size_in_bits) {
+        bs->buffer[pos] = (bs->buffer[pos] << size_in_bits | val);
+    } else {
+        size_in_bits -= bit_left;
+        bs->buffer[pos] = (bs->buffer[pos] << bit_left) | (val >> size_in_bits);
+        bs->buffer[pos] = legacy_swap32(bs->buffer[pos]);
+
+        if (pos + 1 == bs->max_size_in_dword) {
+            bs->max_size_in_dword += 4096;
+            bs->buffer = realloc(bs->buffer, bs->max_size_in_dword * sizeof(unsigned int));
+        }
+
+        bs->buffer[pos + 1] = val;
+    }
+}
+
+static void
+legacy_put_ue(struct legacy_bitstream *bs, unsigned int val)
+{
+    int size_in_bits = 0;
+    int tmp_val = ++val;
+
+    while (tmp_val) {
+        tmp_val >>= 1;
+        size_in_bits++;
+    }
+
+    legacy_put_ui(bs, 0, size_in_bits - 1);
+    legacy_put_ui(bs, val, size_in_bits);
+}
+
+static void
+legacy_put_se(struct legacy_bitstream *bs, int val)
+{
+    legacy_put_ue(bs, val <= 0 ? -2 * val : 2 * val - 1);
+}
+
+static void
+legacy_byte_aligning(struct legacy_bitstream *bs, int bit)
+{
+    int bit_left = 8 - (bs->bit_offset & 0x7);
+
+    if (bit_left != 8)
+        legacy_put_ui(bs, bit ? (1 << bit_left) - 1 : 0, bit_left);
+}
+
+/*
+ * a NAL unit with the syntax elements of a SPS, PPS or slice header,
+ * the values depend on n so the lengths vary
+ */
+#define WRITE_HEADER(bs, n, put_ui, put_ue, put_se, byte_aligning, ep)  \
+    do {                                                                \
+        unsigned int _n = (n), _i;                                      \
+                                                                        \
+        put_ui(bs, 0x00000001, 32);                                     \
+        put_ui(bs, 0, 1);                                               \
+        put_ui(bs, 3, 2);                                               \
+        put_ui(bs, (_n % 3) == 0 ? 7 : (_n % 3) == 1 ? 8 : 5, 5);       \
+        ep;                                                             \
+        switch (_n % 3) {                                               \
+        case 0: /* SPS */                                               \
+            put_ui(bs, 100, 8);                                         \
+            put_ui(bs, 0, 8);                                           \
+            put_ui(bs, 41, 8);                                          \
+            put_ue(bs, 0);                                              \
+            put_ue(bs, 1);                                              \
+            put_ue(bs, 0);                                              \
+            put_ue(bs, 0);                                              \
+            put_ui(bs, 0, 2);                                           \
+            put_ue(bs, 12);                                             \
+            put_ue(bs, 0);                                              \
+            put_ue(bs, 4);                                              \
+            put_ue(bs, 2);                                              \
+            put_ui(bs, 0, 1);                                           \
+            put_ue(bs, 119 + (_n & 0xff));                              \
+            put_ue(bs, 67 + (_n & 0x3f));                               \
+            put_ui(bs, 1, 1);                                           \
+            put_ui(bs, 1, 1);                                           \
+            put_ui(bs, 1, 1);                                           \
+            put_ue(bs, 0);                                              \
+            put_ue(bs, 0);                                              \
+            put_ue(bs, 0);                                              \
+            put_ue(bs, 4);                                              \
+            put_ui(bs, 1, 1);                                           \
+            put_ui(bs, 0, 4);                                           \
+            put_ui(bs, 1, 1);                                           \
+            put_ui(bs, 1, 32);                                          \
+            put_ui(bs, 60, 32);                                         \
+            put_ui(bs, 1, 1);                                           \
+            break;                                                      \
+        case 1: /* PPS */                                               \
+            put_ue(bs, 0);                                              \
+            put_ue(bs, 0);                                              \
+            put_ui(bs, 1, 1);                                           \
+            put_ui(bs, 0, 1);                                           \
+            put_ue(bs, 0);                                              \
+            put_ue(bs, _n & 3);                                         \
+            put_ue(bs, 0);                                              \
+            put_ui(bs, 0, 3);                                           \
+            put_se(bs, (int)(_n % 52) - 26);                            \
+            put_se(bs, 0);                                              \
+            put_se(bs, 0);                                              \
+            put_ui(bs, 1, 1);                                           \
+            put_ui(bs, 0, 2);                                           \
+            put_ui(bs, 1, 1);                                           \
+            put_ue(bs, 0);                                              \
+            put_se(bs, 0);                                              \
+            break;                                                      \
+        default: /* slice header */                                     \
+            put_ue(bs, (_n * 99) % 8160);                               \
+            put_ue(bs, 7);                                              \
+            put_ue(bs, 0);                                              \
+            put_ui(bs, _n & 0xffff, 16);                                \
+            put_ue(bs, _n & 0xffff);                                    \
+            put_ui(bs, (_n * 2) & 0xff, 8);                             \
+            for (_i = 0; _i < 4; _i++) {                                \
+                put_ui(bs, 1, 1);                                       \
+                put_ue(bs, _i);                                         \
+                put_ue(bs, (_n >> _i) & 0xf);                           \
+            }                                                           \
+            put_ui(bs, 0, 1);                                           \
+            put_ue(bs, 0);                                              \
+            put_se(bs, (int)(_n % 13) - 6);                             \
+            put_ue(bs, 0);                                              \
+            put_se(bs, 0);                                              \
+            put_se(bs, 0);                                              \
+            break;                                                      \
+        }                                                               \
+        put_ui(bs, 1, 1);                                               \
+        byte_aligning(bs, 0);                                           \
+    } while (0)
+
+#define NO_EP do { } while (0)
+
+static int
+write_legacy(unsigned int n, unsigned char *out)
+{
+    struct legacy_bitstream bs;
+    int bits;
+
+    legacy_start(&bs);
+    WRITE_HEADER(&bs, n, legacy_put_ui, legacy_put_ue, legacy_put_se, legacy_byte_aligning, NO_EP);
+    legacy_end(&bs);
+    bits = bs.bit_offset;
+    if (out)
+        memcpy(out, bs.buffer, (bits + 7) / 8);
+    free(bs.buffer);
+
+    return bits;
+}
+
+static int
+write_alloc(unsigned int n, unsigned char *out)
+{
+    bitstream bs;
+    int bits;
+
+    bitstream_start(&bs);
+    WRITE_HEADER(&bs, n, bitstream_put_ui, bitstream_put_ue, bitstream_put_se, bitstream_byte_aligning, NO_EP);
+    bitstream_end(&bs);
+    bits = bs.bit_offset;
+    if (out)
+        memcpy(out, bs.buffer, (bits + 7) / 8);
+    free(bs.buffer);
+
+    return bits;
+}
+
+static int
+write_buffer(unsigned int n, unsigned char *out)
+{
+    unsigned char buffer[HEADER_BUFFER_SIZE];
+    bitstream bs;
+
+    bitstream_start_buffer(&bs, out ? out : buffer, HEADER_BUFFER_SIZE);
+    WRITE_HEADER(&bs, n, bitstream_put_ui, bitstream_put_ue, bitstream_put_se, bitstream_byte_aligning, NO_EP);
+    bitstream_end(&bs);
+
+    return bs.overflow ? -1 : bs.bit_offset;
+}
+
+static int
+write_buffer_ep(unsigned int n, unsigned char *out)
+{
+    unsigned char buffer[HEADER_BUFFER_SIZE];
+    bitstream bs;
+
+    bitstream_start_buffer(&bs, out ? out : buffer, HEADER_BUFFER_SIZE);
+    WRITE_HEADER(&bs, n, bitstream_put_ui, bitstream_put_ue, bitstream_put_se, bitstream_byte_aligning,
+                 bitstream_emulation_prevention(&bs, 1));
+    bitstream_end(&bs);
+
+    return bs.overflow ? -1 : bs.bit_offset;
+}
+
+/* reference emulation prevention on a whole NAL unit, header is 5 bytes */
+static int
+add_emulation_bytes(const unsigned char *in, int size, unsigned char *out)
+{
+    int i, o = 0, zeros = 0;
+
+    for (i = 0; i < size; i++) {
+        if (i >= 5 && zeros >= 2 && in[i] <= 3) {
+            out[o++] = 3;
+            zeros = 0;
+        }
+        out[o++] = in[i];
+        zeros = (i >= 5 && in[i] == 0) ? zeros + 1 : 0;
+    }
+
+    return o;
+}
+
+static int
+check_writers(unsigned int headers)
+{
+    unsigned char ref[HEADER_BUFFER_SIZE], out[HEADER_BUFFER_SIZE], ep[2 * HEADER_BUFFER_SIZE];
+    unsigned int n, escaped = 0;
+    int bits, size, ep_size;
+
+    for (n = 0; n < headers; n++) {
+        bits = write_legacy(n, ref);
+        size = (bits + 7) / 8;
+
+        if (write_alloc(n, out) != bits || memcmp(ref, out, size) ||
+            write_buffer(n, out) != bits || memcmp(ref, out, size)) {
+            printf("header %u differs from the previous writer\n", n);
+            return 1;
+        }
+
+        ep_size = add_emulation_bytes(ref, size, ep);
+        escaped += ep_size - size;
+        if (write_buffer_ep(n, out) != bits + (ep_size - size) * 8 || memcmp(ep, out, ep_size)) {
+            printf("header %u: wrong emulation prevention bytes\n", n);
+            return 1;
+        }
+    }
+    printf("%u headers checked, %u emulation prevention bytes\n", headers, escaped);
+
+    return 0;
+}
+
+static double
+now_seconds(void)
+{
+    struct timespec ts;
+
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return ts.tv_sec + ts.tv_nsec / 1e9;
+}
+
+static void
+bench(const char *name, int (*write)(unsigned int, unsigned char *), unsigned int headers)
+{
+    unsigned long long bits = 0;
+    double start = now_seconds(), elapsed;
+    unsigned int n;
+
+    for (n = 0; n < headers; n++)
+        bits += write(n, NULL);
+    elapsed = now_seconds() - start;
+
+    printf("%-28s: %10.0f headers/s, %7.1f ns per header, %.1f Mbit/s\n",
+           name, headers / elapsed, elapsed * 1e9 / headers, bits / elapsed / 1e6);
+}
+
+int main(int argc, char **argv)
+{
+    unsigned int headers = 2000000;
+
+    if (argc > 1)
+        headers = atoi(argv[1]);
+    if (headers == 0) {
+        printf("./bitstream_bench [headers]\n");
+        return 1;
+    }
+
+    if (check_writers(headers < 100000 ? headers : 100000))
+        return 1;
+
+    bench("previous writer", write_legacy, headers);
+    bench("bitstream_start()", write_alloc, headers);
+    bench("bitstream_start_buffer()", write_buffer, headers);
+    bench("  + emulation prevention", write_buffer_ep, headers);
+
+    return 0;
+}
@@ -30,15 +30,20 @@
 #include <sys/types.h>
 #include <sys/stat.h>
 #include <sys/time.h>
+#include <time.h>
 #include <sys/mman.h>
 #include <fcntl.h>
 #include <assert.h>
 #include <pthread.h>
 #include <errno.h>
 #include <math.h>
+#ifdef __SSE2__
+#include <emmintrin.h>
+#endif
 #include <va/va.h>
 #include <va/va_enc_h264.h>
 #include "va_display.h"
+#include "time_us.h"
 
 #define CHECK_VASTATUS(va_status,func)                                  \
     if (va_status != VA_STATUS_SUCCESS) {                               \
@@ -47,6 +52,10 @@
     }
 
 #include "../loadsurface.h"
+#include "../bitstream.h"
+#include "../packed_header.h"
+#include "../coded_sink.h"
+#include "../yuv_input.h"
 
 #define NAL_REF_IDC_NONE        0
 #define NAL_REF_IDC_LOW         1
@@ -63,6 +72,10 @@
 #define SLICE_TYPE_B            1
 #define SLICE_TYPE_I            2
 
+#define IS_P_SLICE(type) ((type) == SLICE_TYPE_P)
+#define IS_B_SLICE(type) ((type) == SLICE_TYPE_B)
+#define IS_I_SLICE(type) ((type) == SLICE_TYPE_I)
+
 #define ENTROPY_MODE_CAVLC      0
 #define ENTROPY_MODE_CABAC      1
 
@@ -70,24 +83,10 @@
 #define PROFILE_IDC_MAIN        77
 #define PROFILE_IDC_HIGH        100
    
-#define BITSTREAM_ALLOCATE_STEPPING     4096
 
 #define SURFACE_NUM 16 /* 16 surfaces for source YUV/reference frame */
-static  VADisplay va_dpy;
+#define SURFACE_NUM_MAX 64 /* upper bound of --surface_num */
 static  VAProfile h264_profile = ~0;
-static  VAConfigAttrib attrib[VAConfigAttribTypeMax];
-static  VAConfigAttrib config_attrib[VAConfigAttribTypeMax];
-static  int config_attrib_num = 0;
-static  VASurfaceID src_surface[SURFACE_NUM];
-static  VABufferID  coded_buf[SURFACE_NUM];
-static  VASurfaceID ref_surface[SURFACE_NUM];
-static  VAConfigID config_id;
-static  VAContextID context_id;
-static  VAEncSequenceParameterBufferH264 seq_param;
-static  VAEncPictureParameterBufferH264 pic_param;
-static  VAEncSliceParameterBufferH264 slice_param;
-static  VAPictureH264 CurrentCurrPic;
-static  VAPictureH264 ReferenceFrames[16], RefPicList0_P[32], RefPicList0_B[32], RefPicList1_B[32];
 static  unsigned int surface_num = SURFACE_NUM;
 static  unsigned int MaxFrameNum = (2<<16);
 static  unsigned int MaxPicOrderCntLsb = (2<<8);
@@ -95,17 +94,23 @@ static  unsigned int Log2MaxFrameNum = 16;
 static  unsigned int Log2MaxPicOrderCntLsb = 8;
 
 static  unsigned int num_ref_frames = 2;
-static  unsigned int numShortTerm = 0;
-static  int constraint_set_flag = 0;
-static  int h264_packedheader = 0; /* support pack header? */
-static  int h264_maxref = (1<<16|1);
 static  int h264_entropy_mode = 1; /* cabac */
 
 static  char *coded_fn = NULL, *srcyuv_fn = NULL, *recyuv_fn = NULL;
-static  FILE *coded_fp = NULL, *srcyuv_fp = NULL, *recyuv_fp = NULL;
+static  FILE *srcyuv_fp = NULL;
+static  struct yuv_input srcyuv_input; /* a raw YUV or Y4M file, "-" for stdin */
+static  int srcyuv_stream = 0; /* not a plain file, the frames are read in order into a ring */
 static  unsigned long long srcyuv_frames = 0;
+static  unsigned char *srcyuv_map = NULL; /* the whole source file, if it could be mapped */
+static  unsigned long long srcyuv_map_size = 0;
+#define SRCYUV_READAHEAD 4 /* frames to prefetch after the one being loaded */
+static  unsigned int upload_threads = 1;
+#define UPLOAD_THREADS_MAX 16 /* upper bound of --upload_threads */
 static  int srcyuv_fourcc = VA_FOURCC_NV12;
 static  int calc_psnr = 0;
+static  int calc_ssim = 0;
+static  int quality_threads = 0; /* 0: one per online CPU */
+static  char *quality_csv_fn = NULL;
 
 static  unsigned int frame_width = 176;
 static  unsigned int frame_height = 144;
@@ -113,22 +118,19 @@ static  unsigned int frame_width_mbaligned;
 static  unsigned int frame_height_mbaligned;
 static  unsigned int frame_rate = 30;
 static  unsigned int frame_count = 60;
-static  unsigned int frame_coded = 0;
 static  unsigned int frame_bitrate = 0;
 static  unsigned int frame_slices = 1;
-static  double frame_size = 0;
+static  unsigned int frame_slice_mbs = 0; /* --slice_mbs, takes precedence over --slices */
+#define SLICE_NUM_MAX 256
 static  int initial_qp = 26;
 static  int minimal_qp = 0;
 static  int intra_period = 30;
 static  int intra_idr_period = 60;
 static  int ip_period = 1;
+static  unsigned int lookahead_depth = 0; /* --lookahead, 0: fixed intra_period/idr_period/ip_period GOP */
+static  unsigned int scenecut_threshold = 20; /* --scenecut, mean 8x8 block difference in luma levels */
+static  int dirty_rect_mode = 0; /* --dirty_rect, send the changed areas as dirty ROI */
 static  int rc_mode = VA_RC_VBR;
-static  unsigned long long current_frame_encoding = 0;
-static  unsigned long long current_frame_display = 0;
-static  unsigned long long current_IDR_display = 0;
-static  unsigned int current_frame_num = 0;
-static  int current_frame_type;
-#define current_slot (current_frame_display % surface_num)
 
 static  int misc_priv_type = 0;
 static  int misc_priv_value = 0;
@@ -138,142 +140,173 @@ static  int misc_priv_value = 0;
 
 /* thread to save coded data/upload source YUV */
 struct storage_task_t {
-    void *next;
     unsigned long long display_order;
     unsigned long long encode_order;
+    unsigned long long enqueue_us; /* time_us_monotonic() when the task was queued */
 };
-static  struct storage_task_t *storage_task_header = NULL, *storage_task_tail = NULL;
 #define SRC_SURFACE_IN_ENCODING 0
 #define SRC_SURFACE_IN_STORAGE  1
-static  int srcsurface_status[SURFACE_NUM];
 static  int encode_syncmode = 0;
-static  pthread_mutex_t encode_mutex = PTHREAD_MUTEX_INITIALIZER;
-static  pthread_cond_t  encode_cond = PTHREAD_COND_INITIALIZER;
-static  pthread_t encode_thread;
-    
-/* for performance profiling */
-static unsigned int UploadPictureTicks=0;
-static unsigned int BeginPictureTicks=0;
-static unsigned int RenderPictureTicks=0;
-static unsigned int EndPictureTicks=0;
-static unsigned int SyncPictureTicks=0;
-static unsigned int SavePictureTicks=0;
-static unsigned int TotalTicks=0;
-
-struct __bitstream {
-    unsigned int *buffer;
-    int bit_offset;
-    int max_size_in_dword;
-};
-typedef struct __bitstream bitstream;
-
-
-static unsigned int 
-va_swap32(unsigned int val)
-{
-    unsigned char *pval = (unsigned char *)&val;
-
-    return ((pval[0] << 24)     |
-            (pval[1] << 16)     |
-            (pval[2] << 8)      |
-            (pval[3] << 0));
-}
-
-static void
-bitstream_start(bitstream *bs)
-{
-    bs->max_size_in_dword = BITSTREAM_ALLOCATE_STEPPING;
-    bs->buffer = calloc(bs->max_size_in_dword * sizeof(int), 1);
-    bs->bit_offset = 0;
-}
-
-static void
-bitstream_end(bitstream *bs)
-{
-    int pos = (bs->bit_offset >> 5);
-    int bit_offset = (bs->bit_offset & 0x1f);
-    int bit_left = 32 - bit_offset;
-
-    if (bit_offset) {
-        bs->buffer[pos] = va_swap32((bs->buffer[pos] << bit_left));
-    }
-}
- 
-static void
-bitstream_put_ui(bitstream *bs, unsigned int val, int size_in_bits)
-{
-    int pos = (bs->bit_offset >> 5);
-    int bit_offset = (bs->bit_offset & 0x1f);
-    int bit_left = 32 - bit_offset;
-
-    if (!size_in_bits)
-        return;
-
-    bs->bit_offset += size_in_bits;
-
-    if (bit_left > size_in_bits) {
-        bs->buffer[pos] = (bs->buffer[pos] << size_in_bits | val);
-    } else {
-        size_in_bits -= bit_left;
-        bs->buffer[pos] = (bs->buffer[pos] << bit_left) | (val >> size_in_bits);
-        bs->buffer[pos] = va_swap32(bs->buffer[pos]);
-
-        if (pos + 1 == bs->max_size_in_dword) {
-            bs->max_size_in_dword += BITSTREAM_ALLOCATE_STEPPING;
-            bs->buffer = realloc(bs->buffer, bs->max_size_in_dword * sizeof(unsigned int));
-        }
-
-        bs->buffer[pos + 1] = val;
-    }
-}
-
-static void
-bitstream_put_ue(bitstream *bs, unsigned int val)
-{
-    int size_in_bits = 0;
-    int tmp_val = ++val;
+static  unsigned int storage_threads = 2;
 
-    while (tmp_val) {
-        tmp_val >>= 1;
-        size_in_bits++;
-    }
-
-    bitstream_put_ui(bs, 0, size_in_bits - 1); // leading zero
-    bitstream_put_ui(bs, val, size_in_bits);
-}
-
-static void
-bitstream_put_se(bitstream *bs, int val)
-{
-    unsigned int new_val;
-
-    if (val <= 0)
-        new_val = -2 * val;
-    else
-        new_val = 2 * val - 1;
-
-    bitstream_put_ue(bs, new_val);
-}
-
-static void
-bitstream_byte_aligning(bitstream *bs, int bit)
-{
-    int bit_offset = (bs->bit_offset & 0x7);
-    int bit_left = 8 - bit_offset;
-    int new_val;
-
-    if (!bit_offset)
-        return;
+/* lookahead analysis of one source frame, against the previous one */
+struct lookahead_frame_t {
+    unsigned int sad;           /* mean difference of the 8x8 block means, in 1/16 luma levels */
+    unsigned int hist_diff;     /* luma histogram difference, in 1/1000 */
+    int scene_cut;
+};
 
-    assert(bit == 0 || bit == 1);
+/* per-frame quality of recyuv vs. srcyuv, Y/U/V planes */
+#define QUALITY_PLANES   3
+#define QUALITY_MAX_PSNR 100.0
+struct frame_quality_t {
+    unsigned long long sse[QUALITY_PLANES];
+    double ssim[QUALITY_PLANES];
+};
 
-    if (bit)
-        new_val = (1 << bit_left) - 1;
-    else
-        new_val = 0;
+/*
+ * One encode stream: its VA context, surfaces, coded/reconstructed
+ * files, reference state and statistics. The options above are shared
+ * by all streams, --streams N runs N sessions in their own threads.
+ */
+struct encode_session {
+    unsigned int index;
+    pthread_t thread;
+
+    VADisplay va_dpy;
+    VAProfile h264_profile;
+    VAConfigAttrib attrib[VAConfigAttribTypeMax];
+    VAConfigAttrib config_attrib[VAConfigAttribTypeMax];
+    int config_attrib_num;
+    VASurfaceID src_surface[SURFACE_NUM_MAX];
+    VABufferID  coded_buf[SURFACE_NUM_MAX];
+    VASurfaceID ref_surface[SURFACE_NUM_MAX];
+    VAConfigID config_id;
+    VAContextID context_id;
+    VAEncSequenceParameterBufferH264 seq_param;
+    VAEncPictureParameterBufferH264 pic_param;
+    VAEncSliceParameterBufferH264 slice_param;
+    VAPictureH264 CurrentCurrPic;
+    VAPictureH264 ReferenceFrames[16], RefPicList0_P[32], RefPicList0_B[32], RefPicList1_B[32];
+
+    unsigned int numShortTerm;
+    int constraint_set_flag;
+    int h264_packedheader; /* support pack header? */
+    int h264_packedslice; /* send packed slice headers */
+    int h264_maxslices; /* VAConfigAttribEncMaxSlices, 0 if not reported */
+    int h264_slice_structure; /* VAConfigAttribEncSliceStructure */
+    int h264_maxref;
+    int h264_entropy_mode;
+    int h264_maxdirtyroi; /* VAConfigAttribEncDirtyROI, 0 if not supported */
+
+    char *coded_fn, *recyuv_fn, *quality_csv_fn; /* with a .<index> suffix for --streams */
+    struct coded_sink coded_sink;
+    FILE *recyuv_fp;
+
+    unsigned int frame_slices;
+    unsigned int slice_mb_start[SLICE_NUM_MAX + 1]; /* slice i covers [start[i], start[i + 1]) */
+    unsigned long long slice_coded_bytes[SLICE_NUM_MAX];
+    unsigned int slice_coded_max[SLICE_NUM_MAX];
+    double frame_size;
+
+    unsigned long long current_frame_encoding;
+    unsigned long long current_frame_display;
+    unsigned long long current_IDR_display;
+    unsigned int current_frame_num;
+    int current_frame_type;
+    int PicOrderCntMsb_ref, pic_order_cnt_lsb_ref; /* POC of the last reference picture */
+
+    /* packed header templates, rebuilt when the parameter sets change */
+    struct packed_header packed_sps, packed_pps, packed_sei;
+    unsigned int sei_cpb_removal_offset; /* bit offset of cpb_removal_delay in packed_sei */
+
+    /*
+     * fixed ring of storage tasks, one producer (encode loop) and
+     * storage_threads consumers; a queued task holds its source surface
+     * IN_STORAGE, so at most surface_num tasks are ever pending
+     */
+    struct storage_task_t storage_task_ring[SURFACE_NUM_MAX];
+    unsigned long long storage_task_head; /* next task to dequeue */
+    unsigned long long storage_task_tail; /* next free ring entry */
+    unsigned long long storage_save_order; /* encode order of the next coded frame to save */
+    int srcsurface_status[SURFACE_NUM_MAX];
+    pthread_cond_t srcsurface_cond[SURFACE_NUM_MAX]; /* signaled when the slot is back IN_ENCODING */
+    pthread_mutex_t encode_mutex;
+    pthread_cond_t  encode_cond; /* a storage task is queued */
+    pthread_cond_t  storage_save_cond; /* storage_save_order moved */
+    pthread_mutex_t recyuv_mutex;
+    pthread_t encode_thread[SURFACE_NUM_MAX];
+
+    /*
+     * --upload_threads: upload_threads - 1 workers started with the
+     * session take row bands of the queued upload jobs, one per frame
+     */
+    pthread_t upload_thread[UPLOAD_THREADS_MAX];
+    unsigned int upload_threads_num;
+    VAImage src_image[SURFACE_NUM_MAX]; /* derived once from src_surface */
+    struct upload_job_t *upload_jobs;   /* with bands left to take */
+    int upload_quit;
+    pthread_mutex_t upload_mutex;
+    pthread_cond_t upload_cond;         /* a job queued, or upload_quit */
+    pthread_cond_t upload_done_cond;    /* a band was uploaded */
+
+    /* for performance profiling */
+    unsigned int UploadPictureTicks;
+    unsigned int BeginPictureTicks;
+    unsigned int RenderPictureTicks;
+    unsigned int EndPictureTicks;
+    unsigned int SyncPictureTicks;
+    unsigned int SavePictureTicks;
+    unsigned int TotalTicks;
+    /* storage task latency, in microseconds */
+    unsigned long long StorageWaitUs, StorageWaitMaxUs;
+    unsigned long long StorageServiceUs, StorageServiceMaxUs;
+    unsigned long long StorageTasks;
+    /* vaBeginPicture to coded data saved, in microseconds */
+    unsigned long long frame_begin_us[SURFACE_NUM_MAX];
+    unsigned long long FrameLatencyUs, FrameLatencyMaxUs;
+
+    /*
+     * --lookahead: a thread analyses the source frames ahead of the
+     * encode loop, which plans the GOP one mini-GOP at a time
+     */
+    pthread_t lookahead_thread;
+    struct lookahead_frame_t *lookahead; /* frame_count entries, in display order */
+    unsigned long long lookahead_done;   /* frames analysed */
+    unsigned long long lookahead_limit;  /* frames the thread may analyse */
+    pthread_mutex_t lookahead_mutex;
+    pthread_cond_t lookahead_cond;
+    unsigned long long plan_display[SURFACE_NUM_MAX]; /* planned mini-GOP, in encoding order */
+    int plan_type[SURFACE_NUM_MAX];
+    unsigned int plan_count, plan_next;
+    unsigned long long plan_next_display; /* first display frame not planned yet */
+    unsigned long long plan_last_idr, plan_last_intra;
+    int plan_postponed;                  /* the intra frame due is postponed */
+    unsigned int LookaheadSceneCuts, LookaheadIDR, LookaheadI, LookaheadPostponed;
+    unsigned long long LookaheadWaitUs;
+
+    /* --dirty_rect: 16x16 blocks changed against the reference frames */
+    unsigned char *dirty_map;
+    VARectangle *dirty_rects;          /* read by the driver until vaEndPicture */
+    unsigned int dirty_rect_num;
+    int dirty_valid;                   /* dirty_rects describe the current frame */
+    int frame_dirty[SURFACE_NUM_MAX];  /* the frame in the slot was sent with a dirty ROI */
+    unsigned long long DirtyBlocks, DirtyBlocksTotal, DirtyRects, DirtyFrames;
+    unsigned long long DirtyLatencyUs, FullLatencyUs, FullFrames;
+
+    struct frame_quality_t *frame_quality;
+    unsigned long long quality_frames;
+    unsigned long long quality_next_frame;
+    int quality_failed;
+    pthread_mutex_t quality_mutex;
+};
+#define current_slot (s->current_frame_display % surface_num)
 
-    bitstream_put_ui(bs, new_val, bit_left);
-}
+#define STREAM_NUM_MAX 64
+static  unsigned int stream_num = 1; /* --streams */
+static  unsigned int display_num = 1; /* --displays, streams are spread over the displays */
+static  VADisplay va_displays[STREAM_NUM_MAX];
+static  struct encode_session *sessions[STREAM_NUM_MAX];
 
 static void 
 rbsp_trailing_bits(bitstream *bs)
@@ -294,23 +327,23 @@ static void nal_header(bitstream *bs, int nal_ref_idc, int nal_unit_type)
     bitstream_put_ui(bs, nal_unit_type, 5);
 }
 
-static void sps_rbsp(bitstream *bs)
+static void sps_rbsp(struct encode_session *s, bitstream *bs)
 {
     int profile_idc = PROFILE_IDC_BASELINE;
 
-    if (h264_profile  == VAProfileH264High)
+    if (s->h264_profile  == VAProfileH264High)
         profile_idc = PROFILE_IDC_HIGH;
-    else if (h264_profile  == VAProfileH264Main)
+    else if (s->h264_profile  == VAProfileH264Main)
         profile_idc = PROFILE_IDC_MAIN;
 
     bitstream_put_ui(bs, profile_idc, 8);               /* profile_idc */
-    bitstream_put_ui(bs, !!(constraint_set_flag & 1), 1);                         /* constraint_set0_flag */
-    bitstream_put_ui(bs, !!(constraint_set_flag & 2), 1);                         /* constraint_set1_flag */
-    bitstream_put_ui(bs, !!(constraint_set_flag & 4), 1);                         /* constraint_set2_flag */
-    bitstream_put_ui(bs, !!(constraint_set_flag & 8), 1);                         /* constraint_set3_flag */
+    bitstream_put_ui(bs, !!(s->constraint_set_flag & 1), 1);                         /* constraint_set0_flag */
+    bitstream_put_ui(bs, !!(s->constraint_set_flag & 2), 1);                         /* constraint_set1_flag */
+    bitstream_put_ui(bs, !!(s->constraint_set_flag & 4), 1);                         /* constraint_set2_flag */
+    bitstream_put_ui(bs, !!(s->constraint_set_flag & 8), 1);                         /* constraint_set3_flag */
     bitstream_put_ui(bs, 0, 4);                         /* reserved_zero_4bits */
-    bitstream_put_ui(bs, seq_param.level_idc, 8);      /* level_idc */
-    bitstream_put_ue(bs, seq_param.seq_parameter_set_id);      /* seq_parameter_set_id */
+    bitstream_put_ui(bs, s->seq_param.level_idc, 8);      /* level_idc */
+    bitstream_put_ue(bs, s->seq_param.seq_parameter_set_id);      /* seq_parameter_set_id */
 
     if ( profile_idc == PROFILE_IDC_HIGH) {
         bitstream_put_ue(bs, 1);        /* chroma_format_idc = 1, 4:2:0 */ 
@@ -320,34 +353,34 @@ static void sps_rbsp(bitstream *bs)
         bitstream_put_ui(bs, 0, 1);     /* seq_scaling_matrix_present_flag */
     }
 
-    bitstream_put_ue(bs, seq_param.seq_fields.bits.log2_max_frame_num_minus4); /* log2_max_frame_num_minus4 */
-    bitstream_put_ue(bs, seq_param.seq_fields.bits.pic_order_cnt_type);        /* pic_order_cnt_type */
+    bitstream_put_ue(bs, s->seq_param.seq_fields.bits.log2_max_frame_num_minus4); /* log2_max_frame_num_minus4 */
+    bitstream_put_ue(bs, s->seq_param.seq_fields.bits.pic_order_cnt_type);        /* pic_order_cnt_type */
 
-    if (seq_param.seq_fields.bits.pic_order_cnt_type == 0)
-        bitstream_put_ue(bs, seq_param.seq_fields.bits.log2_max_pic_order_cnt_lsb_minus4);     /* log2_max_pic_order_cnt_lsb_minus4 */
+    if (s->seq_param.seq_fields.bits.pic_order_cnt_type == 0)
+        bitstream_put_ue(bs, s->seq_param.seq_fields.bits.log2_max_pic_order_cnt_lsb_minus4);     /* log2_max_pic_order_cnt_lsb_minus4 */
     else {
         assert(0);
     }
 
-    bitstream_put_ue(bs, seq_param.max_num_ref_frames);        /* num_ref_frames */
+    bitstream_put_ue(bs, s->seq_param.max_num_ref_frames);        /* num_ref_frames */
     bitstream_put_ui(bs, 0, 1);                                 /* gaps_in_frame_num_value_allowed_flag */
 
-    bitstream_put_ue(bs, seq_param.picture_width_in_mbs - 1);  /* pic_width_in_mbs_minus1 */
-    bitstream_put_ue(bs, seq_param.picture_height_in_mbs - 1); /* pic_height_in_map_units_minus1 */
-    bitstream_put_ui(bs, seq_param.seq_fields.bits.frame_mbs_only_flag, 1);    /* frame_mbs_only_flag */
+    bitstream_put_ue(bs, s->seq_param.picture_width_in_mbs - 1);  /* pic_width_in_mbs_minus1 */
+    bitstream_put_ue(bs, s->seq_param.picture_height_in_mbs - 1); /* pic_height_in_map_units_minus1 */
+    bitstream_put_ui(bs, s->seq_param.seq_fields.bits.frame_mbs_only_flag, 1);    /* frame_mbs_only_flag */
 
-    if (!seq_param.seq_fields.bits.frame_mbs_only_flag) {
+    if (!s->seq_param.seq_fields.bits.frame_mbs_only_flag) {
         assert(0);
     }
 
-    bitstream_put_ui(bs, seq_param.seq_fields.bits.direct_8x8_inference_flag, 1);      /* direct_8x8_inference_flag */
-    bitstream_put_ui(bs, seq_param.frame_cropping_flag, 1);            /* frame_cropping_flag */
+    bitstream_put_ui(bs, s->seq_param.seq_fields.bits.direct_8x8_inference_flag, 1);      /* direct_8x8_inference_flag */
+    bitstream_put_ui(bs, s->seq_param.frame_cropping_flag, 1);            /* frame_cropping_flag */
 
-    if (seq_param.frame_cropping_flag) {
-        bitstream_put_ue(bs, seq_param.frame_crop_left_offset);        /* frame_crop_left_offset */
-        bitstream_put_ue(bs, seq_param.frame_crop_right_offset);       /* frame_crop_right_offset */
-        bitstream_put_ue(bs, seq_param.frame_crop_top_offset);         /* frame_crop_top_offset */
-        bitstream_put_ue(bs, seq_param.frame_crop_bottom_offset);      /* frame_crop_bottom_offset */
+    if (s->seq_param.frame_cropping_flag) {
+        bitstream_put_ue(bs, s->seq_param.frame_crop_left_offset);        /* frame_crop_left_offset */
+        bitstream_put_ue(bs, s->seq_param.frame_crop_right_offset);       /* frame_crop_right_offset */
+        bitstream_put_ue(bs, s->seq_param.frame_crop_top_offset);         /* frame_crop_top_offset */
+        bitstream_put_ue(bs, s->seq_param.frame_crop_bottom_offset);      /* frame_crop_bottom_offset */
     }
     
     //if ( frame_bit_rate < 0 ) { //TODO EW: the vui header isn't correct
@@ -392,87 +425,186 @@ static void sps_rbsp(bitstream *bs)
 }
 
 
-static void pps_rbsp(bitstream *bs)
+static void pps_rbsp(struct encode_session *s, bitstream *bs)
 {
-    bitstream_put_ue(bs, pic_param.pic_parameter_set_id);      /* pic_parameter_set_id */
-    bitstream_put_ue(bs, pic_param.seq_parameter_set_id);      /* seq_parameter_set_id */
+    bitstream_put_ue(bs, s->pic_param.pic_parameter_set_id);      /* pic_parameter_set_id */
+    bitstream_put_ue(bs, s->pic_param.seq_parameter_set_id);      /* seq_parameter_set_id */
 
-    bitstream_put_ui(bs, pic_param.pic_fields.bits.entropy_coding_mode_flag, 1);  /* entropy_coding_mode_flag */
+    bitstream_put_ui(bs, s->pic_param.pic_fields.bits.entropy_coding_mode_flag, 1);  /* entropy_coding_mode_flag */
 
     bitstream_put_ui(bs, 0, 1);                         /* pic_order_present_flag: 0 */
 
     bitstream_put_ue(bs, 0);                            /* num_slice_groups_minus1 */
 
-    bitstream_put_ue(bs, pic_param.num_ref_idx_l0_active_minus1);      /* num_ref_idx_l0_active_minus1 */
-    bitstream_put_ue(bs, pic_param.num_ref_idx_l1_active_minus1);      /* num_ref_idx_l1_active_minus1 1 */
+    bitstream_put_ue(bs, s->pic_param.num_ref_idx_l0_active_minus1);      /* num_ref_idx_l0_active_minus1 */
+    bitstream_put_ue(bs, s->pic_param.num_ref_idx_l1_active_minus1);      /* num_ref_idx_l1_active_minus1 1 */
 
-    bitstream_put_ui(bs, pic_param.pic_fields.bits.weighted_pred_flag, 1);     /* weighted_pred_flag: 0 */
-    bitstream_put_ui(bs, pic_param.pic_fields.bits.weighted_bipred_idc, 2);	/* weighted_bipred_idc: 0 */
+    bitstream_put_ui(bs, s->pic_param.pic_fields.bits.weighted_pred_flag, 1);     /* weighted_pred_flag: 0 */
+    bitstream_put_ui(bs, s->pic_param.pic_fields.bits.weighted_bipred_idc, 2);	/* weighted_bipred_idc: 0 */
 
-    bitstream_put_se(bs, pic_param.pic_init_qp - 26);  /* pic_init_qp_minus26 */
+    bitstream_put_se(bs, s->pic_param.pic_init_qp - 26);  /* pic_init_qp_minus26 */
     bitstream_put_se(bs, 0);                            /* pic_init_qs_minus26 */
     bitstream_put_se(bs, 0);                            /* chroma_qp_index_offset */
 
-    bitstream_put_ui(bs, pic_param.pic_fields.bits.deblocking_filter_control_present_flag, 1); /* deblocking_filter_control_present_flag */
+    bitstream_put_ui(bs, s->pic_param.pic_fields.bits.deblocking_filter_control_present_flag, 1); /* deblocking_filter_control_present_flag */
     bitstream_put_ui(bs, 0, 1);                         /* constrained_intra_pred_flag */
     bitstream_put_ui(bs, 0, 1);                         /* redundant_pic_cnt_present_flag */
     
     /* more_rbsp_data */
-    bitstream_put_ui(bs, pic_param.pic_fields.bits.transform_8x8_mode_flag, 1);    /*transform_8x8_mode_flag */
+    bitstream_put_ui(bs, s->pic_param.pic_fields.bits.transform_8x8_mode_flag, 1);    /*transform_8x8_mode_flag */
     bitstream_put_ui(bs, 0, 1);                         /* pic_scaling_matrix_present_flag */
-    bitstream_put_se(bs, pic_param.second_chroma_qp_index_offset );    /*second_chroma_qp_index_offset */
+    bitstream_put_se(bs, s->pic_param.second_chroma_qp_index_offset );    /*second_chroma_qp_index_offset */
 
     rbsp_trailing_bits(bs);
 }
 
 
+static void slice_header(struct encode_session *s, bitstream *bs)
+{
+    bitstream_put_ue(bs, s->slice_param.macroblock_address);      /* first_mb_in_slice */
+    bitstream_put_ue(bs, s->slice_param.slice_type);              /* slice_type */
+    bitstream_put_ue(bs, s->slice_param.pic_parameter_set_id);    /* pic_parameter_set_id */
+    bitstream_put_ui(bs, s->pic_param.frame_num & ((1 << (s->seq_param.seq_fields.bits.log2_max_frame_num_minus4 + 4)) - 1),
+                     s->seq_param.seq_fields.bits.log2_max_frame_num_minus4 + 4); /* frame_num */
+
+    /* frame_mbs_only_flag == 1 */
+    if (!s->seq_param.seq_fields.bits.frame_mbs_only_flag) {
+        assert(0);
+    }
+
+    if (s->pic_param.pic_fields.bits.idr_pic_flag)
+        bitstream_put_ue(bs, s->slice_param.idr_pic_id);          /* idr_pic_id */
+
+    if (s->seq_param.seq_fields.bits.pic_order_cnt_type == 0) {
+        bitstream_put_ui(bs, s->slice_param.pic_order_cnt_lsb,
+                         s->seq_param.seq_fields.bits.log2_max_pic_order_cnt_lsb_minus4 + 4); /* pic_order_cnt_lsb */
+        /* pic_order_present_flag == 0 */
+    } else {
+        assert(0);
+    }
+
+    /* redundant_pic_cnt_present_flag == 0 */
+    if (IS_P_SLICE(s->slice_param.slice_type)) {
+        bitstream_put_ui(bs, s->slice_param.num_ref_idx_active_override_flag, 1); /* num_ref_idx_active_override_flag */
+        if (s->slice_param.num_ref_idx_active_override_flag)
+            bitstream_put_ue(bs, s->slice_param.num_ref_idx_l0_active_minus1);
+
+        bitstream_put_ui(bs, 0, 1);     /* ref_pic_list_reordering_flag_l0 */
+    } else if (IS_B_SLICE(s->slice_param.slice_type)) {
+        bitstream_put_ui(bs, s->slice_param.direct_spatial_mv_pred_flag, 1); /* direct_spatial_mv_pred_flag */
+        bitstream_put_ui(bs, s->slice_param.num_ref_idx_active_override_flag, 1); /* num_ref_idx_active_override_flag */
+        if (s->slice_param.num_ref_idx_active_override_flag) {
+            bitstream_put_ue(bs, s->slice_param.num_ref_idx_l0_active_minus1);
+            bitstream_put_ue(bs, s->slice_param.num_ref_idx_l1_active_minus1);
+        }
+
+        bitstream_put_ui(bs, 0, 1);     /* ref_pic_list_reordering_flag_l0 */
+        bitstream_put_ui(bs, 0, 1);     /* ref_pic_list_reordering_flag_l1 */
+    }
+
+    /* weighted_pred_flag == 0, weighted_bipred_idc == 0 */
+    if ((s->pic_param.pic_fields.bits.weighted_pred_flag && IS_P_SLICE(s->slice_param.slice_type)) ||
+        (s->pic_param.pic_fields.bits.weighted_bipred_idc == 1 && IS_B_SLICE(s->slice_param.slice_type))) {
+        assert(0);
+    }
+
+    /* dec_ref_pic_marking */
+    if (s->pic_param.pic_fields.bits.reference_pic_flag) {
+        if (s->pic_param.pic_fields.bits.idr_pic_flag) {
+            bitstream_put_ui(bs, 0, 1); /* no_output_of_prior_pics_flag */
+            bitstream_put_ui(bs, 0, 1); /* long_term_reference_flag */
+        } else
+            bitstream_put_ui(bs, 0, 1); /* adaptive_ref_pic_marking_mode_flag */
+    }
+
+    if (s->pic_param.pic_fields.bits.entropy_coding_mode_flag &&
+        !IS_I_SLICE(s->slice_param.slice_type))
+        bitstream_put_ue(bs, s->slice_param.cabac_init_idc);      /* cabac_init_idc */
+
+    bitstream_put_se(bs, s->slice_param.slice_qp_delta);          /* slice_qp_delta */
+
+    if (s->pic_param.pic_fields.bits.deblocking_filter_control_present_flag) {
+        bitstream_put_ue(bs, s->slice_param.disable_deblocking_filter_idc); /* disable_deblocking_filter_idc */
+        if (s->slice_param.disable_deblocking_filter_idc != 1) {
+            bitstream_put_se(bs, s->slice_param.slice_alpha_c0_offset_div2); /* slice_alpha_c0_offset_div2 */
+            bitstream_put_se(bs, s->slice_param.slice_beta_offset_div2);     /* slice_beta_offset_div2 */
+        }
+    }
+
+    /* cabac_alignment_one_bit */
+    if (s->pic_param.pic_fields.bits.entropy_coding_mode_flag)
+        bitstream_byte_aligning(bs, 1);
+}
+
+/* slice headers are built for every slice, into the caller's buffer */
 static int
-build_packed_pic_buffer(unsigned char **header_buffer)
+build_packed_slice_buffer(struct encode_session *s, unsigned char *header_buffer, int size)
 {
     bitstream bs;
 
-    bitstream_start(&bs);
+    bitstream_start_buffer(&bs, header_buffer, size);
     nal_start_code_prefix(&bs);
-    nal_header(&bs, NAL_REF_IDC_HIGH, NAL_PPS);
-    pps_rbsp(&bs);
+    if (IS_I_SLICE(s->slice_param.slice_type))
+        nal_header(&bs, NAL_REF_IDC_HIGH,
+                   s->pic_param.pic_fields.bits.idr_pic_flag ? NAL_IDR : NAL_NON_IDR);
+    else if (IS_P_SLICE(s->slice_param.slice_type))
+        nal_header(&bs, NAL_REF_IDC_MEDIUM, NAL_NON_IDR);
+    else
+        nal_header(&bs, s->pic_param.pic_fields.bits.reference_pic_flag ? NAL_REF_IDC_LOW : NAL_REF_IDC_NONE,
+                   NAL_NON_IDR);
+    slice_header(s, &bs);
     bitstream_end(&bs);
 
-    *header_buffer = (unsigned char *)bs.buffer;
+    assert(!bs.overflow);
     return bs.bit_offset;
 }
 
-static int
-build_packed_seq_buffer(unsigned char **header_buffer)
+static void
+build_packed_pic_buffer(struct encode_session *s)
 {
     bitstream bs;
 
-    bitstream_start(&bs);
+    packed_header_start(&s->packed_pps, &bs);
     nal_start_code_prefix(&bs);
-    nal_header(&bs, NAL_REF_IDC_HIGH, NAL_SPS);
-    sps_rbsp(&bs);
-    bitstream_end(&bs);
+    nal_header(&bs, NAL_REF_IDC_HIGH, NAL_PPS);
+    pps_rbsp(s, &bs);
+    packed_header_end(&s->packed_pps, &bs);
+}
 
-    *header_buffer = (unsigned char *)bs.buffer;
-    return bs.bit_offset;
+static void
+build_packed_seq_buffer(struct encode_session *s)
+{
+    bitstream bs;
+
+    packed_header_start(&s->packed_sps, &bs);
+    nal_start_code_prefix(&bs);
+    nal_header(&bs, NAL_REF_IDC_HIGH, NAL_SPS);
+    sps_rbsp(s, &bs);
+    packed_header_end(&s->packed_sps, &bs);
 }
 
-static int 
-build_packed_sei_buffer_timing(unsigned int init_cpb_removal_length,
-				unsigned int init_cpb_removal_delay,
-				unsigned int init_cpb_removal_delay_offset,
-				unsigned int cpb_removal_length,
-				unsigned int cpb_removal_delay,
-				unsigned int dpb_output_length,
-				unsigned int dpb_output_delay,
-				unsigned char **sei_buffer)
+/*
+ * buffering period + picture timing SEI, the bit offset of
+ * cpb_removal_delay is returned in cpb_removal_offset for patching
+ */
+static void
+build_packed_sei_buffer_timing(struct packed_header *header,
+                               unsigned int init_cpb_removal_length,
+                               unsigned int init_cpb_removal_delay,
+                               unsigned int init_cpb_removal_delay_offset,
+                               unsigned int cpb_removal_length,
+                               unsigned int cpb_removal_delay,
+                               unsigned int dpb_output_length,
+                               unsigned int dpb_output_delay,
+                               unsigned int *cpb_removal_offset)
 {
-    unsigned char *byte_buf;
+    unsigned char sei_bp_buffer[16], sei_pic_buffer[16];
     int bp_byte_size, i, pic_byte_size;
 
     bitstream nal_bs;
     bitstream sei_bp_bs, sei_pic_bs;
 
-    bitstream_start(&sei_bp_bs);
+    bitstream_start_buffer(&sei_bp_bs, sei_bp_buffer, sizeof(sei_bp_buffer));
     bitstream_put_ue(&sei_bp_bs, 0);       /*seq_parameter_set_id*/
     bitstream_put_ui(&sei_bp_bs, init_cpb_removal_delay, cpb_removal_length); 
     bitstream_put_ui(&sei_bp_bs, init_cpb_removal_delay_offset, cpb_removal_length); 
@@ -482,7 +614,7 @@ build_packed_sei_buffer_timing(unsigned int init_cpb_removal_length,
     bitstream_end(&sei_bp_bs);
     bp_byte_size = (sei_bp_bs.bit_offset + 7) / 8;
     
-    bitstream_start(&sei_pic_bs);
+    bitstream_start_buffer(&sei_pic_bs, sei_pic_buffer, sizeof(sei_pic_buffer));
     bitstream_put_ui(&sei_pic_bs, cpb_removal_delay, cpb_removal_length); 
     bitstream_put_ui(&sei_pic_bs, dpb_output_delay, dpb_output_length); 
     if ( sei_pic_bs.bit_offset & 0x7) {
@@ -491,7 +623,7 @@ build_packed_sei_buffer_timing(unsigned int init_cpb_removal_length,
     bitstream_end(&sei_pic_bs);
     pic_byte_size = (sei_pic_bs.bit_offset + 7) / 8;
     
-    bitstream_start(&nal_bs);
+    packed_header_start(header, &nal_bs);
     nal_start_code_prefix(&nal_bs);
     nal_header(&nal_bs, NAL_REF_IDC_NONE, NAL_SEI);
 
@@ -499,27 +631,20 @@ build_packed_sei_buffer_timing(unsigned int init_cpb_removal_length,
     bitstream_put_ui(&nal_bs, 0, 8);
     bitstream_put_ui(&nal_bs, bp_byte_size, 8);
     
-    byte_buf = (unsigned char *)sei_bp_bs.buffer;
     for(i = 0; i < bp_byte_size; i++) {
-        bitstream_put_ui(&nal_bs, byte_buf[i], 8);
+        bitstream_put_ui(&nal_bs, sei_bp_buffer[i], 8);
     }
-    free(byte_buf);
 	/* write the SEI timing data */
     bitstream_put_ui(&nal_bs, 0x01, 8);
     bitstream_put_ui(&nal_bs, pic_byte_size, 8);
     
-    byte_buf = (unsigned char *)sei_pic_bs.buffer;
+    *cpb_removal_offset = nal_bs.bit_offset;
     for(i = 0; i < pic_byte_size; i++) {
-        bitstream_put_ui(&nal_bs, byte_buf[i], 8);
+        bitstream_put_ui(&nal_bs, sei_pic_buffer[i], 8);
     }
-    free(byte_buf);
 
     rbsp_trailing_bits(&nal_bs);
-    bitstream_end(&nal_bs);
-
-    *sei_buffer = (unsigned char *)nal_bs.buffer; 
-   
-    return nal_bs.bit_offset;
+    packed_header_end(header, &nal_bs);
 }
 
 
@@ -618,6 +743,355 @@ void encoding2display_order(
     }
 }
 
+/*
+ * Lookahead: the luma plane of each source frame is reduced to its 8x8
+ * block means. A frame is a scene cut when the blocks differ from the
+ * previous frame by scenecut_threshold on average and either the luma
+ * histogram changed too or the difference jumped compared with the
+ * previous frame (fast motion changes a lot but steadily). It is static
+ * when the blocks changed by less than one luma level on average.
+ *
+ * With --lookahead, lookahead_next_frame() replaces encoding2display_order():
+ * - mini-GOPs of ip_period frames are planned in display order, the
+ *   anchor (P or I) is encoded first, then the B frames before it
+ * - a scene cut ends the mini-GOP with a P frame and is encoded as an
+ *   IDR frame alone, or an I frame if the last IDR is closer than
+ *   intra_period
+ * - the I/IDR frames of intra_period/intra_idr_period are postponed, up
+ *   to LOOKAHEAD_MAX_STRETCH times the period, while all the frames since
+ *   the last one and lookahead_depth frames ahead are static
+ */
+#define LOOKAHEAD_BLOCK         8
+#define LOOKAHEAD_HIST_BINS     64
+#define LOOKAHEAD_HIST_CUT      250     /* histogram difference, in 1/1000 */
+#define LOOKAHEAD_SAD_JUMP      3       /* difference vs. the previous frame's for a cut */
+#define LOOKAHEAD_STATIC_SAD    16      /* one luma level, in 1/16 */
+#define LOOKAHEAD_MAX_STRETCH   4
+
+struct quality_plane_t {
+    unsigned int offset;        /* offset of the first sample in the frame */
+    unsigned int width;
+    unsigned int height;
+    unsigned int stride;        /* in bytes */
+    unsigned int step;          /* 2 for the interleaved NV12 chroma */
+};
+
+static void quality_planes(struct quality_plane_t plane[QUALITY_PLANES]);
+static unsigned char *quality_map_frame(FILE *fp, unsigned long long frame_start,
+                                        char **mmap_ptr, unsigned int *mmap_size);
+
+/* the offset of a frame in the source file, past the Y4M headers */
+static unsigned long long srcyuv_offset(unsigned long long frame)
+{
+    return srcyuv_input.data_offset + frame * srcyuv_input.frame_stride + srcyuv_input.frame_header;
+}
+
+/* a frame of a source stream, the last one is repeated past its end */
+static unsigned char *srcyuv_stream_frame(unsigned long long frame)
+{
+    unsigned char *ptr = yuv_input_frame(&srcyuv_input, frame);
+
+    if (ptr == NULL && errno == ENODATA && srcyuv_input.frames)
+        ptr = yuv_input_frame(&srcyuv_input, srcyuv_input.frames - 1);
+    if (ptr == NULL) {
+        if (srcyuv_input.frames == 0)
+            printf("The source stream has no frame\n");
+        else
+            printf("Frame %llu of the source stream was already dropped\n", frame);
+        exit(1);
+    }
+
+    return ptr;
+}
+
+/* a source frame, *mmap_ptr is to be unmapped if the file couldn't be mapped as a whole */
+static unsigned char *srcyuv_frame(unsigned long long frame, char **mmap_ptr, unsigned int *mmap_size)
+{
+    *mmap_ptr = NULL;
+    *mmap_size = 0;
+    if (srcyuv_stream)
+        return srcyuv_stream_frame(frame);
+
+    frame = frame % srcyuv_frames;
+    if (srcyuv_map)
+        return srcyuv_map + srcyuv_offset(frame);
+
+    return quality_map_frame(srcyuv_fp, srcyuv_offset(frame), mmap_ptr, mmap_size);
+}
+
+#ifdef __SSE2__
+static inline unsigned long long quality_hsum_epu32(__m128i sum)
+{
+    unsigned int lane[4];
+
+    _mm_storeu_si128((__m128i *)lane, sum);
+    return (unsigned long long)lane[0] + lane[1] + lane[2] + lane[3];
+}
+#endif
+
+/* 8x8 block means of the luma plane, the partial blocks on the right/bottom are skipped */
+static void lookahead_block_means(const unsigned char *luma, unsigned char *blocks,
+                                  unsigned int blocks_w, unsigned int blocks_h)
+{
+    unsigned int bx, by, x, y;
+
+    for (by = 0; by < blocks_h; by++, luma += LOOKAHEAD_BLOCK * frame_width, blocks += blocks_w) {
+        bx = 0;
+#ifdef __SSE2__
+        {
+            __m128i zero = _mm_setzero_si128();
+
+            /* two blocks per load, psadbw against zero sums each half */
+            for (; bx + 2 <= blocks_w; bx += 2) {
+                __m128i sum = _mm_setzero_si128();
+                unsigned int lane[4];
+
+                for (y = 0; y < LOOKAHEAD_BLOCK; y++)
+                    sum = _mm_add_epi64(sum, _mm_sad_epu8(_mm_loadu_si128((const __m128i *)
+                                                                          (luma + y * frame_width + bx * LOOKAHEAD_BLOCK)), zero));
+                _mm_storeu_si128((__m128i *)lane, sum);
+                blocks[bx] = (lane[0] + 32) >> 6;
+                blocks[bx + 1] = (lane[2] + 32) >> 6;
+            }
+        }
+#endif
+        for (; bx < blocks_w; bx++) {
+            unsigned int sum = 0;
+
+            for (y = 0; y < LOOKAHEAD_BLOCK; y++)
+                for (x = 0; x < LOOKAHEAD_BLOCK; x++)
+                    sum += luma[y * frame_width + bx * LOOKAHEAD_BLOCK + x];
+            blocks[bx] = (sum + 32) >> 6;
+        }
+    }
+}
+
+static unsigned long long lookahead_sad(const unsigned char *a, const unsigned char *b, unsigned int size)
+{
+    unsigned long long sad = 0;
+    unsigned int i = 0;
+
+#ifdef __SSE2__
+    {
+        __m128i sum = _mm_setzero_si128();
+
+        for (; i + 16 <= size; i += 16)
+            sum = _mm_add_epi64(sum, _mm_sad_epu8(_mm_loadu_si128((const __m128i *)(a + i)),
+                                                  _mm_loadu_si128((const __m128i *)(b + i))));
+        sad = quality_hsum_epu32(sum);
+    }
+#endif
+    for (; i < size; i++)
+        sad += abs(a[i] - b[i]);
+
+    return sad;
+}
+
+static void * lookahead_thread(void *t)
+{
+    struct encode_session *s = t;
+    unsigned int blocks_w = frame_width / LOOKAHEAD_BLOCK, blocks_h = frame_height / LOOKAHEAD_BLOCK;
+    unsigned int blocks_num = blocks_w * blocks_h;
+    unsigned int hist[2][LOOKAHEAD_HIST_BINS], prev_sad = 0, i;
+    unsigned char *blocks;
+    unsigned long long frame;
+
+    blocks = malloc(2 * blocks_num);
+    for (frame = 0; frame < frame_count; frame++) {
+        unsigned char *cur = blocks + (frame & 1) * blocks_num, *prev = blocks + !(frame & 1) * blocks_num;
+        unsigned int *cur_hist = hist[frame & 1], *prev_hist = hist[!(frame & 1)];
+        struct lookahead_frame_t result;
+        unsigned char *luma;
+        char *mmap_ptr;
+        unsigned int mmap_size;
+
+        pthread_mutex_lock(&s->lookahead_mutex);
+        while (frame >= s->lookahead_limit)
+            pthread_cond_wait(&s->lookahead_cond, &s->lookahead_mutex);
+        pthread_mutex_unlock(&s->lookahead_mutex);
+
+        luma = srcyuv_frame(frame, &mmap_ptr, &mmap_size);
+        if (blocks == NULL || luma == NULL) {
+            printf("Lookahead failed, the remaining frames use the fixed GOP cadence\n");
+            break;
+        }
+        lookahead_block_means(luma, cur, blocks_w, blocks_h);
+        if (mmap_ptr)
+            munmap(mmap_ptr, mmap_size);
+
+        memset(cur_hist, 0, sizeof(hist[0]));
+        for (i = 0; i < blocks_num; i++)
+            cur_hist[cur[i] * LOOKAHEAD_HIST_BINS / 256]++;
+
+        memset(&result, 0, sizeof(result));
+        if (frame > 0) {
+            unsigned int hist_diff = 0;
+
+            for (i = 0; i < LOOKAHEAD_HIST_BINS; i++)
+                hist_diff += abs((int)cur_hist[i] - (int)prev_hist[i]);
+            result.sad = lookahead_sad(cur, prev, blocks_num) * 16 / blocks_num;
+            result.hist_diff = hist_diff * 1000ULL / (2 * blocks_num);
+            result.scene_cut = result.sad >= scenecut_threshold * 16 &&
+                (result.hist_diff >= LOOKAHEAD_HIST_CUT ||
+                 result.sad >= LOOKAHEAD_SAD_JUMP * MAX(prev_sad, LOOKAHEAD_STATIC_SAD));
+        }
+        prev_sad = result.sad;
+
+        pthread_mutex_lock(&s->lookahead_mutex);
+        s->lookahead[frame] = result;
+        s->lookahead_done = frame + 1;
+        pthread_cond_broadcast(&s->lookahead_cond);
+        pthread_mutex_unlock(&s->lookahead_mutex);
+    }
+
+    /* on failure, the frames left are neither cuts nor static */
+    pthread_mutex_lock(&s->lookahead_mutex);
+    for (; frame < frame_count; frame++)
+        s->lookahead[frame].sad = ~0U;
+    s->lookahead_done = frame_count;
+    pthread_cond_broadcast(&s->lookahead_cond);
+    pthread_mutex_unlock(&s->lookahead_mutex);
+
+    free(blocks);
+    return NULL;
+}
+
+/* wait until the frames before end are analysed, the thread runs lookahead_depth frames further */
+static void lookahead_wait(struct encode_session *s, unsigned long long end)
+{
+    unsigned long long start_us;
+
+    end = MIN(end, frame_count);
+    pthread_mutex_lock(&s->lookahead_mutex);
+    if (s->lookahead_limit < MIN(end + lookahead_depth, frame_count)) {
+        s->lookahead_limit = MIN(end + lookahead_depth, frame_count);
+        pthread_cond_broadcast(&s->lookahead_cond);
+    }
+    if (s->lookahead_done < end) {
+        start_us = time_us_monotonic();
+        while (s->lookahead_done < end)
+            pthread_cond_wait(&s->lookahead_cond, &s->lookahead_mutex);
+        s->LookaheadWaitUs += time_us_monotonic() - start_us;
+    }
+    pthread_mutex_unlock(&s->lookahead_mutex);
+}
+
+/*
+ * 0 if an intra frame of period isn't due at frame at, 1 if it is, 2 if it
+ * is but postponed as the frames from since on are static
+ */
+static int lookahead_intra_due(struct encode_session *s, unsigned long long since,
+                               unsigned long long at, unsigned int period)
+{
+    unsigned long long i, end = MIN(at + lookahead_depth + 1, frame_count);
+
+    if (period == 0 || at - since < period)
+        return 0;
+    if (at - since >= (unsigned long long)period * LOOKAHEAD_MAX_STRETCH)
+        return 1;
+    for (i = since + 1; i < end; i++)
+        if (s->lookahead[i].sad >= LOOKAHEAD_STATIC_SAD)
+            return 1;
+    return 2;
+}
+
+static void lookahead_plan_frame(struct encode_session *s, unsigned long long display, int type)
+{
+    s->plan_display[s->plan_count] = display;
+    s->plan_type[s->plan_count++] = type;
+
+    if (type == FRAME_IDR || type == FRAME_I) {
+        if (type == FRAME_IDR) {
+            s->plan_last_idr = display;
+            s->LookaheadIDR++;
+        } else
+            s->LookaheadI++;
+        s->plan_last_intra = display;
+        s->plan_postponed = 0;
+    }
+}
+
+/* plan the next mini-GOP, or the next IDR frame */
+static void lookahead_plan(struct encode_session *s)
+{
+    unsigned long long n = s->plan_next_display, anchor, i;
+    unsigned int gop = MIN(ip_period, SURFACE_NUM_MAX);
+    int due;
+
+    s->plan_count = s->plan_next = 0;
+    lookahead_wait(s, n + gop + lookahead_depth);
+
+    due = lookahead_intra_due(s, s->plan_last_idr, n, intra_idr_period);
+    if (n == 0 || s->lookahead[n].scene_cut || due == 1) {
+        if (n > 0 && s->lookahead[n].scene_cut)
+            s->LookaheadSceneCuts++;
+        if (n == 0 || due == 1 || intra_period == 0 || n - s->plan_last_idr >= (unsigned int)intra_period)
+            lookahead_plan_frame(s, n, FRAME_IDR);
+        else
+            lookahead_plan_frame(s, n, FRAME_I);
+        s->plan_next_display = n + 1;
+        return;
+    }
+    if (due == 2 && !s->plan_postponed) {
+        s->plan_postponed = 1;
+        s->LookaheadPostponed++;
+    }
+
+    /* a scene cut or an IDR frame ends the mini-GOP before it */
+    anchor = MIN(n + gop, frame_count) - 1;
+    for (i = n + 1; i <= anchor; i++)
+        if (s->lookahead[i].scene_cut ||
+            lookahead_intra_due(s, s->plan_last_idr, i, intra_idr_period) == 1) {
+            anchor = i - 1;
+            break;
+        }
+
+    due = lookahead_intra_due(s, s->plan_last_intra, anchor, intra_period);
+    if (due == 2 && !s->plan_postponed) {
+        s->plan_postponed = 1;
+        s->LookaheadPostponed++;
+    }
+    lookahead_plan_frame(s, anchor, due == 1 ? FRAME_I : FRAME_P);
+    for (i = n; i < anchor; i++)
+        lookahead_plan_frame(s, i, FRAME_B);
+    s->plan_next_display = anchor + 1;
+}
+
+/* adaptive counterpart of encoding2display_order(), frames are planned in order */
+static void lookahead_next_frame(struct encode_session *s,
+                                 unsigned long long *displaying_order, int *frame_type)
+{
+    if (s->plan_next == s->plan_count)
+        lookahead_plan(s);
+
+    *displaying_order = s->plan_display[s->plan_next];
+    *frame_type = s->plan_type[s->plan_next++];
+}
+
+static int lookahead_start(struct encode_session *s)
+{
+    s->lookahead = calloc(frame_count, sizeof(*s->lookahead));
+    if (s->lookahead == NULL) {
+        printf("Failed to allocate the lookahead of %d frames\n", frame_count);
+        exit(1);
+    }
+    s->lookahead_done = 0;
+    s->lookahead_limit = MIN(lookahead_depth, frame_count);
+    s->plan_count = s->plan_next = 0;
+    s->plan_next_display = s->plan_last_idr = s->plan_last_intra = 0;
+    s->plan_postponed = 0;
+
+    return pthread_create(&s->lookahead_thread, NULL, lookahead_thread, s);
+}
+
+static void lookahead_stop(struct encode_session *s)
+{
+    /* all the frames are planned, so the thread analysed all of them */
+    pthread_join(s->lookahead_thread, NULL);
+    free(s->lookahead);
+    s->lookahead = NULL;
+}
+
 
 static char *fourcc_to_string(int fourcc)
 {
@@ -707,6 +1181,7 @@ static int print_help(void)
     printf("   -n <frame number>\n");
     printf("      if set to 0 and srcyuv is set, the frame count is from srcuv file\n");
     printf("   -o <coded file>\n");
+    printf("      - for stdout (the messages go to stderr), unix:<path> for a Unix socket\n");
     printf("   -f <frame rate>\n");
     printf("   --intra_period <number>\n");
     printf("   --idr_period <number>\n");
@@ -716,19 +1191,36 @@ static int print_help(void)
     printf("   --minqp <number>\n");
     printf("   --rcmode <NONE|CBR|VBR|VCM|CQP|VBR_CONTRAINED>\n");
     printf("   --syncmode: sequentially upload source, encoding, save result, no multi-thread\n");
-    printf("   --srcyuv <filename> load YUV from a file\n");
+    printf("   --srcyuv <filename> load YUV from a file, raw or Y4M, - for stdin\n");
+    printf("      the header of a Y4M file gives the size, frame rate and fourcc (I420)\n");
+    printf("      a pipe is read as a stream, which needs -n and a single stream\n");
     printf("   --fourcc <NV12|IYUV|YV12> source YUV fourcc\n");
     printf("   --recyuv <filename> save reconstructed YUV into a file\n");
     printf("   --enablePSNR calculate PSNR of recyuv vs. srcyuv\n");
+    printf("   --enableSSIM calculate SSIM of recyuv vs. srcyuv, implies --enablePSNR\n");
+    printf("   --quality_csv <filename> save per-frame PSNR/SSIM into a CSV file\n");
+    printf("   --quality_threads <number> threads to calculate PSNR/SSIM, default is the CPU number\n");
     printf("   --entropy <0|1>, 1 means cabac, 0 cavlc\n");
     printf("   --profile <BP|MP|HP>\n");
-    printf("   --surface_num: set the surface number for encoding, default is 16\n");
+    printf("   --surface_num: set the surface number for encoding, default is 16, max is %d\n", SURFACE_NUM_MAX);
+    printf("   --storage_threads <number> threads to save coded data and reload source YUV, default is 2\n");
+    printf("   --upload_threads <number> threads to upload one source frame in row bands, default is 1\n");
+    printf("   --slices <number> split a frame into <number> slices, default is 1\n");
+    printf("   --slice_mbs <number> macroblocks per slice, rounded up to whole MB rows if the driver needs it\n");
+    printf("   --streams <number> encode <number> independent streams in parallel, max is %d\n", STREAM_NUM_MAX);
+    printf("      the coded/reconstructed/CSV files of stream i get a .i suffix\n");
+    printf("   --displays <number> spread the streams over <number> VA displays, default is 1\n");
+    printf("   --lookahead <number> analyse <number> source frames ahead, insert IDR/I frames at scene cuts\n");
+    printf("      and stretch the intra periods of static content, needs --srcyuv\n");
+    printf("   --scenecut <number> mean 8x8 block difference of a scene cut in luma levels, default is 20\n");
+    printf("   --dirty_rect send the 16x16 blocks changed against the reference frames as dirty ROI, needs --srcyuv\n");
     return 0;
 }
 
 static int process_cmdline(int argc, char *argv[])
 {
     char c;
+    int frame_rate_set = 0;
     const struct option long_opts[] = {
         {"help", no_argument, NULL, 0 },
         {"bitrate", required_argument, NULL, 1 },
@@ -749,6 +1241,18 @@ static int process_cmdline(int argc, char *argv[])
         {"entropy", required_argument, NULL, 17 },
         {"profile", required_argument, NULL, 18 },
         {"surface_num", required_argument, NULL, 19 },
+        {"enableSSIM", no_argument, NULL, 20 },
+        {"quality_csv", required_argument, NULL, 21 },
+        {"quality_threads", required_argument, NULL, 22 },
+        {"storage_threads", required_argument, NULL, 23 },
+        {"upload_threads", required_argument, NULL, 24 },
+        {"slices", required_argument, NULL, 25 },
+        {"slice_mbs", required_argument, NULL, 26 },
+        {"streams", required_argument, NULL, 27 },
+        {"displays", required_argument, NULL, 28 },
+        {"lookahead", required_argument, NULL, 29 },
+        {"scenecut", required_argument, NULL, 30 },
+        {"dirty_rect", no_argument, NULL, 31 },
         {NULL, no_argument, NULL, 0 }};
     int long_index;
     
@@ -766,6 +1270,7 @@ static int process_cmdline(int argc, char *argv[])
             break;
         case 'f':
             frame_rate = atoi(optarg);
+            frame_rate_set = 1;
             break;
         case 'o':
             coded_fn = strdup(optarg);
@@ -838,7 +1343,47 @@ static int process_cmdline(int argc, char *argv[])
             break;
         case 19:
             surface_num = atoi(optarg);
-            surface_num = MAX(4, MIN(surface_num,16)); /* clamp to [4, 16] */
+            surface_num = MAX(4, MIN(surface_num, SURFACE_NUM_MAX)); /* clamp to [4, SURFACE_NUM_MAX] */
+            break;
+        case 20:
+            calc_psnr = 1;
+            calc_ssim = 1;
+            break;
+        case 21:
+            quality_csv_fn = strdup(optarg);
+            break;
+        case 22:
+            quality_threads = atoi(optarg);
+            break;
+        case 23:
+            storage_threads = atoi(optarg);
+            break;
+        case 24:
+            upload_threads = atoi(optarg);
+            upload_threads = MAX(1, MIN(upload_threads, UPLOAD_THREADS_MAX));
+            break;
+        case 25:
+            frame_slices = MAX(1, atoi(optarg));
+            break;
+        case 26:
+            frame_slice_mbs = MAX(0, atoi(optarg));
+            break;
+        case 27:
+            stream_num = atoi(optarg);
+            stream_num = MAX(1, MIN(stream_num, STREAM_NUM_MAX));
+            break;
+        case 28:
+            display_num = atoi(optarg);
+            display_num = MAX(1, MIN(display_num, STREAM_NUM_MAX));
+            break;
+        case 29:
+            lookahead_depth = MAX(0, atoi(optarg));
+            break;
+        case 30:
+            scenecut_threshold = MAX(1, atoi(optarg));
+            break;
+        case 31:
+            dirty_rect_mode = 1;
             break;
         case ':':
         case '?':
@@ -847,6 +1392,18 @@ static int process_cmdline(int argc, char *argv[])
         }
     }
 
+    if (coded_fn && !strcmp(coded_fn, "-")) {
+        if (stream_num > 1) {
+            printf("Only one stream can be written to stdout\n");
+            exit(1);
+        }
+        coded_sink_stdout();
+    }
+
+    /* a storage thread holds one source surface at most */
+    storage_threads = MAX(1, MIN(storage_threads, surface_num));
+    display_num = MIN(display_num, stream_num);
+
     if (ip_period < 1) {
 	printf(" ip_period must be greater than 0\n");
         exit(0);
@@ -860,35 +1417,74 @@ static int process_cmdline(int argc, char *argv[])
         exit(0);        
     }
 
-    if (frame_bitrate == 0)
-        frame_bitrate = frame_width * frame_height * 12 * frame_rate / 50;
-        
     /* open source file */
     if (srcyuv_fn) {
-        srcyuv_fp = fopen(srcyuv_fn,"r");
+        if (yuv_input_open(&srcyuv_input, srcyuv_fn, frame_width, frame_height, 0) == 0)
+            srcyuv_fp = fdopen(srcyuv_input.fd, "r");
     
         if (srcyuv_fp == NULL)
             printf("Open source YUV file %s failed, use auto-generated YUV data\n", srcyuv_fn);
-        else {
+        else if (srcyuv_input.y4m) {
+            frame_width = srcyuv_input.width;
+            frame_height = srcyuv_input.height;
+            srcyuv_fourcc = VA_FOURCC_IYUV;
+            if (!frame_rate_set && srcyuv_input.fps_num)
+                frame_rate = (srcyuv_input.fps_num + srcyuv_input.fps_den / 2) / srcyuv_input.fps_den;
+        }
+
+        /* a pipe, or Y4M frames which can't be mapped in place */
+        if (srcyuv_fp && (srcyuv_input.frame_stride == 0 || srcyuv_input.mono)) {
+            unsigned int gop = MIN(ip_period, SURFACE_NUM_MAX);
+
+            srcyuv_stream = 1;
+            if (frame_count == 0 || stream_num > 1) {
+                printf("The source stream %s needs -n <frames> and a single stream\n", srcyuv_fn);
+                exit(1);
+            }
+            /* the surfaces being loaded, the lookahead and the frames encoded out of order */
+            if (yuv_input_start(&srcyuv_input, surface_num + 3 * gop + 2 * lookahead_depth + 2,
+                                SRCYUV_READAHEAD)) {
+                printf("Failed to read the source stream %s (%s)\n", srcyuv_fn, strerror(errno));
+                exit(1);
+            }
+            printf("Source YUV stream %s\n", srcyuv_fn);
+            if (calc_psnr) {
+                printf("PSNR/SSIM need a source YUV file, disabled\n");
+                calc_psnr = calc_ssim = 0;
+            }
+        } else if (srcyuv_fp) {
             struct stat tmp;
 
             fstat(fileno(srcyuv_fp), &tmp);
-            srcyuv_frames = tmp.st_size / (frame_width * frame_height * 1.5);
+            srcyuv_frames = srcyuv_input.frames;
             printf("Source YUV file %s with %llu frames\n", srcyuv_fn, srcyuv_frames);
 
+            /* map the file once, load_surface falls back to per-frame windows if it fails */
+            srcyuv_map_size = tmp.st_size;
+            srcyuv_map = mmap64(0, srcyuv_map_size, PROT_READ, MAP_SHARED, fileno(srcyuv_fp), 0);
+            if (srcyuv_map == MAP_FAILED)
+                srcyuv_map = NULL;
+            else
+                madvise(srcyuv_map, srcyuv_map_size, MADV_SEQUENTIAL);
+
             if (frame_count == 0)
                 frame_count = srcyuv_frames;
         }
     }
 
-    /* open source file */
-    if (recyuv_fn) {
-        recyuv_fp = fopen(recyuv_fn,"w+");
-    
-        if (recyuv_fp == NULL)
-            printf("Open reconstructed YUV file %s failed\n", recyuv_fn);
+    if (frame_bitrate == 0)
+        frame_bitrate = frame_width * frame_height * 12 * frame_rate / 50;
+
+    if (lookahead_depth && (srcyuv_fp == NULL || (srcyuv_frames == 0 && !srcyuv_stream) || intra_period == 1 ||
+                            frame_width < LOOKAHEAD_BLOCK || frame_height < LOOKAHEAD_BLOCK)) {
+        printf("The lookahead needs a source YUV file and intra_period != 1, use the fixed GOP\n");
+        lookahead_depth = 0;
     }
-    
+    if (dirty_rect_mode && (srcyuv_fp == NULL || (srcyuv_frames == 0 && !srcyuv_stream))) {
+        printf("The dirty rectangles need a source YUV file, ignored\n");
+        dirty_rect_mode = 0;
+    }
+
     if (coded_fn == NULL) {
         struct stat buf;
         if (stat("/tmp", &buf) == 0)
@@ -898,13 +1494,6 @@ static int process_cmdline(int argc, char *argv[])
         else
             coded_fn = strdup("./test.264");
     }
-    
-    /* store coded data into a file */
-    coded_fp = fopen(coded_fn,"w+");
-    if (coded_fp == NULL) {
-        printf("Open file %s failed, exit\n", coded_fn);
-        exit(1);
-    }
 
     frame_width_mbaligned = (frame_width + 15) & (~15);
     frame_height_mbaligned = (frame_height + 15) & (~15);
@@ -919,21 +1508,68 @@ static int process_cmdline(int argc, char *argv[])
     return 0;
 }
 
-static int init_va(void)
+/*
+ * Split the frame into frame_slices slices (or frame_slice_mbs MBs per
+ * slice) honoring VAConfigAttribEncMaxSlices and EncSliceStructure;
+ * without ARBITRARY_MACROBLOCKS a slice holds whole MB rows
+ */
+static void setup_slices(struct encode_session *s)
+{
+    unsigned int width_in_mbs = frame_width_mbaligned / 16;
+    unsigned int height_in_mbs = frame_height_mbaligned / 16;
+    unsigned int total_mbs = width_in_mbs * height_in_mbs;
+    unsigned int unit = width_in_mbs, units, per_slice = 0, i;
+
+    if (s->h264_slice_structure & VA_ENC_SLICE_STRUCTURE_ARBITRARY_MACROBLOCKS)
+        unit = 1;
+    units = total_mbs / unit;
+
+    if (frame_slice_mbs) {
+        per_slice = MIN((frame_slice_mbs + unit - 1) / unit, units);
+        s->frame_slices = (units + per_slice - 1) / per_slice;
+    }
+    s->frame_slices = MAX(1, MIN(s->frame_slices, MIN(units, SLICE_NUM_MAX)));
+
+    if (s->h264_maxslices > 0 && s->frame_slices > s->h264_maxslices) {
+        printf("The driver supports %d slices at most, use %d slices\n",
+               s->h264_maxslices, s->h264_maxslices);
+        s->frame_slices = s->h264_maxslices;
+        per_slice = 0;
+    }
+
+    /* only power-of-two row counts, the last slice takes the rest */
+    if (unit != 1 && (s->h264_slice_structure & VA_ENC_SLICE_STRUCTURE_POWER_OF_TWO_ROWS)) {
+        unsigned int rows = per_slice ? per_slice : (units + s->frame_slices - 1) / s->frame_slices;
+
+        per_slice = 1;
+        while (per_slice < rows)
+            per_slice <<= 1;
+        s->frame_slices = (units + per_slice - 1) / per_slice;
+    }
+
+    for (i = 0; i < s->frame_slices; i++) {
+        if (per_slice)
+            s->slice_mb_start[i] = i * per_slice * unit;
+        else /* spread the units evenly */
+            s->slice_mb_start[i] = (unsigned long long)i * units / s->frame_slices * unit;
+    }
+    s->slice_mb_start[s->frame_slices] = total_mbs;
+
+    if (s->frame_slices > 1)
+        printf("Use %d slices, %d MBs in the first slice\n",
+               s->frame_slices, s->slice_mb_start[1] - s->slice_mb_start[0]);
+}
+
+static int init_va(struct encode_session *s)
 {
     VAProfile profile_list[]={VAProfileH264High,VAProfileH264Main,VAProfileH264Baseline,VAProfileH264ConstrainedBaseline};
     VAEntrypoint *entrypoints;
     int num_entrypoints, slice_entrypoint;
     int support_encode = 0;    
-    int major_ver, minor_ver;
     VAStatus va_status;
     unsigned int i;
 
-    va_dpy = va_open_display();
-    va_status = vaInitialize(va_dpy, &major_ver, &minor_ver);
-    CHECK_VASTATUS(va_status, "vaInitialize");
-
-    num_entrypoints = vaMaxNumEntrypoints(va_dpy);
+    num_entrypoints = vaMaxNumEntrypoints(s->va_dpy);
     entrypoints = malloc(num_entrypoints * sizeof(*entrypoints));
     if (!entrypoints) {
         fprintf(stderr, "error: failed to initialize VA entrypoints array\n");
@@ -942,11 +1578,11 @@ static int init_va(void)
 
     /* use the highest profile */
     for (i = 0; i < sizeof(profile_list)/sizeof(profile_list[0]); i++) {
-        if ((h264_profile != ~0) && h264_profile != profile_list[i])
+        if ((s->h264_profile != ~0) && s->h264_profile != profile_list[i])
             continue;
         
-        h264_profile = profile_list[i];
-        vaQueryConfigEntrypoints(va_dpy, h264_profile, entrypoints, &num_entrypoints);
+        s->h264_profile = profile_list[i];
+        vaQueryConfigEntrypoints(s->va_dpy, s->h264_profile, entrypoints, &num_entrypoints);
         for (slice_entrypoint = 0; slice_entrypoint < num_entrypoints; slice_entrypoint++) {
             if (entrypoints[slice_entrypoint] == VAEntrypointEncSlice) {
                 support_encode = 1;
@@ -961,56 +1597,56 @@ static int init_va(void)
         printf("Can't find VAEntrypointEncSlice for H264 profiles\n");
         exit(1);
     } else {
-        switch (h264_profile) {
+        switch (s->h264_profile) {
             case VAProfileH264Baseline:
                 printf("Use profile VAProfileH264Baseline\n");
                 ip_period = 1;
-                constraint_set_flag |= (1 << 0); /* Annex A.2.1 */
-                h264_entropy_mode = 0;
+                s->constraint_set_flag |= (1 << 0); /* Annex A.2.1 */
+                s->h264_entropy_mode = 0;
                 break;
             case VAProfileH264ConstrainedBaseline:
                 printf("Use profile VAProfileH264ConstrainedBaseline\n");
-                constraint_set_flag |= (1 << 0 | 1 << 1); /* Annex A.2.2 */
+                s->constraint_set_flag |= (1 << 0 | 1 << 1); /* Annex A.2.2 */
                 ip_period = 1;
                 break;
 
             case VAProfileH264Main:
                 printf("Use profile VAProfileH264Main\n");
-                constraint_set_flag |= (1 << 1); /* Annex A.2.2 */
+                s->constraint_set_flag |= (1 << 1); /* Annex A.2.2 */
                 break;
 
             case VAProfileH264High:
-                constraint_set_flag |= (1 << 3); /* Annex A.2.4 */
+                s->constraint_set_flag |= (1 << 3); /* Annex A.2.4 */
                 printf("Use profile VAProfileH264High\n");
                 break;
             default:
                 printf("unknow profile. Set to Baseline");
-                h264_profile = VAProfileH264Baseline;
+                s->h264_profile = VAProfileH264Baseline;
                 ip_period = 1;
-                constraint_set_flag |= (1 << 0); /* Annex A.2.1 */
+                s->constraint_set_flag |= (1 << 0); /* Annex A.2.1 */
                 break;
         }
     }
 
     /* find out the format for the render target, and rate control mode */
     for (i = 0; i < VAConfigAttribTypeMax; i++)
-        attrib[i].type = i;
+        s->attrib[i].type = i;
 
-    va_status = vaGetConfigAttributes(va_dpy, h264_profile, VAEntrypointEncSlice,
-                                      &attrib[0], VAConfigAttribTypeMax);
+    va_status = vaGetConfigAttributes(s->va_dpy, s->h264_profile, VAEntrypointEncSlice,
+                                      &s->attrib[0], VAConfigAttribTypeMax);
     CHECK_VASTATUS(va_status, "vaGetConfigAttributes");
     /* check the interested configattrib */
-    if ((attrib[VAConfigAttribRTFormat].value & VA_RT_FORMAT_YUV420) == 0) {
+    if ((s->attrib[VAConfigAttribRTFormat].value & VA_RT_FORMAT_YUV420) == 0) {
         printf("Not find desired YUV420 RT format\n");
         exit(1);
     } else {
-        config_attrib[config_attrib_num].type = VAConfigAttribRTFormat;
-        config_attrib[config_attrib_num].value = VA_RT_FORMAT_YUV420;
-        config_attrib_num++;
+        s->config_attrib[s->config_attrib_num].type = VAConfigAttribRTFormat;
+        s->config_attrib[s->config_attrib_num].value = VA_RT_FORMAT_YUV420;
+        s->config_attrib_num++;
     }
     
-    if (attrib[VAConfigAttribRateControl].value != VA_ATTRIB_NOT_SUPPORTED) {
-        int tmp = attrib[VAConfigAttribRateControl].value;
+    if (s->attrib[VAConfigAttribRateControl].value != VA_ATTRIB_NOT_SUPPORTED) {
+        int tmp = s->attrib[VAConfigAttribRateControl].value;
 
         printf("Support rate control mode (0x%x):", tmp);
         
@@ -1030,46 +1666,47 @@ static int init_va(void)
         printf("\n");
 
         /* need to check if support rc_mode */
-        config_attrib[config_attrib_num].type = VAConfigAttribRateControl;
-        config_attrib[config_attrib_num].value = rc_mode;
-        config_attrib_num++;
+        s->config_attrib[s->config_attrib_num].type = VAConfigAttribRateControl;
+        s->config_attrib[s->config_attrib_num].value = rc_mode;
+        s->config_attrib_num++;
     }
     
 
-    if (attrib[VAConfigAttribEncPackedHeaders].value != VA_ATTRIB_NOT_SUPPORTED) {
-        int tmp = attrib[VAConfigAttribEncPackedHeaders].value;
+    if (s->attrib[VAConfigAttribEncPackedHeaders].value != VA_ATTRIB_NOT_SUPPORTED) {
+        int tmp = s->attrib[VAConfigAttribEncPackedHeaders].value;
 
         printf("Support VAConfigAttribEncPackedHeaders\n");
         
-        h264_packedheader = 1;
-        config_attrib[config_attrib_num].type = VAConfigAttribEncPackedHeaders;
-        config_attrib[config_attrib_num].value = VA_ENC_PACKED_HEADER_NONE;
+        s->h264_packedheader = 1;
+        s->config_attrib[s->config_attrib_num].type = VAConfigAttribEncPackedHeaders;
+        s->config_attrib[s->config_attrib_num].value = VA_ENC_PACKED_HEADER_NONE;
         
         if (tmp & VA_ENC_PACKED_HEADER_SEQUENCE) {
             printf("Support packed sequence headers\n");
-            config_attrib[config_attrib_num].value |= VA_ENC_PACKED_HEADER_SEQUENCE;
+            s->config_attrib[s->config_attrib_num].value |= VA_ENC_PACKED_HEADER_SEQUENCE;
         }
         
         if (tmp & VA_ENC_PACKED_HEADER_PICTURE) {
             printf("Support packed picture headers\n");
-            config_attrib[config_attrib_num].value |= VA_ENC_PACKED_HEADER_PICTURE;
+            s->config_attrib[s->config_attrib_num].value |= VA_ENC_PACKED_HEADER_PICTURE;
         }
         
         if (tmp & VA_ENC_PACKED_HEADER_SLICE) {
             printf("Support packed slice headers\n");
-            config_attrib[config_attrib_num].value |= VA_ENC_PACKED_HEADER_SLICE;
+            s->config_attrib[s->config_attrib_num].value |= VA_ENC_PACKED_HEADER_SLICE;
+            s->h264_packedslice = 1;
         }
         
         if (tmp & VA_ENC_PACKED_HEADER_MISC) {
             printf("Support packed misc headers\n");
-            config_attrib[config_attrib_num].value |= VA_ENC_PACKED_HEADER_MISC;
+            s->config_attrib[s->config_attrib_num].value |= VA_ENC_PACKED_HEADER_MISC;
         }
         
-        config_attrib_num++;
+        s->config_attrib_num++;
     }
 
-    if (attrib[VAConfigAttribEncInterlaced].value != VA_ATTRIB_NOT_SUPPORTED) {
-        int tmp = attrib[VAConfigAttribEncInterlaced].value;
+    if (s->attrib[VAConfigAttribEncInterlaced].value != VA_ATTRIB_NOT_SUPPORTED) {
+        int tmp = s->attrib[VAConfigAttribEncInterlaced].value;
         
         printf("Support VAConfigAttribEncInterlaced\n");
 
@@ -1082,25 +1719,28 @@ static int init_va(void)
         if (tmp & VA_ENC_INTERLACED_PAFF)
             printf("Support VA_ENC_INTERLACED_PAFF\n");
         
-        config_attrib[config_attrib_num].type = VAConfigAttribEncInterlaced;
-        config_attrib[config_attrib_num].value = VA_ENC_PACKED_HEADER_NONE;
-        config_attrib_num++;
+        s->config_attrib[s->config_attrib_num].type = VAConfigAttribEncInterlaced;
+        s->config_attrib[s->config_attrib_num].value = VA_ENC_PACKED_HEADER_NONE;
+        s->config_attrib_num++;
     }
     
-    if (attrib[VAConfigAttribEncMaxRefFrames].value != VA_ATTRIB_NOT_SUPPORTED) {
-        h264_maxref = attrib[VAConfigAttribEncMaxRefFrames].value;
+    if (s->attrib[VAConfigAttribEncMaxRefFrames].value != VA_ATTRIB_NOT_SUPPORTED) {
+        s->h264_maxref = s->attrib[VAConfigAttribEncMaxRefFrames].value;
         
         printf("Support %d RefPicList0 and %d RefPicList1\n",
-               h264_maxref & 0xffff, (h264_maxref >> 16) & 0xffff );
+               s->h264_maxref & 0xffff, (s->h264_maxref >> 16) & 0xffff );
     }
 
-    if (attrib[VAConfigAttribEncMaxSlices].value != VA_ATTRIB_NOT_SUPPORTED)
-        printf("Support %d slices\n", attrib[VAConfigAttribEncMaxSlices].value);
+    if (s->attrib[VAConfigAttribEncMaxSlices].value != VA_ATTRIB_NOT_SUPPORTED) {
+        s->h264_maxslices = s->attrib[VAConfigAttribEncMaxSlices].value;
+        printf("Support %d slices\n", s->h264_maxslices);
+    }
 
-    if (attrib[VAConfigAttribEncSliceStructure].value != VA_ATTRIB_NOT_SUPPORTED) {
-        int tmp = attrib[VAConfigAttribEncSliceStructure].value;
+    if (s->attrib[VAConfigAttribEncSliceStructure].value != VA_ATTRIB_NOT_SUPPORTED) {
+        int tmp = s->attrib[VAConfigAttribEncSliceStructure].value;
         
         printf("Support VAConfigAttribEncSliceStructure\n");
+        s->h264_slice_structure = tmp;
 
         if (tmp & VA_ENC_SLICE_STRUCTURE_ARBITRARY_ROWS)
             printf("Support VA_ENC_SLICE_STRUCTURE_ARBITRARY_ROWS\n");
@@ -1109,50 +1749,58 @@ static int init_va(void)
         if (tmp & VA_ENC_SLICE_STRUCTURE_ARBITRARY_MACROBLOCKS)
             printf("Support VA_ENC_SLICE_STRUCTURE_ARBITRARY_MACROBLOCKS\n");
     }
-    if (attrib[VAConfigAttribEncMacroblockInfo].value != VA_ATTRIB_NOT_SUPPORTED) {
+    if (s->attrib[VAConfigAttribEncMacroblockInfo].value != VA_ATTRIB_NOT_SUPPORTED) {
         printf("Support VAConfigAttribEncMacroblockInfo\n");
     }
+    if (s->attrib[VAConfigAttribEncDirtyROI].value != VA_ATTRIB_NOT_SUPPORTED &&
+        s->attrib[VAConfigAttribEncDirtyROI].value > 0) {
+        s->h264_maxdirtyroi = s->attrib[VAConfigAttribEncDirtyROI].value;
+        printf("Support %d dirty ROI rectangles\n", s->h264_maxdirtyroi);
+    } else if (dirty_rect_mode)
+        printf("No dirty ROI support, the changed areas are only reported\n");
+
+    setup_slices(s);
 
     free(entrypoints);
     return 0;
 }
 
-static int setup_encode()
+static int setup_encode(struct encode_session *s)
 {
     VAStatus va_status;
     VASurfaceID *tmp_surfaceid;
     unsigned int codedbuf_size, i;
     
-    va_status = vaCreateConfig(va_dpy, h264_profile, VAEntrypointEncSlice,
-            &config_attrib[0], config_attrib_num, &config_id);
+    va_status = vaCreateConfig(s->va_dpy, s->h264_profile, VAEntrypointEncSlice,
+            &s->config_attrib[0], s->config_attrib_num, &s->config_id);
     CHECK_VASTATUS(va_status, "vaCreateConfig");
 
     /* create source surfaces */
-    va_status = vaCreateSurfaces(va_dpy,
+    va_status = vaCreateSurfaces(s->va_dpy,
                                  VA_RT_FORMAT_YUV420, frame_width_mbaligned, frame_height_mbaligned,
-                                 &src_surface[0], surface_num,
+                                 &s->src_surface[0], surface_num,
                                  NULL, 0);
     CHECK_VASTATUS(va_status, "vaCreateSurfaces");
 
     /* create reference surfaces */
     va_status = vaCreateSurfaces(
-            va_dpy,
+            s->va_dpy,
             VA_RT_FORMAT_YUV420, frame_width_mbaligned, frame_height_mbaligned,
-            &ref_surface[0], surface_num,
+            &s->ref_surface[0], surface_num,
             NULL, 0
             );
     CHECK_VASTATUS(va_status, "vaCreateSurfaces");
 
     tmp_surfaceid = calloc(2 * surface_num, sizeof(VASurfaceID));
-    memcpy(tmp_surfaceid, src_surface, surface_num * sizeof(VASurfaceID));
-    memcpy(tmp_surfaceid + surface_num, ref_surface, surface_num * sizeof(VASurfaceID));
+    memcpy(tmp_surfaceid, s->src_surface, surface_num * sizeof(VASurfaceID));
+    memcpy(tmp_surfaceid + surface_num, s->ref_surface, surface_num * sizeof(VASurfaceID));
     
     /* Create a context for this encode pipe */
-    va_status = vaCreateContext(va_dpy, config_id,
+    va_status = vaCreateContext(s->va_dpy, s->config_id,
                                 frame_width_mbaligned, frame_height_mbaligned,
                                 VA_PROGRESSIVE,
                                 tmp_surfaceid, 2 * surface_num,
-                                &context_id);
+                                &s->context_id);
     CHECK_VASTATUS(va_status, "vaCreateContext");
     free(tmp_surfaceid);
 
@@ -1165,8 +1813,8 @@ static int setup_encode()
          * but coded buffer need to be mapped and accessed after vaRenderPicture/vaEndPicture
          * so VA won't maintain the coded buffer
          */
-        va_status = vaCreateBuffer(va_dpy,context_id,VAEncCodedBufferType,
-                codedbuf_size, 1, NULL, &coded_buf[i]);
+        va_status = vaCreateBuffer(s->va_dpy,s->context_id,VAEncCodedBufferType,
+                codedbuf_size, 1, NULL, &s->coded_buf[i]);
         CHECK_VASTATUS(va_status,"vaCreateBuffer");
     }
     
@@ -1237,46 +1885,46 @@ static void sort_two(VAPictureH264 ref[], int left, int right, unsigned int key,
     sort_one(ref, j+1, right, list1_ascending, frame_idx);
 }
 
-static int update_ReferenceFrames(void)
+static int update_ReferenceFrames(struct encode_session *s)
 {
     int i;
     
-    if (current_frame_type == FRAME_B)
+    if (s->current_frame_type == FRAME_B)
         return 0;
 
-    CurrentCurrPic.flags = VA_PICTURE_H264_SHORT_TERM_REFERENCE;
-    numShortTerm++;
-    if (numShortTerm > num_ref_frames)
-        numShortTerm = num_ref_frames;
-    for (i=numShortTerm-1; i>0; i--)
-        ReferenceFrames[i] = ReferenceFrames[i-1];
-    ReferenceFrames[0] = CurrentCurrPic;
+    s->CurrentCurrPic.flags = VA_PICTURE_H264_SHORT_TERM_REFERENCE;
+    s->numShortTerm++;
+    if (s->numShortTerm > num_ref_frames)
+        s->numShortTerm = num_ref_frames;
+    for (i=s->numShortTerm-1; i>0; i--)
+        s->ReferenceFrames[i] = s->ReferenceFrames[i-1];
+    s->ReferenceFrames[0] = s->CurrentCurrPic;
     
-    if (current_frame_type != FRAME_B)
-        current_frame_num++;
-    if (current_frame_num > MaxFrameNum)
-        current_frame_num = 0;
+    if (s->current_frame_type != FRAME_B)
+        s->current_frame_num++;
+    if (s->current_frame_num > MaxFrameNum)
+        s->current_frame_num = 0;
     
     return 0;
 }
 
 
-static int update_RefPicList(void)
+static int update_RefPicList(struct encode_session *s)
 {
-    unsigned int current_poc = CurrentCurrPic.TopFieldOrderCnt;
+    unsigned int current_poc = s->CurrentCurrPic.TopFieldOrderCnt;
     
-    if (current_frame_type == FRAME_P) {
-        memcpy(RefPicList0_P, ReferenceFrames, numShortTerm * sizeof(VAPictureH264));
-        sort_one(RefPicList0_P, 0, numShortTerm-1, 0, 1);
+    if (s->current_frame_type == FRAME_P) {
+        memcpy(s->RefPicList0_P, s->ReferenceFrames, s->numShortTerm * sizeof(VAPictureH264));
+        sort_one(s->RefPicList0_P, 0, s->numShortTerm-1, 0, 1);
     }
     
-    if (current_frame_type == FRAME_B) {
-        memcpy(RefPicList0_B, ReferenceFrames, numShortTerm * sizeof(VAPictureH264));
-        sort_two(RefPicList0_B, 0, numShortTerm-1, current_poc, 0,
+    if (s->current_frame_type == FRAME_B) {
+        memcpy(s->RefPicList0_B, s->ReferenceFrames, s->numShortTerm * sizeof(VAPictureH264));
+        sort_two(s->RefPicList0_B, 0, s->numShortTerm-1, current_poc, 0,
                  1, 0, 1);
 
-        memcpy(RefPicList1_B, ReferenceFrames, numShortTerm * sizeof(VAPictureH264));
-        sort_two(RefPicList1_B, 0, numShortTerm-1, current_poc, 0,
+        memcpy(s->RefPicList1_B, s->ReferenceFrames, s->numShortTerm * sizeof(VAPictureH264));
+        sort_two(s->RefPicList1_B, 0, s->numShortTerm-1, current_poc, 0,
                  0, 1, 0);
     }
     
@@ -1284,53 +1932,53 @@ static int update_RefPicList(void)
 }
 
 
-static int render_sequence(void)
+static int render_sequence(struct encode_session *s)
 {
     VABufferID seq_param_buf, rc_param_buf, misc_param_tmpbuf, render_id[2];
     VAStatus va_status;
     VAEncMiscParameterBuffer *misc_param, *misc_param_tmp;
     VAEncMiscParameterRateControl *misc_rate_ctrl;
     
-    seq_param.level_idc = 41 /*SH_LEVEL_3*/;
-    seq_param.picture_width_in_mbs = frame_width_mbaligned / 16;
-    seq_param.picture_height_in_mbs = frame_height_mbaligned / 16;
-    seq_param.bits_per_second = frame_bitrate;
-
-    seq_param.intra_period = intra_period;
-    seq_param.intra_idr_period = intra_idr_period;
-    seq_param.ip_period = ip_period;
-
-    seq_param.max_num_ref_frames = num_ref_frames;
-    seq_param.seq_fields.bits.frame_mbs_only_flag = 1;
-    seq_param.time_scale = 900;
-    seq_param.num_units_in_tick = 15; /* Tc = num_units_in_tick / time_sacle */
-    seq_param.seq_fields.bits.log2_max_pic_order_cnt_lsb_minus4 = Log2MaxPicOrderCntLsb - 4;
-    seq_param.seq_fields.bits.log2_max_frame_num_minus4 = Log2MaxFrameNum - 4;;
-    seq_param.seq_fields.bits.frame_mbs_only_flag = 1;
-    seq_param.seq_fields.bits.chroma_format_idc = 1;
-    seq_param.seq_fields.bits.direct_8x8_inference_flag = 1;
+    s->seq_param.level_idc = 41 /*SH_LEVEL_3*/;
+    s->seq_param.picture_width_in_mbs = frame_width_mbaligned / 16;
+    s->seq_param.picture_height_in_mbs = frame_height_mbaligned / 16;
+    s->seq_param.bits_per_second = frame_bitrate;
+
+    s->seq_param.intra_period = intra_period;
+    s->seq_param.intra_idr_period = intra_idr_period;
+    s->seq_param.ip_period = ip_period;
+
+    s->seq_param.max_num_ref_frames = num_ref_frames;
+    s->seq_param.seq_fields.bits.frame_mbs_only_flag = 1;
+    s->seq_param.time_scale = 900;
+    s->seq_param.num_units_in_tick = 15; /* Tc = num_units_in_tick / time_sacle */
+    s->seq_param.seq_fields.bits.log2_max_pic_order_cnt_lsb_minus4 = Log2MaxPicOrderCntLsb - 4;
+    s->seq_param.seq_fields.bits.log2_max_frame_num_minus4 = Log2MaxFrameNum - 4;;
+    s->seq_param.seq_fields.bits.frame_mbs_only_flag = 1;
+    s->seq_param.seq_fields.bits.chroma_format_idc = 1;
+    s->seq_param.seq_fields.bits.direct_8x8_inference_flag = 1;
     
     if (frame_width != frame_width_mbaligned ||
         frame_height != frame_height_mbaligned) {
-        seq_param.frame_cropping_flag = 1;
-        seq_param.frame_crop_left_offset = 0;
-        seq_param.frame_crop_right_offset = (frame_width_mbaligned - frame_width)/2;
-        seq_param.frame_crop_top_offset = 0;
-        seq_param.frame_crop_bottom_offset = (frame_height_mbaligned - frame_height)/2;
+        s->seq_param.frame_cropping_flag = 1;
+        s->seq_param.frame_crop_left_offset = 0;
+        s->seq_param.frame_crop_right_offset = (frame_width_mbaligned - frame_width)/2;
+        s->seq_param.frame_crop_top_offset = 0;
+        s->seq_param.frame_crop_bottom_offset = (frame_height_mbaligned - frame_height)/2;
     }
     
-    va_status = vaCreateBuffer(va_dpy, context_id,
+    va_status = vaCreateBuffer(s->va_dpy, s->context_id,
                                VAEncSequenceParameterBufferType,
-                               sizeof(seq_param),1,&seq_param,&seq_param_buf);
+                               sizeof(s->seq_param),1,&s->seq_param,&seq_param_buf);
     CHECK_VASTATUS(va_status,"vaCreateBuffer");
     
-    va_status = vaCreateBuffer(va_dpy, context_id,
+    va_status = vaCreateBuffer(s->va_dpy, s->context_id,
                                VAEncMiscParameterBufferType,
                                sizeof(VAEncMiscParameterBuffer) + sizeof(VAEncMiscParameterRateControl),
                                1,NULL,&rc_param_buf);
     CHECK_VASTATUS(va_status,"vaCreateBuffer");
     
-    vaMapBuffer(va_dpy, rc_param_buf,(void **)&misc_param);
+    vaMapBuffer(s->va_dpy, rc_param_buf,(void **)&misc_param);
     misc_param->type = VAEncMiscParameterTypeRateControl;
     misc_rate_ctrl = (VAEncMiscParameterRateControl *)misc_param->data;
     memset(misc_rate_ctrl, 0, sizeof(*misc_rate_ctrl));
@@ -1340,42 +1988,41 @@ static int render_sequence(void)
     misc_rate_ctrl->initial_qp = initial_qp;
     misc_rate_ctrl->min_qp = minimal_qp;
     misc_rate_ctrl->basic_unit_size = 0;
-    vaUnmapBuffer(va_dpy, rc_param_buf);
+    vaUnmapBuffer(s->va_dpy, rc_param_buf);
 
     render_id[0] = seq_param_buf;
     render_id[1] = rc_param_buf;
     
-    va_status = vaRenderPicture(va_dpy,context_id, &render_id[0], 2);
+    va_status = vaRenderPicture(s->va_dpy,s->context_id, &render_id[0], 2);
     CHECK_VASTATUS(va_status,"vaRenderPicture");;
 
     if (misc_priv_type != 0) {
-        va_status = vaCreateBuffer(va_dpy, context_id,
+        va_status = vaCreateBuffer(s->va_dpy, s->context_id,
                                    VAEncMiscParameterBufferType,
                                    sizeof(VAEncMiscParameterBuffer),
                                    1, NULL, &misc_param_tmpbuf);
         CHECK_VASTATUS(va_status,"vaCreateBuffer");
-        vaMapBuffer(va_dpy, misc_param_tmpbuf,(void **)&misc_param_tmp);
+        vaMapBuffer(s->va_dpy, misc_param_tmpbuf,(void **)&misc_param_tmp);
         misc_param_tmp->type = misc_priv_type;
         misc_param_tmp->data[0] = misc_priv_value;
-        vaUnmapBuffer(va_dpy, misc_param_tmpbuf);
+        vaUnmapBuffer(s->va_dpy, misc_param_tmpbuf);
     
-        va_status = vaRenderPicture(va_dpy,context_id, &misc_param_tmpbuf, 1);
+        va_status = vaRenderPicture(s->va_dpy,s->context_id, &misc_param_tmpbuf, 1);
     }
     
     return 0;
 }
 
-static int calc_poc(int pic_order_cnt_lsb)
+static int calc_poc(struct encode_session *s, int pic_order_cnt_lsb)
 {
-    static int PicOrderCntMsb_ref = 0, pic_order_cnt_lsb_ref = 0;
     int prevPicOrderCntMsb, prevPicOrderCntLsb;
     int PicOrderCntMsb, TopFieldOrderCnt;
     
-    if (current_frame_type == FRAME_IDR)
+    if (s->current_frame_type == FRAME_IDR)
         prevPicOrderCntMsb = prevPicOrderCntLsb = 0;
     else {
-        prevPicOrderCntMsb = PicOrderCntMsb_ref;
-        prevPicOrderCntLsb = pic_order_cnt_lsb_ref;
+        prevPicOrderCntMsb = s->PicOrderCntMsb_ref;
+        prevPicOrderCntLsb = s->pic_order_cnt_lsb_ref;
     }
     
     if ((pic_order_cnt_lsb < prevPicOrderCntLsb) &&
@@ -1389,210 +2036,169 @@ static int calc_poc(int pic_order_cnt_lsb)
     
     TopFieldOrderCnt = PicOrderCntMsb + pic_order_cnt_lsb;
 
-    if (current_frame_type != FRAME_B) {
-        PicOrderCntMsb_ref = PicOrderCntMsb;
-        pic_order_cnt_lsb_ref = pic_order_cnt_lsb;
+    if (s->current_frame_type != FRAME_B) {
+        s->PicOrderCntMsb_ref = PicOrderCntMsb;
+        s->pic_order_cnt_lsb_ref = pic_order_cnt_lsb;
     }
     
     return TopFieldOrderCnt;
 }
 
-static int render_picture(void)
+static int render_picture(struct encode_session *s)
 {
     VABufferID pic_param_buf;
     VAStatus va_status;
     int i = 0;
 
-    pic_param.CurrPic.picture_id = ref_surface[current_slot];
-    pic_param.CurrPic.frame_idx = current_frame_num;
-    pic_param.CurrPic.flags = 0;
-    pic_param.CurrPic.TopFieldOrderCnt = calc_poc((current_frame_display - current_IDR_display) % MaxPicOrderCntLsb);
-    pic_param.CurrPic.BottomFieldOrderCnt = pic_param.CurrPic.TopFieldOrderCnt;
-    CurrentCurrPic = pic_param.CurrPic;
+    s->pic_param.CurrPic.picture_id = s->ref_surface[current_slot];
+    s->pic_param.CurrPic.frame_idx = s->current_frame_num;
+    s->pic_param.CurrPic.flags = 0;
+    s->pic_param.CurrPic.TopFieldOrderCnt = calc_poc(s, (s->current_frame_display - s->current_IDR_display) % MaxPicOrderCntLsb);
+    s->pic_param.CurrPic.BottomFieldOrderCnt = s->pic_param.CurrPic.TopFieldOrderCnt;
+    s->CurrentCurrPic = s->pic_param.CurrPic;
 
     if (getenv("TO_DEL")) { /* set RefPicList into ReferenceFrames */
-        update_RefPicList(); /* calc RefPicList */
-        memset(pic_param.ReferenceFrames, 0xff, 16 * sizeof(VAPictureH264)); /* invalid all */
-        if (current_frame_type == FRAME_P) {
-            pic_param.ReferenceFrames[0] = RefPicList0_P[0];
-        } else if (current_frame_type == FRAME_B) {
-            pic_param.ReferenceFrames[0] = RefPicList0_B[0];
-            pic_param.ReferenceFrames[1] = RefPicList1_B[0];
+        update_RefPicList(s); /* calc RefPicList */
+        memset(s->pic_param.ReferenceFrames, 0xff, 16 * sizeof(VAPictureH264)); /* invalid all */
+        if (s->current_frame_type == FRAME_P) {
+            s->pic_param.ReferenceFrames[0] = s->RefPicList0_P[0];
+        } else if (s->current_frame_type == FRAME_B) {
+            s->pic_param.ReferenceFrames[0] = s->RefPicList0_B[0];
+            s->pic_param.ReferenceFrames[1] = s->RefPicList1_B[0];
         }
     } else {
-        memcpy(pic_param.ReferenceFrames, ReferenceFrames, numShortTerm*sizeof(VAPictureH264));
-        for (i = numShortTerm; i < surface_num; i++) {
-            pic_param.ReferenceFrames[i].picture_id = VA_INVALID_SURFACE;
-            pic_param.ReferenceFrames[i].flags = VA_PICTURE_H264_INVALID;
+        memcpy(s->pic_param.ReferenceFrames, s->ReferenceFrames, s->numShortTerm*sizeof(VAPictureH264));
+        for (i = s->numShortTerm; i < 16; i++) {
+            s->pic_param.ReferenceFrames[i].picture_id = VA_INVALID_SURFACE;
+            s->pic_param.ReferenceFrames[i].flags = VA_PICTURE_H264_INVALID;
         }
     }
     
-    pic_param.pic_fields.bits.idr_pic_flag = (current_frame_type == FRAME_IDR);
-    pic_param.pic_fields.bits.reference_pic_flag = (current_frame_type != FRAME_B);
-    pic_param.pic_fields.bits.entropy_coding_mode_flag = h264_entropy_mode;
-    pic_param.pic_fields.bits.deblocking_filter_control_present_flag = 1;
-    pic_param.frame_num = current_frame_num;
-    pic_param.coded_buf = coded_buf[current_slot];
-    pic_param.last_picture = (current_frame_encoding == frame_count);
-    pic_param.pic_init_qp = initial_qp;
-
-    va_status = vaCreateBuffer(va_dpy, context_id,VAEncPictureParameterBufferType,
-                               sizeof(pic_param),1,&pic_param, &pic_param_buf);
+    s->pic_param.pic_fields.bits.idr_pic_flag = (s->current_frame_type == FRAME_IDR);
+    s->pic_param.pic_fields.bits.reference_pic_flag = (s->current_frame_type != FRAME_B);
+    s->pic_param.pic_fields.bits.entropy_coding_mode_flag = s->h264_entropy_mode;
+    s->pic_param.pic_fields.bits.deblocking_filter_control_present_flag = 1;
+    s->pic_param.frame_num = s->current_frame_num;
+    s->pic_param.coded_buf = s->coded_buf[current_slot];
+    s->pic_param.last_picture = (s->current_frame_encoding == frame_count);
+    s->pic_param.pic_init_qp = initial_qp;
+
+    va_status = vaCreateBuffer(s->va_dpy, s->context_id,VAEncPictureParameterBufferType,
+                               sizeof(s->pic_param),1,&s->pic_param, &pic_param_buf);
     CHECK_VASTATUS(va_status,"vaCreateBuffer");;
 
-    va_status = vaRenderPicture(va_dpy,context_id, &pic_param_buf, 1);
+    va_status = vaRenderPicture(s->va_dpy,s->context_id, &pic_param_buf, 1);
     CHECK_VASTATUS(va_status,"vaRenderPicture");
 
     return 0;
 }
 
-static int render_packedsequence(void)
+static int render_packedsequence(struct encode_session *s)
 {
-    VAEncPackedHeaderParameterBuffer packedheader_param_buffer;
-    VABufferID packedseq_para_bufid, packedseq_data_bufid, render_id[2];
-    unsigned int length_in_bits;
-    unsigned char *packedseq_buffer = NULL;
+    struct {
+        VAEncSequenceParameterBufferH264 seq_param;
+        VAProfile h264_profile;
+        int constraint_set_flag;
+    } key;
+    VABufferID render_id[2];
     VAStatus va_status;
 
-    length_in_bits = build_packed_seq_buffer(&packedseq_buffer); 
-    
-    packedheader_param_buffer.type = VAEncPackedHeaderSequence;
-    
-    packedheader_param_buffer.bit_length = length_in_bits; /*length_in_bits*/
-    packedheader_param_buffer.has_emulation_bytes = 0;
-    va_status = vaCreateBuffer(va_dpy,
-                               context_id,
-                               VAEncPackedHeaderParameterBufferType,
-                               sizeof(packedheader_param_buffer), 1, &packedheader_param_buffer,
-                               &packedseq_para_bufid);
-    CHECK_VASTATUS(va_status,"vaCreateBuffer");
+    memset(&key, 0, sizeof(key));
+    memcpy(&key.seq_param, &s->seq_param, sizeof(key.seq_param));
+    key.h264_profile = s->h264_profile;
+    key.constraint_set_flag = s->constraint_set_flag;
+    if (!packed_header_lookup(&s->packed_sps, &key, sizeof(key)))
+        build_packed_seq_buffer(s);
 
-    va_status = vaCreateBuffer(va_dpy,
-                               context_id,
-                               VAEncPackedHeaderDataBufferType,
-                               (length_in_bits + 7) / 8, 1, packedseq_buffer,
-                               &packedseq_data_bufid);
-    CHECK_VASTATUS(va_status,"vaCreateBuffer");
-
-    render_id[0] = packedseq_para_bufid;
-    render_id[1] = packedseq_data_bufid;
-    va_status = vaRenderPicture(va_dpy,context_id, render_id, 2);
+    packed_header_buffers(s->va_dpy, s->context_id, &s->packed_sps, render_id);
+    va_status = vaRenderPicture(s->va_dpy,s->context_id, render_id, 2);
     CHECK_VASTATUS(va_status,"vaRenderPicture");
 
-    free(packedseq_buffer);
-    
     return 0;
 }
 
 
-static int render_packedpicture(void)
+static int render_packedpicture(struct encode_session *s)
 {
-    VAEncPackedHeaderParameterBuffer packedheader_param_buffer;
-    VABufferID packedpic_para_bufid, packedpic_data_bufid, render_id[2];
-    unsigned int length_in_bits;
-    unsigned char *packedpic_buffer = NULL;
+    VAEncPictureParameterBufferH264 key;
+    VABufferID render_id[2];
     VAStatus va_status;
 
-    length_in_bits = build_packed_pic_buffer(&packedpic_buffer); 
-    packedheader_param_buffer.type = VAEncPackedHeaderPicture;
-    packedheader_param_buffer.bit_length = length_in_bits;
-    packedheader_param_buffer.has_emulation_bytes = 0;
-
-    va_status = vaCreateBuffer(va_dpy,
-                               context_id,
-                               VAEncPackedHeaderParameterBufferType,
-                               sizeof(packedheader_param_buffer), 1, &packedheader_param_buffer,
-                               &packedpic_para_bufid);
-    CHECK_VASTATUS(va_status,"vaCreateBuffer");
-
-    va_status = vaCreateBuffer(va_dpy,
-                               context_id,
-                               VAEncPackedHeaderDataBufferType,
-                               (length_in_bits + 7) / 8, 1, packedpic_buffer,
-                               &packedpic_data_bufid);
-    CHECK_VASTATUS(va_status,"vaCreateBuffer");
-
-    render_id[0] = packedpic_para_bufid;
-    render_id[1] = packedpic_data_bufid;
-    va_status = vaRenderPicture(va_dpy,context_id, render_id, 2);
+    /* the PPS doesn't depend on the picture being encoded */
+    memcpy(&key, &s->pic_param, sizeof(key));
+    memset(&key.CurrPic, 0, sizeof(key.CurrPic));
+    memset(key.ReferenceFrames, 0, sizeof(key.ReferenceFrames));
+    key.coded_buf = 0;
+    key.frame_num = 0;
+    key.last_picture = 0;
+    key.pic_fields.bits.idr_pic_flag = 0;
+    key.pic_fields.bits.reference_pic_flag = 0;
+    if (!packed_header_lookup(&s->packed_pps, &key, sizeof(key)))
+        build_packed_pic_buffer(s);
+
+    packed_header_buffers(s->va_dpy, s->context_id, &s->packed_pps, render_id);
+    va_status = vaRenderPicture(s->va_dpy,s->context_id, render_id, 2);
     CHECK_VASTATUS(va_status,"vaRenderPicture");
 
-    free(packedpic_buffer);
-    
     return 0;
 }
 
-static void render_packedsei(void)
+static void render_packedsei(struct encode_session *s)
 {
-    VAEncPackedHeaderParameterBuffer packed_header_param_buffer;
-    VABufferID packed_sei_header_param_buf_id, packed_sei_buf_id, render_id[2];
-    unsigned int length_in_bits /*offset_in_bytes*/;
-    unsigned char *packed_sei_buffer = NULL;
+    struct {
+        int i_initial_cpb_removal_delay_length;
+        int i_initial_cpb_removal_delay;
+        int i_cpb_removal_delay_length;
+        int i_dpb_output_delay_length;
+    } key;
+    VABufferID render_id[2];
     VAStatus va_status;
-    int init_cpb_size, target_bit_rate, i_initial_cpb_removal_delay_length, i_initial_cpb_removal_delay;
-    int i_cpb_removal_delay, i_dpb_output_delay_length, i_cpb_removal_delay_length;
+    int init_cpb_size, target_bit_rate, i_cpb_removal_delay;
 
     /* it comes for the bps defined in SPS */
     target_bit_rate = frame_bitrate;
     init_cpb_size = (target_bit_rate * 8) >> 10;
-    i_initial_cpb_removal_delay = init_cpb_size * 0.5 * 1024 / target_bit_rate * 90000;
 
+    memset(&key, 0, sizeof(key));
+    key.i_initial_cpb_removal_delay = init_cpb_size * 0.5 * 1024 / target_bit_rate * 90000;
+    key.i_initial_cpb_removal_delay_length = 24;
+    key.i_cpb_removal_delay_length = 24;
+    key.i_dpb_output_delay_length = 24;
     i_cpb_removal_delay = 2;
-    i_initial_cpb_removal_delay_length = 24;
-    i_cpb_removal_delay_length = 24;
-    i_dpb_output_delay_length = 24;
-    
-
-    length_in_bits = build_packed_sei_buffer_timing(
-        i_initial_cpb_removal_delay_length,
-        i_initial_cpb_removal_delay,
-        0,
-        i_cpb_removal_delay_length,
-        i_cpb_removal_delay * current_frame_encoding,
-        i_dpb_output_delay_length,
-        0,
-        &packed_sei_buffer);
-
-    //offset_in_bytes = 0;
-    packed_header_param_buffer.type = VAEncPackedHeaderH264_SEI;
-    packed_header_param_buffer.bit_length = length_in_bits;
-    packed_header_param_buffer.has_emulation_bytes = 0;
-
-    va_status = vaCreateBuffer(va_dpy,
-                               context_id,
-                               VAEncPackedHeaderParameterBufferType,
-                               sizeof(packed_header_param_buffer), 1, &packed_header_param_buffer,
-                               &packed_sei_header_param_buf_id);
-    CHECK_VASTATUS(va_status,"vaCreateBuffer");
 
-    va_status = vaCreateBuffer(va_dpy,
-                               context_id,
-                               VAEncPackedHeaderDataBufferType,
-                               (length_in_bits + 7) / 8, 1, packed_sei_buffer,
-                               &packed_sei_buf_id);
-    CHECK_VASTATUS(va_status,"vaCreateBuffer");
-
-
-    render_id[0] = packed_sei_header_param_buf_id;
-    render_id[1] = packed_sei_buf_id;
-    va_status = vaRenderPicture(va_dpy,context_id, render_id, 2);
+    /* only cpb_removal_delay changes from one picture to the next */
+    if (packed_header_lookup(&s->packed_sei, &key, sizeof(key)))
+        packed_header_patch(&s->packed_sei, s->sei_cpb_removal_offset,
+                            i_cpb_removal_delay * s->current_frame_encoding,
+                            key.i_cpb_removal_delay_length);
+    else
+        build_packed_sei_buffer_timing(
+            &s->packed_sei,
+            key.i_initial_cpb_removal_delay_length,
+            key.i_initial_cpb_removal_delay,
+            0,
+            key.i_cpb_removal_delay_length,
+            i_cpb_removal_delay * s->current_frame_encoding,
+            key.i_dpb_output_delay_length,
+            0,
+            &s->sei_cpb_removal_offset);
+
+    packed_header_buffers(s->va_dpy, s->context_id, &s->packed_sei, render_id);
+    va_status = vaRenderPicture(s->va_dpy,s->context_id, render_id, 2);
     CHECK_VASTATUS(va_status,"vaRenderPicture");
-
-    
-    free(packed_sei_buffer);
         
     return;
 }
 
 
-static int render_hrd(void)
+static int render_hrd(struct encode_session *s)
 {
     VABufferID misc_parameter_hrd_buf_id;
     VAStatus va_status;
     VAEncMiscParameterBuffer *misc_param;
     VAEncMiscParameterHRD *misc_hrd_param;
     
-    va_status = vaCreateBuffer(va_dpy, context_id,
+    va_status = vaCreateBuffer(s->va_dpy, s->context_id,
                    VAEncMiscParameterBufferType,
                    sizeof(VAEncMiscParameterBuffer) + sizeof(VAEncMiscParameterHRD),
                    1,
@@ -1600,7 +2206,7 @@ static int render_hrd(void)
                    &misc_parameter_hrd_buf_id);
     CHECK_VASTATUS(va_status, "vaCreateBuffer");
 
-    vaMapBuffer(va_dpy,
+    vaMapBuffer(s->va_dpy,
                 misc_parameter_hrd_buf_id,
                 (void **)&misc_param);
     misc_param->type = VAEncMiscParameterTypeHRD;
@@ -1613,71 +2219,98 @@ static int render_hrd(void)
         misc_hrd_param->initial_buffer_fullness = 0;
         misc_hrd_param->buffer_size = 0;
     }
-    vaUnmapBuffer(va_dpy, misc_parameter_hrd_buf_id);
+    vaUnmapBuffer(s->va_dpy, misc_parameter_hrd_buf_id);
 
-    va_status = vaRenderPicture(va_dpy,context_id, &misc_parameter_hrd_buf_id, 1);
+    va_status = vaRenderPicture(s->va_dpy,s->context_id, &misc_parameter_hrd_buf_id, 1);
     CHECK_VASTATUS(va_status,"vaRenderPicture");;
 
     return 0;
 }
 
-static int render_slice(void)
+static int render_slice(struct encode_session *s)
 {
-    VABufferID slice_param_buf;
+    VAEncPackedHeaderParameterBuffer packedheader_param_buffer;
+    VABufferID render_id[3];
+    unsigned int length_in_bits;
+    unsigned char packedslice_buffer[256]; /* a slice header takes a few dozen bytes */
     VAStatus va_status;
-    int i;
+    int i, num_buffers;
 
-    update_RefPicList();
+    update_RefPicList(s);
     
-    /* one frame, one slice */
-    slice_param.macroblock_address = 0;
-    slice_param.num_macroblocks = frame_width_mbaligned * frame_height_mbaligned/(16*16); /* Measured by MB */
-    slice_param.slice_type = (current_frame_type == FRAME_IDR)?2:current_frame_type;
-    if (current_frame_type == FRAME_IDR) {
-        if (current_frame_encoding != 0)
-            ++slice_param.idr_pic_id;
-    } else if (current_frame_type == FRAME_P) {
-        int refpiclist0_max = h264_maxref & 0xffff;
-        memcpy(slice_param.RefPicList0, RefPicList0_P, refpiclist0_max*sizeof(VAPictureH264));
+    s->slice_param.slice_type = (s->current_frame_type == FRAME_IDR)?2:s->current_frame_type;
+    if (s->current_frame_type == FRAME_IDR) {
+        if (s->current_frame_encoding != 0)
+            ++s->slice_param.idr_pic_id;
+    } else if (s->current_frame_type == FRAME_P) {
+        int refpiclist0_max = s->h264_maxref & 0xffff;
+        memcpy(s->slice_param.RefPicList0, s->RefPicList0_P, refpiclist0_max*sizeof(VAPictureH264));
 
         for (i = refpiclist0_max; i < 32; i++) {
-            slice_param.RefPicList0[i].picture_id = VA_INVALID_SURFACE;
-            slice_param.RefPicList0[i].flags = VA_PICTURE_H264_INVALID;
+            s->slice_param.RefPicList0[i].picture_id = VA_INVALID_SURFACE;
+            s->slice_param.RefPicList0[i].flags = VA_PICTURE_H264_INVALID;
         }
-    } else if (current_frame_type == FRAME_B) {
-        int refpiclist0_max = h264_maxref & 0xffff;
-        int refpiclist1_max = (h264_maxref >> 16) & 0xffff;
+    } else if (s->current_frame_type == FRAME_B) {
+        int refpiclist0_max = s->h264_maxref & 0xffff;
+        int refpiclist1_max = (s->h264_maxref >> 16) & 0xffff;
 
-        memcpy(slice_param.RefPicList0, RefPicList0_B, refpiclist0_max*sizeof(VAPictureH264));
+        memcpy(s->slice_param.RefPicList0, s->RefPicList0_B, refpiclist0_max*sizeof(VAPictureH264));
         for (i = refpiclist0_max; i < 32; i++) {
-            slice_param.RefPicList0[i].picture_id = VA_INVALID_SURFACE;
-            slice_param.RefPicList0[i].flags = VA_PICTURE_H264_INVALID;
+            s->slice_param.RefPicList0[i].picture_id = VA_INVALID_SURFACE;
+            s->slice_param.RefPicList0[i].flags = VA_PICTURE_H264_INVALID;
         }
 
-        memcpy(slice_param.RefPicList1, RefPicList1_B, refpiclist1_max*sizeof(VAPictureH264));
+        memcpy(s->slice_param.RefPicList1, s->RefPicList1_B, refpiclist1_max*sizeof(VAPictureH264));
         for (i = refpiclist1_max; i < 32; i++) {
-            slice_param.RefPicList1[i].picture_id = VA_INVALID_SURFACE;
-            slice_param.RefPicList1[i].flags = VA_PICTURE_H264_INVALID;
+            s->slice_param.RefPicList1[i].picture_id = VA_INVALID_SURFACE;
+            s->slice_param.RefPicList1[i].flags = VA_PICTURE_H264_INVALID;
         }
     }
 
-    slice_param.slice_alpha_c0_offset_div2 = 0;
-    slice_param.slice_beta_offset_div2 = 0;
-    slice_param.direct_spatial_mv_pred_flag = 1;
-    slice_param.pic_order_cnt_lsb = (current_frame_display - current_IDR_display) % MaxPicOrderCntLsb;
+    s->slice_param.slice_alpha_c0_offset_div2 = 0;
+    s->slice_param.slice_beta_offset_div2 = 0;
+    s->slice_param.direct_spatial_mv_pred_flag = 1;
+    s->slice_param.pic_order_cnt_lsb = (s->current_frame_display - s->current_IDR_display) % MaxPicOrderCntLsb;
     
-    va_status = vaCreateBuffer(va_dpy,context_id,VAEncSliceParameterBufferType,
-                               sizeof(slice_param),1,&slice_param,&slice_param_buf);
-    CHECK_VASTATUS(va_status,"vaCreateBuffer");;
+    /*
+     * one buffer set per slice: the packed slice header (if the driver
+     * takes it) goes to the same vaRenderPicture() as its slice parameter
+     */
+    for (i = 0; i < s->frame_slices; i++) {
+        s->slice_param.macroblock_address = s->slice_mb_start[i];
+        s->slice_param.num_macroblocks = s->slice_mb_start[i + 1] - s->slice_mb_start[i]; /* Measured by MB */
+
+        num_buffers = 0;
+        if (s->h264_packedslice) {
+            length_in_bits = build_packed_slice_buffer(s, packedslice_buffer, sizeof(packedslice_buffer));
+            packedheader_param_buffer.type = VAEncPackedHeaderSlice;
+            packedheader_param_buffer.bit_length = length_in_bits;
+            packedheader_param_buffer.has_emulation_bytes = 0;
+
+            va_status = vaCreateBuffer(s->va_dpy, s->context_id, VAEncPackedHeaderParameterBufferType,
+                                       sizeof(packedheader_param_buffer), 1, &packedheader_param_buffer,
+                                       &render_id[num_buffers++]);
+            CHECK_VASTATUS(va_status,"vaCreateBuffer");
+
+            va_status = vaCreateBuffer(s->va_dpy, s->context_id, VAEncPackedHeaderDataBufferType,
+                                       (length_in_bits + 7) / 8, 1, packedslice_buffer,
+                                       &render_id[num_buffers++]);
+            CHECK_VASTATUS(va_status,"vaCreateBuffer");
+        }
 
-    va_status = vaRenderPicture(va_dpy,context_id, &slice_param_buf, 1);
-    CHECK_VASTATUS(va_status,"vaRenderPicture");
+        va_status = vaCreateBuffer(s->va_dpy,s->context_id,VAEncSliceParameterBufferType,
+                                   sizeof(s->slice_param),1,&s->slice_param,&render_id[num_buffers++]);
+        CHECK_VASTATUS(va_status,"vaCreateBuffer");;
+
+        va_status = vaRenderPicture(s->va_dpy,s->context_id, render_id, num_buffers);
+        CHECK_VASTATUS(va_status,"vaRenderPicture");
+    }
     
     return 0;
 }
 
 
-static int upload_source_YUV_once_for_all()
+static int upload_source_YUV_once_for_all(struct encode_session *s)
 {
     int box_width=8;
     int row_shift=0;
@@ -1685,7 +2318,7 @@ static int upload_source_YUV_once_for_all()
 
     for (i = 0; i < surface_num; i++) {
         printf("\rLoading data into surface %d.....", i);
-        upload_surface(va_dpy, src_surface[i], box_width, row_shift, 0);
+        upload_surface(s->va_dpy, s->src_surface[i], box_width, row_shift, 0);
 
         row_shift++;
         if (row_shift==(2*box_width)) row_shift= 0;
@@ -1695,30 +2328,190 @@ static int upload_source_YUV_once_for_all()
     return 0;
 }
 
-static int load_surface(VASurfaceID surface_id, unsigned long long display_order)
+/* a frame mapped for upload_threads row bands, the last band takes the rest */
+struct upload_job_t {
+    VAImage *image;
+    unsigned char *surface_p;
+    unsigned char *src_Y, *src_U, *src_V;
+    int rows;
+    unsigned int bands, next_band, done_bands;
+    struct upload_job_t *next;
+};
+
+/* called with upload_mutex, the job leaves the queue with its last band */
+static unsigned int upload_take_band(struct encode_session *s, struct upload_job_t *job)
+{
+    struct upload_job_t **p;
+    unsigned int band = job->next_band++;
+
+    if (job->next_band == job->bands) {
+        for (p = &s->upload_jobs; *p != job; p = &(*p)->next)
+            ;
+        *p = job->next;
+    }
+
+    return band;
+}
+
+/* called with upload_mutex, drops it while the band is copied */
+static void upload_band(struct encode_session *s, struct upload_job_t *job, unsigned int band)
+{
+    int row_start = band * job->rows;
+    int row_end = (band == job->bands - 1) ? (int)frame_height : row_start + job->rows;
+
+    pthread_mutex_unlock(&s->upload_mutex);
+    upload_image_yuv_rows(job->image, job->surface_p, srcyuv_fourcc, frame_width,
+                          job->src_Y, job->src_U, job->src_V,
+                          row_start, row_end);
+    pthread_mutex_lock(&s->upload_mutex);
+
+    if (++job->done_bands == job->bands)
+        pthread_cond_broadcast(&s->upload_done_cond);
+}
+
+static void * upload_band_thread(void *t)
+{
+    struct encode_session *s = t;
+    struct upload_job_t *job;
+
+    pthread_mutex_lock(&s->upload_mutex);
+    while (1) {
+        if (s->upload_jobs) {
+            job = s->upload_jobs;
+            upload_band(s, job, upload_take_band(s, job));
+        } else if (s->upload_quit)
+            break;
+        else
+            pthread_cond_wait(&s->upload_cond, &s->upload_mutex);
+    }
+    pthread_mutex_unlock(&s->upload_mutex);
+
+    return 0;
+}
+
+static void upload_start(struct encode_session *s)
+{
+    unsigned int i;
+    VAStatus va_status;
+
+    for (i = 0; i < surface_num; i++) {
+        va_status = vaDeriveImage(s->va_dpy, s->src_surface[i], &s->src_image[i]);
+        CHECK_VASTATUS(va_status,"vaDeriveImage");
+    }
+
+    s->upload_jobs = NULL;
+    s->upload_quit = 0;
+    pthread_mutex_init(&s->upload_mutex, NULL);
+    pthread_cond_init(&s->upload_cond, NULL);
+    pthread_cond_init(&s->upload_done_cond, NULL);
+
+    /* fewer workers only make the storage threads upload more bands themselves */
+    for (s->upload_threads_num = 0; s->upload_threads_num < upload_threads - 1; s->upload_threads_num++)
+        if (pthread_create(&s->upload_thread[s->upload_threads_num], NULL, upload_band_thread, s))
+            break;
+}
+
+static void upload_stop(struct encode_session *s)
+{
+    unsigned int i;
+
+    pthread_mutex_lock(&s->upload_mutex);
+    s->upload_quit = 1;
+    pthread_cond_broadcast(&s->upload_cond);
+    pthread_mutex_unlock(&s->upload_mutex);
+
+    for (i = 0; i < s->upload_threads_num; i++)
+        pthread_join(s->upload_thread[i], NULL);
+
+    pthread_cond_destroy(&s->upload_done_cond);
+    pthread_cond_destroy(&s->upload_cond);
+    pthread_mutex_destroy(&s->upload_mutex);
+
+    for (i = 0; i < surface_num; i++)
+        vaDestroyImage(s->va_dpy, s->src_image[i].image_id);
+}
+
+/* queue the frame to the upload workers and take its bands until none is left */
+static int upload_surface_yuv_bands(struct encode_session *s, VASurfaceID surface_id, unsigned char *src_Y,
+                                    unsigned char *src_U, unsigned char *src_V)
+{
+    struct upload_job_t job, **p;
+    unsigned int i;
+    VAStatus va_status;
+
+    for (i = 0; i < surface_num; i++)
+        if (s->src_surface[i] == surface_id)
+            break;
+    assert(i < surface_num);
+
+    memset(&job, 0, sizeof(job));
+    job.image = &s->src_image[i];
+    job.src_Y = src_Y;
+    job.src_U = src_U;
+    job.src_V = src_V;
+    job.bands = upload_threads;
+    job.rows = (frame_height / upload_threads) & ~1;
+
+    va_status = vaMapBuffer(s->va_dpy, job.image->buf, (void **)&job.surface_p);
+    CHECK_VASTATUS(va_status,"vaMapBuffer");
+
+    pthread_mutex_lock(&s->upload_mutex);
+    for (p = &s->upload_jobs; *p; p = &(*p)->next)
+        ;
+    *p = &job;
+    pthread_cond_broadcast(&s->upload_cond);
+
+    while (job.next_band < job.bands)
+        upload_band(s, &job, upload_take_band(s, &job));
+    while (job.done_bands < job.bands)
+        pthread_cond_wait(&s->upload_done_cond, &s->upload_mutex);
+    pthread_mutex_unlock(&s->upload_mutex);
+
+    vaUnmapBuffer(s->va_dpy, job.image->buf);
+
+    return 0;
+}
+
+static int load_surface(struct encode_session *s, VASurfaceID surface_id, unsigned long long display_order)
 {
     unsigned char *srcyuv_ptr = NULL, *src_Y = NULL, *src_U = NULL, *src_V = NULL;
     unsigned long long frame_start, mmap_start;
     char *mmap_ptr = NULL;
-    int frame_size, mmap_size;
+    int frame_size, mmap_size = 0;
     
     if (srcyuv_fp == NULL)
         return 0;
     
     /* allow encoding more than srcyuv_frames */    
-    display_order = display_order % srcyuv_frames;
+    if (!srcyuv_stream)
+        display_order = display_order % srcyuv_frames;
     frame_size = frame_width * frame_height * 3 / 2; /* for YUV420 */
-    frame_start = display_order * frame_size;
-    
-    mmap_start = frame_start & (~0xfff);
-    mmap_size = (frame_size + (frame_start & 0xfff) + 0xfff) & (~0xfff);
-    mmap_ptr = mmap64(0, mmap_size, PROT_READ, MAP_SHARED,
-                      fileno(srcyuv_fp), (off64_t)mmap_start);
-    if (mmap_ptr == MAP_FAILED) {
-        printf("Failed to mmap YUV file (%s)\n", strerror(errno));
-        return 1;
+    frame_start = srcyuv_offset(display_order);
+
+    if (srcyuv_stream) {
+        srcyuv_ptr = srcyuv_stream_frame(display_order);
+    } else if (srcyuv_map) {
+        unsigned long long ahead_start = (frame_start + frame_size) & (~0xfff);
+        unsigned long long ahead_end = frame_start + srcyuv_input.frame_stride * (1ULL + SRCYUV_READAHEAD);
+
+        /* ask the kernel for the next frames while this one is copied */
+        if (ahead_end > srcyuv_map_size)
+            ahead_end = srcyuv_map_size;
+        if (ahead_end > ahead_start)
+            madvise(srcyuv_map + ahead_start, ahead_end - ahead_start, MADV_WILLNEED);
+
+        srcyuv_ptr = srcyuv_map + frame_start;
+    } else {
+        mmap_start = frame_start & (~0xfff);
+        mmap_size = (frame_size + (frame_start & 0xfff) + 0xfff) & (~0xfff);
+        mmap_ptr = mmap64(0, mmap_size, PROT_READ, MAP_SHARED,
+                          fileno(srcyuv_fp), (off64_t)mmap_start);
+        if (mmap_ptr == MAP_FAILED) {
+            printf("Failed to mmap YUV file (%s)\n", strerror(errno));
+            return 1;
+        }
+        srcyuv_ptr = (unsigned char *)mmap_ptr +  (frame_start & 0xfff);
     }
-    srcyuv_ptr = (unsigned char *)mmap_ptr +  (frame_start & 0xfff);
     if (srcyuv_fourcc == VA_FOURCC_NV12) {
         src_Y = srcyuv_ptr;
         src_U = src_Y + frame_width * frame_height;
@@ -1738,9 +2531,12 @@ static int load_surface(VASurfaceID surface_id, unsigned long long display_order
         exit(1);
     }
     
-    upload_surface_yuv(va_dpy, surface_id,
-                       srcyuv_fourcc, frame_width, frame_height,
-                       src_Y, src_U, src_V);
+    if (upload_threads > 1)
+        upload_surface_yuv_bands(s, surface_id, src_Y, src_U, src_V);
+    else
+        upload_surface_yuv(s->va_dpy, surface_id,
+                           srcyuv_fourcc, frame_width, frame_height,
+                           src_Y, src_U, src_V);
     if (mmap_ptr)
         munmap(mmap_ptr, mmap_size);
 
@@ -1748,13 +2544,13 @@ static int load_surface(VASurfaceID surface_id, unsigned long long display_order
 }
 
 
-static int save_recyuv(VASurfaceID surface_id,
+static int save_recyuv(struct encode_session *s, VASurfaceID surface_id,
                        unsigned long long display_order,
                        unsigned long long encode_order)
 {
     unsigned char *dst_Y = NULL, *dst_U = NULL, *dst_V = NULL;
 
-    if (recyuv_fp == NULL)
+    if (s->recyuv_fp == NULL)
         return 0;
 
     if (srcyuv_fourcc == VA_FOURCC_NV12) {
@@ -1772,26 +2568,29 @@ static int save_recyuv(VASurfaceID surface_id,
         exit(1);
     }
     
-    download_surface_yuv(va_dpy, surface_id,
+    download_surface_yuv(s->va_dpy, surface_id,
                          srcyuv_fourcc, frame_width, frame_height,
                          dst_Y, dst_U, dst_V);
-    fseek(recyuv_fp, display_order * frame_width * frame_height * 1.5, SEEK_SET);
+
+    /* storage threads share recyuv_fp */
+    pthread_mutex_lock(&s->recyuv_mutex);
+    fseek(s->recyuv_fp, display_order * frame_width * frame_height * 1.5, SEEK_SET);
 
     if (srcyuv_fourcc == VA_FOURCC_NV12) {
         int uv_size = 2 * (frame_width/2) * (frame_height/2);
-        fwrite(dst_Y, uv_size * 2, 1, recyuv_fp);
-        fwrite(dst_U, uv_size, 1, recyuv_fp);
+        fwrite(dst_Y, uv_size * 2, 1, s->recyuv_fp);
+        fwrite(dst_U, uv_size, 1, s->recyuv_fp);
     } else if (srcyuv_fourcc == VA_FOURCC_IYUV ||
                srcyuv_fourcc == VA_FOURCC_YV12) {
         int uv_size = (frame_width/2) * (frame_height/2);
-        fwrite(dst_Y, uv_size * 4, 1, recyuv_fp);
+        fwrite(dst_Y, uv_size * 4, 1, s->recyuv_fp);
         
         if (srcyuv_fourcc == VA_FOURCC_IYUV) {
-            fwrite(dst_U, uv_size, 1, recyuv_fp);
-            fwrite(dst_V, uv_size, 1, recyuv_fp);
+            fwrite(dst_U, uv_size, 1, s->recyuv_fp);
+            fwrite(dst_V, uv_size, 1, s->recyuv_fp);
         } else {
-            fwrite(dst_V, uv_size, 1, recyuv_fp);
-            fwrite(dst_U, uv_size, 1, recyuv_fp);
+            fwrite(dst_V, uv_size, 1, s->recyuv_fp);
+            fwrite(dst_U, uv_size, 1, s->recyuv_fp);
         }
     } else {
         printf("Unsupported YUV format\n");
@@ -1805,27 +2604,84 @@ static int save_recyuv(VASurfaceID surface_id,
     if (dst_V)
         free(dst_V);
 
-    fflush(recyuv_fp);
+    fflush(s->recyuv_fp);
+    pthread_mutex_unlock(&s->recyuv_mutex);
 
     return 0;
 }
 
 
-static int save_codeddata(unsigned long long display_order, unsigned long long encode_order)
+/*
+ * Add the size of the slice NAL units in a coded segment to the
+ * per-slice statistics, *slice is the index of the next slice
+ */
+/*
+ * start code scan over the segment chain of a coded frame, the state is
+ * carried from one segment to the next as a NAL unit may span several
+ */
+struct slice_scan_t {
+    unsigned int zeros;         /* 0x00 bytes just before */
+    int nal_header;             /* the next byte is a NAL header */
+    int in_slice;               /* the current NAL unit is a slice */
+    unsigned long long nal_size; /* of the current NAL unit, its start code included */
+    unsigned int slice;
+};
+
+static void count_slice_end(struct encode_session *s, struct slice_scan_t *scan, unsigned long long nal_size)
+{
+    if (scan->in_slice && scan->slice < s->frame_slices) {
+        s->slice_coded_bytes[scan->slice] += nal_size;
+        s->slice_coded_max[scan->slice] = MAX(s->slice_coded_max[scan->slice], nal_size);
+        scan->slice++;
+    }
+    scan->in_slice = 0;
+}
+
+static void count_slice_sizes(struct encode_session *s, struct slice_scan_t *scan, unsigned char *buf, unsigned int size)
+{
+    unsigned int i;
+
+    for (i = 0; i < size; i++) {
+        if (scan->nal_header) {
+            unsigned int nal_type = buf[i] & 0x1f;
+
+            scan->in_slice = (nal_type == NAL_NON_IDR || nal_type == NAL_IDR);
+            scan->nal_header = 0;
+        }
+        scan->nal_size++;
+
+        if (buf[i] == 1 && scan->zeros >= 2) {
+            /* the zeros and 0x01 of this start code are not part of the previous NAL unit */
+            count_slice_end(s, scan, scan->nal_size - scan->zeros - 1);
+            scan->nal_size = 3;
+            scan->nal_header = 1;
+        }
+        scan->zeros = buf[i] ? 0 : scan->zeros + 1;
+    }
+}
+
+static int save_codeddata(struct encode_session *s, unsigned long long display_order, unsigned long long encode_order)
 {    
-    VACodedBufferSegment *buf_list = NULL;
+    VACodedBufferSegment *buf_list = NULL, *segment;
     VAStatus va_status;
-    unsigned int coded_size = 0;
+    long long coded_size;
+    struct slice_scan_t scan;
 
-    va_status = vaMapBuffer(va_dpy,coded_buf[display_order % surface_num],(void **)(&buf_list));
+    va_status = vaMapBuffer(s->va_dpy,s->coded_buf[display_order % surface_num],(void **)(&buf_list));
     CHECK_VASTATUS(va_status,"vaMapBuffer");
-    while (buf_list != NULL) {
-        coded_size += fwrite(buf_list->buf, 1, buf_list->size, coded_fp);
-        buf_list = (VACodedBufferSegment *) buf_list->next;
-
-        frame_size += coded_size;
+    coded_size = coded_sink_write_coded(&s->coded_sink, NULL, 0, buf_list);
+    if (coded_size < 0) {
+        printf("Write to %s failed (%s), exit\n", s->coded_fn, strerror(errno));
+        exit(1);
     }
-    vaUnmapBuffer(va_dpy,coded_buf[display_order % surface_num]);
+    s->frame_size += coded_size;
+    if (s->frame_slices > 1) {
+        memset(&scan, 0, sizeof(scan));
+        for (segment = buf_list; segment; segment = (VACodedBufferSegment *)segment->next)
+            count_slice_sizes(s, &scan, segment->buf, segment->size);
+        count_slice_end(s, &scan, scan.nal_size);
+    }
+    vaUnmapBuffer(s->va_dpy,s->coded_buf[display_order % surface_num]);
 
     printf("\r      "); /* return back to startpoint */
     switch (encode_order % 4) {
@@ -1843,112 +2699,427 @@ static int save_codeddata(unsigned long long display_order, unsigned long long e
             break;
     }
     printf("%08lld", encode_order);
-    printf("(%06d bytes coded)",coded_size);
-
-    fflush(coded_fp);
+    printf("(%06lld bytes coded)",coded_size);
     
     return 0;
 }
 
 
-static struct storage_task_t * storage_task_dequeue(void)
+static int storage_task_dequeue(struct encode_session *s, struct storage_task_t *task)
 {
-    struct storage_task_t *header;
+    int ret = 0;
+
+    pthread_mutex_lock(&s->encode_mutex);
 
-    pthread_mutex_lock(&encode_mutex);
+    /* wait for a task, unless all frames are taken by storage threads */
+    while (s->storage_task_head == s->storage_task_tail && s->storage_task_head < frame_count)
+        pthread_cond_wait(&s->encode_cond, &s->encode_mutex);
 
-    header = storage_task_header;    
-    if (storage_task_header != NULL) {
-        if (storage_task_tail == storage_task_header)
-            storage_task_tail = NULL;
-        storage_task_header = header->next;
+    if (s->storage_task_head != s->storage_task_tail) {
+        *task = s->storage_task_ring[s->storage_task_head % surface_num];
+        ret = 1;
+
+        /* wake up the other storage threads to exit */
+        if (++s->storage_task_head >= frame_count)
+            pthread_cond_broadcast(&s->encode_cond);
     }
     
-    pthread_mutex_unlock(&encode_mutex);
+    pthread_mutex_unlock(&s->encode_mutex);
     
-    return header;
+    return ret;
 }
 
-static int storage_task_queue(unsigned long long display_order, unsigned long long encode_order)
+static int storage_task_queue(struct encode_session *s, unsigned long long display_order, unsigned long long encode_order)
 {
-    struct storage_task_t *tmp;
+    struct storage_task_t *task;
+    unsigned long long now = time_us_monotonic();
 
-    tmp = calloc(1, sizeof(struct storage_task_t));
-    tmp->display_order = display_order;
-    tmp->encode_order = encode_order;
+    pthread_mutex_lock(&s->encode_mutex);
 
-    pthread_mutex_lock(&encode_mutex);
-    
-    if (storage_task_header == NULL) {
-        storage_task_header = tmp;
-        storage_task_tail = tmp;
-    } else {
-        storage_task_tail->next = tmp;
-        storage_task_tail = tmp;
-    }
+    /* the encode loop only queues a slot it got back, so the ring can't overflow */
+    assert(s->storage_task_tail - s->storage_task_head < surface_num);
+    task = &s->storage_task_ring[s->storage_task_tail % surface_num];
+    task->display_order = display_order;
+    task->encode_order = encode_order;
+    task->enqueue_us = now;
+    s->storage_task_tail++;
 
-    srcsurface_status[display_order % surface_num] = SRC_SURFACE_IN_STORAGE;
-    pthread_cond_signal(&encode_cond);
+    s->srcsurface_status[display_order % surface_num] = SRC_SURFACE_IN_STORAGE;
+    pthread_cond_signal(&s->encode_cond);
     
-    pthread_mutex_unlock(&encode_mutex);
+    pthread_mutex_unlock(&s->encode_mutex);
     
     return 0;
 }
 
-static void storage_task(unsigned long long display_order, unsigned long long encode_order)
+static void storage_task(struct encode_session *s, unsigned long long display_order, unsigned long long encode_order,
+                         unsigned long long wait_us)
 {
-    unsigned int tmp;
+    unsigned int tmp, sync_ticks, save_ticks, upload_ticks;
+    unsigned long long start_us = time_us_monotonic(), service_us;
+    unsigned int slot = display_order % surface_num;
+    unsigned long long latency_us;
     VAStatus va_status;
     
     tmp = GetTickCount();
-    va_status = vaSyncSurface(va_dpy, src_surface[display_order % surface_num]);
+    va_status = vaSyncSurface(s->va_dpy, s->src_surface[slot]);
     CHECK_VASTATUS(va_status,"vaSyncSurface");
-    SyncPictureTicks += GetTickCount() - tmp;
+    sync_ticks = GetTickCount() - tmp;
+
+    /* coded data is saved in encoding order */
+    pthread_mutex_lock(&s->encode_mutex);
+    while (s->storage_save_order != encode_order)
+        pthread_cond_wait(&s->storage_save_cond, &s->encode_mutex);
+    pthread_mutex_unlock(&s->encode_mutex);
+
     tmp = GetTickCount();
-    save_codeddata(display_order, encode_order);
-    SavePictureTicks += GetTickCount() - tmp;
+    save_codeddata(s, display_order, encode_order);
+    save_ticks = GetTickCount() - tmp;
+    latency_us = time_us_monotonic() - s->frame_begin_us[slot];
 
-    save_recyuv(ref_surface[display_order % surface_num], display_order, encode_order);
+    pthread_mutex_lock(&s->encode_mutex);
+    s->storage_save_order++;
+    pthread_cond_broadcast(&s->storage_save_cond);
+    pthread_mutex_unlock(&s->encode_mutex);
+
+    save_recyuv(s, s->ref_surface[slot], display_order, encode_order);
 
     /* reload a new frame data */
     tmp = GetTickCount();
     if (srcyuv_fp != NULL)
-        load_surface(src_surface[display_order % surface_num], display_order + surface_num);
-    UploadPictureTicks += GetTickCount() - tmp;
-
-    pthread_mutex_lock(&encode_mutex);
-    srcsurface_status[display_order % surface_num] = SRC_SURFACE_IN_ENCODING;
-    pthread_mutex_unlock(&encode_mutex);
+        load_surface(s, s->src_surface[slot], display_order + surface_num);
+    upload_ticks = GetTickCount() - tmp;
+    service_us = time_us_monotonic() - start_us;
+
+    pthread_mutex_lock(&s->encode_mutex);
+    s->StorageTasks++;
+    s->FrameLatencyUs += latency_us;
+    s->FrameLatencyMaxUs = MAX(s->FrameLatencyMaxUs, latency_us);
+    if (s->frame_dirty[slot])
+        s->DirtyLatencyUs += latency_us;
+    else {
+        s->FullLatencyUs += latency_us;
+        s->FullFrames++;
+    }
+    s->StorageWaitUs += wait_us;
+    s->StorageWaitMaxUs = MAX(s->StorageWaitMaxUs, wait_us);
+    s->StorageServiceUs += service_us;
+    s->StorageServiceMaxUs = MAX(s->StorageServiceMaxUs, service_us);
+    s->SyncPictureTicks += sync_ticks;
+    s->SavePictureTicks += save_ticks;
+    s->UploadPictureTicks += upload_ticks;
+    s->srcsurface_status[slot] = SRC_SURFACE_IN_ENCODING;
+    pthread_cond_signal(&s->srcsurface_cond[slot]);
+    pthread_mutex_unlock(&s->encode_mutex);
 }
 
         
 static void * storage_task_thread(void *t)
 {
-    while (1) {
-        struct storage_task_t *current;
-        
-        current = storage_task_dequeue();
-        if (current == NULL) {
-            pthread_mutex_lock(&encode_mutex);
-            pthread_cond_wait(&encode_cond, &encode_mutex);
-            pthread_mutex_unlock(&encode_mutex);
+    struct encode_session *s = t;
+    struct storage_task_t current;
+
+    /* until all frames are taken */
+    while (storage_task_dequeue(s, &current))
+        storage_task(s, current.display_order, current.encode_order,
+                     time_us_monotonic() - current.enqueue_us);
+
+    return 0;
+}
+
+
+/*
+ * Dirty rectangles: the source frame is compared with the source of
+ * every reference its slices may use (L0 for P, L0 and L1 for B) in
+ * 16x16 blocks (and the 8x8 chroma blocks under them), a block is
+ * dirty when it differs from any of them.
+ * Runs of changed blocks in a block row are extended down while the
+ * next row has the same run, the rectangles are then merged pairwise,
+ * cheapest union first, down to the number the driver supports.
+ * P/B frames get them as VAEncMiscParameterTypeDirtyROI, I/IDR frames
+ * are coded in full, as are frames which changed everywhere or nowhere.
+ */
+#define DIRTY_BLOCK 16
+#define DIRTY_MERGE_MAX 128     /* more rectangles are sent as their bounding box */
+
+/* rows of a block differ, width in bytes */
+static int dirty_rows_differ(const unsigned char *cur, const unsigned char *prev,
+                             unsigned int width, unsigned int height, unsigned int stride)
+{
+    unsigned int y;
+
+    for (y = 0; y < height; y++, cur += stride, prev += stride) {
+#ifdef __SSE2__
+        if (width == 16) {
+            __m128i eq = _mm_cmpeq_epi8(_mm_loadu_si128((const __m128i *)cur),
+                                        _mm_loadu_si128((const __m128i *)prev));
+
+            if (_mm_movemask_epi8(eq) != 0xffff)
+                return 1;
             continue;
         }
-        
-        storage_task(current->display_order, current->encode_order);
-        
-        free(current);
+        if (width == 8) {
+            __m128i eq = _mm_cmpeq_epi8(_mm_loadl_epi64((const __m128i *)cur),
+                                        _mm_loadl_epi64((const __m128i *)prev));
 
-        /* all frames are saved, exit the thread */
-        if (++frame_coded >= frame_count)
-            break;
+            if ((_mm_movemask_epi8(eq) & 0xff) != 0xff)
+                return 1;
+            continue;
+        }
+#endif
+        if (memcmp(cur, prev, width))
+            return 1;
     }
 
     return 0;
 }
 
+/* mark the blocks that differ from one reference, the ones already dirty are skipped */
+static void dirty_detect_blocks(struct encode_session *s, const unsigned char *cur,
+                                const unsigned char *prev)
+{
+    unsigned int blocks_w = (frame_width + DIRTY_BLOCK - 1) / DIRTY_BLOCK;
+    unsigned int blocks_h = (frame_height + DIRTY_BLOCK - 1) / DIRTY_BLOCK;
+    struct quality_plane_t plane[QUALITY_PLANES];
+    unsigned int bx, by, i;
+
+    quality_planes(plane);
+    for (by = 0; by < blocks_h; by++) {
+        for (bx = 0; bx < blocks_w; bx++) {
+            unsigned int x = bx * DIRTY_BLOCK, y = by * DIRTY_BLOCK;
+            unsigned int w = MIN(DIRTY_BLOCK, frame_width - x), h = MIN(DIRTY_BLOCK, frame_height - y);
+            int dirty;
+
+            if (s->dirty_map[by * blocks_w + bx])
+                continue;
+            dirty = dirty_rows_differ(cur + y * frame_width + x, prev + y * frame_width + x,
+                                      w, h, frame_width);
+
+            /* the NV12 chroma plane holds U and V, a single compare covers both */
+            for (i = 1; !dirty && i < QUALITY_PLANES; i += plane[1].step) {
+                unsigned int offset = plane[i].offset + (y / 2) * plane[i].stride + (x / 2) * plane[i].step;
+
+                dirty = dirty_rows_differ(cur + offset, prev + offset, (w / 2) * plane[i].step,
+                                          h / 2, plane[i].stride);
+            }
+            s->dirty_map[by * blocks_w + bx] = dirty;
+        }
+    }
+}
+
+/* display order of the references in the active RefPicList0/1 of the current frame */
+static unsigned int dirty_ref_frames(struct encode_session *s, unsigned long long display[16])
+{
+    int refpiclist_max[2] = { s->h264_maxref & 0xffff, (s->h264_maxref >> 16) & 0xffff };
+    VAPictureH264 *list[2] = { s->RefPicList0_B, s->RefPicList1_B };
+    unsigned int lists = 2, num = 0, l, i, j;
+
+    update_RefPicList(s);
+    if (s->current_frame_type == FRAME_P) {
+        list[0] = s->RefPicList0_P;
+        lists = 1;
+    }
+    for (l = 0; l < lists; l++) {
+        for (i = 0; i < MIN((unsigned int)refpiclist_max[l], s->numShortTerm); i++) {
+            /* POC counts frames from the IDR, see render_picture() */
+            unsigned long long frame = s->current_IDR_display + list[l][i].TopFieldOrderCnt;
+
+            for (j = 0; j < num && display[j] != frame; j++)
+                ;
+            if (j == num && num < 16)
+                display[num++] = frame;
+        }
+    }
+
+    return num;
+}
+
+static unsigned int dirty_rect_area(const VARectangle *r)
+{
+    return r->width * r->height;
+}
 
-static int encode_frames(void)
+static void dirty_rect_union(VARectangle *r, const VARectangle *a, const VARectangle *b)
+{
+    int x = MIN(a->x, b->x), y = MIN(a->y, b->y);
+
+    r->width = MAX(a->x + a->width, b->x + b->width) - x;
+    r->height = MAX(a->y + a->height, b->y + b->height) - y;
+    r->x = x;
+    r->y = y;
+}
+
+/* changed blocks to rectangles in block units, returns the number of rectangles */
+static unsigned int dirty_merge_blocks(struct encode_session *s)
+{
+    unsigned int blocks_w = (frame_width + DIRTY_BLOCK - 1) / DIRTY_BLOCK;
+    unsigned int blocks_h = (frame_height + DIRTY_BLOCK - 1) / DIRTY_BLOCK;
+    VARectangle *rects = s->dirty_rects;
+    unsigned int num = 0, open_begin = 0, open_end = 0, bx, by, i;
+
+    for (by = 0; by < blocks_h; by++) {
+        const unsigned char *row = s->dirty_map + by * blocks_w;
+        unsigned int row_begin = num;
+
+        for (bx = 0; bx < blocks_w; bx++) {
+            unsigned int x = bx;
+
+            if (!row[bx])
+                continue;
+            while (bx < blocks_w && row[bx])
+                bx++;
+
+            /* the rectangles of the previous row are [open_begin, open_end) */
+            for (i = open_begin; i < open_end; i++)
+                if (rects[i].x == x && rects[i].width == bx - x &&
+                    rects[i].y + rects[i].height == by)
+                    break;
+            if (i < open_end) {
+                VARectangle tmp = rects[i];
+
+                /* move it to the rectangles of this row */
+                memmove(&rects[i], &rects[i + 1], (num - i - 1) * sizeof(*rects));
+                rects[num - 1] = tmp;
+                rects[num - 1].height++;
+                open_end--;
+                row_begin--;
+            } else {
+                rects[num].x = x;
+                rects[num].y = by;
+                rects[num].width = bx - x;
+                rects[num].height = 1;
+                num++;
+            }
+        }
+        open_begin = row_begin;
+        open_end = num;
+    }
+
+    return num;
+}
+
+static void dirty_reduce_rects(struct encode_session *s, unsigned int max)
+{
+    VARectangle *rects = s->dirty_rects, u;
+    unsigned int i, j, best_i = 0, best_j = 1;
+
+    while (s->dirty_rect_num > max) {
+        unsigned int best = ~0U;
+
+        /* the union adding the least area */
+        for (i = 0; i < s->dirty_rect_num && best; i++)
+            for (j = i + 1; j < s->dirty_rect_num && best; j++) {
+                unsigned int cost;
+
+                dirty_rect_union(&u, &rects[i], &rects[j]);
+                cost = dirty_rect_area(&u) - dirty_rect_area(&rects[i]) - dirty_rect_area(&rects[j]);
+                if ((int)cost < 0)
+                    cost = 0;
+                if (cost < best) {
+                    best = cost;
+                    best_i = i;
+                    best_j = j;
+                }
+            }
+        dirty_rect_union(&rects[best_i], &rects[best_i], &rects[best_j]);
+        rects[best_j] = rects[--s->dirty_rect_num];
+    }
+}
+
+/*
+ * compare the current source frame with the sources of its references,
+ * called after render_picture() so that the reference lists are known
+ */
+static void dirty_rect_detect(struct encode_session *s)
+{
+    unsigned int blocks_w = (frame_width + DIRTY_BLOCK - 1) / DIRTY_BLOCK;
+    unsigned int blocks_h = (frame_height + DIRTY_BLOCK - 1) / DIRTY_BLOCK;
+    unsigned long long ref_display[16];
+    unsigned char *cur, *prev = NULL;
+    char *cur_mmap, *prev_mmap = NULL;
+    unsigned int cur_size, prev_size, changed = 0, ref_num, i;
+    int coded_in_full = (s->current_frame_type == FRAME_IDR || s->current_frame_type == FRAME_I);
+
+    s->dirty_valid = 0;
+    if (coded_in_full)
+        return;
+    ref_num = dirty_ref_frames(s, ref_display);
+    if (ref_num == 0)
+        return;
+
+    cur = srcyuv_frame(s->current_frame_display, &cur_mmap, &cur_size);
+    memset(s->dirty_map, 0, blocks_w * blocks_h);
+    for (i = 0; cur && i < ref_num; i++) {
+        prev = srcyuv_frame(ref_display[i], &prev_mmap, &prev_size);
+        if (prev == NULL)
+            break;
+        dirty_detect_blocks(s, cur, prev);
+        if (prev_mmap)
+            munmap(prev_mmap, prev_size);
+    }
+    if (cur && prev) {
+        for (i = 0; i < blocks_w * blocks_h; i++)
+            changed += s->dirty_map[i];
+        s->DirtyBlocks += changed;
+        s->DirtyBlocksTotal += blocks_w * blocks_h;
+
+        s->dirty_rect_num = dirty_merge_blocks(s);
+        /* too many to merge them one by one, the bounding box will do */
+        if (s->dirty_rect_num > MAX(DIRTY_MERGE_MAX, s->h264_maxdirtyroi)) {
+            for (i = 1; i < s->dirty_rect_num; i++)
+                dirty_rect_union(&s->dirty_rects[0], &s->dirty_rects[0], &s->dirty_rects[i]);
+            s->dirty_rect_num = 1;
+        }
+        if (s->h264_maxdirtyroi > 0)
+            dirty_reduce_rects(s, s->h264_maxdirtyroi);
+
+        /* block units to pixels */
+        for (i = 0; i < s->dirty_rect_num; i++) {
+            VARectangle *r = &s->dirty_rects[i];
+
+            r->x *= DIRTY_BLOCK;
+            r->y *= DIRTY_BLOCK;
+            r->width = MIN(r->width * DIRTY_BLOCK, frame_width - r->x);
+            r->height = MIN(r->height * DIRTY_BLOCK, frame_height - r->y);
+        }
+        /* no rectangle at all reads as the whole frame to some drivers, send none */
+        s->dirty_valid = (changed > 0 && changed < blocks_w * blocks_h);
+    }
+    if (cur_mmap)
+        munmap(cur_mmap, cur_size);
+}
+
+static int render_dirty_roi(struct encode_session *s)
+{
+    VABufferID misc_param_buf_id;
+    VAStatus va_status;
+    VAEncMiscParameterBuffer *misc_param;
+    VAEncMiscParameterBufferDirtyROI *dirty_roi;
+
+    va_status = vaCreateBuffer(s->va_dpy, s->context_id,
+                               VAEncMiscParameterBufferType,
+                               sizeof(VAEncMiscParameterBuffer) + sizeof(VAEncMiscParameterBufferDirtyROI),
+                               1, NULL, &misc_param_buf_id);
+    CHECK_VASTATUS(va_status, "vaCreateBuffer");
+
+    va_status = vaMapBuffer(s->va_dpy, misc_param_buf_id, (void **)&misc_param);
+    CHECK_VASTATUS(va_status, "vaMapBuffer");
+    misc_param->type = VAEncMiscParameterTypeDirtyROI;
+    dirty_roi = (VAEncMiscParameterBufferDirtyROI *)misc_param->data;
+    dirty_roi->num_roi_rectangle = s->dirty_rect_num;
+    dirty_roi->roi_rectangle = s->dirty_rects;
+    vaUnmapBuffer(s->va_dpy, misc_param_buf_id);
+
+    va_status = vaRenderPicture(s->va_dpy, s->context_id, &misc_param_buf_id, 1);
+    CHECK_VASTATUS(va_status, "vaRenderPicture");
+
+    s->DirtyFrames++;
+    s->DirtyRects += s->dirty_rect_num;
+
+    return 0;
+}
+
+static int encode_frames(struct encode_session *s)
 {
     unsigned int i, tmp;
     VAStatus va_status;
@@ -1956,106 +3127,155 @@ static int encode_frames(void)
 
     /* upload RAW YUV data into all surfaces */
     tmp = GetTickCount();
+    if (srcyuv_fp != NULL && upload_threads > 1)
+        upload_start(s);
     if (srcyuv_fp != NULL) {
         for (i = 0; i < surface_num; i++)
-            load_surface(src_surface[i], i);
+            load_surface(s, s->src_surface[i], i);
     } else
-        upload_source_YUV_once_for_all();
-    UploadPictureTicks += GetTickCount() - tmp;
+        upload_source_YUV_once_for_all(s);
+    s->UploadPictureTicks += GetTickCount() - tmp;
     
     /* ready for encoding */
-    memset(srcsurface_status, SRC_SURFACE_IN_ENCODING, sizeof(srcsurface_status));
+    memset(s->srcsurface_status, SRC_SURFACE_IN_ENCODING, sizeof(s->srcsurface_status));
+    for (i = 0; i < surface_num; i++)
+        pthread_cond_init(&s->srcsurface_cond[i], NULL);
     
-    memset(&seq_param, 0, sizeof(seq_param));
-    memset(&pic_param, 0, sizeof(pic_param));
-    memset(&slice_param, 0, sizeof(slice_param));
+    memset(&s->seq_param, 0, sizeof(s->seq_param));
+    memset(&s->pic_param, 0, sizeof(s->pic_param));
+    memset(&s->slice_param, 0, sizeof(s->slice_param));
 
-    if (encode_syncmode == 0)
-        pthread_create(&encode_thread, NULL, storage_task_thread, NULL);
-    
-    for (current_frame_encoding = 0; current_frame_encoding < frame_count; current_frame_encoding++) {
-        encoding2display_order(current_frame_encoding, intra_period, intra_idr_period, ip_period,
-                               &current_frame_display, &current_frame_type);
-        if (current_frame_type == FRAME_IDR) {
-            numShortTerm = 0;
-            current_frame_num = 0;
-            current_IDR_display = current_frame_display;
+    if (encode_syncmode == 0) {
+        for (i = 0; i < storage_threads; i++)
+            pthread_create(&s->encode_thread[i], NULL, storage_task_thread, s);
+    }
+    
+    if (lookahead_depth)
+        lookahead_start(s);
+    if (dirty_rect_mode) {
+        unsigned int blocks_num = ((frame_width + DIRTY_BLOCK - 1) / DIRTY_BLOCK) *
+            ((frame_height + DIRTY_BLOCK - 1) / DIRTY_BLOCK);
+
+        s->dirty_map = calloc(blocks_num, 1);
+        s->dirty_rects = calloc(blocks_num, sizeof(*s->dirty_rects));
+        if (s->dirty_map == NULL || s->dirty_rects == NULL) {
+            printf("Failed to allocate the dirty rectangles\n");
+            exit(1);
         }
+    }
 
-        /* check if the source frame is ready */
-        while (srcsurface_status[current_slot] != SRC_SURFACE_IN_ENCODING) {
-            usleep(1);
+    for (s->current_frame_encoding = 0; s->current_frame_encoding < frame_count; s->current_frame_encoding++) {
+        if (lookahead_depth)
+            lookahead_next_frame(s, &s->current_frame_display, &s->current_frame_type);
+        else
+            encoding2display_order(s->current_frame_encoding, intra_period, intra_idr_period, ip_period,
+                                   &s->current_frame_display, &s->current_frame_type);
+        if (s->current_frame_type == FRAME_IDR) {
+            s->numShortTerm = 0;
+            s->current_frame_num = 0;
+            s->current_IDR_display = s->current_frame_display;
         }
+
+        /* wait until the source frame is reloaded by a storage thread */
+        pthread_mutex_lock(&s->encode_mutex);
+        while (s->srcsurface_status[current_slot] != SRC_SURFACE_IN_ENCODING)
+            pthread_cond_wait(&s->srcsurface_cond[current_slot], &s->encode_mutex);
+        pthread_mutex_unlock(&s->encode_mutex);
         
+        s->dirty_valid = 0;
+
+        s->frame_begin_us[current_slot] = time_us_monotonic();
         tmp = GetTickCount();
-        va_status = vaBeginPicture(va_dpy, context_id, src_surface[current_slot]);
+        va_status = vaBeginPicture(s->va_dpy, s->context_id, s->src_surface[current_slot]);
         CHECK_VASTATUS(va_status,"vaBeginPicture");
-        BeginPictureTicks += GetTickCount() - tmp;
+        s->BeginPictureTicks += GetTickCount() - tmp;
         
         tmp = GetTickCount();
-        if (current_frame_type == FRAME_IDR) {
-            render_sequence();
-            render_picture();            
-            if (h264_packedheader) {
-                render_packedsequence();
-                render_packedpicture();
+        if (s->current_frame_type == FRAME_IDR) {
+            render_sequence(s);
+            render_picture(s);            
+            if (s->h264_packedheader) {
+                render_packedsequence(s);
+                render_packedpicture(s);
             }
             //if (rc_mode == VA_RC_CBR)
-            //    render_packedsei();
-            //render_hrd();
+            //    render_packedsei(s);
+            //render_hrd(s);
         } else {
-            //render_sequence();
-            render_picture();
+            //render_sequence(s);
+            render_picture(s);
+            if (dirty_rect_mode)
+                dirty_rect_detect(s);
+            if (s->dirty_valid && s->h264_maxdirtyroi > 0)
+                render_dirty_roi(s);
             //if (rc_mode == VA_RC_CBR)
-            //    render_packedsei();
-            //render_hrd();
+            //    render_packedsei(s);
+            //render_hrd(s);
         }
-        render_slice();
-        RenderPictureTicks += GetTickCount() - tmp;
+        render_slice(s);
+        s->frame_dirty[current_slot] = (s->dirty_valid && s->h264_maxdirtyroi > 0);
+        s->RenderPictureTicks += GetTickCount() - tmp;
         
         tmp = GetTickCount();
-        va_status = vaEndPicture(va_dpy,context_id);
+        va_status = vaEndPicture(s->va_dpy,s->context_id);
         CHECK_VASTATUS(va_status,"vaEndPicture");;
-        EndPictureTicks += GetTickCount() - tmp;
+        s->EndPictureTicks += GetTickCount() - tmp;
 
         if (encode_syncmode)
-            storage_task(current_frame_display, current_frame_encoding);
+            storage_task(s, s->current_frame_display, s->current_frame_encoding, 0);
         else /* queue the storage task queue */
-            storage_task_queue(current_frame_display, current_frame_encoding);
+            storage_task_queue(s, s->current_frame_display, s->current_frame_encoding);
         
-        update_ReferenceFrames();        
+        update_ReferenceFrames(s);        
     }
 
+    if (lookahead_depth)
+        lookahead_stop(s);
+    free(s->dirty_map);
+    free(s->dirty_rects);
+    s->dirty_map = NULL;
+    s->dirty_rects = NULL;
+
     if (encode_syncmode == 0) {
-        int ret;
-        pthread_join(encode_thread, (void **)&ret);
+        for (i = 0; i < storage_threads; i++)
+            pthread_join(s->encode_thread[i], NULL);
     }
+    if (srcyuv_fp != NULL && upload_threads > 1)
+        upload_stop(s);
     
     return 0;
 }
 
 
-static int release_encode()
+static int release_encode(struct encode_session *s)
 {
     int i;
     
-    vaDestroySurfaces(va_dpy,&src_surface[0],surface_num);
-    vaDestroySurfaces(va_dpy,&ref_surface[0],surface_num);
+    vaDestroySurfaces(s->va_dpy,&s->src_surface[0],surface_num);
+    vaDestroySurfaces(s->va_dpy,&s->ref_surface[0],surface_num);
 
     for (i = 0; i < surface_num; i++)
-        vaDestroyBuffer(va_dpy,coded_buf[i]);
+        vaDestroyBuffer(s->va_dpy,s->coded_buf[i]);
+
+    packed_header_release(&s->packed_sps);
+    packed_header_release(&s->packed_pps);
+    packed_header_release(&s->packed_sei);
     
-    vaDestroyContext(va_dpy,context_id);
-    vaDestroyConfig(va_dpy,config_id);
+    vaDestroyContext(s->va_dpy,s->context_id);
+    vaDestroyConfig(s->va_dpy,s->config_id);
 
     return 0;
 }
 
-static int deinit_va()
+static int deinit_va(void)
 { 
-    vaTerminate(va_dpy);
+    unsigned int i;
 
-    va_close_display(va_dpy);
+    /* the X11 backend keeps one connection only, close it last */
+    for (i = 0; i < display_num; i++)
+        vaTerminate(va_displays[i]);
+    for (i = 0; i < display_num; i++)
+        va_close_display(va_displays[i]);
 
     return 0;
 }
@@ -2069,10 +3289,17 @@ static int print_input()
            frame_width, frame_height, frame_count);
     printf("INPUT: FrameRate    : %d\n", frame_rate);
     printf("INPUT: Bitrate      : %d\n", frame_bitrate);
-    printf("INPUT: Slieces      : %d\n", frame_slices);
+    if (frame_slice_mbs)
+        printf("INPUT: Slices       : %d MBs per slice\n", frame_slice_mbs);
+    else
+        printf("INPUT: Slices       : %d\n", frame_slices);
     printf("INPUT: IntraPeriod  : %d\n", intra_period);
     printf("INPUT: IDRPeriod    : %d\n", intra_idr_period);
     printf("INPUT: IpPeriod     : %d\n", ip_period);
+    if (lookahead_depth)
+        printf("INPUT: Lookahead    : %d frames, scene cut at %d\n", lookahead_depth, scenecut_threshold);
+    if (dirty_rect_mode)
+        printf("INPUT: Dirty rects  : %dx%d blocks\n", DIRTY_BLOCK, DIRTY_BLOCK);
     printf("INPUT: Initial QP   : %d\n", initial_qp);
     printf("INPUT: Min QP       : %d\n", minimal_qp);
     printf("INPUT: Source YUV   : %s", srcyuv_fp?"FILE":"AUTO generated");
@@ -2080,8 +3307,10 @@ static int print_input()
         printf(":%s (fourcc %s)\n", srcyuv_fn, fourcc_to_string(srcyuv_fourcc));
     else
         printf("\n");
+    if (stream_num > 1)
+        printf("INPUT: Streams      : %d on %d display(s)\n", stream_num, display_num);
     printf("INPUT: Coded Clip   : %s\n", coded_fn);
-    if (recyuv_fp == NULL)
+    if (recyuv_fn == NULL)
         printf("INPUT: Rec   Clip   : %s\n", "Not save reconstructed frame");
     else
         printf("INPUT: Rec   Clip   : Save reconstructed frame into %s (fourcc %s)\n", recyuv_fn,
@@ -2092,87 +3321,487 @@ static int print_input()
     return 0;
 }
 
-static int calc_PSNR(double *psnr)
+/*
+ * Quality engine: the frames of srcyuv/recyuv are handed out to a pool
+ * of workers, each one computes the SSE (and the SSIM) of the Y/U/V
+ * planes of its frame
+ */
+static void quality_planes(struct quality_plane_t plane[QUALITY_PLANES])
 {
-    char *srcyuv_ptr = NULL, *recyuv_ptr = NULL, tmp;
-    unsigned long long min_size;
-    unsigned long long i, sse=0;
-    double ssemean;
-    int fourM = 0x400000; /* 4M */
+    unsigned int luma_size = frame_width * frame_height;
+    unsigned int chroma_size = (frame_width/2) * (frame_height/2);
+    int i;
 
-    min_size = MIN(srcyuv_frames, frame_count) * frame_width * frame_height * 1.5;
-    for (i=0; i<min_size; i++) {
-        unsigned long long j = i % fourM;
-        
-        if ((i % fourM) == 0) {
-            if (srcyuv_ptr)
-                munmap(srcyuv_ptr, fourM);
-            if (recyuv_ptr)
-                munmap(recyuv_ptr, fourM);
-
-            srcyuv_ptr = mmap64(0, fourM, PROT_READ, MAP_SHARED, fileno(srcyuv_fp), (off64_t)i);
-            recyuv_ptr = mmap64(0, fourM, PROT_READ, MAP_SHARED, fileno(recyuv_fp), (off64_t)i);
-            if ((srcyuv_ptr == MAP_FAILED) || (recyuv_ptr == MAP_FAILED)) {
-                printf("Failed to mmap YUV files\n");
-                return 1;
+    plane[0].offset = 0;
+    plane[0].width = frame_width;
+    plane[0].height = frame_height;
+    plane[0].stride = frame_width;
+    plane[0].step = 1;
+    for (i = 1; i < QUALITY_PLANES; i++) {
+        plane[i].width = frame_width / 2;
+        plane[i].height = frame_height / 2;
+        plane[i].stride = frame_width / 2;
+        plane[i].step = 1;
+    }
+
+    if (srcyuv_fourcc == VA_FOURCC_NV12) {
+        plane[1].offset = luma_size;
+        plane[2].offset = luma_size + 1;
+        plane[1].stride = plane[2].stride = frame_width;
+        plane[1].step = plane[2].step = 2;
+    } else if (srcyuv_fourcc == VA_FOURCC_IYUV) {
+        plane[1].offset = luma_size;
+        plane[2].offset = luma_size + chroma_size;
+    } else { /* YV12 */
+        plane[2].offset = luma_size;
+        plane[1].offset = luma_size + chroma_size;
+    }
+}
+
+/* sum of squared errors of a planar plane */
+static unsigned long long quality_sse_plane(const unsigned char *src, const unsigned char *rec,
+                                            int width, int height, int stride)
+{
+    unsigned long long sse = 0;
+    int x, y;
+
+    for (y = 0; y < height; y++, src += stride, rec += stride) {
+        x = 0;
+#ifdef __SSE2__
+        {
+            __m128i zero = _mm_setzero_si128();
+            __m128i sum = _mm_setzero_si128();
+
+            /* a row of 8K samples is at most 512 * 4 * 255^2 per lane */
+            for (; x + 16 <= width; x += 16) {
+                __m128i a = _mm_loadu_si128((const __m128i *)(src + x));
+                __m128i b = _mm_loadu_si128((const __m128i *)(rec + x));
+                __m128i d0 = _mm_sub_epi16(_mm_unpacklo_epi8(a, zero), _mm_unpacklo_epi8(b, zero));
+                __m128i d1 = _mm_sub_epi16(_mm_unpackhi_epi8(a, zero), _mm_unpackhi_epi8(b, zero));
+
+                sum = _mm_add_epi32(sum, _mm_madd_epi16(d0, d0));
+                sum = _mm_add_epi32(sum, _mm_madd_epi16(d1, d1));
             }
+            sse += quality_hsum_epu32(sum);
+        }
+#endif
+        for (; x < width; x++) {
+            int d = src[x] - rec[x];
+            sse += d * d;
         }
-        tmp = srcyuv_ptr[j] - recyuv_ptr[j];
-        sse += tmp * tmp;
     }
-    ssemean = (double)sse/(double)min_size;
-    *psnr = 20.0*log10(255) - 10.0*log10(ssemean);
 
-    if (srcyuv_ptr)
-        munmap(srcyuv_ptr, fourM);
-    if (recyuv_ptr)
-        munmap(recyuv_ptr, fourM);
-    
+    return sse;
+}
+
+/* sum of squared errors of the U and V samples of an interleaved plane */
+static void quality_sse_plane_uv(const unsigned char *src, const unsigned char *rec,
+                                 int width, int height, int stride,
+                                 unsigned long long *sse_u, unsigned long long *sse_v)
+{
+    unsigned long long u = 0, v = 0;
+    int x, y;
+
+    for (y = 0; y < height; y++, src += stride, rec += stride) {
+        x = 0;
+#ifdef __SSE2__
+        {
+            __m128i mask = _mm_set1_epi16(0x00ff);
+            __m128i sum_u = _mm_setzero_si128();
+            __m128i sum_v = _mm_setzero_si128();
+
+            for (; x + 8 <= width; x += 8) {
+                __m128i a = _mm_loadu_si128((const __m128i *)(src + 2 * x));
+                __m128i b = _mm_loadu_si128((const __m128i *)(rec + 2 * x));
+                __m128i du = _mm_sub_epi16(_mm_and_si128(a, mask), _mm_and_si128(b, mask));
+                __m128i dv = _mm_sub_epi16(_mm_srli_epi16(a, 8), _mm_srli_epi16(b, 8));
+
+                sum_u = _mm_add_epi32(sum_u, _mm_madd_epi16(du, du));
+                sum_v = _mm_add_epi32(sum_v, _mm_madd_epi16(dv, dv));
+            }
+            u += quality_hsum_epu32(sum_u);
+            v += quality_hsum_epu32(sum_v);
+        }
+#endif
+        for (; x < width; x++) {
+            int du = src[2 * x] - rec[2 * x];
+            int dv = src[2 * x + 1] - rec[2 * x + 1];
+
+            u += du * du;
+            v += dv * dv;
+        }
+    }
+
+    *sse_u = u;
+    *sse_v = v;
+}
+
+/* sums of a 4x4 block: src, rec, src^2 + rec^2, src * rec */
+static void quality_ssim_4x4(const unsigned char *src, const unsigned char *rec,
+                             int stride, int step, int sums[4])
+{
+    int s1 = 0, s2 = 0, ss = 0, s12 = 0;
+    int x, y;
+
+    for (y = 0; y < 4; y++, src += stride, rec += stride) {
+        for (x = 0; x < 4 * step; x += step) {
+            int a = src[x], b = rec[x];
+
+            s1 += a;
+            s2 += b;
+            ss += a * a + b * b;
+            s12 += a * b;
+        }
+    }
+    sums[0] = s1;
+    sums[1] = s2;
+    sums[2] = ss;
+    sums[3] = s12;
+}
+
+/* SSIM of an 8x8 window from the sums of its four 4x4 blocks */
+static double quality_ssim_end(int s1, int s2, int ss, int s12)
+{
+    static const int ssim_c1 = (int)(.01*.01*255*255*64 + .5);
+    static const int ssim_c2 = (int)(.03*.03*255*255*64*63 + .5);
+    int vars = ss * 64 - s1 * s1 - s2 * s2;
+    int covar = s12 * 64 - s1 * s2;
+
+    return (double)(2 * s1 * s2 + ssim_c1) * (double)(2 * covar + ssim_c2) /
+        ((double)(s1 * s1 + s2 * s2 + ssim_c1) * (double)(vars + ssim_c2));
+}
+
+/*
+ * mean SSIM over 8x8 windows overlapping by 4 samples, the 4x4 block
+ * sums of two block rows are kept in scratch
+ */
+static double quality_ssim_plane(const unsigned char *src, const unsigned char *rec,
+                                 int width, int height, int stride, int step,
+                                 int (*scratch)[4])
+{
+    int blocks_w = width / 4, blocks_h = height / 4;
+    int (*sums[2])[4] = { scratch, scratch + blocks_w };
+    unsigned long long count = 0;
+    double ssim = 0;
+    int bx, by;
+
+    if (blocks_w < 2 || blocks_h < 2)
+        return 1.0;
+
+    for (by = 0; by < blocks_h; by++) {
+        int (*cur)[4] = sums[by & 1], (*prev)[4] = sums[(by + 1) & 1];
+
+        for (bx = 0; bx < blocks_w; bx++)
+            quality_ssim_4x4(src + 4 * by * stride + 4 * bx * step,
+                             rec + 4 * by * stride + 4 * bx * step,
+                             stride, step, cur[bx]);
+        if (by == 0)
+            continue;
+
+        for (bx = 0; bx < blocks_w - 1; bx++) {
+            ssim += quality_ssim_end(
+                prev[bx][0] + prev[bx + 1][0] + cur[bx][0] + cur[bx + 1][0],
+                prev[bx][1] + prev[bx + 1][1] + cur[bx][1] + cur[bx + 1][1],
+                prev[bx][2] + prev[bx + 1][2] + cur[bx][2] + cur[bx + 1][2],
+                prev[bx][3] + prev[bx + 1][3] + cur[bx][3] + cur[bx + 1][3]);
+            count++;
+        }
+    }
+
+    return ssim / count;
+}
+
+static unsigned char *quality_map_frame(FILE *fp, unsigned long long frame_start,
+                                        char **mmap_ptr, unsigned int *mmap_size)
+{
+    unsigned long long frame_size = frame_width * frame_height * 3 / 2;
+    unsigned long long mmap_start = frame_start & (~0xfff);
+
+    *mmap_size = (frame_size + (frame_start & 0xfff) + 0xfff) & (~0xfff);
+    *mmap_ptr = mmap64(0, *mmap_size, PROT_READ, MAP_SHARED, fileno(fp), (off64_t)mmap_start);
+    if (*mmap_ptr == MAP_FAILED)
+        return NULL;
+
+    return (unsigned char *)*mmap_ptr + (frame_start & 0xfff);
+}
+
+static int quality_frame(struct encode_session *s, unsigned long long frame, struct quality_plane_t plane[QUALITY_PLANES],
+                         int (*scratch)[4], struct frame_quality_t *quality)
+{
+    unsigned char *src, *rec;
+    char *src_mmap, *rec_mmap;
+    unsigned int src_size, rec_size;
+    int i;
+
+    src = quality_map_frame(srcyuv_fp, srcyuv_offset(frame), &src_mmap, &src_size);
+    rec = quality_map_frame(s->recyuv_fp, frame * (frame_width * frame_height * 3 / 2), &rec_mmap, &rec_size);
+    if (src == NULL || rec == NULL) {
+        printf("Failed to mmap YUV files (%s)\n", strerror(errno));
+        if (src)
+            munmap(src_mmap, src_size);
+        if (rec)
+            munmap(rec_mmap, rec_size);
+        return 1;
+    }
+
+    quality->sse[0] = quality_sse_plane(src, rec, plane[0].width, plane[0].height, plane[0].stride);
+    if (plane[1].step == 2)
+        quality_sse_plane_uv(src + plane[1].offset, rec + plane[1].offset,
+                             plane[1].width, plane[1].height, plane[1].stride,
+                             &quality->sse[1], &quality->sse[2]);
+    else
+        for (i = 1; i < QUALITY_PLANES; i++)
+            quality->sse[i] = quality_sse_plane(src + plane[i].offset, rec + plane[i].offset,
+                                                plane[i].width, plane[i].height, plane[i].stride);
+
+    for (i = 0; calc_ssim && i < QUALITY_PLANES; i++)
+        quality->ssim[i] = quality_ssim_plane(src + plane[i].offset, rec + plane[i].offset,
+                                              plane[i].width, plane[i].height,
+                                              plane[i].stride, plane[i].step, scratch);
+
+    munmap(src_mmap, src_size);
+    munmap(rec_mmap, rec_size);
+
     return 0;
 }
 
-static int print_performance(unsigned int PictureCount)
+static void * quality_thread(void *t)
 {
-    unsigned int psnr_ret = 1, others = 0;
-    double psnr = 0, total_size = frame_width * frame_height * 1.5 * frame_count;
+    struct encode_session *s = t;
+    struct quality_plane_t plane[QUALITY_PLANES];
+    int (*scratch)[4];
+
+    quality_planes(plane);
+    scratch = calloc(2 * (frame_width / 4 + 1), sizeof(*scratch));
+    if (scratch == NULL) {
+        /* the frames of this worker would be left at 0 SSE */
+        pthread_mutex_lock(&s->quality_mutex);
+        s->quality_failed = 1;
+        pthread_mutex_unlock(&s->quality_mutex);
+        return NULL;
+    }
+
+    while (1) {
+        unsigned long long frame;
+        int failed;
+
+        pthread_mutex_lock(&s->quality_mutex);
+        frame = s->quality_next_frame++;
+        failed = s->quality_failed;
+        pthread_mutex_unlock(&s->quality_mutex);
+
+        if (frame >= s->quality_frames || failed)
+            break;
+
+        if (quality_frame(s, frame, plane, scratch, &s->frame_quality[frame])) {
+            pthread_mutex_lock(&s->quality_mutex);
+            s->quality_failed = 1;
+            pthread_mutex_unlock(&s->quality_mutex);
+        }
+    }
+
+    free(scratch);
+    return NULL;
+}
+
+static double sse_to_psnr(unsigned long long sse, unsigned long long samples)
+{
+    double ssemean = (double)sse / (double)samples;
 
-    if (calc_psnr && srcyuv_fp && recyuv_fp)
-        psnr_ret = calc_PSNR(&psnr);
+    if (sse == 0)
+        return QUALITY_MAX_PSNR;
+    return MIN(QUALITY_MAX_PSNR, 20.0*log10(255) - 10.0*log10(ssemean));
+}
+
+static int save_quality_csv(struct encode_session *s)
+{
+    unsigned long long samples[QUALITY_PLANES], frame;
+    unsigned long long luma_size = frame_width * frame_height;
+    FILE *csv_fp;
+
+    csv_fp = fopen(s->quality_csv_fn, "w");
+    if (csv_fp == NULL) {
+        printf("Open quality CSV file %s failed\n", s->quality_csv_fn);
+        return 1;
+    }
+
+    samples[0] = luma_size;
+    samples[1] = samples[2] = (frame_width/2) * (frame_height/2);
+
+    fprintf(csv_fp, "frame,psnr_y,psnr_u,psnr_v,psnr");
+    if (calc_ssim)
+        fprintf(csv_fp, ",ssim_y,ssim_u,ssim_v,ssim");
+    fprintf(csv_fp, "\n");
+
+    for (frame = 0; frame < s->quality_frames; frame++) {
+        struct frame_quality_t *quality = &s->frame_quality[frame];
+
+        fprintf(csv_fp, "%llu,%.4f,%.4f,%.4f,%.4f", frame,
+                sse_to_psnr(quality->sse[0], samples[0]),
+                sse_to_psnr(quality->sse[1], samples[1]),
+                sse_to_psnr(quality->sse[2], samples[2]),
+                sse_to_psnr(quality->sse[0] + quality->sse[1] + quality->sse[2],
+                            samples[0] + samples[1] + samples[2]));
+        if (calc_ssim)
+            fprintf(csv_fp, ",%.6f,%.6f,%.6f,%.6f",
+                    quality->ssim[0], quality->ssim[1], quality->ssim[2],
+                    (4 * quality->ssim[0] + quality->ssim[1] + quality->ssim[2]) / 6);
+        fprintf(csv_fp, "\n");
+    }
+
+    fclose(csv_fp);
+
+    return 0;
+}
+
+/*
+ * psnr/ssim are per plane (Y/U/V) plus the whole frame in the last
+ * entry, PSNR from the SSE of all frames, SSIM averaged over frames
+ */
+static int calc_quality(struct encode_session *s, double psnr[QUALITY_PLANES + 1], double ssim[QUALITY_PLANES + 1])
+{
+    unsigned long long sse[QUALITY_PLANES] = {0}, samples[QUALITY_PLANES];
+    unsigned long long frame;
+    pthread_t *threads;
+    int i, threads_num = quality_threads;
+
+    s->quality_frames = MIN(srcyuv_frames, frame_count);
+    if (s->quality_frames == 0)
+        return 1;
+
+    if (threads_num <= 0)
+        threads_num = sysconf(_SC_NPROCESSORS_ONLN);
+    threads_num = MAX(1, MIN(threads_num, s->quality_frames));
+
+    s->frame_quality = calloc(s->quality_frames, sizeof(*s->frame_quality));
+    threads = calloc(threads_num, sizeof(*threads));
+    if (s->frame_quality == NULL || threads == NULL) {
+        printf("Failed to allocate memory for PSNR/SSIM\n");
+        free(threads);
+        return 1;
+    }
+
+    /* recyuv is written through stdio */
+    fflush(s->recyuv_fp);
+
+    for (i = 0; i < threads_num; i++)
+        pthread_create(&threads[i], NULL, quality_thread, s);
+    for (i = 0; i < threads_num; i++)
+        pthread_join(threads[i], NULL);
+    free(threads);
+
+    if (s->quality_failed) {
+        printf("Failed to calculate PSNR/SSIM\n");
+        return 1;
+    }
+
+    samples[0] = frame_width * frame_height * s->quality_frames;
+    samples[1] = samples[2] = (frame_width/2) * (frame_height/2) * s->quality_frames;
+    for (i = 0; i <= QUALITY_PLANES; i++)
+        ssim[i] = 0;
+    for (frame = 0; frame < s->quality_frames; frame++) {
+        for (i = 0; i < QUALITY_PLANES; i++) {
+            sse[i] += s->frame_quality[frame].sse[i];
+            ssim[i] += s->frame_quality[frame].ssim[i] / s->quality_frames;
+        }
+    }
+    for (i = 0; i < QUALITY_PLANES; i++)
+        psnr[i] = sse_to_psnr(sse[i], samples[i]);
+    psnr[QUALITY_PLANES] = sse_to_psnr(sse[0] + sse[1] + sse[2],
+                                       samples[0] + samples[1] + samples[2]);
+    ssim[QUALITY_PLANES] = (4 * ssim[0] + ssim[1] + ssim[2]) / 6;
+
+    if (s->quality_csv_fn)
+        save_quality_csv(s);
+
+    return 0;
+}
+
+static int print_performance(struct encode_session *s, unsigned int PictureCount)
+{
+    unsigned int psnr_ret = 1, others = 0, i;
+    double psnr[QUALITY_PLANES + 1], ssim[QUALITY_PLANES + 1];
+    double total_size = frame_width * frame_height * 1.5 * frame_count;
+
+    if (calc_psnr && srcyuv_fp && s->recyuv_fp)
+        psnr_ret = calc_quality(s, psnr, ssim);
     
-    others = TotalTicks - UploadPictureTicks - BeginPictureTicks
-        - RenderPictureTicks - EndPictureTicks - SyncPictureTicks - SavePictureTicks;
+    others = s->TotalTicks - s->UploadPictureTicks - s->BeginPictureTicks
+        - s->RenderPictureTicks - s->EndPictureTicks - s->SyncPictureTicks - s->SavePictureTicks;
 
     printf("\n\n");
 
+    if (stream_num > 1)
+        printf("PERFORMANCE: Stream %d (%s)\n", s->index, s->coded_fn);
     printf("PERFORMANCE:   Frame Rate           : %.2f fps (%d frames, %d ms (%.2f ms per frame))\n",
-           (double) 1000*PictureCount / TotalTicks, PictureCount,
-           TotalTicks, ((double)  TotalTicks) / (double) PictureCount);
-    printf("PERFORMANCE:   Compression ratio    : %d:1\n", (unsigned int)(total_size / frame_size));
-    if (psnr_ret == 0)
-        printf("PERFORMANCE:   PSNR                 : %.2f (%lld frames calculated)\n",
-               psnr, MIN(frame_count, srcyuv_frames));
+           (double) 1000*PictureCount / s->TotalTicks, PictureCount,
+           s->TotalTicks, ((double)  s->TotalTicks) / (double) PictureCount);
+    printf("PERFORMANCE:   Compression ratio    : %d:1\n", (unsigned int)(total_size / s->frame_size));
+    if (psnr_ret == 0) {
+        printf("PERFORMANCE:   PSNR                 : %.2f (Y %.2f, U %.2f, V %.2f, %lld frames calculated)\n",
+               psnr[QUALITY_PLANES], psnr[0], psnr[1], psnr[2], s->quality_frames);
+        if (calc_ssim)
+            printf("PERFORMANCE:   SSIM                 : %.4f (Y %.4f, U %.4f, V %.4f)\n",
+                   ssim[QUALITY_PLANES], ssim[0], ssim[1], ssim[2]);
+    }
 
     printf("PERFORMANCE:     UploadPicture      : %d ms (%.2f, %.2f%% percent)\n",
-           (int) UploadPictureTicks, ((double)  UploadPictureTicks) / (double) PictureCount,
-           UploadPictureTicks/(double) TotalTicks/0.01);
+           (int) s->UploadPictureTicks, ((double)  s->UploadPictureTicks) / (double) PictureCount,
+           s->UploadPictureTicks/(double) s->TotalTicks/0.01);
     printf("PERFORMANCE:     vaBeginPicture     : %d ms (%.2f, %.2f%% percent)\n",
-           (int) BeginPictureTicks, ((double)  BeginPictureTicks) / (double) PictureCount,
-           BeginPictureTicks/(double) TotalTicks/0.01);
+           (int) s->BeginPictureTicks, ((double)  s->BeginPictureTicks) / (double) PictureCount,
+           s->BeginPictureTicks/(double) s->TotalTicks/0.01);
     printf("PERFORMANCE:     vaRenderHeader     : %d ms (%.2f, %.2f%% percent)\n",
-           (int) RenderPictureTicks, ((double)  RenderPictureTicks) / (double) PictureCount,
-           RenderPictureTicks/(double) TotalTicks/0.01);
+           (int) s->RenderPictureTicks, ((double)  s->RenderPictureTicks) / (double) PictureCount,
+           s->RenderPictureTicks/(double) s->TotalTicks/0.01);
     printf("PERFORMANCE:     vaEndPicture       : %d ms (%.2f, %.2f%% percent)\n",
-           (int) EndPictureTicks, ((double)  EndPictureTicks) / (double) PictureCount,
-           EndPictureTicks/(double) TotalTicks/0.01);
+           (int) s->EndPictureTicks, ((double)  s->EndPictureTicks) / (double) PictureCount,
+           s->EndPictureTicks/(double) s->TotalTicks/0.01);
     printf("PERFORMANCE:     vaSyncSurface      : %d ms (%.2f, %.2f%% percent)\n",
-           (int) SyncPictureTicks, ((double) SyncPictureTicks) / (double) PictureCount,
-           SyncPictureTicks/(double) TotalTicks/0.01);
+           (int) s->SyncPictureTicks, ((double) s->SyncPictureTicks) / (double) PictureCount,
+           s->SyncPictureTicks/(double) s->TotalTicks/0.01);
     printf("PERFORMANCE:     SavePicture        : %d ms (%.2f, %.2f%% percent)\n",
-           (int) SavePictureTicks, ((double)  SavePictureTicks) / (double) PictureCount,
-           SavePictureTicks/(double) TotalTicks/0.01);
+           (int) s->SavePictureTicks, ((double)  s->SavePictureTicks) / (double) PictureCount,
+           s->SavePictureTicks/(double) s->TotalTicks/0.01);
     printf("PERFORMANCE:     Others             : %d ms (%.2f, %.2f%% percent)\n",
            (int) others, ((double) others) / (double) PictureCount,
-           others/(double) TotalTicks/0.01);
+           others/(double) s->TotalTicks/0.01);
+
+    for (i = 0; s->frame_slices > 1 && i < s->frame_slices; i++)
+        printf("PERFORMANCE:   Slice %3d (%5d MBs) : %.0f bytes average, %d bytes max\n",
+               i, s->slice_mb_start[i + 1] - s->slice_mb_start[i],
+               (double) s->slice_coded_bytes[i] / PictureCount, s->slice_coded_max[i]);
+
+    if (s->StorageTasks) {
+        printf("PERFORMANCE:   Frame latency        : %.2f ms average, %.2f ms max\n",
+               s->FrameLatencyUs / 1000.0 / s->StorageTasks, s->FrameLatencyMaxUs / 1000.0);
+        printf("PERFORMANCE:   Storage queue wait   : %.2f ms average, %.2f ms max\n",
+               s->StorageWaitUs / 1000.0 / s->StorageTasks, s->StorageWaitMaxUs / 1000.0);
+        printf("PERFORMANCE:   Storage service time : %.2f ms average, %.2f ms max\n",
+               s->StorageServiceUs / 1000.0 / s->StorageTasks, s->StorageServiceMaxUs / 1000.0);
+    }
+
+    if (lookahead_depth)
+        printf("PERFORMANCE:   Lookahead            : %d scene cuts, %d IDR/%d I frames, %d intra periods stretched, %.2f ms waited\n",
+               s->LookaheadSceneCuts, s->LookaheadIDR, s->LookaheadI, s->LookaheadPostponed,
+               s->LookaheadWaitUs / 1000.0);
+
+    if (dirty_rect_mode && s->DirtyBlocksTotal) {
+        printf("PERFORMANCE:   Changed blocks       : %.2f%% (%lld of %lld in P/B frames)\n",
+               100.0 * s->DirtyBlocks / s->DirtyBlocksTotal, s->DirtyBlocks, s->DirtyBlocksTotal);
+        if (s->DirtyFrames && s->FullFrames) {
+            double dirty_ms = s->DirtyLatencyUs / 1000.0 / s->DirtyFrames;
+            double full_ms = s->FullLatencyUs / 1000.0 / s->FullFrames;
+
+            printf("PERFORMANCE:   Dirty ROI frames     : %lld, %.2f rectangles, %.2f ms vs. %.2f ms coded in full (%.2f ms saved per frame)\n",
+                   s->DirtyFrames, (double)s->DirtyRects / s->DirtyFrames, dirty_ms, full_ms, full_ms - dirty_ms);
+        }
+    }
+
+    if (s->h264_packedheader)
+        printf("PERFORMANCE:   Packed SPS/PPS/SEI   : %d/%d/%d built, %d/%d/%d reused\n",
+               s->packed_sps.num_builds, s->packed_pps.num_builds, s->packed_sei.num_builds,
+               s->packed_sps.num_reuses, s->packed_pps.num_reuses, s->packed_sei.num_reuses);
 
     if (encode_syncmode == 0)
         printf("(Multithread enabled, the timing is only for reference)\n");
@@ -2181,9 +3810,108 @@ static int print_performance(unsigned int PictureCount)
 }
 
 
+/* stream i of --streams N writes <filename>.i */
+static char *session_filename(const char *fn, unsigned int index)
+{
+    char *name;
+
+    if (fn == NULL)
+        return NULL;
+    if (stream_num == 1)
+        return strdup(fn);
+
+    name = malloc(strlen(fn) + 16);
+    if (name)
+        sprintf(name, "%s.%d", fn, index);
+    return name;
+}
+
+static int open_displays(void)
+{
+    int major_ver, minor_ver;
+    VAStatus va_status;
+    unsigned int i;
+
+    for (i = 0; i < display_num; i++) {
+        va_displays[i] = va_open_display();
+        va_status = vaInitialize(va_displays[i], &major_ver, &minor_ver);
+        CHECK_VASTATUS(va_status, "vaInitialize");
+    }
+
+    return 0;
+}
+
+static struct encode_session *create_session(unsigned int index)
+{
+    struct encode_session *s;
+    unsigned int i;
+
+    s = calloc(1, sizeof(*s));
+    if (s == NULL) {
+        printf("Failed to allocate encode session %d\n", index);
+        exit(1);
+    }
+
+    s->index = index;
+    s->va_dpy = va_displays[index % display_num];
+    s->h264_profile = h264_profile;
+    s->h264_entropy_mode = h264_entropy_mode;
+    s->h264_maxref = (1<<16|1);
+    s->frame_slices = frame_slices;
+
+    packed_header_init(&s->packed_sps, VAEncPackedHeaderSequence);
+    packed_header_init(&s->packed_pps, VAEncPackedHeaderPicture);
+    packed_header_init(&s->packed_sei, VAEncPackedHeaderH264_SEI);
+
+    pthread_mutex_init(&s->encode_mutex, NULL);
+    pthread_cond_init(&s->encode_cond, NULL);
+    pthread_cond_init(&s->storage_save_cond, NULL);
+    pthread_mutex_init(&s->recyuv_mutex, NULL);
+    pthread_mutex_init(&s->quality_mutex, NULL);
+    pthread_mutex_init(&s->lookahead_mutex, NULL);
+    pthread_cond_init(&s->lookahead_cond, NULL);
+    for (i = 0; i < SURFACE_NUM_MAX; i++)
+        pthread_cond_init(&s->srcsurface_cond[i], NULL);
+
+    s->coded_fn = session_filename(coded_fn, index);
+    s->recyuv_fn = session_filename(recyuv_fn, index);
+    s->quality_csv_fn = session_filename(quality_csv_fn, index);
+
+    /* open reconstructed YUV file */
+    if (s->recyuv_fn) {
+        s->recyuv_fp = fopen(s->recyuv_fn,"w+");
+    
+        if (s->recyuv_fp == NULL)
+            printf("Open reconstructed YUV file %s failed\n", s->recyuv_fn);
+    }
+
+    /* store coded data into a file, stdout or a socket */
+    if (coded_sink_open(&s->coded_sink, s->coded_fn)) {
+        printf("Open %s failed (%s), exit\n", s->coded_fn, strerror(errno));
+        exit(1);
+    }
+
+    return s;
+}
+
+static void * session_thread(void *t)
+{
+    struct encode_session *s = t;
+    unsigned int start = GetTickCount();
+
+    setup_encode(s);
+    encode_frames(s);
+    release_encode(s);
+
+    s->TotalTicks += GetTickCount() - start;
+
+    return NULL;
+}
+
 int main(int argc,char **argv)
 {
-    unsigned int start;
+    unsigned int start, i, total_ticks;
+    double fps = 0;
     
     process_cmdline(argc, argv);
 
@@ -2191,16 +3919,50 @@ int main(int argc,char **argv)
     
     start = GetTickCount();
     
-    init_va();
-    setup_encode();
+    open_displays();
+    for (i = 0; i < stream_num; i++) {
+        sessions[i] = create_session(i);
+        init_va(sessions[i]);
+    }
     
-    encode_frames();
+    /* one thread per stream, a single stream is encoded in place */
+    if (stream_num == 1)
+        session_thread(sessions[0]);
+    else {
+        for (i = 0; i < stream_num; i++)
+            pthread_create(&sessions[i]->thread, NULL, session_thread, sessions[i]);
+        for (i = 0; i < stream_num; i++)
+            pthread_join(sessions[i]->thread, NULL);
+    }
 
-    release_encode();
     deinit_va();
 
-    TotalTicks += GetTickCount() - start;
-    print_performance(frame_count);
+    if (srcyuv_map)
+        munmap(srcyuv_map, srcyuv_map_size);
+    if (srcyuv_stream)
+        yuv_input_close(&srcyuv_input);
+
+    total_ticks = GetTickCount() - start;
+    for (i = 0; i < stream_num; i++) {
+        struct encode_session *s = sessions[i];
+
+        /* the session setup before the encode thread counts for a single stream */
+        if (stream_num == 1)
+            s->TotalTicks = total_ticks;
+        print_performance(s, frame_count);
+        fps += (double) 1000 * frame_count / s->TotalTicks;
+
+        coded_sink_close(&s->coded_sink);
+        if (s->recyuv_fp)
+            fclose(s->recyuv_fp);
+        free(s->frame_quality);
+        s->frame_quality = NULL;
+    }
+
+    if (stream_num > 1)
+        printf("\nPERFORMANCE: All %d streams         : %.2f fps aggregate (%d frames, %d ms wall clock, %.2f fps)\n",
+               stream_num, fps, stream_num * frame_count, total_ticks,
+               (double) 1000 * stream_num * frame_count / total_ticks);
     
     return 0;
 }
@@ -49,6 +49,8 @@
 #include <va/va_enc_jpeg.h>
 #include "va_display.h"
 #include "jpegenc_utils.h"
+#include "../coded_sink.h"
+#include "../yuv_input.h"
 
 #ifndef VA_FOURCC_I420
 #define VA_FOURCC_I420          0x30323449
@@ -63,8 +65,9 @@
 
 void show_help()
 {
-    printf("Usage: ./jpegenc <width> <height> <input file> <output file> <fourcc value 0(I420)/1(NV12)/2(UYVY)/3(YUY2)/4(Y8)/5(RGBA)> q <quality>\n");
+    printf("Usage: ./jpegenc <width> <height> <input file(- for stdin)> <output file(- for stdout, unix:<path> for a Unix socket)> <fourcc value 0(I420)/1(NV12)/2(UYVY)/3(YUY2)/4(Y8)/5(RGBA)> q <quality>\n");
     printf("Currently supporting only I420/NV12/UYVY/YUY2/Y8 input file formats.\n");
+    printf("A Y4M input file gives the width/height and is read as I420.\n");
     printf("Example: ./jpegenc 1024 768 input_file.yuv output.jpeg 0 50\n\n");
     return;
 }
@@ -456,38 +459,31 @@ int build_packed_jpeg_header_buffer(unsigned char **header_buffer, YUVComponentS
     return bs.bit_offset;
 }
 
-//Upload the yuv image from the file to the VASurface
-void upload_yuv_to_surface(VADisplay va_dpy, FILE *yuv_fp, VASurfaceID surface_id, YUVComponentSpecs yuvComp, int picture_width, int picture_height, int frame_size)
+//Upload the yuv image read from the input to the VASurface
+void upload_yuv_to_surface(VADisplay va_dpy, const unsigned char *frame, VASurfaceID surface_id, YUVComponentSpecs yuvComp, int picture_width, int picture_height, int frame_size)
 {
 
     VAImage surface_image;
     VAStatus va_status;
     void *surface_p = NULL;
-    unsigned char newImageBuffer[frame_size];
-    unsigned char *y_src, *u_src, *v_src;
+    const unsigned char *y_src, *u_src, *v_src;
     unsigned char *y_dst, *u_dst;
     int y_size = picture_width * picture_height;
     int u_size = 0;
     int row, col;
-    size_t n_items;
 
     //u_size is used for I420, NV12 formats only
     u_size = ((picture_width >> 1) * (picture_height >> 1));
 
-    memset(newImageBuffer,0,frame_size);
-    do {
-        n_items = fread(newImageBuffer, frame_size, 1, yuv_fp);
-    } while (n_items != 1);
-
     va_status = vaDeriveImage(va_dpy, surface_id, &surface_image);
     CHECK_VASTATUS(va_status,"vaDeriveImage");
 
     vaMapBuffer(va_dpy, surface_image.buf, &surface_p);
     assert(VA_STATUS_SUCCESS == va_status);
 
-    y_src = newImageBuffer;
-    u_src = newImageBuffer + y_size; /* UV offset for NV12 */
-    v_src = newImageBuffer + y_size + u_size;
+    y_src = frame;
+    u_src = frame + y_size; /* UV offset for NV12 */
+    v_src = frame + y_size + u_size;
 
     y_dst = surface_p + surface_image.offsets[0];
     u_dst = surface_p + surface_image.offsets[1]; /* UV offset for NV12 */
@@ -640,7 +636,7 @@ void init_yuv_component(YUVComponentSpecs *yuvComponent, int yuv_type, int *surf
     
 }
 
-int encode_input_image(FILE *yuv_fp, FILE *jpeg_fp, int picture_width, int picture_height, int frame_size, int yuv_type, int quality)
+int encode_input_image(const unsigned char *frame, struct coded_sink *jpeg_sink, int picture_width, int picture_height, int frame_size, int yuv_type, int quality)
 {
     int num_entrypoints,enc_entrypoint;
     int major_ver, minor_ver;
@@ -728,7 +724,7 @@ int encode_input_image(FILE *yuv_fp, FILE *jpeg_fp, int picture_width, int pictu
     CHECK_VASTATUS(va_status, "vaCreateSurfaces");
     
     //Map the input yuv file to the input surface created with the surface_id
-    upload_yuv_to_surface(va_dpy, yuv_fp, surface_id, yuvComponent, picture_width, picture_height, frame_size);
+    upload_yuv_to_surface(va_dpy, frame, surface_id, yuvComponent, picture_width, picture_height, frame_size);
     
     /* 6. Create Context for the encode pipe*/
     va_status = vaCreateContext(va_dpy, config_id, picture_width, picture_height, 
@@ -826,10 +822,7 @@ int encode_input_image(FILE *yuv_fp, FILE *jpeg_fp, int picture_width, int pictu
 
     if (writeToFile) {
         VASurfaceStatus surface_status;
-        size_t w_items;
         VACodedBufferSegment *coded_buffer_segment;
-        unsigned char *coded_mem;
-        int slice_data_length;
 
         va_status = vaSyncSurface(va_dpy, surface_id);
         CHECK_VASTATUS(va_status, "vaSyncSurface");
@@ -841,19 +834,15 @@ int encode_input_image(FILE *yuv_fp, FILE *jpeg_fp, int picture_width, int pictu
         va_status = vaMapBuffer(va_dpy, codedbuf_buf_id, (void **)(&coded_buffer_segment));
         CHECK_VASTATUS(va_status,"vaMapBuffer");
 
-        coded_mem = coded_buffer_segment->buf;
-  
        if (coded_buffer_segment->status & VA_CODED_BUF_STATUS_SLICE_OVERFLOW_MASK) {
             vaUnmapBuffer(va_dpy, codedbuf_buf_id);
             printf("ERROR......Coded buffer too small\n");
         }
 
 
-        slice_data_length = coded_buffer_segment->size;
-
-        do {
-            w_items = fwrite(coded_mem, slice_data_length, 1, jpeg_fp);
-        } while (w_items != 1);
+        /* all the segments in one writev() */
+        if (coded_sink_write_coded(jpeg_sink, NULL, 0, coded_buffer_segment) < 0)
+            printf("ERROR......Can't write the output\n");
 
         va_status = vaUnmapBuffer(va_dpy, codedbuf_buf_id);
         CHECK_VASTATUS(va_status, "vaUnmapBuffer");
@@ -878,9 +867,9 @@ int encode_input_image(FILE *yuv_fp, FILE *jpeg_fp, int picture_width, int pictu
 
 int main(int argc, char *argv[])
 {
-    FILE *yuv_fp;
-    FILE *jpeg_fp;
-    off_t file_size;
+    struct yuv_input input;
+    struct coded_sink jpeg_sink;
+    unsigned char *frame;
     clock_t start_time, finish_time;
     unsigned int duration;
     unsigned int yuv_type = 0;
@@ -901,15 +890,6 @@ int main(int argc, char *argv[])
     yuv_type = atoi(argv[5]);
     quality = atoi(argv[6]);
     
-    yuv_fp = fopen(argv[3],"rb");
-    if ( yuv_fp == NULL){
-        printf("Can't open input YUV file\n");
-        return -1;
-    }
-    
-    fseeko(yuv_fp, (off_t)0, SEEK_END);
-    file_size = ftello(yuv_fp);
-    
     //<input file type: 0(I420)/1(NV12)/2(UYVY)/3(YUY2)/4(Y8)/5(RGBA)>
     switch(yuv_type)
     {
@@ -943,25 +923,42 @@ int main(int argc, char *argv[])
         
     }
     
-    if ( (file_size < frame_size) || (file_size % frame_size) ) {
-        fclose(yuv_fp);
-        printf("The YUV file's size is not correct: file_size=%zd, frame_size=%d\n", file_size, frame_size);
+    if (yuv_input_open(&input, argv[3], picture_width, picture_height, frame_size)) {
+        printf("Can't open input YUV file\n");
+        return -1;
+    }
+
+    //A Y4M file is 4:2:0 (or mono read as 4:2:0) with its own size
+    if (input.y4m) {
+        yuv_type = 0;
+        picture_width = input.width;
+        picture_height = input.height;
+        frame_size = input.frame_size;
+    }
+
+    if (input.frame_stride && input.frames == 0) {
+        yuv_input_close(&input);
+        printf("The YUV file's size is not correct: frame_size=%d\n", frame_size);
+        return -1;
+    }
+
+    //Only the first frame is encoded
+    if (yuv_input_start(&input, 0, 1) || (frame = yuv_input_frame(&input, 0)) == NULL) {
+        yuv_input_close(&input);
+        printf("Can't read a frame from the input\n");
         return -1;
     }
-    
-    fseeko(yuv_fp, (off_t)0, SEEK_SET);
 
-    jpeg_fp = fopen(argv[4], "wb");  
-    if ( jpeg_fp == NULL) {
-        fclose(yuv_fp);
+    if (coded_sink_open(&jpeg_sink, argv[4])) {
+        yuv_input_close(&input);
         printf("Can't open output destination jpeg file\n");
         return -1;
     }   
         
     start_time = clock();
-    encode_input_image(yuv_fp, jpeg_fp, picture_width, picture_height, frame_size, yuv_type, quality);
-    if(yuv_fp != NULL) fclose(yuv_fp);
-    if(jpeg_fp != NULL) fclose(jpeg_fp);
+    encode_input_image(frame, &jpeg_sink, picture_width, picture_height, frame_size, yuv_type, quality);
+    yuv_input_close(&input);
+    coded_sink_close(&jpeg_sink);
     finish_time = clock();
     duration = finish_time - start_time;
     printf("Encoding finished in %u ticks\n", duration);
@@ -27,6 +27,7 @@
 
 #include <sys/types.h>
 #include <stdio.h>
+#include "../bitstream.h"
 
 #define MAX_JPEG_COMPONENTS 3 //only for Y, U and V
 #define JPEG_Y 0
@@ -39,78 +40,6 @@
 #define NUM_DC_RUN_SIZE_BITS 16
 #define NUM_DC_CODE_WORDS_HUFFVAL 12
 
-#define BITSTREAM_ALLOCATE_STEPPING     4096
-
-struct __bitstream {
-    unsigned int *buffer;
-    int bit_offset;
-    int max_size_in_dword;
-};
-
-typedef struct __bitstream bitstream;
-
-static unsigned int 
-swap32(unsigned int val)
-{
-    unsigned char *pval = (unsigned char *)&val;
-
-    return ((pval[0] << 24)     |
-            (pval[1] << 16)     |
-            (pval[2] << 8)      |
-            (pval[3] << 0));
-}
-
-static void
-bitstream_start(bitstream *bs)
-{
-    bs->max_size_in_dword = BITSTREAM_ALLOCATE_STEPPING;
-    bs->buffer = calloc(bs->max_size_in_dword * sizeof(int), 1);
-    bs->bit_offset = 0;
-}
-
-static void
-bitstream_end(bitstream *bs)
-{
-    int pos = (bs->bit_offset >> 5);
-    int bit_offset = (bs->bit_offset & 0x1f);
-    int bit_left = 32 - bit_offset;
-
-    if (bit_offset) {
-        bs->buffer[pos] = swap32((bs->buffer[pos] << bit_left));
-    }
-}
- 
-static void
-bitstream_put_ui(bitstream *bs, unsigned int val, int size_in_bits)
-{
-    int pos = (bs->bit_offset >> 5);
-    int bit_offset = (bs->bit_offset & 0x1f);
-    int bit_left = 32 - bit_offset;
-
-    if (!size_in_bits)
-        return;
-
-    if (size_in_bits < 32)
-        val &= ((1 << size_in_bits) - 1);
-
-    bs->bit_offset += size_in_bits;
-
-    if (bit_left > size_in_bits) {
-        bs->buffer[pos] = (bs->buffer[pos] << size_in_bits | val);
-    } else {
-        size_in_bits -= bit_left;
-        bs->buffer[pos] = (bs->buffer[pos] << bit_left) | (val >> size_in_bits);
-        bs->buffer[pos] = swap32(bs->buffer[pos]);
-
-        if (pos + 1 == bs->max_size_in_dword) {
-            bs->max_size_in_dword += BITSTREAM_ALLOCATE_STEPPING;
-            bs->buffer = realloc(bs->buffer, bs->max_size_in_dword * sizeof(unsigned int));
-        }
-
-        bs->buffer[pos + 1] = val;
-    }
-}
-
 //As per Jpeg Spec ISO/IEC 10918-1, below values are assigned
 enum jpeg_markers {
 
@@ -29,6 +29,7 @@
 #include "sysdeps.h"
 
 #include <getopt.h>
+#include <limits.h>
 #include <unistd.h>
 
 #include <sys/time.h>
@@ -41,6 +42,10 @@
 #include <va/va_enc_mpeg2.h>
 
 #include "va_display.h"
+#include "time_us.h"
+#include "../bitstream.h"
+#include "../coded_sink.h"
+#include "../yuv_input.h"
 
 #define START_CODE_PICUTRE      0x00000100
 #define START_CODE_SLICE        0x00000101
@@ -55,6 +60,8 @@
 #define CHROMA_FORMAT_444       3
 
 #define MAX_SLICES              128
+#define MPEG2_CONTEXTS_MAX      8       /* --contexts */
+#define INPUT_SURFACE_MAX       16      /* --inputs */
 
 enum {
     MPEG2_MODE_I = 0,
@@ -96,6 +103,41 @@ static struct _mpeg2_sampling_density
     }
 };
 
+#define SID_REFERENCE_PICTURE_L0                0
+#define SID_REFERENCE_PICTURE_L1                1
+#define SID_RECON_PICTURE                       2
+#define SID_NUMBER                              SID_RECON_PICTURE + 1
+
+/* a picture in an input surface, in encoding order */
+struct mpeg2enc_input_picture {
+    int gop;
+    int coded_order;
+    int display_order;
+    VAEncPictureType type;
+    int next_is_bpic;
+    int last;                           /* the last picture of its GOP */
+};
+
+/*
+ * The upload thread of a context walks through the pictures of its GOPs
+ * in encoding order (update_next_frame_info) and uploads them into a ring
+ * of input surfaces, picture n goes to surface n % num_input_surfaces.
+ * It runs ahead of the encoder, past the B picture reordering, until all
+ * the surfaces are in use.
+ */
+struct mpeg2enc_upload_queue {
+    pthread_t thread;
+    pthread_mutex_t mutex;
+    pthread_cond_t cond;
+    VASurfaceID surfaces[INPUT_SURFACE_MAX];
+    struct mpeg2enc_input_picture picture[INPUT_SURFACE_MAX];
+    unsigned long long uploaded;        /* pictures in the input surfaces */
+    unsigned long long released;        /* pictures encoded, their surfaces are free */
+    int end;
+    unsigned long long wait_us;         /* the encoder waited for an upload */
+    unsigned long long stall_us;        /* the upload waited for a free surface */
+};
+
 struct mpeg2enc_context {
     /* args */
     int rate_control_mode;
@@ -106,11 +148,10 @@ struct mpeg2enc_context {
     int width;
     int height;
     int frame_size;
-    int num_pictures;
+    int num_pictures;                   /* INT_MAX until the end of a stream was read */
     int qp;
-    FILE *ifp;
-    FILE *ofp;
-    unsigned char *frame_data_buffer;
+    struct yuv_input *input;            /* shared by the contexts */
+    struct coded_sink sink;
     int intra_period;
     int ip_period;
     int bit_rate; /* in kbps */
@@ -128,6 +169,7 @@ struct mpeg2enc_context {
     VAEncSliceParameterBufferMPEG2 slice_param[MAX_SLICES];
     VAContextID context_id;
     VAConfigID config_id;
+    VASurfaceID surface_ids[SID_NUMBER];
     VABufferID seq_param_buf_id;                /* Sequence level parameter */
     VABufferID pic_param_buf_id;                /* Picture level parameter */
     VABufferID slice_param_buf_id[MAX_SLICES];  /* Slice level parameter, multil slices */
@@ -141,107 +183,45 @@ struct mpeg2enc_context {
     int codedbuf_pb_size;
 
     /* thread */
-    pthread_t upload_thread_id;
-    int upload_thread_value;
+    int num_input_surfaces;
+    struct mpeg2enc_upload_queue upload;
     int current_input_surface;
-    int current_upload_surface;
+
+    /* GOP-parallel encoding */
+    int contexts;
+    struct mpeg2enc_gop_queue *gop_queue;
+    struct mpeg2enc_gop_output *gop_output;     /* the GOP being encoded */
+};
+
+struct mpeg2enc_gop_output {
+    unsigned char *data;
+    size_t size, alloc;
+    int frames;
+    int done;
 };
 
 /*
- * mpeg2enc helpers
+ * With --contexts K, the closed GOPs are handed out in order to K
+ * contexts, each one encodes its GOP into memory. A GOP is written once
+ * the GOPs before it were written, up to 2 * K GOPs are being encoded or
+ * waiting to be written, GOP g uses gop[g % window].
  */
-#define BITSTREAM_ALLOCATE_STEPPING     4096
-
-struct __bitstream {
-    unsigned int *buffer;
-    int bit_offset;
-    int max_size_in_dword;
+struct mpeg2enc_gop_queue {
+    pthread_mutex_t mutex;
+    pthread_cond_t cond;
+    struct coded_sink *sink;
+    int window;
+    int next_gop;                       /* to hand out */
+    int written;                        /* GOPs written */
+    int frames;                         /* frames written */
+    int end;                            /* no frame in next_gop */
+    struct mpeg2enc_gop_output gop[2 * MPEG2_CONTEXTS_MAX];
+    unsigned long long wait_us;         /* a context waited to get a GOP */
 };
 
-typedef struct __bitstream bitstream;
-
-static unsigned int 
-swap32(unsigned int val)
-{
-    unsigned char *pval = (unsigned char *)&val;
-
-    return ((pval[0] << 24)     |
-            (pval[1] << 16)     |
-            (pval[2] << 8)      |
-            (pval[3] << 0));
-}
-
-static void
-bitstream_start(bitstream *bs)
-{
-    bs->max_size_in_dword = BITSTREAM_ALLOCATE_STEPPING;
-    bs->buffer = calloc(bs->max_size_in_dword * sizeof(int), 1);
-    bs->bit_offset = 0;
-}
-
-static void
-bitstream_end(bitstream *bs)
-{
-    int pos = (bs->bit_offset >> 5);
-    int bit_offset = (bs->bit_offset & 0x1f);
-    int bit_left = 32 - bit_offset;
-
-    if (bit_offset) {
-        bs->buffer[pos] = swap32((bs->buffer[pos] << bit_left));
-    }
-}
- 
-static void
-bitstream_put_ui(bitstream *bs, unsigned int val, int size_in_bits)
-{
-    int pos = (bs->bit_offset >> 5);
-    int bit_offset = (bs->bit_offset & 0x1f);
-    int bit_left = 32 - bit_offset;
-
-    if (!size_in_bits)
-        return;
-
-    if (size_in_bits < 32)
-        val &= ((1 << size_in_bits) - 1);
-
-    bs->bit_offset += size_in_bits;
-
-    if (bit_left > size_in_bits) {
-        bs->buffer[pos] = (bs->buffer[pos] << size_in_bits | val);
-    } else {
-        size_in_bits -= bit_left;
-        bs->buffer[pos] = (bs->buffer[pos] << bit_left) | (val >> size_in_bits);
-        bs->buffer[pos] = swap32(bs->buffer[pos]);
-
-        if (pos + 1 == bs->max_size_in_dword) {
-            bs->max_size_in_dword += BITSTREAM_ALLOCATE_STEPPING;
-            bs->buffer = realloc(bs->buffer, bs->max_size_in_dword * sizeof(unsigned int));
-        }
-
-        bs->buffer[pos + 1] = val;
-    }
-}
-
-static void
-bitstream_byte_aligning(bitstream *bs, int bit)
-{
-    int bit_offset = (bs->bit_offset & 0x7);
-    int bit_left = 8 - bit_offset;
-    int new_val;
-
-    if (!bit_offset)
-        return;
-
-    assert(bit == 0 || bit == 1);
-
-    if (bit)
-        new_val = (1 << bit_left) - 1;
-    else
-        new_val = 0;
-
-    bitstream_put_ui(bs, new_val, bit_left);
-}
-
+/*
+ * mpeg2enc helpers
+ */
 static struct mpeg2_frame_rate {
     int code;
     float value;
@@ -413,48 +393,28 @@ build_packed_seq_buffer(struct mpeg2enc_context *ctx,
     return bs.bit_offset;
 }
 
-/*
- * mpeg2enc
- */
-#define SID_INPUT_PICTURE_0                     0
-#define SID_INPUT_PICTURE_1                     1
-#define SID_REFERENCE_PICTURE_L0                2
-#define SID_REFERENCE_PICTURE_L1                3
-#define SID_RECON_PICTURE                       4
-#define SID_NUMBER                              SID_RECON_PICTURE + 1
 
-static VASurfaceID surface_ids[SID_NUMBER];
-
-/*
- * upload thread function
- */
-static void *
-upload_yuv_to_surface(void *data)
+static void
+upload_yuv_to_surface(struct mpeg2enc_context *ctx, const unsigned char *frame, VASurfaceID surface_id)
 {
-    struct mpeg2enc_context *ctx = data;
     VAImage surface_image;
     VAStatus va_status;
     void *surface_p = NULL;
-    unsigned char *y_src, *u_src, *v_src;
+    const unsigned char *y_src, *u_src, *v_src;
     unsigned char *y_dst, *u_dst, *v_dst;
     int y_size = ctx->width * ctx->height;
     int u_size = (ctx->width >> 1) * (ctx->height >> 1);
     int row, col;
-    size_t n_items;
-
-    do {
-        n_items = fread(ctx->frame_data_buffer, ctx->frame_size, 1, ctx->ifp);
-    } while (n_items != 1);
 
-    va_status = vaDeriveImage(ctx->va_dpy, surface_ids[ctx->current_upload_surface], &surface_image);
+    va_status = vaDeriveImage(ctx->va_dpy, surface_id, &surface_image);
     CHECK_VASTATUS(va_status,"vaDeriveImage");
 
     vaMapBuffer(ctx->va_dpy, surface_image.buf, &surface_p);
     assert(VA_STATUS_SUCCESS == va_status);
         
-    y_src = ctx->frame_data_buffer;
-    u_src = ctx->frame_data_buffer + y_size; /* UV offset for NV12 */
-    v_src = ctx->frame_data_buffer + y_size + u_size;
+    y_src = frame;
+    u_src = frame + y_size; /* UV offset for NV12 */
+    v_src = frame + y_size + u_size;
 
     y_dst = surface_p + surface_image.offsets[0];
     u_dst = surface_p + surface_image.offsets[1]; /* UV offset for NV12 */
@@ -494,27 +454,14 @@ upload_yuv_to_surface(void *data)
 
     vaUnmapBuffer(ctx->va_dpy, surface_image.buf);
     vaDestroyImage(ctx->va_dpy, surface_image.image_id);
-
-    return NULL;
 }
 
 static void 
 mpeg2enc_exit(struct mpeg2enc_context *ctx, int exit_code)
 {
-    if (ctx->frame_data_buffer) {
-        free(ctx->frame_data_buffer);
-        ctx->frame_data_buffer = NULL;
-    }
-
-    if (ctx->ifp) {
-        fclose(ctx->ifp);
-        ctx->ifp = NULL;
-    }
+    yuv_input_close(ctx->input);
 
-    if (ctx->ofp) {
-        fclose(ctx->ofp);
-        ctx->ofp = NULL;
-    }
+    coded_sink_close(&ctx->sink);
 
     exit(exit_code);
 }
@@ -525,13 +472,15 @@ usage(char *program)
     fprintf(stderr, "Usage: %s --help\n", program);
     fprintf(stderr, "\t--help   print this message\n");
     fprintf(stderr, "Usage: %s <width> <height> <ifile> <ofile> [options]\n", program);
-    fprintf(stderr, "\t<width>  specifies the frame width\n");
-    fprintf(stderr, "\t<height> specifies the frame height\n");
-    fprintf(stderr, "\t<ifile>  specifies the I420/IYUV YUV file\n");
-    fprintf(stderr, "\t<ofile>  specifies the encoded MPEG-2 file\n");
+    fprintf(stderr, "\t<width>  specifies the frame width, taken from the header of a Y4M file\n");
+    fprintf(stderr, "\t<height> specifies the frame height, taken from the header of a Y4M file\n");
+    fprintf(stderr, "\t<ifile>  specifies the I420/IYUV YUV file or a Y4M file, - for stdin\n");
+    fprintf(stderr, "\t<ofile>  specifies the encoded MPEG-2 file, - for stdout or unix:<path> for a Unix socket\n");
     fprintf(stderr, "where options include:\n");
     fprintf(stderr, "\t--cqp <QP>       const qp mode with specified <QP>\n");
     fprintf(stderr, "\t--fps <FPS>      specify the frame rate\n");
+    fprintf(stderr, "\t--contexts <K>   encode K closed GOPs at the same time, one context each (1..%d)\n", MPEG2_CONTEXTS_MAX);
+    fprintf(stderr, "\t--inputs <N>     upload up to N pictures ahead of the encoder (2..%d, default 4)\n", INPUT_SURFACE_MAX);
     fprintf(stderr, "\t--mode <MODE>    specify the mode 0 (I), 1 (I/P) and 2 (I/P/B)\n");
     fprintf(stderr, "\t--profile <PROFILE>      specify the profile 0(Simple), or 1(Main, default)\n");
     fprintf(stderr, "\t--level <LEVEL>  specify the level 0(Low), 1(Main, default) or 2(High)\n");    
@@ -572,7 +521,7 @@ parse_args(struct mpeg2enc_context *ctx, int argc, char **argv)
 {
     int c, tmp;
     int option_index = 0;
-    long file_size;
+    int fps = 0;
     int profile = 1, level = 1;
 
     static struct option long_options[] = {
@@ -582,6 +531,8 @@ parse_args(struct mpeg2enc_context *ctx, int argc, char **argv)
         {"mode",        required_argument,      0,      'm'},
         {"profile",     required_argument,      0,      'p'},
         {"level",       required_argument,      0,      'l'},
+        {"contexts",    required_argument,      0,      'k'},
+        {"inputs",      required_argument,      0,      'i'},
         { NULL,         0,                      NULL,   0 }
     };
 
@@ -597,29 +548,25 @@ parse_args(struct mpeg2enc_context *ctx, int argc, char **argv)
         goto err_exit;
     }
 
-    ctx->ifp = fopen(argv[3], "rb");
-
-    if (ctx->ifp == NULL) {
+    if (yuv_input_open(ctx->input, argv[3], ctx->width, ctx->height, 0)) {
         fprintf(stderr, "Can't open the input file\n");
         goto err_exit;
     }
 
-    fseek(ctx->ifp, 0l, SEEK_END);
-    file_size = ftell(ctx->ifp);
-    ctx->frame_size = ctx->width * ctx->height * 3 / 2;
+    /* a Y4M header overrides the command line */
+    ctx->width = ctx->input->width;
+    ctx->height = ctx->input->height;
+    ctx->frame_size = ctx->input->frame_size;
 
-    if ((file_size < ctx->frame_size) ||
-        (file_size % ctx->frame_size)) {
-        fprintf(stderr, "The input file size %ld isn't a multiple of the frame size %d\n", file_size, ctx->frame_size);
+    if (ctx->input->frame_stride && ctx->input->frames == 0) {
+        fprintf(stderr, "The input file is smaller than the frame size %d\n", ctx->frame_size);
         goto err_exit;
     }
 
-    ctx->num_pictures = file_size / ctx->frame_size;
-    fseek(ctx->ifp, 0l, SEEK_SET);
-    
-    ctx->ofp = fopen(argv[4], "wb");
-    
-    if (ctx->ofp == NULL) {
+    /* the length of a stream is known once its end was read */
+    ctx->num_pictures = ctx->input->frames ? ctx->input->frames : INT_MAX;
+
+    if (coded_sink_open(&ctx->sink, argv[4])) {
         fprintf(stderr, "Can't create the output file\n");
         goto err_exit;
     }
@@ -631,6 +578,8 @@ parse_args(struct mpeg2enc_context *ctx, int argc, char **argv)
     ctx->mode = MPEG2_MODE_IP;
     ctx->profile = VAProfileMPEG2Main;
     ctx->level = MPEG2_LEVEL_MAIN;
+    ctx->contexts = 1;
+    ctx->num_input_surfaces = 4;
 
     optind = 5;
 
@@ -664,7 +613,7 @@ parse_args(struct mpeg2enc_context *ctx, int argc, char **argv)
             if (tmp <= 0)
                 fprintf(stderr, "Warning: FPS must be greater than 0\n");
             else
-                ctx->fps = tmp;
+                ctx->fps = fps = tmp;
 
             ctx->rate_control_mode = VA_RC_CBR;
 
@@ -700,6 +649,26 @@ parse_args(struct mpeg2enc_context *ctx, int argc, char **argv)
 
             break;
 
+        case 'k':
+            tmp = atoi(optarg);
+
+            if (tmp < 1 || tmp > MPEG2_CONTEXTS_MAX)
+                fprintf(stderr, "Waning: CONTEXTS must be in [1, %d]\n", MPEG2_CONTEXTS_MAX);
+            else
+                ctx->contexts = tmp;
+
+            break;
+
+        case 'i':
+            tmp = atoi(optarg);
+
+            if (tmp < 2 || tmp > INPUT_SURFACE_MAX)
+                fprintf(stderr, "Waning: INPUTS must be in [2, %d]\n", INPUT_SURFACE_MAX);
+            else
+                ctx->num_input_surfaces = tmp;
+
+            break;
+
         case '?':
             fprintf(stderr, "Error: unkown command options\n");
 
@@ -708,6 +677,9 @@ parse_args(struct mpeg2enc_context *ctx, int argc, char **argv)
         }
     }
 
+    if (!fps && ctx->input->fps_num)
+        ctx->fps = (ctx->input->fps_num + ctx->input->fps_den / 2) / ctx->input->fps_den;
+
     mpeg2_profile_level(ctx, profile, level);
 
     return;
@@ -781,7 +753,8 @@ mpeg2enc_init_sequence_parameter(struct mpeg2enc_context *ctx,
     seq_param->sequence_extension.bits.frame_rate_extension_d = 0;
 
     seq_param->gop_header.bits.time_code = (1 << 12); /* bit12: marker_bit */
-    seq_param->gop_header.bits.closed_gop = 0;
+    /* a GOP starts with its I picture, no B picture refers to the GOP before */
+    seq_param->gop_header.bits.closed_gop = 1;
     seq_param->gop_header.bits.broken_link = 0;    
 }
 
@@ -814,6 +787,44 @@ mpeg2enc_init_picture_parameter(struct mpeg2enc_context *ctx,
     pic_param->picture_coding_extension.bits.composite_display_flag = 0;
 }
 
+/* the context and the surfaces of one encoder, the config is shared */
+static void
+mpeg2enc_create_context(struct mpeg2enc_context *ctx)
+{
+    VAStatus va_status;
+
+    /* Create a context for this decode pipe */
+    va_status = vaCreateContext(ctx->va_dpy,
+                                ctx->config_id,
+                                ctx->width,
+                                ctx->height,
+                                VA_PROGRESSIVE, 
+                                0,
+                                0,
+                                &ctx->context_id);
+    CHECK_VASTATUS(va_status, "vaCreateContext");
+
+    va_status = vaCreateSurfaces(ctx->va_dpy,
+                                 VA_RT_FORMAT_YUV420,
+                                 ctx->width,
+                                 ctx->height,
+                                 ctx->surface_ids,
+                                 SID_NUMBER,
+                                 NULL,
+                                 0);
+    CHECK_VASTATUS(va_status, "vaCreateSurfaces");
+
+    va_status = vaCreateSurfaces(ctx->va_dpy,
+                                 VA_RT_FORMAT_YUV420,
+                                 ctx->width,
+                                 ctx->height,
+                                 ctx->upload.surfaces,
+                                 ctx->num_input_surfaces,
+                                 NULL,
+                                 0);
+    CHECK_VASTATUS(va_status, "vaCreateSurfaces");
+}
+
 static void 
 mpeg2enc_alloc_va_resources(struct mpeg2enc_context *ctx)
 {
@@ -879,26 +890,7 @@ mpeg2enc_alloc_va_resources(struct mpeg2enc_context *ctx)
                                &ctx->config_id);
     CHECK_VASTATUS(va_status, "vaCreateConfig");
 
-    /* Create a context for this decode pipe */
-    va_status = vaCreateContext(ctx->va_dpy,
-                                ctx->config_id,
-                                ctx->width,
-                                ctx->height,
-                                VA_PROGRESSIVE, 
-                                0,
-                                0,
-                                &ctx->context_id);
-    CHECK_VASTATUS(va_status, "vaCreateContext");
-
-    va_status = vaCreateSurfaces(ctx->va_dpy,
-                                 VA_RT_FORMAT_YUV420,
-                                 ctx->width,
-                                 ctx->height,
-                                 surface_ids,
-                                 SID_NUMBER,
-                                 NULL,
-                                 0);
-    CHECK_VASTATUS(va_status, "vaCreateSurfaces");
+    mpeg2enc_create_context(ctx);
 }
 
 static void 
@@ -906,7 +898,6 @@ mpeg2enc_init(struct mpeg2enc_context *ctx)
 {
     int i;
 
-    ctx->frame_data_buffer = (unsigned char *)malloc(ctx->frame_size);
     ctx->seq_param_buf_id = VA_INVALID_ID;
     ctx->pic_param_buf_id = VA_INVALID_ID;
     ctx->packed_seq_header_param_buf_id = VA_INVALID_ID;
@@ -946,13 +937,22 @@ mpeg2enc_init(struct mpeg2enc_context *ctx)
     mpeg2enc_init_picture_parameter(ctx, &ctx->pic_param);
     mpeg2enc_alloc_va_resources(ctx);
 
-    /* thread */
-    ctx->current_input_surface = SID_INPUT_PICTURE_0;
-    ctx->current_upload_surface = SID_INPUT_PICTURE_1;
-    ctx->upload_thread_value = pthread_create(&ctx->upload_thread_id,
-                                              NULL,
-                                              upload_yuv_to_surface,
-                                              ctx);
+    /*
+     * a B picture goes back ip_period frames from its P picture, the
+     * parallel contexts are up to 2 * K GOPs apart, the upload threads
+     * read as far ahead as they have input surfaces
+     */
+    if (yuv_input_start(ctx->input,
+                        (ctx->contexts > 1 ? 2 * ctx->contexts * ctx->intra_period : 0) + ctx->ip_period + 1,
+                        ctx->num_input_surfaces)) {
+        fprintf(stderr, "Can't start reading the input file\n");
+        mpeg2enc_exit(ctx, 1);
+    }
+
+    if (yuv_input_frame(ctx->input, 0) == NULL) {
+        fprintf(stderr, "The input has no frame\n");
+        mpeg2enc_exit(ctx, 1);
+    }
 }
 
 static int 
@@ -1016,9 +1016,9 @@ mpeg2enc_update_picture_parameter(struct mpeg2enc_context *ctx,
 
     pic_param->picture_type = picture_type;
     pic_param->temporal_reference = (display_order - ctx->gop_header_in_display_order) & 0x3FF;
-    pic_param->reconstructed_picture = surface_ids[SID_RECON_PICTURE];
-    pic_param->forward_reference_picture = surface_ids[SID_REFERENCE_PICTURE_L0];
-    pic_param->backward_reference_picture = surface_ids[SID_REFERENCE_PICTURE_L1];
+    pic_param->reconstructed_picture = ctx->surface_ids[SID_RECON_PICTURE];
+    pic_param->forward_reference_picture = ctx->surface_ids[SID_REFERENCE_PICTURE_L0];
+    pic_param->backward_reference_picture = ctx->surface_ids[SID_REFERENCE_PICTURE_L1];
 
     f_code_x = 0xf;
     f_code_y = 0xf;
@@ -1048,15 +1048,15 @@ mpeg2enc_update_picture_parameter(struct mpeg2enc_context *ctx,
         pic_param->f_code[0][1] = f_code_y;
         pic_param->f_code[1][0] = 0xf;
         pic_param->f_code[1][1] = 0xf;
-        pic_param->forward_reference_picture = surface_ids[SID_REFERENCE_PICTURE_L0];
+        pic_param->forward_reference_picture = ctx->surface_ids[SID_REFERENCE_PICTURE_L0];
         pic_param->backward_reference_picture = VA_INVALID_SURFACE;
     } else if (pic_param->picture_type == VAEncPictureTypeBidirectional) {
         pic_param->f_code[0][0] = f_code_x;
         pic_param->f_code[0][1] = f_code_y;
         pic_param->f_code[1][0] = f_code_x;
         pic_param->f_code[1][1] = f_code_y;
-        pic_param->forward_reference_picture = surface_ids[SID_REFERENCE_PICTURE_L0];
-        pic_param->backward_reference_picture = surface_ids[SID_REFERENCE_PICTURE_L1];
+        pic_param->forward_reference_picture = ctx->surface_ids[SID_REFERENCE_PICTURE_L0];
+        pic_param->backward_reference_picture = ctx->surface_ids[SID_REFERENCE_PICTURE_L1];
     } else {
         assert(0);
     }
@@ -1125,23 +1125,10 @@ begin_picture(struct mpeg2enc_context *ctx,
               VAEncPictureType picture_type)
 {
     VAStatus va_status;
-    int tmp;
     VAEncPackedHeaderParameterBuffer packed_header_param_buffer;
     unsigned int length_in_bits;
     unsigned char *packed_seq_buffer = NULL, *packed_pic_buffer = NULL;
 
-    if (ctx->upload_thread_value != 0) {
-        fprintf(stderr, "FATAL error!!!\n");
-        exit(1);
-    }
-    
-    pthread_join(ctx->upload_thread_id, NULL);
-
-    ctx->upload_thread_value = -1;
-    tmp = ctx->current_input_surface;
-    ctx->current_input_surface = ctx->current_upload_surface;
-    ctx->current_upload_surface = tmp;
-
     mpeg2enc_update_sequence_parameter(ctx, picture_type, coded_order, display_order);
     mpeg2enc_update_picture_parameter(ctx, picture_type, coded_order, display_order);
 
@@ -1230,7 +1217,7 @@ mpeg2enc_render_picture(struct mpeg2enc_context *ctx)
 
     va_status = vaBeginPicture(ctx->va_dpy,
                                ctx->context_id,
-                               surface_ids[ctx->current_input_surface]);
+                               ctx->upload.surfaces[ctx->current_input_surface]);
     CHECK_VASTATUS(va_status,"vaBeginPicture");
 
     va_status = vaRenderPicture(ctx->va_dpy,
@@ -1274,21 +1261,21 @@ end_picture(struct mpeg2enc_context *ctx, VAEncPictureType picture_type, int nex
     VABufferID tempID;
 
     /* Prepare for next picture */
-    tempID = surface_ids[SID_RECON_PICTURE];  
+    tempID = ctx->surface_ids[SID_RECON_PICTURE];  
 
     if (picture_type != VAEncPictureTypeBidirectional) {
         if (next_is_bpic) {
-            surface_ids[SID_RECON_PICTURE] = surface_ids[SID_REFERENCE_PICTURE_L1]; 
-            surface_ids[SID_REFERENCE_PICTURE_L1] = tempID;	
+            ctx->surface_ids[SID_RECON_PICTURE] = ctx->surface_ids[SID_REFERENCE_PICTURE_L1]; 
+            ctx->surface_ids[SID_REFERENCE_PICTURE_L1] = tempID;	
         } else {
-            surface_ids[SID_RECON_PICTURE] = surface_ids[SID_REFERENCE_PICTURE_L0]; 
-            surface_ids[SID_REFERENCE_PICTURE_L0] = tempID;
+            ctx->surface_ids[SID_RECON_PICTURE] = ctx->surface_ids[SID_REFERENCE_PICTURE_L0]; 
+            ctx->surface_ids[SID_REFERENCE_PICTURE_L0] = tempID;
         }
     } else {
         if (!next_is_bpic) {
-            surface_ids[SID_RECON_PICTURE] = surface_ids[SID_REFERENCE_PICTURE_L0]; 
-            surface_ids[SID_REFERENCE_PICTURE_L0] = surface_ids[SID_REFERENCE_PICTURE_L1];
-            surface_ids[SID_REFERENCE_PICTURE_L1] = tempID;
+            ctx->surface_ids[SID_RECON_PICTURE] = ctx->surface_ids[SID_REFERENCE_PICTURE_L0]; 
+            ctx->surface_ids[SID_REFERENCE_PICTURE_L0] = ctx->surface_ids[SID_REFERENCE_PICTURE_L1];
+            ctx->surface_ids[SID_REFERENCE_PICTURE_L1] = tempID;
         }
     }
 
@@ -1304,26 +1291,48 @@ end_picture(struct mpeg2enc_context *ctx, VAEncPictureType picture_type, int nex
     ctx->num_slice_groups = 0;
 }
 
+/* the coded picture at the end of the GOP, returns its size or -1 */
+static long long
+mpeg2enc_gop_append(struct mpeg2enc_gop_output *gop, VACodedBufferSegment *segment)
+{
+    long long size = 0;
+    unsigned char *data;
+
+    for (; segment; segment = (VACodedBufferSegment *)segment->next) {
+        if (gop->size + segment->size > gop->alloc) {
+            gop->alloc = 2 * gop->alloc;
+            if (gop->alloc < gop->size + segment->size)
+                gop->alloc = gop->size + segment->size;
+            data = realloc(gop->data, gop->alloc);
+            if (data == NULL)
+                return -1;
+            gop->data = data;
+        }
+        memcpy(gop->data + gop->size, segment->buf, segment->size);
+        gop->size += segment->size;
+        size += segment->size;
+    }
+
+    return size;
+}
+
 static int
 store_coded_buffer(struct mpeg2enc_context *ctx, VAEncPictureType picture_type)
 {
     VACodedBufferSegment *coded_buffer_segment;
-    unsigned char *coded_mem;
-    int slice_data_length;
+    long long slice_data_length;
     VAStatus va_status;
     VASurfaceStatus surface_status;
-    size_t w_items;
 
-    va_status = vaSyncSurface(ctx->va_dpy, surface_ids[ctx->current_input_surface]);
+    va_status = vaSyncSurface(ctx->va_dpy, ctx->upload.surfaces[ctx->current_input_surface]);
     CHECK_VASTATUS(va_status,"vaSyncSurface");
 
     surface_status = 0;
-    va_status = vaQuerySurfaceStatus(ctx->va_dpy, surface_ids[ctx->current_input_surface], &surface_status);
+    va_status = vaQuerySurfaceStatus(ctx->va_dpy, ctx->upload.surfaces[ctx->current_input_surface], &surface_status);
     CHECK_VASTATUS(va_status,"vaQuerySurfaceStatus");
 
     va_status = vaMapBuffer(ctx->va_dpy, ctx->codedbuf_buf_id, (void **)(&coded_buffer_segment));
     CHECK_VASTATUS(va_status,"vaMapBuffer");
-    coded_mem = coded_buffer_segment->buf;
 
     if (coded_buffer_segment->status & VA_CODED_BUF_STATUS_SLICE_OVERFLOW_MASK) {
         if (picture_type == VAEncPictureTypeIntra)
@@ -1335,11 +1344,16 @@ store_coded_buffer(struct mpeg2enc_context *ctx, VAEncPictureType picture_type)
         return -1;
     }
 
-    slice_data_length = coded_buffer_segment->size;
-
-    do {
-        w_items = fwrite(coded_mem, slice_data_length, 1, ctx->ofp);
-    } while (w_items != 1);
+    /* all the segments of the picture in one writev(), a parallel context keeps its GOP */
+    if (ctx->gop_output)
+        slice_data_length = mpeg2enc_gop_append(ctx->gop_output, coded_buffer_segment);
+    else
+        slice_data_length = coded_sink_write_coded(&ctx->sink, NULL, 0, coded_buffer_segment);
+    if (slice_data_length < 0) {
+        fprintf(stderr, "Can't write the output file\n");
+        vaUnmapBuffer(ctx->va_dpy, ctx->codedbuf_buf_id);
+        mpeg2enc_exit(ctx, 1);
+    }
 
     if (picture_type == VAEncPictureTypeIntra) {
         if (ctx->codedbuf_i_size > slice_data_length * 3 / 2) {
@@ -1365,26 +1379,13 @@ encode_picture(struct mpeg2enc_context *ctx,
                int coded_order,
                int display_order,
                VAEncPictureType picture_type,
-               int next_is_bpic,
-               int next_display_order)
+               int next_is_bpic)
 {
     VAStatus va_status;
     int ret = 0, codedbuf_size;
     
     begin_picture(ctx, coded_order, display_order, picture_type);
 
-    if (1) {
-        /* upload YUV data to VA surface for next frame */
-        if (next_display_order >= ctx->num_pictures)
-            next_display_order = ctx->num_pictures - 1;
-
-        fseek(ctx->ifp, ctx->frame_size * next_display_order, SEEK_SET);
-        ctx->upload_thread_value = pthread_create(&ctx->upload_thread_id,
-                                                  NULL,
-                                                  upload_yuv_to_surface,
-                                                  ctx);
-    }
-
     do {
         mpeg2enc_destroy_buffers(ctx, &ctx->codedbuf_buf_id, 1);
         mpeg2enc_destroy_buffers(ctx, &ctx->pic_param_buf_id, 1);
@@ -1415,6 +1416,35 @@ encode_picture(struct mpeg2enc_context *ctx,
     end_picture(ctx, picture_type, next_is_bpic);
 }
 
+/*
+ * a stream ends before display_order if the frame can't be read, only
+ * the upload thread changes num_pictures, under the upload mutex
+ */
+static void
+update_num_pictures(struct mpeg2enc_context *ctx, int display_order)
+{
+    if (ctx->num_pictures == INT_MAX &&
+        yuv_input_frame(ctx->input, display_order) == NULL &&
+        errno == ENODATA) {
+        pthread_mutex_lock(&ctx->upload.mutex);
+        ctx->num_pictures = ctx->input->frames;
+        pthread_mutex_unlock(&ctx->upload.mutex);
+    }
+}
+
+/* num_pictures as seen by the encoder */
+static int
+mpeg2enc_num_pictures(struct mpeg2enc_context *ctx)
+{
+    int num_pictures;
+
+    pthread_mutex_lock(&ctx->upload.mutex);
+    num_pictures = ctx->num_pictures;
+    pthread_mutex_unlock(&ctx->upload.mutex);
+
+    return num_pictures;
+}
+
 static void
 update_next_frame_info(struct mpeg2enc_context *ctx,
                        VAEncPictureType curr_type,
@@ -1424,7 +1454,8 @@ update_next_frame_info(struct mpeg2enc_context *ctx,
     if (((curr_coded_order + 1) % ctx->intra_period) == 0) {
         ctx->next_type = VAEncPictureTypeIntra;
         ctx->next_display_order = curr_coded_order + 1;
-        
+        update_num_pictures(ctx, ctx->next_display_order);
+
         return;
     }
 
@@ -1455,6 +1486,8 @@ update_next_frame_info(struct mpeg2enc_context *ctx,
         }
     }
 
+    update_num_pictures(ctx, ctx->next_display_order);
+
     if (ctx->next_display_order >= ctx->num_pictures) {
         int rtmp = ctx->next_display_order - (ctx->num_pictures - 1);
         ctx->next_display_order = ctx->num_pictures - 1;
@@ -1462,50 +1495,355 @@ update_next_frame_info(struct mpeg2enc_context *ctx,
     }
 }
 
+/* the next GOP to encode, -1 at the end of the input */
+static int
+gop_queue_take(struct mpeg2enc_context *ctx)
+{
+    struct mpeg2enc_gop_queue *queue = ctx->gop_queue;
+    unsigned long long start;
+    int gop;
+
+    pthread_mutex_lock(&queue->mutex);
+    start = time_us_monotonic();
+    while (!queue->end && queue->next_gop >= queue->written + queue->window)
+        pthread_cond_wait(&queue->cond, &queue->mutex);
+    queue->wait_us += time_us_monotonic() - start;
+
+    gop = queue->end ? -1 : queue->next_gop++;
+    pthread_mutex_unlock(&queue->mutex);
+
+    /* the length of a stream is known once a frame can't be read */
+    if (gop >= 0)
+        update_num_pictures(ctx, gop * ctx->intra_period);
+
+    if (gop >= 0 && gop * ctx->intra_period >= ctx->num_pictures) {
+        pthread_mutex_lock(&queue->mutex);
+        queue->end = 1;
+        pthread_cond_broadcast(&queue->cond);
+        pthread_mutex_unlock(&queue->mutex);
+        gop = -1;
+    }
+
+    return gop;
+}
+
+/* GOP gop was encoded, write it and the GOPs after it which are done */
 static void
-mpeg2enc_run(struct mpeg2enc_context *ctx)
+gop_queue_submit(struct mpeg2enc_context *ctx, int gop)
 {
-    int display_order = 0, coded_order = 0;
+    struct mpeg2enc_gop_queue *queue = ctx->gop_queue;
+    struct mpeg2enc_gop_output *output;
+    int num_pictures = mpeg2enc_num_pictures(ctx);
+
+    pthread_mutex_lock(&queue->mutex);
+    queue->gop[gop % queue->window].done = 1;
+
+    for (output = &queue->gop[queue->written % queue->window]; output->done;
+         output = &queue->gop[queue->written % queue->window]) {
+        if (coded_sink_write(queue->sink, output->data, output->size) < 0) {
+            fprintf(stderr, "Can't write the output file\n");
+            mpeg2enc_exit(ctx, 1);
+        }
+        queue->frames += output->frames;
+        queue->written++;
+        output->size = 0;
+        output->done = 0;
+
+        if (num_pictures == INT_MAX)
+            fprintf(stderr, "\r %d ...", queue->frames);
+        else
+            fprintf(stderr, "\r %d/%d ...", queue->frames, num_pictures);
+    }
+
+    pthread_cond_broadcast(&queue->cond);
+    pthread_mutex_unlock(&queue->mutex);
+}
+
+/*
+ * upload thread function, the GOPs of the context (from the GOP queue
+ * with several contexts) picture by picture in encoding order
+ */
+static void *
+upload_thread_function(void *data)
+{
+    struct mpeg2enc_context *ctx = data;
+    struct mpeg2enc_upload_queue *upload = &ctx->upload;
+    struct mpeg2enc_input_picture *picture;
+    const unsigned char *frame;
+    unsigned long long start;
+    int gop = 0, coded_order, display_order, slot;
     VAEncPictureType type;
 
-    ctx->new_sequence = 1;
-    ctx->new_gop_header = 1;
-    ctx->gop_header_in_display_order = display_order;
+    for (;; gop++) {
+        if (ctx->gop_queue) {
+            gop = gop_queue_take(ctx);
+            if (gop < 0)
+                break;
+        } else {
+            update_num_pictures(ctx, gop * ctx->intra_period);
+            if (gop * ctx->intra_period >= ctx->num_pictures)
+                break;
+        }
+
+        coded_order = gop * ctx->intra_period;
+        ctx->next_type = VAEncPictureTypeIntra;
+        ctx->next_display_order = coded_order;
+
+        do {
+            type = ctx->next_type;
+            display_order = ctx->next_display_order;
+
+            pthread_mutex_lock(&upload->mutex);
+            start = time_us_monotonic();
+            while (upload->uploaded - upload->released >= (unsigned int)ctx->num_input_surfaces)
+                pthread_cond_wait(&upload->cond, &upload->mutex);
+            upload->stall_us += time_us_monotonic() - start;
+            pthread_mutex_unlock(&upload->mutex);
+
+            /* probed at the start of the GOP or by update_next_frame_info */
+            frame = yuv_input_frame(ctx->input, display_order);
+            assert(frame);
+
+            slot = upload->uploaded % ctx->num_input_surfaces;
+            upload_yuv_to_surface(ctx, frame, upload->surfaces[slot]);
+
+            /* follow the IPBxxBPBxxB mode */
+            update_next_frame_info(ctx, type, coded_order, display_order);
+
+            picture = &upload->picture[slot];
+            picture->gop = gop;
+            picture->coded_order = coded_order;
+            picture->display_order = display_order;
+            picture->type = type;
+            picture->next_is_bpic = (ctx->next_type == VAEncPictureTypeBidirectional);
+            coded_order++;
+            picture->last = (coded_order >= ctx->num_pictures || ctx->next_type == VAEncPictureTypeIntra);
+
+            pthread_mutex_lock(&upload->mutex);
+            upload->uploaded++;
+            pthread_cond_broadcast(&upload->cond);
+            pthread_mutex_unlock(&upload->mutex);
+        } while (!picture->last);
+    }
+
+    pthread_mutex_lock(&upload->mutex);
+    upload->end = 1;
+    pthread_cond_broadcast(&upload->cond);
+    pthread_mutex_unlock(&upload->mutex);
+
+    return NULL;
+}
+
+static void
+mpeg2enc_upload_start(struct mpeg2enc_context *ctx)
+{
+    struct mpeg2enc_upload_queue *upload = &ctx->upload;
+
+    pthread_mutex_init(&upload->mutex, NULL);
+    pthread_cond_init(&upload->cond, NULL);
+    upload->uploaded = 0;
+    upload->released = 0;
+    upload->end = 0;
+    upload->wait_us = 0;
+    upload->stall_us = 0;
+
+    if (pthread_create(&upload->thread, NULL, upload_thread_function, ctx)) {
+        fprintf(stderr, "Can't create the upload thread\n");
+        mpeg2enc_exit(ctx, 1);
+    }
+}
+
+static void
+mpeg2enc_upload_stop(struct mpeg2enc_context *ctx)
+{
+    pthread_join(ctx->upload.thread, NULL);
+    pthread_cond_destroy(&ctx->upload.cond);
+    pthread_mutex_destroy(&ctx->upload.mutex);
+}
+
+/* the next uploaded picture, NULL at the end of the input */
+static struct mpeg2enc_input_picture *
+upload_wait(struct mpeg2enc_context *ctx)
+{
+    struct mpeg2enc_upload_queue *upload = &ctx->upload;
+    struct mpeg2enc_input_picture *picture = NULL;
+    unsigned long long start;
+
+    pthread_mutex_lock(&upload->mutex);
+    start = time_us_monotonic();
+    while (upload->uploaded == upload->released && !upload->end)
+        pthread_cond_wait(&upload->cond, &upload->mutex);
+    upload->wait_us += time_us_monotonic() - start;
+
+    if (upload->uploaded != upload->released) {
+        ctx->current_input_surface = upload->released % ctx->num_input_surfaces;
+        picture = &upload->picture[ctx->current_input_surface];
+    }
+    pthread_mutex_unlock(&upload->mutex);
+
+    return picture;
+}
+
+/* the picture was encoded, its input surface can take the next one */
+static void
+upload_release(struct mpeg2enc_context *ctx)
+{
+    pthread_mutex_lock(&ctx->upload.mutex);
+    ctx->upload.released++;
+    pthread_cond_broadcast(&ctx->upload.cond);
+    pthread_mutex_unlock(&ctx->upload.mutex);
+}
+
+/* encode the pictures of the upload thread, a GOP queue gets the finished GOPs */
+static void
+mpeg2enc_encode(struct mpeg2enc_context *ctx)
+{
+    struct mpeg2enc_input_picture *picture;
+    int gop = -1, frames = 0, coded_order, num_pictures, last;
+
+    while ((picture = upload_wait(ctx)) != NULL) {
+        if (picture->gop != gop) {
+            gop = picture->gop;
+            frames = 0;
+            ctx->new_sequence = (gop == 0);
+            ctx->new_gop_header = 1;
+            ctx->gop_header_in_display_order = picture->display_order;
+            if (ctx->gop_queue)
+                ctx->gop_output = &ctx->gop_queue->gop[gop % ctx->gop_queue->window];
+        }
 
-    while (coded_order < ctx->num_pictures) {
-        type = ctx->next_type;
-        display_order = ctx->next_display_order;
-        /* follow the IPBxxBPBxxB mode */
-        update_next_frame_info(ctx, type, coded_order, display_order);
         encode_picture(ctx,
-                       coded_order,
-                       display_order,
-                       type,
-                       ctx->next_type == VAEncPictureTypeBidirectional,
-                       ctx->next_display_order);
+                       picture->coded_order,
+                       picture->display_order,
+                       picture->type,
+                       picture->next_is_bpic);
 
-        /* update gop_header */
-        ctx->new_sequence = 0;
-        ctx->new_gop_header = ctx->next_type == VAEncPictureTypeIntra;
+        coded_order = picture->coded_order + 1;
+        last = picture->last;
+        upload_release(ctx);
 
-        if (ctx->new_gop_header)
-            ctx->gop_header_in_display_order += ctx->intra_period;
+        ctx->new_sequence = 0;
+        ctx->new_gop_header = 0;
+        frames++;
 
-        coded_order++;
+        if (ctx->gop_queue) {
+            if (last) {
+                ctx->gop_output->frames = frames;
+                gop_queue_submit(ctx, gop);
+            }
+            continue;
+        }
 
-        fprintf(stderr, "\r %d/%d ...", coded_order, ctx->num_pictures);
+        num_pictures = mpeg2enc_num_pictures(ctx);
+        if (num_pictures == INT_MAX)
+            fprintf(stderr, "\r %d ...", coded_order);
+        else
+            fprintf(stderr, "\r %d/%d ...", coded_order, num_pictures);
         fflush(stdout);
     }
 }
 
+static void
+print_upload_stats(unsigned long long wait_us, unsigned long long stall_us, int frames)
+{
+    fprintf(stderr, "the encoder waited %.1f ms for an upload (%.3f ms per frame), "
+            "the uploads waited %.1f ms for a free input surface\n",
+            wait_us / 1000.0, frames ? wait_us / 1000.0 / frames : 0.0, stall_us / 1000.0);
+}
+
+static void
+mpeg2enc_run(struct mpeg2enc_context *ctx)
+{
+    mpeg2enc_upload_start(ctx);
+    mpeg2enc_encode(ctx);
+    mpeg2enc_upload_stop(ctx);
+
+    fprintf(stderr, "\n");
+    print_upload_stats(ctx->upload.wait_us, ctx->upload.stall_us, ctx->num_pictures);
+}
+
+static void *
+gop_worker(void *data)
+{
+    struct mpeg2enc_context *ctx = data;
+
+    mpeg2enc_upload_start(ctx);
+    mpeg2enc_encode(ctx);
+    mpeg2enc_upload_stop(ctx);
+
+    return NULL;
+}
+
+static void mpeg2enc_release_context(struct mpeg2enc_context *ctx);
+
+/*
+ * closed GOPs (the B pictures of a GOP don't reference the next one) on
+ * ctx->contexts contexts, ctx is the first one
+ */
+static void
+mpeg2enc_run_parallel(struct mpeg2enc_context *ctx)
+{
+    struct mpeg2enc_context *contexts[MPEG2_CONTEXTS_MAX];
+    pthread_t threads[MPEG2_CONTEXTS_MAX];
+    struct mpeg2enc_gop_queue queue;
+    unsigned long long wait_us = 0, stall_us = 0;
+    int i;
+
+    memset(&queue, 0, sizeof(queue));
+    pthread_mutex_init(&queue.mutex, NULL);
+    pthread_cond_init(&queue.cond, NULL);
+    queue.sink = &ctx->sink;
+    queue.window = 2 * ctx->contexts;
+
+    contexts[0] = ctx;
+    for (i = 1; i < ctx->contexts; i++) {
+        contexts[i] = malloc(sizeof(*ctx));
+        assert(contexts[i]);
+        /* the parameters, sizes and VA buffer ids (none in use) of the first context */
+        memcpy(contexts[i], ctx, sizeof(*ctx));
+        mpeg2enc_create_context(contexts[i]);
+    }
+
+    for (i = 0; i < ctx->contexts; i++) {
+        contexts[i]->gop_queue = &queue;
+        pthread_create(&threads[i], NULL, gop_worker, contexts[i]);
+    }
+
+    for (i = 0; i < ctx->contexts; i++) {
+        pthread_join(threads[i], NULL);
+        wait_us += contexts[i]->upload.wait_us;
+        stall_us += contexts[i]->upload.stall_us;
+    }
+
+    for (i = 1; i < ctx->contexts; i++) {
+        mpeg2enc_release_context(contexts[i]);
+        free(contexts[i]);
+    }
+
+    for (i = 0; i < queue.window; i++)
+        free(queue.gop[i].data);
+
+    ctx->num_pictures = queue.frames;
+    fprintf(stderr, "\n%d contexts, %d GOPs, the contexts waited %.1f ms for a GOP to be written\n",
+            ctx->contexts, queue.written, queue.wait_us / 1000.0);
+    print_upload_stats(wait_us, stall_us, ctx->num_pictures);
+}
+
 /*
  * end
  */
 static void
-mpeg2enc_release_va_resources(struct mpeg2enc_context *ctx)
+mpeg2enc_release_context(struct mpeg2enc_context *ctx)
 {
-    vaDestroySurfaces(ctx->va_dpy, surface_ids, SID_NUMBER);	
+    vaDestroySurfaces(ctx->va_dpy, ctx->surface_ids, SID_NUMBER);	
+    vaDestroySurfaces(ctx->va_dpy, ctx->upload.surfaces, ctx->num_input_surfaces);
     vaDestroyContext(ctx->va_dpy, ctx->context_id);
+}
+
+static void
+mpeg2enc_release_va_resources(struct mpeg2enc_context *ctx)
+{
+    mpeg2enc_release_context(ctx);
     vaDestroyConfig(ctx->va_dpy, ctx->config_id);
     vaTerminate(ctx->va_dpy);
     va_close_display(ctx->va_dpy);
@@ -1514,7 +1852,6 @@ mpeg2enc_release_va_resources(struct mpeg2enc_context *ctx)
 static void
 mpeg2enc_end(struct mpeg2enc_context *ctx)
 {
-    pthread_join(ctx->upload_thread_id, NULL);
     mpeg2enc_release_va_resources(ctx);
 }
 
@@ -1522,15 +1859,23 @@ int
 main(int argc, char *argv[])
 {
     struct mpeg2enc_context ctx;
+    struct yuv_input input;
     struct timeval tpstart, tpend; 
     float timeuse;
 
     gettimeofday(&tpstart, NULL);
 
     memset(&ctx, 0, sizeof(ctx));
+    ctx.sink.fd = -1;
+    memset(&input, 0, sizeof(input));
+    input.fd = -1;
+    ctx.input = &input;
     parse_args(&ctx, argc, argv);
     mpeg2enc_init(&ctx);
-    mpeg2enc_run(&ctx);
+    if (ctx.contexts > 1)
+        mpeg2enc_run_parallel(&ctx);
+    else
+        mpeg2enc_run(&ctx);
     mpeg2enc_end(&ctx);
 
     gettimeofday(&tpend, NULL);
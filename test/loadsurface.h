@@ -22,6 +22,9 @@
  * SOFTWARE OR THE USE OR OTHER DEALINGS IN THE SOFTWARE.
  */
 #include "loadsurface_yuv.h"
+#ifdef __SSE2__
+#include <emmintrin.h>
+#endif
 
 static int scale_2dimage(unsigned char *src_img, int src_imgw, int src_imgh,
                          unsigned char *dst_img, int dst_imgw, int dst_imgh)
@@ -288,91 +291,124 @@ static int upload_surface(VADisplay va_dpy, VASurfaceID surface_id,
 }
 
 /*
- * Upload YUV data from memory into a surface
+ * Interleave a row of U and V samples into NV12 UV pairs
+ */
+static void interleave_uv_row(unsigned char *uv, const unsigned char *u,
+                              const unsigned char *v, int width)
+{
+    int j = 0;
+
+#ifdef __SSE2__
+    for (; j + 16 <= width; j += 16) {
+        __m128i u16 = _mm_loadu_si128((const __m128i *)(u + j));
+        __m128i v16 = _mm_loadu_si128((const __m128i *)(v + j));
+
+        _mm_storeu_si128((__m128i *)(uv + 2 * j), _mm_unpacklo_epi8(u16, v16));
+        _mm_storeu_si128((__m128i *)(uv + 2 * j + 16), _mm_unpackhi_epi8(u16, v16));
+    }
+#endif
+    for (; j < width; j++) {
+        uv[2*j] = u[j];
+        uv[2*j+1] = v[j];
+    }
+}
+
+/*
+ * Split a row of NV12 UV pairs into U and V samples
+ */
+static void deinterleave_uv_row(unsigned char *u, unsigned char *v,
+                                const unsigned char *uv, int width)
+{
+    int j = 0;
+
+#ifdef __SSE2__
+    const __m128i mask = _mm_set1_epi16(0xff);
+
+    for (; j + 16 <= width; j += 16) {
+        __m128i lo = _mm_loadu_si128((const __m128i *)(uv + 2 * j));
+        __m128i hi = _mm_loadu_si128((const __m128i *)(uv + 2 * j + 16));
+
+        _mm_storeu_si128((__m128i *)(u + j),
+                         _mm_packus_epi16(_mm_and_si128(lo, mask), _mm_and_si128(hi, mask)));
+        _mm_storeu_si128((__m128i *)(v + j),
+                         _mm_packus_epi16(_mm_srli_epi16(lo, 8), _mm_srli_epi16(hi, 8)));
+    }
+#endif
+    for (; j < width; j++) {
+        u[j] = uv[2*j];
+        v[j] = uv[2*j+1];
+    }
+}
+
+/*
+ * Copy rows [row_start, row_end) of YUV data from memory into a mapped
+ * image, row_start/row_end must be even; callers may split a frame in
+ * row bands and upload them in parallel
  * if src_fourcc == NV12, assume the buffer pointed by src_U
  * is UV interleaved (src_V is ignored)
  */
-static int upload_surface_yuv(VADisplay va_dpy, VASurfaceID surface_id,
-                              int src_fourcc, int src_width, int src_height,
-                              unsigned char *src_Y, unsigned char *src_U, unsigned char *src_V)
+static void upload_image_yuv_rows(VAImage *surface_image, unsigned char *surface_p,
+                                  int src_fourcc, int src_width,
+                                  unsigned char *src_Y, unsigned char *src_U, unsigned char *src_V,
+                                  int row_start, int row_end)
 {
-    VAImage surface_image;
-    unsigned char *surface_p=NULL, *Y_start=NULL, *U_start=NULL, *V_start=NULL;
-    int Y_pitch=0, U_pitch=0, V_pitch=0, row;
-    VAStatus va_status;
-    
-    va_status = vaDeriveImage(va_dpy,surface_id, &surface_image);
-    CHECK_VASTATUS(va_status,"vaDeriveImage");
-
-    vaMapBuffer(va_dpy,surface_image.buf,(void **)&surface_p);
-    assert(VA_STATUS_SUCCESS == va_status);
+    unsigned char *Y_start=NULL, *U_start=NULL;
+    int Y_pitch=0, U_pitch=0, row;
 
     Y_start = surface_p;
-    Y_pitch = surface_image.pitches[0];
-    switch (surface_image.format.fourcc) {
+    Y_pitch = surface_image->pitches[0];
+    switch (surface_image->format.fourcc) {
     case VA_FOURCC_NV12:
-        U_start = (unsigned char *)surface_p + surface_image.offsets[1];
-        V_start = U_start + 1;
-        U_pitch = surface_image.pitches[1];
-        V_pitch = surface_image.pitches[1];
-        break;
-    case VA_FOURCC_IYUV:
-        U_start = (unsigned char *)surface_p + surface_image.offsets[1];
-        V_start = (unsigned char *)surface_p + surface_image.offsets[2];
-        U_pitch = surface_image.pitches[1];
-        V_pitch = surface_image.pitches[2];
-        break;
-    case VA_FOURCC_YV12:
-        U_start = (unsigned char *)surface_p + surface_image.offsets[2];
-        V_start = (unsigned char *)surface_p + surface_image.offsets[1];
-        U_pitch = surface_image.pitches[2];
-        V_pitch = surface_image.pitches[1];
-        break;
-    case VA_FOURCC_YUY2:
-        U_start = surface_p + 1;
-        V_start = surface_p + 3;
-        U_pitch = surface_image.pitches[0];
-        V_pitch = surface_image.pitches[0];
+        U_start = (unsigned char *)surface_p + surface_image->offsets[1];
+        U_pitch = surface_image->pitches[1];
         break;
     default:
+        printf("unsupported fourcc in load_surface_yuv\n");
         assert(0);
+        return;
     }
 
     /* copy Y plane */
-    for (row=0;row<src_height;row++) {
+    for (row=row_start;row<row_end;row++) {
         unsigned char *Y_row = Y_start + row * Y_pitch;
         memcpy(Y_row, src_Y + row*src_width, src_width);
     }
   
-    for (row =0; row < src_height/2; row++) {
+    for (row = row_start/2; row < row_end/2; row++) {
         unsigned char *U_row = U_start + row * U_pitch;
-        unsigned char *u_ptr = NULL, *v_ptr=NULL;
-        int j;
-        switch (surface_image.format.fourcc) {
-        case VA_FOURCC_NV12:
-            if (src_fourcc == VA_FOURCC_NV12) {
-                memcpy(U_row, src_U + row * src_width, src_width);
-                break;
-            } else if (src_fourcc == VA_FOURCC_IYUV) {
-                u_ptr = src_U + row * (src_width/2);
-                v_ptr = src_V + row * (src_width/2);
-            } else if (src_fourcc == VA_FOURCC_YV12) {
-                v_ptr = src_U + row * (src_width/2);
-                u_ptr = src_V + row * (src_width/2);
-            }
-            for(j = 0; j < src_width/2; j++) {
-                U_row[2*j] = u_ptr[j];
-                U_row[2*j+1] = v_ptr[j];
-            }
-            break;
-        case VA_FOURCC_IYUV:
-        case VA_FOURCC_YV12:
-        case VA_FOURCC_YUY2:
-        default:
-            printf("unsupported fourcc in load_surface_yuv\n");
-            assert(0);
-        }
+
+        if (src_fourcc == VA_FOURCC_NV12)
+            memcpy(U_row, src_U + row * src_width, src_width);
+        else if (src_fourcc == VA_FOURCC_IYUV)
+            interleave_uv_row(U_row, src_U + row * (src_width/2),
+                              src_V + row * (src_width/2), src_width/2);
+        else if (src_fourcc == VA_FOURCC_YV12)
+            interleave_uv_row(U_row, src_V + row * (src_width/2),
+                              src_U + row * (src_width/2), src_width/2);
     }
+}
+
+/*
+ * Upload YUV data from memory into a surface
+ * if src_fourcc == NV12, assume the buffer pointed by src_U
+ * is UV interleaved (src_V is ignored)
+ */
+static int upload_surface_yuv(VADisplay va_dpy, VASurfaceID surface_id,
+                              int src_fourcc, int src_width, int src_height,
+                              unsigned char *src_Y, unsigned char *src_U, unsigned char *src_V)
+{
+    VAImage surface_image;
+    unsigned char *surface_p=NULL;
+    VAStatus va_status;
+    
+    va_status = vaDeriveImage(va_dpy,surface_id, &surface_image);
+    CHECK_VASTATUS(va_status,"vaDeriveImage");
+
+    vaMapBuffer(va_dpy,surface_image.buf,(void **)&surface_p);
+    assert(VA_STATUS_SUCCESS == va_status);
+
+    upload_image_yuv_rows(&surface_image, surface_p, src_fourcc, src_width,
+                          src_Y, src_U, src_V, 0, src_height);
     
     vaUnmapBuffer(va_dpy,surface_image.buf);
 
@@ -445,7 +481,6 @@ static int download_surface_yuv(VADisplay va_dpy, VASurfaceID surface_id,
     for (row =0; row < dst_height/2; row++) {
         unsigned char *U_row = U_start + row * U_pitch;
         unsigned char *u_ptr = NULL, *v_ptr = NULL;
-        int j;
         switch (surface_image.format.fourcc) {
         case VA_FOURCC_NV12:
             if (dst_fourcc == VA_FOURCC_NV12) {
@@ -458,10 +493,7 @@ static int download_surface_yuv(VADisplay va_dpy, VASurfaceID surface_id,
                 v_ptr = dst_U + row * (dst_width/2);
                 u_ptr = dst_V + row * (dst_width/2);
             }
-            for(j = 0; j < dst_width/2; j++) {
-                u_ptr[j] = U_row[2*j];
-                v_ptr[j] = U_row[2*j+1];
-            }
+            deinterleave_uv_row(u_ptr, v_ptr, U_row, dst_width/2);
             break;
         case VA_FOURCC_IYUV:
         case VA_FOURCC_YV12:
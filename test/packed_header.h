@@ -0,0 +1,187 @@
+/*
+ * Copyright (c) 2016 Intel Corporation. All Rights Reserved.
+ *
+ * Permission is hereby granted, free of charge, to any person obtaining a
+ * copy of this software and associated documentation files (the
+ * "Software"), to deal in the Software without restriction, including
+ * without limitation the rights to use, copy, modify, merge, publish,
+ * distribute, sub license, and/or sell copies of the Software, and to
+ * permit persons to whom the Software is furnished to do so, subject to
+ * the following conditions:
+ *
+ * The above copyright notice and this permission notice (including the
+ * next paragraph) shall be included in all copies or substantial portions
+ * of the Software.
+ *
+ * THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND, EXPRESS
+ * OR IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF
+ * MERCHANTABILITY, FITNESS FOR A PARTICULAR PURPOSE AND NON-INFRINGEMENT.
+ * IN NO EVENT SHALL PRECISION INSIGHT AND/OR ITS SUPPLIERS BE LIABLE FOR
+ * ANY CLAIM, DAMAGES OR OTHER LIABILITY, WHETHER IN AN ACTION OF CONTRACT,
+ * TORT OR OTHERWISE, ARISING FROM, OUT OF OR IN CONNECTION WITH THE
+ * SOFTWARE OR THE USE OR OTHER DEALINGS IN THE SOFTWARE.
+ */
+
+/*
+ * Packed header templates for the encode tests
+ *
+ * A packed header (SPS, PPS, SEI ...) is serialized once, together with a
+ * copy of the parameters it was built from (the key). packed_header_lookup()
+ * tells the caller whether the template is still valid for the current
+ * parameters; when they changed, the template is dropped and the caller
+ * writes it again between packed_header_start() and packed_header_end().
+ *
+ * Fields which change on every picture (e.g. the SEI timing delays) are
+ * written as fixed length fields, their bit position is recorded by the
+ * caller and packed_header_patch() overwrites them in place in the template.
+ *
+ * packed_header_buffers() creates the VAEncPackedHeaderParameterBuffer/
+ * VAEncPackedHeaderDataBuffer pair of one picture from the template. The
+ * pair belongs to the caller, it is disposed of like the other parameter
+ * buffers of the picture; only the template is kept from one picture to
+ * the next.
+ *
+ * As loadsurface.h, this file expects CHECK_VASTATUS from the includer.
+ */
+#ifndef PACKED_HEADER_H
+#define PACKED_HEADER_H
+
+#include <stdlib.h>
+#include <string.h>
+#include <assert.h>
+#include "bitstream.h"
+
+#define PACKED_HEADER_MAX_SIZE  256     /* in bytes, SPS/PPS/SEI take a few dozen */
+
+struct packed_header {
+    unsigned int type;                  /* VAEncPackedHeaderType */
+    unsigned char data[PACKED_HEADER_MAX_SIZE];
+    unsigned int length_in_bits;        /* 0: no valid template */
+    void *key;                          /* parameters the template was built from */
+    unsigned int key_size;
+    unsigned int num_builds;
+    unsigned int num_reuses;
+};
+
+static inline void
+packed_header_init(struct packed_header *header, unsigned int type)
+{
+    memset(header, 0, sizeof(*header));
+    header->type = type;
+}
+
+/* drop the template, the key is kept */
+static inline void
+packed_header_invalidate(struct packed_header *header)
+{
+    header->length_in_bits = 0;
+}
+
+static inline void
+packed_header_release(struct packed_header *header)
+{
+    packed_header_invalidate(header);
+    free(header->key);
+    header->key = NULL;
+    header->key_size = 0;
+}
+
+/*
+ * 1 if the template was built from the same key, otherwise it is
+ * invalidated, the new key stored and the caller has to build it
+ */
+static inline int
+packed_header_lookup(struct packed_header *header,
+                     const void *key, unsigned int key_size)
+{
+    if (header->length_in_bits &&
+        header->key_size == key_size &&
+        !memcmp(header->key, key, key_size)) {
+        header->num_reuses++;
+        return 1;
+    }
+
+    packed_header_invalidate(header);
+    if (header->key_size != key_size) {
+        free(header->key);
+        header->key = malloc(key_size);
+        assert(header->key);
+        header->key_size = key_size;
+    }
+    memcpy(header->key, key, key_size);
+
+    return 0;
+}
+
+static inline void
+packed_header_start(struct packed_header *header, bitstream *bs)
+{
+    bitstream_start_buffer(bs, header->data, sizeof(header->data));
+}
+
+static inline void
+packed_header_end(struct packed_header *header, bitstream *bs)
+{
+    bitstream_end(bs);
+    assert(!bs->overflow);
+    header->length_in_bits = bs->bit_offset;
+    header->num_builds++;
+}
+
+/*
+ * overwrite the size_in_bits field at bit_offset of the template, it must
+ * be written without emulation prevention bytes
+ */
+static inline void
+packed_header_patch(struct packed_header *header,
+                    unsigned int bit_offset, unsigned int value, int size_in_bits)
+{
+    int i;
+
+    assert(size_in_bits > 0 && size_in_bits <= 32);
+    assert(bit_offset + size_in_bits <= header->length_in_bits);
+
+    for (i = 0; i < size_in_bits; i++) {
+        unsigned int bit = bit_offset + i;
+        unsigned char mask = 0x80 >> (bit & 7);
+
+        if ((value >> (size_in_bits - 1 - i)) & 1)
+            header->data[bit / 8] |= mask;
+        else
+            header->data[bit / 8] &= ~mask;
+    }
+}
+
+/*
+ * create the parameter/data buffers of the template for the picture about
+ * to be rendered in buffers[0..1], returns the number of buffers
+ */
+static inline int
+packed_header_buffers(VADisplay va_dpy, VAContextID context_id,
+                      struct packed_header *header, VABufferID *buffers)
+{
+    VAEncPackedHeaderParameterBuffer packed_header_param_buffer;
+    VAStatus va_status;
+
+    assert(header->length_in_bits);
+
+    packed_header_param_buffer.type = header->type;
+    packed_header_param_buffer.bit_length = header->length_in_bits;
+    packed_header_param_buffer.has_emulation_bytes = 0;
+
+    va_status = vaCreateBuffer(va_dpy, context_id,
+                               VAEncPackedHeaderParameterBufferType,
+                               sizeof(packed_header_param_buffer), 1, &packed_header_param_buffer,
+                               &buffers[0]);
+    CHECK_VASTATUS(va_status, "vaCreateBuffer");
+
+    va_status = vaCreateBuffer(va_dpy, context_id,
+                               VAEncPackedHeaderDataBufferType,
+                               (header->length_in_bits + 7) / 8, 1, header->data,
+                               &buffers[1]);
+    CHECK_VASTATUS(va_status, "vaCreateBuffer");
+
+    return 2;
+}
+
+#endif /* PACKED_HEADER_H */
@@ -28,8 +28,12 @@
  * then it will encode it to a 264 file(test.264).
  *
  * ./mpeg2transcode  : only do decode
- * ./mpeg2transcode <any parameter >: decode+vpp+encode
+ * ./mpeg2transcode <frames>: decode+vpp+encode, the clip is decoded <frames> times
+ * ./mpeg2transcode <frames> 1280x960,640x480,320x240: one encode per size
  *
+ * The transcode runs as a pipeline: a decode thread, a VPP thread and the
+ * encoder in the main thread. The decoded (and scaled) surfaces are the
+ * input surfaces of the encoder, nothing is read back to the CPU.
  */  
 #include <stdio.h>
 #include <string.h>
@@ -71,6 +75,8 @@ sp<SurfaceControl> surface_ctrl;
 #include <va/va_x11.h>
 #include <X11/Xlib.h>
 #endif
+#include "../bitstream.h"
+#include "../coded_sink.h"
 
 #define CHECK_VASTATUS(va_status,func)                                  \
 if (va_status != VA_STATUS_SUCCESS) {                                   \
@@ -1935,16 +1941,12 @@ static  pthread_mutex_t gmutex;
 static  int box_width = 32;
 static  int multi_thread = 0;
 static  int verbose = 0;
-static  int zoom_out = 4;
-static VASurfaceID zoom_surface_id = VA_INVALID_SURFACE;
 
 static Display *x11_display;
 static VADisplay va_dpy;
 
-static int picture_width = 1280, picture_width_in_mbs = 80;
-static int picture_height = 960, picture_height_in_mbs = 60;
-static int frame_size = picture_width * picture_height +  ((picture_width * picture_height) >> 1) ;
-static unsigned char *newImageBuffer = 0;
+static int picture_width = 1280;
+static int picture_height = 960;
 
 static int qp_value = 26;
 
@@ -1958,22 +1960,18 @@ static int frame_bit_rate = -1;
 
 #define MAX_SLICES      32
 
-static int
-build_packed_pic_buffer(unsigned char **header_buffer);
-
-static int
-build_packed_seq_buffer(unsigned char **header_buffer);
-
-struct upload_thread_param
-{
-    FILE *yuv_fp;
-    VASurfaceID surface_id;
-};
-
-static void 
-upload_yuv_to_surface(FILE *yuv_fp, VASurfaceID surface_id);
+/***************************************************
+ *
+ *  The encode pipe resource define 
+ *
+ ***************************************************/
+#define SID_REFERENCE_PICTURE_L0                0
+#define SID_REFERENCE_PICTURE_L1                1
+#define SID_RECON_PICTURE                       2
+#define SID_NUMBER                              SID_RECON_PICTURE + 1
 
-static struct {
+/* one H.264 encode pipe, every rendition has its own */
+struct avcenc_context {
     VAProfile profile;
     VAEncSequenceParameterBufferH264 seq_param;
     VAEncPictureParameterBufferH264 pic_param;
@@ -1991,13 +1989,18 @@ static struct {
     int num_slices;
     int codedbuf_i_size;
     int codedbuf_pb_size;
-    int current_input_surface;
-    struct upload_thread_param upload_thread_param;
-    pthread_t upload_thread_id;
-    int upload_thread_value;
-} avcenc_context;
+    VASurfaceID input_surface_id;               /* decoded (and scaled) picture */
+    int picture_width, picture_height;
+    VASurfaceID surface_ids[SID_NUMBER];        /* reference and reconstructed pictures */
+};
+
+static int
+build_packed_pic_buffer(struct avcenc_context *avc, unsigned char **header_buffer);
+
+static int
+build_packed_seq_buffer(struct avcenc_context *avc, unsigned char **header_buffer);
 
-static void create_encode_pipe()
+static void create_encode_pipe(struct avcenc_context *avc)
 {
     VAEntrypoint entrypoints[5];
     int num_entrypoints,slice_entrypoint;
@@ -2012,7 +2015,7 @@ static void create_encode_pipe()
     va_status = vaInitialize(va_dpy, &major_ver, &minor_ver);
     CHECK_VASTATUS(va_status, "vaInitialize");
 #endif
-    vaQueryConfigEntrypoints(va_dpy, avcenc_context.profile, entrypoints, 
+    vaQueryConfigEntrypoints(va_dpy, avc->profile, entrypoints, 
                              &num_entrypoints);
 
     for	(slice_entrypoint = 0; slice_entrypoint < num_entrypoints; slice_entrypoint++) {
@@ -2028,7 +2031,7 @@ static void create_encode_pipe()
     /* find out the format for the render target, and rate control mode */
     attrib[0].type = VAConfigAttribRTFormat;
     attrib[1].type = VAConfigAttribRateControl;
-    vaGetConfigAttributes(va_dpy, avcenc_context.profile, VAEntrypointEncSlice,
+    vaGetConfigAttributes(va_dpy, avc->profile, VAEntrypointEncSlice,
                           &attrib[0], 2);
 
     if ((attrib[0].value & VA_RT_FORMAT_YUV420) == 0) {
@@ -2045,178 +2048,417 @@ static void create_encode_pipe()
     attrib[0].value = VA_RT_FORMAT_YUV420; /* set to desired RT format */
     attrib[1].value = VA_RC_CQP; /* set to desired RC mode */
 
-    va_status = vaCreateConfig(va_dpy, avcenc_context.profile, VAEntrypointEncSlice,
-                               &attrib[0], 2,&avcenc_context.config_id);
+    va_status = vaCreateConfig(va_dpy, avc->profile, VAEntrypointEncSlice,
+                               &attrib[0], 2,&avc->config_id);
     CHECK_VASTATUS(va_status, "vaCreateConfig");
 
     /* Create a context for this decode pipe */
-    va_status = vaCreateContext(va_dpy, avcenc_context.config_id,
-                                picture_width, picture_height,
+    va_status = vaCreateContext(va_dpy, avc->config_id,
+                                avc->picture_width, avc->picture_height,
                                 VA_PROGRESSIVE, 
                                 0, 0,
-                                &avcenc_context.context_id);
+                                &avc->context_id);
     CHECK_VASTATUS(va_status, "vaCreateContext");
 }
 
-static void destory_encode_pipe()
+static void destory_encode_pipe(struct avcenc_context *avc)
 {
-    vaDestroyContext(va_dpy,avcenc_context.context_id);
-    vaDestroyConfig(va_dpy,avcenc_context.config_id);
-    vaTerminate(va_dpy);
-    XCloseDisplay(x11_display);
+    vaDestroyContext(va_dpy,avc->context_id);
+    vaDestroyConfig(va_dpy,avc->config_id);
 }
 
 /***************************************************
  *
- *  The encode pipe resource define 
+ *  The transcode pipeline
  *
  ***************************************************/
-#define SID_INPUT_PICTURE_0                     0
-#define SID_INPUT_PICTURE_1                     1
-#define SID_REFERENCE_PICTURE_L0                2
-#define SID_REFERENCE_PICTURE_L1                3
-#define SID_RECON_PICTURE                       4
-#define SID_NUMBER                              SID_RECON_PICTURE + 1
-static  VASurfaceID surface_ids[SID_NUMBER];
+#define DECODE_SURFACES         6       /* decode render targets */
+#define REORDER_SURFACES        4       /* input pictures the encoder holds for the B frames */
+#define SCALER_SURFACES         8       /* output surfaces of a scaler */
+#define SURFACE_QUEUE_MAX       8
+#define RENDITION_MAX           8
 
-static int frame_number;
-static int enc_frame_number;
+/*
+ * Surfaces handed from one stage to the next, in display order. The decode
+ * thread takes its render targets from decode_free and queues every decoded
+ * surface to the decoded queue of each rendition. The VPP thread of a
+ * rendition scales it, drops its reference to the decoded surface once the
+ * scaled one is synced and queues the scaled surface to scaled, where the
+ * encode thread of the rendition takes it. A rendition at the size of the
+ * clip encodes the decoded surface itself and drops its reference after it
+ * was encoded. The decoded surface goes back to decode_free once no
+ * rendition references it.
+ */
+struct surface_queue
+{
+    pthread_mutex_t mutex;
+    pthread_cond_t cond;
+    VASurfaceID surface_ids[SURFACE_QUEUE_MAX];
+    int head, count;
+    int end;
+};
 
-/***************************************************/
+/*
+ * A VPP context scaling in_width x in_height surfaces to out_width x
+ * out_height, created once with a pool of output surfaces. The pipeline
+ * parameter buffer is created for every picture and destroyed after
+ * vaEndPicture(), as the decode buffers are.
+ */
+struct vpp_scaler
+{
+    VAConfigID config_id;
+    VAContextID context_id;
+    VASurfaceID surface_ids[SCALER_SURFACES];
+    struct surface_queue free_surfaces;
+    VARectangle surface_region;
+    VARectangle output_region;
+};
 
-static void *
-upload_thread_function(void *data)
+/* one output of the ladder, it is scaled and encoded by its own threads */
+struct rendition
+{
+    int width, height;
+    int scale;                                  /* through a VPP scaler, not the clip size */
+    struct vpp_scaler scaler;
+    struct avcenc_context avc;
+    struct coded_sink sink;
+    struct surface_queue decoded;
+    struct surface_queue scaled;
+    VASurfaceID input_surface_ids[REORDER_SURFACES];
+    int input_frames;                           /* taken from scaled */
+    int released_frames;                        /* encoded, the surfaces are released */
+    int enc_frame_number;
+    pthread_t scale_thread, encode_thread;
+    float seconds;                              /* from the start to the last picture encoded */
+};
+
+static struct {
+    VAContextID decode_context_id;
+    int frames;
+    struct timeval start;
+    VASurfaceID decode_surface_ids[DECODE_SURFACES];
+    int decode_refs[DECODE_SURFACES];           /* renditions still using the decoded surface */
+    pthread_mutex_t decode_refs_mutex;
+    struct surface_queue decode_free;
+    int num_renditions;
+    struct rendition renditions[RENDITION_MAX];
+} transcode_context;
+
+static void surface_queue_init(struct surface_queue *queue)
 {
-    struct upload_thread_param *param = (upload_thread_param*)data;
+    memset(queue, 0, sizeof(*queue));
+    pthread_mutex_init(&queue->mutex, NULL);
+    pthread_cond_init(&queue->cond, NULL);
+}
 
-    upload_yuv_to_surface(param->yuv_fp, param->surface_id);
+static void surface_queue_put(struct surface_queue *queue, VASurfaceID surface_id)
+{
+    pthread_mutex_lock(&queue->mutex);
+    while (queue->count == SURFACE_QUEUE_MAX)
+        pthread_cond_wait(&queue->cond, &queue->mutex);
+    queue->surface_ids[(queue->head + queue->count) % SURFACE_QUEUE_MAX] = surface_id;
+    queue->count++;
+    pthread_cond_broadcast(&queue->cond);
+    pthread_mutex_unlock(&queue->mutex);
+}
 
-    return NULL;
+/* no more surfaces will be put */
+static void surface_queue_end(struct surface_queue *queue)
+{
+    pthread_mutex_lock(&queue->mutex);
+    queue->end = 1;
+    pthread_cond_broadcast(&queue->cond);
+    pthread_mutex_unlock(&queue->mutex);
 }
 
-static void alloc_encode_resource(FILE *yuv_fp)
+/* the oldest surface, VA_INVALID_SURFACE once the queue is empty and ended */
+static VASurfaceID surface_queue_get(struct surface_queue *queue)
+{
+    VASurfaceID surface_id = VA_INVALID_SURFACE;
+
+    pthread_mutex_lock(&queue->mutex);
+    while (queue->count == 0 && !queue->end)
+        pthread_cond_wait(&queue->cond, &queue->mutex);
+    if (queue->count) {
+        surface_id = queue->surface_ids[queue->head];
+        queue->head = (queue->head + 1) % SURFACE_QUEUE_MAX;
+        queue->count--;
+        pthread_cond_broadcast(&queue->cond);
+    }
+    pthread_mutex_unlock(&queue->mutex);
+
+    return surface_id;
+}
+
+static void surface_queue_destroy(struct surface_queue *queue)
+{
+    pthread_cond_destroy(&queue->cond);
+    pthread_mutex_destroy(&queue->mutex);
+}
+
+static void vpp_scaler_create(struct vpp_scaler *scaler,
+                              int in_width, int in_height,
+                              int out_width, int out_height,
+                              unsigned int rt_format)
 {
     VAStatus va_status;
+    VAEntrypoint entrypoints[5];
+    VAConfigAttrib attrib;
+    VAProcPipelineCaps vpp_cap;
+    int num_entrypoints, proc_entrypoint;
+    VABufferID filter_bufs[VAProcFilterCount];
+    unsigned int num_filter_bufs = 0;
+    int i;
+
+    memset(scaler, 0, sizeof(*scaler));
+
+    va_status = vaQueryConfigEntrypoints(va_dpy,
+                                         VAProfileNone,
+                                         entrypoints,
+                                         &num_entrypoints);
+    CHECK_VASTATUS(va_status, "vaQueryConfigEntrypoints");
+
+    for	(proc_entrypoint = 0; proc_entrypoint < num_entrypoints; proc_entrypoint++) {
+        if (entrypoints[proc_entrypoint] == VAEntrypointVideoProc)
+            break;
+    }
+
+    if (proc_entrypoint == num_entrypoints) {
+        /* not find Video Proc entry point */
+        assert(0);
+    }
+
+    attrib.type = VAConfigAttribRTFormat;
+    vaGetConfigAttributes(va_dpy,
+                          VAProfileNone,
+                          VAEntrypointVideoProc,
+                          &attrib,
+                          1);
+
+    if ((attrib.value & rt_format) == 0) {
+        assert(0);
+    }
+
+    attrib.value = rt_format;
+    va_status = vaCreateConfig(va_dpy,
+                               VAProfileNone, 
+                               VAEntrypointVideoProc,
+                               &attrib,
+                               1,
+                               &scaler->config_id);
+    CHECK_VASTATUS(va_status, "vaCreateConfig");
 
-    // Create surface
     va_status = vaCreateSurfaces(va_dpy,
-                                 picture_width, picture_height,
-                                 VA_RT_FORMAT_YUV420, SID_NUMBER,
-                                 &surface_ids[0]);
+                                 out_width,
+                                 out_height,
+                                 rt_format,
+                                 SCALER_SURFACES,
+                                 scaler->surface_ids);
     CHECK_VASTATUS(va_status, "vaCreateSurfaces");
 
-    newImageBuffer = (unsigned char *)malloc(frame_size);
+    /* Create a context for VPP pipe */
+    va_status = vaCreateContext(va_dpy,
+                                scaler->config_id,
+                                in_width,
+                                in_height,
+                                VA_PROGRESSIVE,
+                                scaler->surface_ids,
+                                SCALER_SURFACES,
+                                &scaler->context_id);
+    CHECK_VASTATUS(va_status, "vaCreateContext");
 
-    /* firstly upload YUV data to SID_INPUT_PICTURE_1 */
-    avcenc_context.upload_thread_param.yuv_fp = yuv_fp;
-    avcenc_context.upload_thread_param.surface_id = surface_ids[SID_INPUT_PICTURE_1];
-#if 0
-    avcenc_context.upload_thread_value = pthread_create(&avcenc_context.upload_thread_id,
-                                                        NULL,
-                                                        upload_thread_function, 
-                                                        (void*)&avcenc_context.upload_thread_param);
-#endif
-upload_yuv_to_surface(yuv_fp, surface_ids[SID_INPUT_PICTURE_1]);
+    va_status = vaQueryVideoProcPipelineCaps(va_dpy,
+                                             scaler->context_id,
+                                             filter_bufs, num_filter_bufs,
+                                             &vpp_cap);
+    CHECK_VASTATUS(va_status, "vaQueryVideoProcPipelineCaps");
+
+    scaler->surface_region.x = 0;
+    scaler->surface_region.y = 0;
+    scaler->surface_region.width = in_width;
+    scaler->surface_region.height = in_height;
+
+    scaler->output_region.x = 0;
+    scaler->output_region.y = 0;
+    scaler->output_region.width = out_width;
+    scaler->output_region.height = out_height;
+
+    surface_queue_init(&scaler->free_surfaces);
+    for (i = 0; i < SCALER_SURFACES; i++)
+        surface_queue_put(&scaler->free_surfaces, scaler->surface_ids[i]);
 }
 
-static void release_encode_resource()
+/* scale in_surface_id into a free output surface, waits for one */
+static VASurfaceID vpp_scaler_scale(struct vpp_scaler *scaler, VASurfaceID in_surface_id)
 {
-    //pthread_join(avcenc_context.upload_thread_id, NULL);
-    free(newImageBuffer);
+    VAStatus va_status;
+    VAProcPipelineParameterBuffer pipeline_param;
+    VABufferID pipeline_param_buf_id;
+    VASurfaceID out_surface_id;
+
+    out_surface_id = surface_queue_get(&scaler->free_surfaces);
 
+    memset(&pipeline_param, 0, sizeof(pipeline_param));
+    pipeline_param.surface = in_surface_id;
+    pipeline_param.surface_region = &scaler->surface_region;
+    pipeline_param.output_region = &scaler->output_region;
+
+    va_status = vaCreateBuffer(va_dpy,
+                               scaler->context_id,
+                               VAProcPipelineParameterBufferType,
+                               sizeof(pipeline_param),
+                               1,
+                               &pipeline_param,
+                               &pipeline_param_buf_id);
+    CHECK_VASTATUS(va_status, "vaCreateBuffer");
+
+    va_status = vaBeginPicture(va_dpy,
+                               scaler->context_id,
+                               out_surface_id);
+    CHECK_VASTATUS(va_status, "vaBeginPicture");
+
+    va_status = vaRenderPicture(va_dpy,
+                                scaler->context_id,
+                                &pipeline_param_buf_id,
+                                1);
+    CHECK_VASTATUS(va_status, "vaRenderPicture");
+
+    va_status = vaEndPicture(va_dpy, scaler->context_id);
+    CHECK_VASTATUS(va_status, "vaEndPicture");
+
+    vaDestroyBuffer(va_dpy, pipeline_param_buf_id);
+
+    return out_surface_id;
+}
+
+/* the output surface was consumed */
+static void vpp_scaler_release(struct vpp_scaler *scaler, VASurfaceID surface_id)
+{
+    surface_queue_put(&scaler->free_surfaces, surface_id);
+}
+
+static void vpp_scaler_destroy(struct vpp_scaler *scaler)
+{
+    vaDestroyContext(va_dpy, scaler->context_id);
+    vaDestroySurfaces(va_dpy, scaler->surface_ids, SCALER_SURFACES);
+    vaDestroyConfig(va_dpy, scaler->config_id);
+    surface_queue_destroy(&scaler->free_surfaces);
+}
+
+static int decode_surface_index(VASurfaceID surface_id)
+{
+    int i;
+
+    for (i = 0; i < DECODE_SURFACES; i++) {
+        if (transcode_context.decode_surface_ids[i] == surface_id)
+            return i;
+    }
+
+    assert(0);
+    return -1;
+}
+
+/* a rendition is done with the decoded surface, the last one gives it back to the decoder */
+static void release_decoded_surface(VASurfaceID surface_id)
+{
+    int index = decode_surface_index(surface_id);
+    int refs;
+
+    pthread_mutex_lock(&transcode_context.decode_refs_mutex);
+    refs = --transcode_context.decode_refs[index];
+    pthread_mutex_unlock(&transcode_context.decode_refs_mutex);
+
+    assert(refs >= 0);
+    if (refs == 0)
+        surface_queue_put(&transcode_context.decode_free, surface_id);
+}
+
+/* the input surface of display_num, the pipeline delivers them in display order */
+static VASurfaceID get_input_surface(struct rendition *rendition, int display_num)
+{
+    VASurfaceID surface_id;
+
+    if (display_num >= transcode_context.frames)
+        display_num = transcode_context.frames - 1;
+
+    assert(display_num >= rendition->released_frames);
+
+    while (rendition->input_frames <= display_num) {
+        assert(rendition->input_frames - rendition->released_frames < REORDER_SURFACES);
+        surface_id = surface_queue_get(&rendition->scaled);
+        assert(surface_id != VA_INVALID_SURFACE);
+        rendition->input_surface_ids[rendition->input_frames % REORDER_SURFACES] = surface_id;
+        rendition->input_frames++;
+    }
+
+    return rendition->input_surface_ids[display_num % REORDER_SURFACES];
+}
+
+/* the pictures before display_num were encoded, give their surfaces back */
+static void release_input_surfaces(struct rendition *rendition, int display_num)
+{
+    VASurfaceID surface_id;
+
+    while (rendition->released_frames < display_num &&
+           rendition->released_frames < rendition->input_frames) {
+        surface_id = rendition->input_surface_ids[rendition->released_frames % REORDER_SURFACES];
+
+        if (rendition->scale)
+            vpp_scaler_release(&rendition->scaler, surface_id);
+        else
+            release_decoded_surface(surface_id);
+
+        rendition->released_frames++;
+    }
+}
+
+/***************************************************/
+
+static void alloc_encode_resource(struct avcenc_context *avc)
+{
+    VAStatus va_status;
+
+    // Create surface
+    va_status = vaCreateSurfaces(va_dpy,
+                                 avc->picture_width, avc->picture_height,
+                                 VA_RT_FORMAT_YUV420, SID_NUMBER,
+                                 &avc->surface_ids[0]);
+    CHECK_VASTATUS(va_status, "vaCreateSurfaces");
+}
+
+static void release_encode_resource(struct avcenc_context *avc)
+{
     // Release all the surfaces resource
-    vaDestroySurfaces(va_dpy, &surface_ids[0], SID_NUMBER);	
+    vaDestroySurfaces(va_dpy, &avc->surface_ids[0], SID_NUMBER);	
 }
 
-static void avcenc_update_picture_parameter(int slice_type, int frame_num, int display_num, int is_idr)
+static void avcenc_update_picture_parameter(struct avcenc_context *avc, int slice_type, int frame_num, int display_num, int is_idr)
 {
     VAEncPictureParameterBufferH264 *pic_param;
     VAStatus va_status;
 
     // Picture level
-    pic_param = &avcenc_context.pic_param;
-    pic_param->CurrPic.picture_id = surface_ids[SID_RECON_PICTURE];
+    pic_param = &avc->pic_param;
+    pic_param->CurrPic.picture_id = avc->surface_ids[SID_RECON_PICTURE];
     pic_param->CurrPic.TopFieldOrderCnt = display_num * 2;
-    pic_param->ReferenceFrames[0].picture_id = surface_ids[SID_REFERENCE_PICTURE_L0];
-    pic_param->ReferenceFrames[1].picture_id = surface_ids[SID_REFERENCE_PICTURE_L1];
+    pic_param->ReferenceFrames[0].picture_id = avc->surface_ids[SID_REFERENCE_PICTURE_L0];
+    pic_param->ReferenceFrames[1].picture_id = avc->surface_ids[SID_REFERENCE_PICTURE_L1];
     pic_param->ReferenceFrames[2].picture_id = VA_INVALID_ID;
-    assert(avcenc_context.codedbuf_buf_id != VA_INVALID_ID);
-    pic_param->coded_buf = avcenc_context.codedbuf_buf_id;
+    assert(avc->codedbuf_buf_id != VA_INVALID_ID);
+    pic_param->coded_buf = avc->codedbuf_buf_id;
     pic_param->frame_num = frame_num;
     pic_param->pic_fields.bits.idr_pic_flag = !!is_idr;
     pic_param->pic_fields.bits.reference_pic_flag = (slice_type != SLICE_TYPE_B);
 
     va_status = vaCreateBuffer(va_dpy,
-                               avcenc_context.context_id,
+                               avc->context_id,
                                VAEncPictureParameterBufferType,
                                sizeof(*pic_param), 1, pic_param,
-                               &avcenc_context.pic_param_buf_id);
+                               &avc->pic_param_buf_id);
     CHECK_VASTATUS(va_status,"vaCreateBuffer");
 }
 
-static void upload_yuv_to_surface(FILE *yuv_fp, VASurfaceID surface_id)
-{
-    VAImage surface_image;
-    VAStatus va_status;
-    void *surface_p = NULL;
-    unsigned char *y_src, *u_src, *v_src;
-    unsigned char *y_dst, *u_dst, *v_dst;
-    int y_size = picture_width * picture_height;
-    int u_size = (picture_width >> 1) * (picture_height >> 1);
-    int row, col;
-    size_t n_items;
-	static int flag=1;
-    do {
-		if(flag == 0) break;
-        n_items = fread(newImageBuffer, frame_size, 1, yuv_fp);
-		flag = 0;
-    } while (n_items != 1);
-    va_status = vaDeriveImage(va_dpy, surface_id, &surface_image);
-    CHECK_VASTATUS(va_status,"vaDeriveImage");
-
-    vaMapBuffer(va_dpy, surface_image.buf, &surface_p);
-    assert(VA_STATUS_SUCCESS == va_status);
-        
-    y_src = newImageBuffer;
-    u_src = newImageBuffer + y_size; /* UV offset for NV12 */
-    v_src = newImageBuffer + y_size + u_size;
-
-    y_dst = (unsigned char *)surface_p + surface_image.offsets[0];
-    u_dst = (unsigned char *)surface_p + surface_image.offsets[1]; /* UV offset for NV12 */
-    v_dst = (unsigned char *)surface_p + surface_image.offsets[2];
-
-    /* Y plane */
-    for (row = 0; row < surface_image.height; row++) {
-        memcpy(y_dst, y_src, surface_image.width);
-        y_dst += surface_image.pitches[0];
-        y_src += picture_width;
-    }
-
-    /* UV plane */
-    memcpy(u_dst, u_src, picture_width*picture_height/2);
-
-#if 0
-    if (surface_image.format.fourcc == VA_FOURCC_NV12) { /* UV plane */
-        for (row = 0; row < surface_image.height / 2; row++) {
-            for (col = 0; col < surface_image.width / 2; col++) {
-                u_dst[col * 2] = u_src[col];
-                u_dst[col * 2 + 1] = v_src[col];
-            }
-
-            u_dst += surface_image.pitches[1];
-            u_src += (picture_width / 2);
-            v_src += (picture_width / 2);
-        }
-    } else {
-        /* FIXME: fix this later */
-        assert(0);
-    }
-#endif
-    vaUnmapBuffer(va_dpy, surface_image.buf);
-    vaDestroyImage(va_dpy, surface_image.image_id);
-}
-
-static void avcenc_update_slice_parameter(int slice_type)
+static void avcenc_update_slice_parameter(struct avcenc_context *avc, int slice_type)
 {
     VAEncSliceParameterBufferH264 *slice_param;
     VAStatus va_status;
@@ -2224,9 +2466,9 @@ static void avcenc_update_slice_parameter(int slice_type)
 
     // Slice level
     i = 0;
-    slice_param = &avcenc_context.slice_param[i];
+    slice_param = &avc->slice_param[i];
     slice_param->macroblock_address = 0;
-    slice_param->num_macroblocks = picture_height_in_mbs * picture_width_in_mbs;
+    slice_param->num_macroblocks = avc->seq_param.picture_height_in_mbs * avc->seq_param.picture_width_in_mbs;
     slice_param->pic_parameter_set_id = 0;
     slice_param->slice_type = slice_type;
     slice_param->direct_spatial_mv_pred_flag = 0;
@@ -2242,34 +2484,20 @@ static void avcenc_update_slice_parameter(int slice_type)
     /* FIXME: fill other fields */
 
     va_status = vaCreateBuffer(va_dpy,
-                               avcenc_context.context_id,
+                               avc->context_id,
                                VAEncSliceParameterBufferType,
                                sizeof(*slice_param), 1, slice_param,
-                               &avcenc_context.slice_param_buf_id[i]);
+                               &avc->slice_param_buf_id[i]);
     CHECK_VASTATUS(va_status,"vaCreateBuffer");;
 
     i++;
 
-    avcenc_context.num_slices = i;
+    avc->num_slices = i;
 }
 
-static int begin_picture(FILE *yuv_fp, int frame_num, int display_num, int slice_type, int is_idr)
+static int begin_picture(struct avcenc_context *avc, int frame_num, int display_num, int slice_type, int is_idr)
 {
     VAStatus va_status;
-#if 0
-    if (avcenc_context.upload_thread_value != 0) {
-        fprintf(stderr, "FATAL error!!!\n");
-        exit(1);
-    }
-#endif    
-    //pthread_join(avcenc_context.upload_thread_id, NULL);
-
-    avcenc_context.upload_thread_value = -1;
-
-    if (avcenc_context.current_input_surface == SID_INPUT_PICTURE_0)
-        avcenc_context.current_input_surface = SID_INPUT_PICTURE_1;
-    else
-        avcenc_context.current_input_surface = SID_INPUT_PICTURE_0;
 
     if (frame_num == 0) {
         VAEncPackedHeaderParameterBuffer packed_header_param_buffer;
@@ -2277,43 +2505,43 @@ static int begin_picture(FILE *yuv_fp, int frame_num, int display_num, int slice
         unsigned char *packed_seq_buffer = NULL, *packed_pic_buffer = NULL;
 
         assert(slice_type == SLICE_TYPE_I);
-        length_in_bits = build_packed_seq_buffer(&packed_seq_buffer);
+        length_in_bits = build_packed_seq_buffer(avc, &packed_seq_buffer);
         offset_in_bytes = 0;
         packed_header_param_buffer.type = VAEncPackedHeaderSequence;
         packed_header_param_buffer.has_emulation_bytes = 0;
         packed_header_param_buffer.bit_length = length_in_bits;
         va_status = vaCreateBuffer(va_dpy,
-                                   avcenc_context.context_id,
+                                   avc->context_id,
                                    VAEncPackedHeaderParameterBufferType,
                                    sizeof(packed_header_param_buffer), 1, &packed_header_param_buffer,
-                                   &avcenc_context.packed_seq_header_param_buf_id);
+                                   &avc->packed_seq_header_param_buf_id);
         CHECK_VASTATUS(va_status,"vaCreateBuffer");
 
         va_status = vaCreateBuffer(va_dpy,
-                                   avcenc_context.context_id,
+                                   avc->context_id,
                                    VAEncPackedHeaderDataBufferType,
                                    (length_in_bits + 7) / 8, 1, packed_seq_buffer,
-                                   &avcenc_context.packed_seq_buf_id);
+                                   &avc->packed_seq_buf_id);
         CHECK_VASTATUS(va_status,"vaCreateBuffer");
 
-        length_in_bits = build_packed_pic_buffer(&packed_pic_buffer);
+        length_in_bits = build_packed_pic_buffer(avc, &packed_pic_buffer);
         offset_in_bytes = 0;
         packed_header_param_buffer.type = VAEncPackedHeaderPicture;
         packed_header_param_buffer.has_emulation_bytes = 0;
         packed_header_param_buffer.bit_length = length_in_bits;
 
         va_status = vaCreateBuffer(va_dpy,
-                                   avcenc_context.context_id,
+                                   avc->context_id,
                                    VAEncPackedHeaderParameterBufferType,
                                    sizeof(packed_header_param_buffer), 1, &packed_header_param_buffer,
-                                   &avcenc_context.packed_pic_header_param_buf_id);
+                                   &avc->packed_pic_header_param_buf_id);
         CHECK_VASTATUS(va_status,"vaCreateBuffer");
 
         va_status = vaCreateBuffer(va_dpy,
-                                   avcenc_context.context_id,
+                                   avc->context_id,
                                    VAEncPackedHeaderDataBufferType,
                                    (length_in_bits + 7) / 8, 1, packed_pic_buffer,
-                                   &avcenc_context.packed_pic_buf_id);
+                                   &avc->packed_pic_buf_id);
         CHECK_VASTATUS(va_status,"vaCreateBuffer");
 
         free(packed_seq_buffer);
@@ -2321,59 +2549,59 @@ static int begin_picture(FILE *yuv_fp, int frame_num, int display_num, int slice
     }
 
     /* sequence parameter set */
-    VAEncSequenceParameterBufferH264 *seq_param = &avcenc_context.seq_param;
+    VAEncSequenceParameterBufferH264 *seq_param = &avc->seq_param;
     va_status = vaCreateBuffer(va_dpy,
-                               avcenc_context.context_id,
+                               avc->context_id,
                                VAEncSequenceParameterBufferType,
                                sizeof(*seq_param), 1, seq_param,
-                               &avcenc_context.seq_param_buf_id);
+                               &avc->seq_param_buf_id);
     CHECK_VASTATUS(va_status,"vaCreateBuffer");;
 
     /* slice parameter */
-    avcenc_update_slice_parameter(slice_type);
+    avcenc_update_slice_parameter(avc, slice_type);
 
     return 0;
 }
 
-int avcenc_render_picture()
+int avcenc_render_picture(struct avcenc_context *avc)
 {
     VAStatus va_status;
     VABufferID va_buffers[8];
     unsigned int num_va_buffers = 0;
 
-    va_buffers[num_va_buffers++] = avcenc_context.seq_param_buf_id;
-    va_buffers[num_va_buffers++] = avcenc_context.pic_param_buf_id;
+    va_buffers[num_va_buffers++] = avc->seq_param_buf_id;
+    va_buffers[num_va_buffers++] = avc->pic_param_buf_id;
 
-    if (avcenc_context.packed_seq_header_param_buf_id != VA_INVALID_ID)
-        va_buffers[num_va_buffers++] = avcenc_context.packed_seq_header_param_buf_id;
+    if (avc->packed_seq_header_param_buf_id != VA_INVALID_ID)
+        va_buffers[num_va_buffers++] = avc->packed_seq_header_param_buf_id;
 
-    if (avcenc_context.packed_seq_buf_id != VA_INVALID_ID)
-        va_buffers[num_va_buffers++] = avcenc_context.packed_seq_buf_id;
+    if (avc->packed_seq_buf_id != VA_INVALID_ID)
+        va_buffers[num_va_buffers++] = avc->packed_seq_buf_id;
 
-    if (avcenc_context.packed_pic_header_param_buf_id != VA_INVALID_ID)
-        va_buffers[num_va_buffers++] = avcenc_context.packed_pic_header_param_buf_id;
+    if (avc->packed_pic_header_param_buf_id != VA_INVALID_ID)
+        va_buffers[num_va_buffers++] = avc->packed_pic_header_param_buf_id;
 
-    if (avcenc_context.packed_pic_buf_id != VA_INVALID_ID)
-        va_buffers[num_va_buffers++] = avcenc_context.packed_pic_buf_id;
+    if (avc->packed_pic_buf_id != VA_INVALID_ID)
+        va_buffers[num_va_buffers++] = avc->packed_pic_buf_id;
 
     va_status = vaBeginPicture(va_dpy,
-                               avcenc_context.context_id,
-                               surface_ids[avcenc_context.current_input_surface]);
+                               avc->context_id,
+                               avc->input_surface_id);
     CHECK_VASTATUS(va_status,"vaBeginPicture");
 
     va_status = vaRenderPicture(va_dpy,
-                                avcenc_context.context_id,
+                                avc->context_id,
                                 va_buffers,
                                 num_va_buffers);
     CHECK_VASTATUS(va_status,"vaRenderPicture");
 
     va_status = vaRenderPicture(va_dpy,
-                                avcenc_context.context_id,
-                                &avcenc_context.slice_param_buf_id[0],
-                                avcenc_context.num_slices);
+                                avc->context_id,
+                                &avc->slice_param_buf_id[0],
+                                avc->num_slices);
     CHECK_VASTATUS(va_status,"vaRenderPicture");
 
-    va_status = vaEndPicture(va_dpy, avcenc_context.context_id);
+    va_status = vaEndPicture(va_dpy, avc->context_id);
     CHECK_VASTATUS(va_status,"vaEndPicture");
 
     return 0;
@@ -2395,51 +2623,41 @@ static int avcenc_destroy_buffers(VABufferID *va_buffers, unsigned int num_va_bu
     return 0;
 }
 
-static void end_picture(int slice_type, int next_is_bpic)
+static void end_picture(struct avcenc_context *avc, int slice_type, int next_is_bpic)
 {
     VABufferID tempID;
 
     /* Prepare for next picture */
-    tempID = surface_ids[SID_RECON_PICTURE];  
+    tempID = avc->surface_ids[SID_RECON_PICTURE];  
 
     if (slice_type != SLICE_TYPE_B) {
         if (next_is_bpic) {
-            surface_ids[SID_RECON_PICTURE] = surface_ids[SID_REFERENCE_PICTURE_L1]; 
-            surface_ids[SID_REFERENCE_PICTURE_L1] = tempID;	
+            avc->surface_ids[SID_RECON_PICTURE] = avc->surface_ids[SID_REFERENCE_PICTURE_L1]; 
+            avc->surface_ids[SID_REFERENCE_PICTURE_L1] = tempID;	
         } else {
-            surface_ids[SID_RECON_PICTURE] = surface_ids[SID_REFERENCE_PICTURE_L0]; 
-            surface_ids[SID_REFERENCE_PICTURE_L0] = tempID;
+            avc->surface_ids[SID_RECON_PICTURE] = avc->surface_ids[SID_REFERENCE_PICTURE_L0]; 
+            avc->surface_ids[SID_REFERENCE_PICTURE_L0] = tempID;
         }
     } else {
         if (!next_is_bpic) {
-            surface_ids[SID_RECON_PICTURE] = surface_ids[SID_REFERENCE_PICTURE_L0]; 
-            surface_ids[SID_REFERENCE_PICTURE_L0] = surface_ids[SID_REFERENCE_PICTURE_L1];
-            surface_ids[SID_REFERENCE_PICTURE_L1] = tempID;
+            avc->surface_ids[SID_RECON_PICTURE] = avc->surface_ids[SID_REFERENCE_PICTURE_L0]; 
+            avc->surface_ids[SID_REFERENCE_PICTURE_L0] = avc->surface_ids[SID_REFERENCE_PICTURE_L1];
+            avc->surface_ids[SID_REFERENCE_PICTURE_L1] = tempID;
         }
     }
 
-    avcenc_destroy_buffers(&avcenc_context.seq_param_buf_id, 1);
-    avcenc_destroy_buffers(&avcenc_context.pic_param_buf_id, 1);
-    avcenc_destroy_buffers(&avcenc_context.packed_seq_header_param_buf_id, 1);
-    avcenc_destroy_buffers(&avcenc_context.packed_seq_buf_id, 1);
-    avcenc_destroy_buffers(&avcenc_context.packed_pic_header_param_buf_id, 1);
-    avcenc_destroy_buffers(&avcenc_context.packed_pic_buf_id, 1);
-    avcenc_destroy_buffers(&avcenc_context.slice_param_buf_id[0], avcenc_context.num_slices);
-    avcenc_destroy_buffers(&avcenc_context.codedbuf_buf_id, 1);
-    memset(avcenc_context.slice_param, 0, sizeof(avcenc_context.slice_param));
-    avcenc_context.num_slices = 0;
+    avcenc_destroy_buffers(&avc->seq_param_buf_id, 1);
+    avcenc_destroy_buffers(&avc->pic_param_buf_id, 1);
+    avcenc_destroy_buffers(&avc->packed_seq_header_param_buf_id, 1);
+    avcenc_destroy_buffers(&avc->packed_seq_buf_id, 1);
+    avcenc_destroy_buffers(&avc->packed_pic_header_param_buf_id, 1);
+    avcenc_destroy_buffers(&avc->packed_pic_buf_id, 1);
+    avcenc_destroy_buffers(&avc->slice_param_buf_id[0], avc->num_slices);
+    avcenc_destroy_buffers(&avc->codedbuf_buf_id, 1);
+    memset(avc->slice_param, 0, sizeof(avc->slice_param));
+    avc->num_slices = 0;
 }
 
-#define BITSTREAM_ALLOCATE_STEPPING     4096
-
-struct __bitstream {
-    unsigned int *buffer;
-    int bit_offset;
-    int max_size_in_dword;
-};
-
-typedef struct __bitstream bitstream;
-
 #if 0
 static int 
 get_coded_bitsteam_length(unsigned char *buffer, int buffer_length)
@@ -2458,113 +2676,6 @@ get_coded_bitsteam_length(unsigned char *buffer, int buffer_length)
 }
 #endif
 
-static unsigned int 
-swap32(unsigned int val)
-{
-    unsigned char *pval = (unsigned char *)&val;
-
-    return ((pval[0] << 24)     |
-            (pval[1] << 16)     |
-            (pval[2] << 8)      |
-            (pval[3] << 0));
-}
-
-static void
-bitstream_start(bitstream *bs)
-{
-    bs->max_size_in_dword = BITSTREAM_ALLOCATE_STEPPING;
-    bs->buffer = (unsigned int *)calloc(bs->max_size_in_dword * sizeof(int), 1);
-    bs->bit_offset = 0;
-}
-
-static void
-bitstream_end(bitstream *bs)
-{
-    int pos = (bs->bit_offset >> 5);
-    int bit_offset = (bs->bit_offset & 0x1f);
-    int bit_left = 32 - bit_offset;
-
-    if (bit_offset) {
-        bs->buffer[pos] = swap32((bs->buffer[pos] << bit_left));
-    }
-}
- 
-static void
-bitstream_put_ui(bitstream *bs, unsigned int val, int size_in_bits)
-{
-    int pos = (bs->bit_offset >> 5);
-    int bit_offset = (bs->bit_offset & 0x1f);
-    int bit_left = 32 - bit_offset;
-
-    if (!size_in_bits)
-        return;
-
-    bs->bit_offset += size_in_bits;
-
-    if (bit_left > size_in_bits) {
-        bs->buffer[pos] = (bs->buffer[pos] << size_in_bits | val);
-    } else {
-        size_in_bits -= bit_left;
-        bs->buffer[pos] = (bs->buffer[pos] << bit_left) | (val >> size_in_bits);
-        bs->buffer[pos] = swap32(bs->buffer[pos]);
-
-        if (pos + 1 == bs->max_size_in_dword) {
-            bs->max_size_in_dword += BITSTREAM_ALLOCATE_STEPPING;
-            bs->buffer = (unsigned int *)realloc(bs->buffer, bs->max_size_in_dword * sizeof(unsigned int));
-        }
-
-        bs->buffer[pos + 1] = val;
-    }
-}
-
-static void
-bitstream_put_ue(bitstream *bs, unsigned int val)
-{
-    int size_in_bits = 0;
-    int tmp_val = ++val;
-
-    while (tmp_val) {
-        tmp_val >>= 1;
-        size_in_bits++;
-    }
-
-    bitstream_put_ui(bs, 0, size_in_bits - 1); // leading zero
-    bitstream_put_ui(bs, val, size_in_bits);
-}
-
-static void
-bitstream_put_se(bitstream *bs, int val)
-{
-    unsigned int new_val;
-
-    if (val <= 0)
-        new_val = -2 * val;
-    else
-        new_val = 2 * val - 1;
-
-    bitstream_put_ue(bs, new_val);
-}
-
-static void
-bitstream_byte_aligning(bitstream *bs, int bit)
-{
-    int bit_offset = (bs->bit_offset & 0x7);
-    int bit_left = 8 - bit_offset;
-    int new_val;
-
-    if (!bit_offset)
-        return;
-
-    assert(bit == 0 || bit == 1);
-
-    if (bit)
-        new_val = (1 << bit_left) - 1;
-    else
-        new_val = 0;
-
-    bitstream_put_ui(bs, new_val, bit_left);
-}
-
 static void 
 rbsp_trailing_bits(bitstream *bs)
 {
@@ -2584,14 +2695,14 @@ static void nal_header(bitstream *bs, int nal_ref_idc, int nal_unit_type)
     bitstream_put_ui(bs, nal_unit_type, 5);
 }
 
-static void sps_rbsp(bitstream *bs)
+static void sps_rbsp(struct avcenc_context *avc, bitstream *bs)
 {
-    VAEncSequenceParameterBufferH264 *seq_param = &avcenc_context.seq_param;
+    VAEncSequenceParameterBufferH264 *seq_param = &avc->seq_param;
     int profile_idc = PROFILE_IDC_BASELINE;
 
-    if (avcenc_context.profile == VAProfileH264High)
+    if (avc->profile == VAProfileH264High)
         profile_idc = PROFILE_IDC_HIGH;
-    else if (avcenc_context.profile == VAProfileH264Main)
+    else if (avc->profile == VAProfileH264Main)
         profile_idc = PROFILE_IDC_MAIN;
 
     bitstream_put_ui(bs, profile_idc, 8);               /* profile_idc */
@@ -2638,21 +2749,21 @@ static void sps_rbsp(bitstream *bs)
 }
 
 #if 0
-static void build_nal_sps(FILE *avc_fp)
+static void build_nal_sps(struct avcenc_context *avc, FILE *avc_fp)
 {
     bitstream bs;
 
     bitstream_start(&bs);
     nal_start_code_prefix(&bs);
     nal_header(&bs, NAL_REF_IDC_HIGH, NAL_SPS);
-    sps_rbsp(&bs);
+    sps_rbsp(avc, &bs);
     bitstream_end(&bs, avc_fp);
 }
 #endif
 
-static void pps_rbsp(bitstream *bs)
+static void pps_rbsp(struct avcenc_context *avc, bitstream *bs)
 {
-    VAEncPictureParameterBufferH264 *pic_param = &avcenc_context.pic_param;
+    VAEncPictureParameterBufferH264 *pic_param = &avc->pic_param;
 
     bitstream_put_ue(bs, pic_param->pic_parameter_set_id);      /* pic_parameter_set_id */
     bitstream_put_ue(bs, pic_param->seq_parameter_set_id);      /* seq_parameter_set_id */
@@ -2681,34 +2792,34 @@ static void pps_rbsp(bitstream *bs)
 }
 
 #if 0
-static void build_nal_pps(FILE *avc_fp)
+static void build_nal_pps(struct avcenc_context *avc, FILE *avc_fp)
 {
     bitstream bs;
 
     bitstream_start(&bs);
     nal_start_code_prefix(&bs);
     nal_header(&bs, NAL_REF_IDC_HIGH, NAL_PPS);
-    pps_rbsp(&bs);
+    pps_rbsp(avc, &bs);
     bitstream_end(&bs, avc_fp);
 }
 
 static void 
-build_header(FILE *avc_fp)
+build_header(struct avcenc_context *avc, FILE *avc_fp)
 {
-    build_nal_sps(avc_fp);
-    build_nal_pps(avc_fp);
+    build_nal_sps(avc, avc_fp);
+    build_nal_pps(avc, avc_fp);
 }
 #endif
 
 static int
-build_packed_pic_buffer(unsigned char **header_buffer)
+build_packed_pic_buffer(struct avcenc_context *avc, unsigned char **header_buffer)
 {
     bitstream bs;
 
     bitstream_start(&bs);
     nal_start_code_prefix(&bs);
     nal_header(&bs, NAL_REF_IDC_HIGH, NAL_PPS);
-    pps_rbsp(&bs);
+    pps_rbsp(avc, &bs);
     bitstream_end(&bs);
 
     *header_buffer = (unsigned char *)bs.buffer;
@@ -2716,14 +2827,14 @@ build_packed_pic_buffer(unsigned char **header_buffer)
 }
 
 static int
-build_packed_seq_buffer(unsigned char **header_buffer)
+build_packed_seq_buffer(struct avcenc_context *avc, unsigned char **header_buffer)
 {
     bitstream bs;
 
     bitstream_start(&bs);
     nal_start_code_prefix(&bs);
     nal_header(&bs, NAL_REF_IDC_HIGH, NAL_SPS);
-    sps_rbsp(&bs);
+    sps_rbsp(avc, &bs);
     bitstream_end(&bs);
 
     *header_buffer = (unsigned char *)bs.buffer;
@@ -2733,10 +2844,10 @@ build_packed_seq_buffer(unsigned char **header_buffer)
 
 #if 0
 static void 
-slice_header(bitstream *bs, int frame_num, int display_frame, int slice_type, int nal_ref_idc, int is_idr)
+slice_header(struct avcenc_context *avc, bitstream *bs, int frame_num, int display_frame, int slice_type, int nal_ref_idc, int is_idr)
 {
-    VAEncSequenceParameterBufferH264 *seq_param = &avcenc_context.seq_param;
-    VAEncPictureParameterBufferH264 *pic_param = &avcenc_context.pic_param;
+    VAEncSequenceParameterBufferH264 *seq_param = &avc->seq_param;
+    VAEncPictureParameterBufferH264 *pic_param = &avc->pic_param;
     int is_cabac = (pic_param->pic_fields.bits.entropy_coding_mode_flag == ENTROPY_MODE_CABAC);
 
     bitstream_put_ue(bs, 0);                   /* first_mb_in_slice: 0 */
@@ -2801,7 +2912,7 @@ slice_header(bitstream *bs, int frame_num, int display_frame, int slice_type, in
 }
 
 static void 
-slice_data(bitstream *bs)
+slice_data(struct avcenc_context *avc, bitstream *bs)
 {
     VACodedBufferSegment *coded_buffer_segment;
     unsigned char *coded_mem;
@@ -2809,14 +2920,14 @@ slice_data(bitstream *bs)
     VAStatus va_status;
     VASurfaceStatus surface_status;
 
-    va_status = vaSyncSurface(va_dpy, surface_ids[avcenc_context.current_input_surface]);
+    va_status = vaSyncSurface(va_dpy, avc->input_surface_id);
     CHECK_VASTATUS(va_status,"vaSyncSurface");
 
     surface_status = 0;
-    va_status = vaQuerySurfaceStatus(va_dpy, surface_ids[avcenc_context.current_input_surface], &surface_status);
+    va_status = vaQuerySurfaceStatus(va_dpy, avc->input_surface_id, &surface_status);
     CHECK_VASTATUS(va_status,"vaQuerySurfaceStatus");
 
-    va_status = vaMapBuffer(va_dpy, avcenc_context.codedbuf_buf_id, (void **)(&coded_buffer_segment));
+    va_status = vaMapBuffer(va_dpy, avc->codedbuf_buf_id, (void **)(&coded_buffer_segment));
     CHECK_VASTATUS(va_status,"vaMapBuffer");
     coded_mem = coded_buffer_segment->buf;
 
@@ -2827,166 +2938,147 @@ slice_data(bitstream *bs)
         coded_mem++;
     }
 
-    vaUnmapBuffer(va_dpy, avcenc_context.codedbuf_buf_id);
+    vaUnmapBuffer(va_dpy, avc->codedbuf_buf_id);
 }
 
 static void 
-build_nal_slice(FILE *avc_fp, int frame_num, int display_frame, int slice_type, int is_idr)
+build_nal_slice(struct avcenc_context *avc, FILE *avc_fp, int frame_num, int display_frame, int slice_type, int is_idr)
 {
     bitstream bs;
 
     bitstream_start(&bs);
-    slice_data(&bs);
+    slice_data(avc, &bs);
     bitstream_end(&bs, avc_fp);
 }
 
 #endif
 
 static int
-store_coded_buffer(FILE *avc_fp, int slice_type)
+store_coded_buffer(struct avcenc_context *avc, struct coded_sink *avc_sink, int slice_type)
 {
     VACodedBufferSegment *coded_buffer_segment;
-    unsigned char *coded_mem;
-    int slice_data_length;
+    long long slice_data_length;
     VAStatus va_status;
     VASurfaceStatus surface_status;
-    size_t w_items;
 
-    va_status = vaSyncSurface(va_dpy, surface_ids[avcenc_context.current_input_surface]);
+    va_status = vaSyncSurface(va_dpy, avc->input_surface_id);
     CHECK_VASTATUS(va_status,"vaSyncSurface");
 
     surface_status = (VASurfaceStatus)0;
-    va_status = vaQuerySurfaceStatus(va_dpy, surface_ids[avcenc_context.current_input_surface], &surface_status);
+    va_status = vaQuerySurfaceStatus(va_dpy, avc->input_surface_id, &surface_status);
     CHECK_VASTATUS(va_status,"vaQuerySurfaceStatus");
 
-    va_status = vaMapBuffer(va_dpy, avcenc_context.codedbuf_buf_id, (void **)(&coded_buffer_segment));
+    va_status = vaMapBuffer(va_dpy, avc->codedbuf_buf_id, (void **)(&coded_buffer_segment));
     CHECK_VASTATUS(va_status,"vaMapBuffer");
-    coded_mem = (unsigned char *)coded_buffer_segment->buf;
 
     if (coded_buffer_segment->status & VA_CODED_BUF_STATUS_SLICE_OVERFLOW_MASK) {
         if (slice_type == SLICE_TYPE_I)
-            avcenc_context.codedbuf_i_size *= 2;
+            avc->codedbuf_i_size *= 2;
         else
-            avcenc_context.codedbuf_pb_size *= 2;
+            avc->codedbuf_pb_size *= 2;
 
-        vaUnmapBuffer(va_dpy, avcenc_context.codedbuf_buf_id);
+        vaUnmapBuffer(va_dpy, avc->codedbuf_buf_id);
         return -1;
     }
 
-    slice_data_length = coded_buffer_segment->size;
-    do {
-        w_items = fwrite(coded_mem, slice_data_length, 1, avc_fp);
-    } while (w_items != 1);
+    /* all the segments of the frame in one writev() */
+    slice_data_length = coded_sink_write_coded(avc_sink, NULL, 0, coded_buffer_segment);
+    if (slice_data_length < 0) {
+        perror("Write the coded data");
+        exit(1);
+    }
 
     if (slice_type == SLICE_TYPE_I) {
-        if (avcenc_context.codedbuf_i_size > slice_data_length * 3 / 2) {
-            avcenc_context.codedbuf_i_size = slice_data_length * 3 / 2;
+        if (avc->codedbuf_i_size > slice_data_length * 3 / 2) {
+            avc->codedbuf_i_size = slice_data_length * 3 / 2;
         }
         
-        if (avcenc_context.codedbuf_pb_size < slice_data_length) {
-            avcenc_context.codedbuf_pb_size = slice_data_length;
+        if (avc->codedbuf_pb_size < slice_data_length) {
+            avc->codedbuf_pb_size = slice_data_length;
         }
     } else {
-        if (avcenc_context.codedbuf_pb_size > slice_data_length * 3 / 2) {
-            avcenc_context.codedbuf_pb_size = slice_data_length * 3 / 2;
+        if (avc->codedbuf_pb_size > slice_data_length * 3 / 2) {
+            avc->codedbuf_pb_size = slice_data_length * 3 / 2;
         }
     }
 
-    vaUnmapBuffer(va_dpy, avcenc_context.codedbuf_buf_id);
+    vaUnmapBuffer(va_dpy, avc->codedbuf_buf_id);
 
     return 0;
 }
 
 static void
-encode_picture(FILE *yuv_fp, FILE *avc_fp,
+encode_picture(struct rendition *rendition,
                int frame_num, int display_num,
                int is_idr,
-               int slice_type, int next_is_bpic,
-               int next_display_num)
+               int slice_type, int next_is_bpic)
 {
+    struct avcenc_context *avc = &rendition->avc;
     VAStatus va_status;
     int ret = 0, codedbuf_size;
     
-    begin_picture(yuv_fp, frame_num, display_num, slice_type, is_idr);
-
-    //if (next_display_num < frame_number) {
-    if (1) {
-        int index;
+    avc->input_surface_id = get_input_surface(rendition, display_num);
 
-        /* prepare for next frame */
-        if (avcenc_context.current_input_surface == SID_INPUT_PICTURE_0)
-            index = SID_INPUT_PICTURE_1;
-        else
-            index = SID_INPUT_PICTURE_0;
-        if ( next_display_num >= frame_number )
-            next_display_num = frame_number - 1;
-        fseek(yuv_fp, frame_size * next_display_num, SEEK_SET);
-        avcenc_context.upload_thread_param.yuv_fp = yuv_fp;
-        avcenc_context.upload_thread_param.surface_id = surface_ids[index];
-#if 0
-        avcenc_context.upload_thread_value = pthread_create(&avcenc_context.upload_thread_id,
-                                                            NULL,
-                                                            upload_thread_function, 
-                                                            (void*)&avcenc_context.upload_thread_param);
-#endif
-//upload_thread_function();
-upload_yuv_to_surface(yuv_fp, surface_ids[index]);
-    }
+    begin_picture(avc, frame_num, display_num, slice_type, is_idr);
 
     do {
-        avcenc_destroy_buffers(&avcenc_context.codedbuf_buf_id, 1);
-        avcenc_destroy_buffers(&avcenc_context.pic_param_buf_id, 1);
+        avcenc_destroy_buffers(&avc->codedbuf_buf_id, 1);
+        avcenc_destroy_buffers(&avc->pic_param_buf_id, 1);
 
 
         if (SLICE_TYPE_I == slice_type) {
-            codedbuf_size = avcenc_context.codedbuf_i_size;
+            codedbuf_size = avc->codedbuf_i_size;
         } else {
-            codedbuf_size = avcenc_context.codedbuf_pb_size;
+            codedbuf_size = avc->codedbuf_pb_size;
         }
 
         /* coded buffer */
         va_status = vaCreateBuffer(va_dpy,
-                                   avcenc_context.context_id,
+                                   avc->context_id,
                                    VAEncCodedBufferType,
                                    codedbuf_size, 1, NULL,
-                                   &avcenc_context.codedbuf_buf_id);
+                                   &avc->codedbuf_buf_id);
         CHECK_VASTATUS(va_status,"vaCreateBuffer");
 
         /* picture parameter set */
-        avcenc_update_picture_parameter(slice_type, frame_num, display_num, is_idr);
+        avcenc_update_picture_parameter(avc, slice_type, frame_num, display_num, is_idr);
 
-        avcenc_render_picture();
+        avcenc_render_picture(avc);
 
-        ret = store_coded_buffer(avc_fp, slice_type);
+        ret = store_coded_buffer(avc, &rendition->sink, slice_type);
     } while (ret);
 
-    end_picture(slice_type, next_is_bpic);
+    end_picture(avc, slice_type, next_is_bpic);
 }
 
-static void encode_pb_pictures(FILE *yuv_fp, FILE *avc_fp, int f, int nbframes, int next_f)
+static void encode_pb_pictures(struct rendition *rendition, int f, int nbframes)
 {
     int i;
-    encode_picture(yuv_fp, avc_fp,
-                   enc_frame_number, f + nbframes,
+    encode_picture(rendition,
+                   rendition->enc_frame_number, f + nbframes,
                    0,
-                   SLICE_TYPE_P, 1, f);
+                   SLICE_TYPE_P, 1);
 
     for( i = 0; i < nbframes - 1; i++) {
-        encode_picture(yuv_fp, avc_fp,
-                       enc_frame_number + 1, f + i,
+        encode_picture(rendition,
+                       rendition->enc_frame_number + 1, f + i,
                        0,
-                       SLICE_TYPE_B, 1, f + i + 1);
+                       SLICE_TYPE_B, 1);
     }
     
-    encode_picture(yuv_fp, avc_fp,
-                   enc_frame_number + 1, f + nbframes - 1,
+    encode_picture(rendition,
+                   rendition->enc_frame_number + 1, f + nbframes - 1,
                    0,
-                   SLICE_TYPE_B, 0, next_f);
+                   SLICE_TYPE_B, 0);
 }
 
 static void show_help()
 {
-    printf("Usage: avnenc <width> <height> <input_yuvfile> <output_avcfile> [qp=qpvalue|fb=framebitrate] [mode=0(I frames only)/1(I and P frames)/2(I, P and B frames)\n");
+    printf("Usage: mpeg2transcode [frames [WxH,WxH,...]]\n");
+    printf("\tframes: decode the clip <frames> times and transcode it, without it the clip is only decoded\n");
+    printf("\tWxH,...: the ABR ladder, at most %d different sizes, default %dx%d\n", RENDITION_MAX, picture_width, picture_height);
+    printf("\t         one size is encoded to test.264, several sizes to test_<W>x<H>.264\n");
+    printf("e.g. mpeg2transcode 300 1280x960,640x480,320x240\n");
 }
 
 static void avcenc_context_seq_param_init(VAEncSequenceParameterBufferH264 *seq_param,
@@ -3051,183 +3143,162 @@ static void avcenc_context_pic_param_init(VAEncPictureParameterBufferH264 *pic_p
     pic_param->pic_fields.bits.deblocking_filter_control_present_flag = 1;
 }
 
-static void avcenc_context_init(int width, int height)
+static void avcenc_context_init(struct avcenc_context *avc, int width, int height)
 {
     int i;
-    memset(&avcenc_context, 0, sizeof(avcenc_context));
-    avcenc_context.profile = VAProfileH264Main;
-    avcenc_context.seq_param_buf_id = VA_INVALID_ID;
-    avcenc_context.pic_param_buf_id = VA_INVALID_ID;
-    avcenc_context.packed_seq_header_param_buf_id = VA_INVALID_ID;
-    avcenc_context.packed_seq_buf_id = VA_INVALID_ID;
-    avcenc_context.packed_pic_header_param_buf_id = VA_INVALID_ID;
-    avcenc_context.packed_pic_buf_id = VA_INVALID_ID;
-    avcenc_context.codedbuf_buf_id = VA_INVALID_ID;
-    avcenc_context.codedbuf_i_size = width * height;
-    avcenc_context.codedbuf_pb_size = 0;
-    avcenc_context.current_input_surface = SID_INPUT_PICTURE_0;
-    avcenc_context.upload_thread_value = -1;
+    memset(avc, 0, sizeof(*avc));
+    avc->profile = VAProfileH264Main;
+    avc->seq_param_buf_id = VA_INVALID_ID;
+    avc->pic_param_buf_id = VA_INVALID_ID;
+    avc->packed_seq_header_param_buf_id = VA_INVALID_ID;
+    avc->packed_seq_buf_id = VA_INVALID_ID;
+    avc->packed_pic_header_param_buf_id = VA_INVALID_ID;
+    avc->packed_pic_buf_id = VA_INVALID_ID;
+    avc->codedbuf_buf_id = VA_INVALID_ID;
+    avc->codedbuf_i_size = width * height;
+    avc->codedbuf_pb_size = 0;
+    avc->input_surface_id = VA_INVALID_SURFACE;
+    avc->picture_width = width;
+    avc->picture_height = height;
 
     for (i = 0; i < MAX_SLICES; i++) {
-        avcenc_context.slice_param_buf_id[i] = VA_INVALID_ID;
+        avc->slice_param_buf_id[i] = VA_INVALID_ID;
     }
 
-    avcenc_context_seq_param_init(&avcenc_context.seq_param, width, height);
-    avcenc_context_pic_param_init(&avcenc_context.pic_param);
+    avcenc_context_seq_param_init(&avc->seq_param, width, height);
+    avcenc_context_pic_param_init(&avc->pic_param);
 }
 
-static int
-zoom_out_surface(VADisplay va_dpy,
-                 VASurfaceID in_surface_id,
-                 VASurfaceID *out_surface_id)
+/* decode the clip into surface_id */
+static void decode_picture(VAContextID context_id, VASurfaceID surface_id)
 {
+    VABufferID pic_param_buf,iqmatrix_buf,slice_param_buf,slice_data_buf;
     VAStatus va_status;
-    VAEntrypoint entrypoints[5];
-    VAConfigAttrib attrib;
-    VAConfigID config_id;
-    VASurfaceID vpp_surface_id = VA_INVALID_SURFACE;
-    VAContextID context_id;
-    VAProcPipelineCaps vpp_cap;
-    VABufferID pipeline_param_buf_id = VA_INVALID_ID;
-    VAProcPipelineParameterBuffer pipeline_param;
-    int num_entrypoints, proc_entrypoint;
-    VARectangle surface_region, output_region;
-    VABufferID filter_bufs[VAProcFilterCount];
-    unsigned int num_filter_bufs = 0;
 
+    va_status = vaCreateBuffer(va_dpy, context_id,
+                              VAPictureParameterBufferType,
+                              sizeof(VAPictureParameterBufferMPEG2),
+                              1, &pic_param,
+                              &pic_param_buf);
+    CHECK_VASTATUS(va_status, "vaCreateBuffer");
+    
+    va_status = vaCreateBuffer(va_dpy, context_id,
+                              VAIQMatrixBufferType,
+                              sizeof(VAIQMatrixBufferMPEG2),
+                              1, &iq_matrix,
+                              &iqmatrix_buf );
+    CHECK_VASTATUS(va_status, "vaCreateBuffer");
 
-    va_status = vaQueryConfigEntrypoints(va_dpy,
-                                         VAProfileNone,
-                                         entrypoints,
-                                         &num_entrypoints);
-    CHECK_VASTATUS(va_status, "vaQueryConfigEntrypoints");
+    va_status = vaCreateBuffer(va_dpy, context_id,
+                              VASliceParameterBufferType,
+                              sizeof(VASliceParameterBufferMPEG2),
+                              15,
+                              &slice_param, &slice_param_buf);
+    CHECK_VASTATUS(va_status, "vaCreateBuffer");
 
-    for	(proc_entrypoint = 0; proc_entrypoint < num_entrypoints; proc_entrypoint++) {
-        if (entrypoints[proc_entrypoint] == VAEntrypointVideoProc)
-            break;
-    }
+    va_status = vaCreateBuffer(va_dpy, context_id,
+                              VASliceDataBufferType,
+                              //0xc4-0x2f+1,
+                              //19310-0x2f+1,
+                              19252,
+                              1,
+                              //mpeg2_clip+0x2f,
+                              mpeg2_clip+0x3b,
+                              &slice_data_buf);
+    CHECK_VASTATUS(va_status, "vaCreateBuffer");
 
-    if (proc_entrypoint == num_entrypoints) {
-        /* not find Video Proc entry point */
-        assert(0);
-    }
+    va_status = vaBeginPicture(va_dpy, context_id, surface_id);
+    CHECK_VASTATUS(va_status, "vaBeginPicture");
 
-    attrib.type = VAConfigAttribRTFormat;
-    vaGetConfigAttributes(va_dpy,
-                          VAProfileNone,
-                          VAEntrypointVideoProc,
-                          &attrib,
-                          1);
+    va_status = vaRenderPicture(va_dpy,context_id, &pic_param_buf, 1);
+    CHECK_VASTATUS(va_status, "vaRenderPicture");
+    
+    va_status = vaRenderPicture(va_dpy,context_id, &iqmatrix_buf, 1);
+    CHECK_VASTATUS(va_status, "vaRenderPicture");
+    
+    va_status = vaRenderPicture(va_dpy,context_id, &slice_param_buf, 1);
+    CHECK_VASTATUS(va_status, "vaRenderPicture");
+    
+    va_status = vaRenderPicture(va_dpy,context_id, &slice_data_buf, 1);
+    CHECK_VASTATUS(va_status, "vaRenderPicture");
+    
+    va_status = vaEndPicture(va_dpy,context_id);
+    CHECK_VASTATUS(va_status, "vaEndPicture");
 
-    if ((attrib.value & VA_RT_FORMAT_YUV420) == 0) {
-        assert(0);
-    }
+    vaDestroyBuffer(va_dpy, pic_param_buf);
+    vaDestroyBuffer(va_dpy, iqmatrix_buf);
+    vaDestroyBuffer(va_dpy, slice_param_buf);
+    vaDestroyBuffer(va_dpy, slice_data_buf);
+}
 
-    va_status = vaCreateConfig(va_dpy,
-                               VAProfileNone, 
-                               VAEntrypointVideoProc,
-                               &attrib,
-                               1,
-                               &config_id);
-    CHECK_VASTATUS(va_status, "vaQueryConfigEntrypoints");
+static void *
+decode_thread_function(void *data)
+{
+    VASurfaceID surface_id;
+    VAStatus va_status;
+    int i, j, index;
 
-    va_status = vaCreateSurfaces(va_dpy,
-                                 surface_width * zoom_out,
-                                 surface_height * zoom_out,
-                                 VA_RT_FORMAT_YUV420,
-                                 1,
-                                 &vpp_surface_id);
-    CHECK_VASTATUS(va_status, "vaCreateSurfaces");
+    for (i = 0; i < transcode_context.frames; i++) {
+        surface_id = surface_queue_get(&transcode_context.decode_free);
+        decode_picture(transcode_context.decode_context_id, surface_id);
 
-    /* Create a context for VPP pipe */
-    va_status = vaCreateContext(va_dpy,
-                                config_id,
-                                surface_width,
-                                surface_height,
-                                VA_PROGRESSIVE,
-                                &vpp_surface_id,
-                                1,
-                                &context_id);
-    CHECK_VASTATUS(va_status, "vaCreateContext");
+        va_status = vaSyncSurface(va_dpy, surface_id);
+        CHECK_VASTATUS(va_status, "vaSyncSurface");
 
-    vaQueryVideoProcPipelineCaps(va_dpy,
-                                 context_id,
-                                 filter_bufs, num_filter_bufs,
-                                 &vpp_cap);
-    CHECK_VASTATUS(va_status, "vaQueryVideoProcPipelineCaps");
+        /* every rendition holds a reference until it is done with it */
+        index = decode_surface_index(surface_id);
+        pthread_mutex_lock(&transcode_context.decode_refs_mutex);
+        transcode_context.decode_refs[index] = transcode_context.num_renditions;
+        pthread_mutex_unlock(&transcode_context.decode_refs_mutex);
 
-    surface_region.x = 0;
-    surface_region.y = 0;
-    surface_region.width = surface_width;
-    surface_region.height = surface_height;
+        for (j = 0; j < transcode_context.num_renditions; j++)
+            surface_queue_put(&transcode_context.renditions[j].decoded, surface_id);
+    }
 
-    output_region.x = 0;
-    output_region.y = 0;
-    output_region.width = surface_width * zoom_out;
-    output_region.height = surface_height * zoom_out;
+    for (j = 0; j < transcode_context.num_renditions; j++)
+        surface_queue_end(&transcode_context.renditions[j].decoded);
 
-    memset(&pipeline_param, 0, sizeof(pipeline_param));
-    pipeline_param.surface = in_surface_id;
-    pipeline_param.surface_region = &surface_region;
-    pipeline_param.output_region = &output_region;
+    return NULL;
+}
 
-    va_status = vaCreateBuffer(va_dpy,
-                               context_id,
-                               VAProcPipelineParameterBufferType,
-                               sizeof(pipeline_param),
-                               1,
-                               &pipeline_param,
-                               &pipeline_param_buf_id);
-    CHECK_VASTATUS(va_status, "vaCreateBuffer");
+static void *
+scale_thread_function(void *data)
+{
+    struct rendition *rendition = (struct rendition *)data;
+    VASurfaceID surface_id, scaled_surface_id;
+    VAStatus va_status;
 
-    va_status = vaBeginPicture(va_dpy,
-                               context_id,
-                               vpp_surface_id);
-    CHECK_VASTATUS(va_status, "vaBeginPicture");
+    while ((surface_id = surface_queue_get(&rendition->decoded)) != VA_INVALID_SURFACE) {
+        if (!rendition->scale) {
+            surface_queue_put(&rendition->scaled, surface_id);
+            continue;
+        }
 
-    va_status = vaRenderPicture(va_dpy,
-                                context_id,
-                                &pipeline_param_buf_id,
-                                1);
-    CHECK_VASTATUS(va_status, "vaRenderPicture");
+        scaled_surface_id = vpp_scaler_scale(&rendition->scaler, surface_id);
 
-    va_status = vaEndPicture(va_dpy, context_id);
-    CHECK_VASTATUS(va_status, "vaEndPicture");
+        /* the decoded surface was read once the scaled one is ready */
+        va_status = vaSyncSurface(va_dpy, scaled_surface_id);
+        CHECK_VASTATUS(va_status, "vaSyncSurface");
 
-    vaDestroyContext(va_dpy, context_id);
-    vaDestroyConfig(va_dpy, config_id);
+        release_decoded_surface(surface_id);
+        surface_queue_put(&rendition->scaled, scaled_surface_id);
+    }
 
-    *out_surface_id = vpp_surface_id;
-    return 0;
+    surface_queue_end(&rendition->scaled);
+
+    return NULL;
 }
 
-static int encode_file()
+static void *
+encode_thread_function(void *data)
 {
-    int f;
-    FILE *yuv_fp;
-    FILE *avc_fp;
-    long file_size;
+    struct rendition *rendition = (struct rendition *)data;
+    int frame_number = transcode_context.frames;
     int i_frame_only=1,i_p_frame_only=0;
-    int mode_value;
-    struct timeval tpstart,tpend; 
-    float  timeuse;
-	int frame_number = 1;
-	yuv_fp = fopen("dump.yuv","rb");
+    int fcurrent = 0;
+    struct timeval tpend;
 
-    fseek(yuv_fp, 0l, SEEK_SET);
-
-    avc_fp = fopen("test.264", "wb");	
-    if ( avc_fp == NULL) {
-        fclose(yuv_fp);
-        printf("Can't open output avc file\n");
-        return -1;
-    }	
-    gettimeofday(&tpstart,NULL);	
-    avcenc_context_init(picture_width, picture_height);
-    create_encode_pipe();
-    alloc_encode_resource(yuv_fp);
-
-    enc_frame_number = 0;
+    rendition->enc_frame_number = 0;
     for ( int f = 0; f < frame_number; ) {		//picture level loop
         static int const frame_type_pattern[][2] = { {SLICE_TYPE_I,1}, 
                                                      {SLICE_TYPE_P,3}, {SLICE_TYPE_P,3},{SLICE_TYPE_P,3},
@@ -3236,74 +3307,226 @@ static int encode_file()
                                                      {SLICE_TYPE_P,2} };
 
         if ( i_frame_only ) {
-            encode_picture(yuv_fp, avc_fp,enc_frame_number, f, f==0, SLICE_TYPE_I, 0, f+1);
+            encode_picture(rendition,rendition->enc_frame_number, f, f==0, SLICE_TYPE_I, 0);
             f++;
-            enc_frame_number++;
+            rendition->enc_frame_number++;
         } else if ( i_p_frame_only ) {
             if ( (f % intra_period) == 0 ) {
-                encode_picture(yuv_fp, avc_fp,enc_frame_number, f, f==0, SLICE_TYPE_I, 0, f+1);
+                encode_picture(rendition,rendition->enc_frame_number, f, f==0, SLICE_TYPE_I, 0);
                 f++;
-                enc_frame_number++;
+                rendition->enc_frame_number++;
             } else {
-                encode_picture(yuv_fp, avc_fp,enc_frame_number, f, f==0, SLICE_TYPE_P, 0, f+1);
+                encode_picture(rendition,rendition->enc_frame_number, f, f==0, SLICE_TYPE_P, 0);
                 f++;
-                enc_frame_number++;
+                rendition->enc_frame_number++;
             }
         } else { // follow the i,p,b pattern
-            static int fcurrent = 0;
-            int fnext;
-            
             fcurrent = fcurrent % (sizeof(frame_type_pattern)/sizeof(int[2]));
-            fnext = (fcurrent+1) % (sizeof(frame_type_pattern)/sizeof(int[2]));
             
             if ( frame_type_pattern[fcurrent][0] == SLICE_TYPE_I ) {
-                encode_picture(yuv_fp, avc_fp,enc_frame_number, f, f==0, SLICE_TYPE_I, 0, 
-                        f+frame_type_pattern[fnext][1]);
+                encode_picture(rendition,rendition->enc_frame_number, f, f==0, SLICE_TYPE_I, 0);
                 f++;
-                enc_frame_number++;
+                rendition->enc_frame_number++;
             } else {
-                encode_pb_pictures(yuv_fp, avc_fp, f, frame_type_pattern[fcurrent][1]-1, 
-                        f + frame_type_pattern[fcurrent][1] + frame_type_pattern[fnext][1] -1 );
+                encode_pb_pictures(rendition, f, frame_type_pattern[fcurrent][1]-1);
                 f += frame_type_pattern[fcurrent][1];
-                enc_frame_number++;
+                rendition->enc_frame_number++;
             }
  
             fcurrent++;
         }
-        printf("\r %d/%d ...", f+1, frame_number);
-        fflush(stdout);
+
+        /* the pictures before f were encoded */
+        release_input_surfaces(rendition, f);
+
+        /* the renditions run side by side, one progress line is enough */
+        if (rendition == &transcode_context.renditions[0]) {
+            printf("\r %d/%d ...", f+1, frame_number);
+            fflush(stdout);
+        }
     }
 
+    release_input_surfaces(rendition, frame_number);
+
     gettimeofday(&tpend,NULL);
-    timeuse=1000000*(tpend.tv_sec-tpstart.tv_sec)+ tpend.tv_usec-tpstart.tv_usec;
+    rendition->seconds = 1000000*(tpend.tv_sec-transcode_context.start.tv_sec)+ tpend.tv_usec-transcode_context.start.tv_usec;
+    rendition->seconds /= 1000000;
+
+    return NULL;
+}
+
+/* the ladder, renditions are added before transcode(), every size once */
+static int add_rendition(int width, int height)
+{
+    struct rendition *rendition;
+    int i;
+
+    if (transcode_context.num_renditions == RENDITION_MAX)
+        return -1;
+
+    for (i = 0; i < transcode_context.num_renditions; i++) {
+        if (transcode_context.renditions[i].width == width &&
+            transcode_context.renditions[i].height == height)
+            return -1;
+    }
+
+    rendition = &transcode_context.renditions[transcode_context.num_renditions++];
+    rendition->width = width;
+    rendition->height = height;
+    rendition->scale = (width != surface_width || height != surface_height);
+
+    return 0;
+}
+
+/*
+ * decode frames pictures into decode_surface_ids once, scale and encode
+ * them for every rendition in parallel
+ */
+static int transcode(VAContextID decode_context_id, VASurfaceID *decode_surface_ids, int frames)
+{
+    struct rendition *rendition;
+    pthread_t decode_thread;
+    struct timeval tpend; 
+    float  timeuse;
+    char name[64];
+    int i;
+
+    for (i = 0; i < transcode_context.num_renditions; i++) {
+        rendition = &transcode_context.renditions[i];
+
+        /* a single output keeps the old name */
+        if (transcode_context.num_renditions == 1)
+            strcpy(name, "test.264");
+        else
+            sprintf(name, "test_%dx%d.264", rendition->width, rendition->height);
+
+        if (coded_sink_open(&rendition->sink, name)) {
+            printf("Can't open output avc file %s\n", name);
+            while (i--)
+                coded_sink_close(&transcode_context.renditions[i].sink);
+            return -1;
+        }
+    }
+
+    gettimeofday(&transcode_context.start,NULL);	
+    transcode_context.decode_context_id = decode_context_id;
+    transcode_context.frames = frames;
+    pthread_mutex_init(&transcode_context.decode_refs_mutex, NULL);
+    surface_queue_init(&transcode_context.decode_free);
+
+    for (i = 0; i < DECODE_SURFACES; i++) {
+        transcode_context.decode_surface_ids[i] = decode_surface_ids[i];
+        surface_queue_put(&transcode_context.decode_free, decode_surface_ids[i]);
+    }
+
+    for (i = 0; i < transcode_context.num_renditions; i++) {
+        rendition = &transcode_context.renditions[i];
+
+        avcenc_context_init(&rendition->avc, rendition->width, rendition->height);
+        create_encode_pipe(&rendition->avc);
+        alloc_encode_resource(&rendition->avc);
+
+        if (rendition->scale)
+            vpp_scaler_create(&rendition->scaler,
+                              surface_width, surface_height,
+                              rendition->width, rendition->height,
+                              VA_RT_FORMAT_YUV420);
+
+        surface_queue_init(&rendition->decoded);
+        surface_queue_init(&rendition->scaled);
+        rendition->input_frames = 0;
+        rendition->released_frames = 0;
+    }
+
+    pthread_create(&decode_thread, NULL, decode_thread_function, NULL);
+    for (i = 0; i < transcode_context.num_renditions; i++) {
+        rendition = &transcode_context.renditions[i];
+        pthread_create(&rendition->scale_thread, NULL, scale_thread_function, rendition);
+        pthread_create(&rendition->encode_thread, NULL, encode_thread_function, rendition);
+    }
+
+    for (i = 0; i < transcode_context.num_renditions; i++) {
+        rendition = &transcode_context.renditions[i];
+        pthread_join(rendition->encode_thread, NULL);
+        pthread_join(rendition->scale_thread, NULL);
+    }
+    pthread_join(decode_thread, NULL);
+
+    gettimeofday(&tpend,NULL);
+    timeuse=1000000*(tpend.tv_sec-transcode_context.start.tv_sec)+ tpend.tv_usec-transcode_context.start.tv_usec;
     timeuse/=1000000;
     printf("\ndone!\n");
-    printf("encode %d frames in %f secondes, FPS is %.1f\n",frame_number, timeuse, frame_number/timeuse);
-    release_encode_resource();
-    destory_encode_pipe();
-
-    fclose(yuv_fp);
-    fclose(avc_fp);
+    for (i = 0; i < transcode_context.num_renditions; i++) {
+        rendition = &transcode_context.renditions[i];
+        printf("rendition %dx%d: %d frames in %f secondes, FPS is %.1f\n",
+               rendition->width, rendition->height,
+               frames, rendition->seconds, frames/rendition->seconds);
+    }
+    printf("transcode %d frames in %f secondes, FPS is %.1f\n",frames, timeuse, frames/timeuse);
+    if (transcode_context.num_renditions > 1)
+        printf("%d renditions, %.1f encoded pictures per second\n",
+               transcode_context.num_renditions, frames*transcode_context.num_renditions/timeuse);
+
+    for (i = 0; i < transcode_context.num_renditions; i++) {
+        rendition = &transcode_context.renditions[i];
+
+        release_encode_resource(&rendition->avc);
+        destory_encode_pipe(&rendition->avc);
+        if (rendition->scale)
+            vpp_scaler_destroy(&rendition->scaler);
+        surface_queue_destroy(&rendition->decoded);
+        surface_queue_destroy(&rendition->scaled);
+        coded_sink_close(&rendition->sink);
+    }
 
+    surface_queue_destroy(&transcode_context.decode_free);
+    pthread_mutex_destroy(&transcode_context.decode_refs_mutex);
 
+    return 0;
 }
+
 int main(int argc,char **argv)
 {
     VAEntrypoint entrypoints[5];
     int num_entrypoints,vld_entrypoint;
     VAConfigAttrib attrib;
     VAConfigID config_id;
-    VASurfaceID surface_id;
+    VASurfaceID surface_ids[DECODE_SURFACES], surface_id;
     VAContextID context_id;
-    VABufferID pic_param_buf,iqmatrix_buf,slice_param_buf,slice_data_buf;
     int major_ver, minor_ver;
     VAStatus va_status;
-    int putsurface=0;
-	VAImageFormat image_format;
-	VAImage yuv_image;
+    int putsurface=0, frames=1;
 
-    if (argc > 1)
+    if (argc > 1 && (!strcmp(argv[1], "-h") || !strcmp(argv[1], "--help"))) {
+        show_help();
+        exit(0);
+    }
+
+    if (argc > 1) {
         putsurface=1;
+        frames = atoi(argv[1]);
+        if (frames < 1)
+            frames = 1;
+    }
+
+    if (argc > 2) {
+        /* the ABR ladder, e.g. 1280x960,640x480,320x240 */
+        char *ladder = strdup(argv[2]), *size;
+        int width, height;
+
+        for (size = strtok(ladder, ","); size; size = strtok(NULL, ",")) {
+            if (sscanf(size, "%dx%d", &width, &height) != 2 ||
+                width <= 0 || height <= 0 ||
+                add_rendition(width, height)) {
+                fprintf(stderr, "Invalid rendition %s, at most %d different WxH sizes\n", size, RENDITION_MAX);
+                show_help();
+                exit(-1);
+            }
+        }
+        free(ladder);
+    }
+    if (transcode_context.num_renditions == 0)
+        add_rendition(picture_width, picture_height);
 #ifdef ANDROID 
     x11_display = (Display*)malloc(sizeof(Display));
     *(x11_display ) = 0x18c34078;
@@ -3349,68 +3572,21 @@ int main(int argc,char **argv)
     CHECK_VASTATUS(va_status, "vaQueryConfigEntrypoints");
 
     va_status = vaCreateSurfaces(va_dpy,CLIP_WIDTH,CLIP_HEIGHT,
-                                VA_RT_FORMAT_YUV420, 1, &surface_id);
+                                VA_RT_FORMAT_YUV420, DECODE_SURFACES, surface_ids);
     CHECK_VASTATUS(va_status, "vaCreateSurfaces");
+    surface_id = surface_ids[0];
 
     /* Create a context for this decode pipe */
     va_status = vaCreateContext(va_dpy, config_id,
                                CLIP_WIDTH,
                                ((CLIP_HEIGHT+15)/16)*16,
                                VA_PROGRESSIVE,
-                               &surface_id,
-                               1,
+                               surface_ids,
+                               DECODE_SURFACES,
                                &context_id);
     CHECK_VASTATUS(va_status, "vaCreateContext");
-    
-    va_status = vaCreateBuffer(va_dpy, context_id,
-                              VAPictureParameterBufferType,
-                              sizeof(VAPictureParameterBufferMPEG2),
-                              1, &pic_param,
-                              &pic_param_buf);
-    CHECK_VASTATUS(va_status, "vaCreateBuffer");
-    
-    va_status = vaCreateBuffer(va_dpy, context_id,
-                              VAIQMatrixBufferType,
-                              sizeof(VAIQMatrixBufferMPEG2),
-                              1, &iq_matrix,
-                              &iqmatrix_buf );
-    CHECK_VASTATUS(va_status, "vaCreateBuffer");
-
-    va_status = vaCreateBuffer(va_dpy, context_id,
-                              VASliceParameterBufferType,
-                              sizeof(VASliceParameterBufferMPEG2),
-                              15,
-                              &slice_param, &slice_param_buf);
-    CHECK_VASTATUS(va_status, "vaCreateBuffer");
-
-    va_status = vaCreateBuffer(va_dpy, context_id,
-                              VASliceDataBufferType,
-                              //0xc4-0x2f+1,
-                              //19310-0x2f+1,
-                              19252,
-                              1,
-                              //mpeg2_clip+0x2f,
-                              mpeg2_clip+0x3b,
-                              &slice_data_buf);
-    CHECK_VASTATUS(va_status, "vaCreateBuffer");
 
-    va_status = vaBeginPicture(va_dpy, context_id, surface_id);
-    CHECK_VASTATUS(va_status, "vaBeginPicture");
-
-    va_status = vaRenderPicture(va_dpy,context_id, &pic_param_buf, 1);
-    CHECK_VASTATUS(va_status, "vaRenderPicture");
-    
-    va_status = vaRenderPicture(va_dpy,context_id, &iqmatrix_buf, 1);
-    CHECK_VASTATUS(va_status, "vaRenderPicture");
-    
-    va_status = vaRenderPicture(va_dpy,context_id, &slice_param_buf, 1);
-    CHECK_VASTATUS(va_status, "vaRenderPicture");
-    
-    va_status = vaRenderPicture(va_dpy,context_id, &slice_data_buf, 1);
-    CHECK_VASTATUS(va_status, "vaRenderPicture");
-    
-    va_status = vaEndPicture(va_dpy,context_id);
-    CHECK_VASTATUS(va_status, "vaEndPicture");
+    decode_picture(context_id, surface_id);
 
     va_status = vaSyncSurface(va_dpy, surface_id);
     CHECK_VASTATUS(va_status, "vaSyncSurface");
@@ -3439,41 +3615,14 @@ int main(int argc,char **argv)
                                 0,0,WIN_WIDTH,WIN_HEIGHT,
                                 NULL,0,0);
 #endif
-		image_format.fourcc = VA_FOURCC_NV12;
-		image_format.byte_order = VA_LSB_FIRST;
-		image_format.bits_per_pixel = 12;
-
-		if( vaCreateImage(va_dpy, &image_format,
-							surface_width * zoom_out,surface_height * zoom_out,                         
-							&yuv_image) != VA_STATUS_SUCCESS )
-			printf("vaCreateImage error\n");
-
-		zoom_out_surface(va_dpy, surface_id, &zoom_surface_id);
-
-		if (vaGetImage(va_dpy,zoom_surface_id,0,0,
-						surface_width * zoom_out,surface_height * zoom_out,
-						yuv_image.image_id) != VA_STATUS_SUCCESS)
-			printf("vaGetImage error\n");			
-		unsigned char *image_data = NULL;
-		va_status = vaMapBuffer(va_dpy,yuv_image.buf,(void **)&image_data);
-		CHECK_VASTATUS(va_status, "vaMapBuffer()");
-
-		FILE * image_fp = fopen("dump.yuv", "wb");
-		fwrite(image_data, surface_width * zoom_out * surface_height * zoom_out *3/2, 1, image_fp);
-		fclose(image_fp);
-
-		/*va_status = vaPutSurface(va_dpy, zoom_out>1?zoom_surface_id:surface_id,Drawable(win),
-                                0,0,surface_width * zoom_out,surface_height * zoom_out,
-                                0,0,WIN_WIDTH,WIN_HEIGHT,
-                                NULL,0,0);*/
 #endif
        CHECK_VASTATUS(va_status, "vaPutSurface");
-		encode_file();
+		transcode(context_id, surface_ids, frames);
     }
     printf("press any key to exit\n");
     getchar();
 
-    vaDestroySurfaces(va_dpy,&surface_id,1);
+    vaDestroySurfaces(va_dpy,surface_ids,DECODE_SURFACES);
     vaDestroyConfig(va_dpy,config_id);
     vaDestroyContext(va_dpy,context_id);
 
@@ -0,0 +1,395 @@
+/*
+ * Copyright (c) 2016 Intel Corporation. All Rights Reserved.
+ *
+ * Permission is hereby granted, free of charge, to any person obtaining a
+ * copy of this software and associated documentation files (the
+ * "Software"), to deal in the Software without restriction, including
+ * without limitation the rights to use, copy, modify, merge, publish,
+ * distribute, sub license, and/or sell copies of the Software, and to
+ * permit persons to whom the Software is furnished to do so, subject to
+ * the following conditions:
+ *
+ * The above copyright notice and this permission notice (including the
+ * next paragraph) shall be included in all copies or substantial portions
+ * of the Software.
+ *
+ * THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND, EXPRESS
+ * OR IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF
+ * MERCHANTABILITY, FITNESS FOR A PARTICULAR PURPOSE AND NON-INFRINGEMENT.
+ * IN NO EVENT SHALL PRECISION INSIGHT AND/OR ITS SUPPLIERS BE LIABLE FOR
+ * ANY CLAIM, DAMAGES OR OTHER LIABILITY, WHETHER IN AN ACTION OF CONTRACT,
+ * TORT OR OTHERWISE, ARISING FROM, OUT OF OR IN CONNECTION WITH THE
+ * SOFTWARE OR THE USE OR OTHER DEALINGS IN THE SOFTWARE.
+ */
+
+/*
+ * Source frames of the encode tests
+ *
+ * The input is a raw YUV file, a Y4M file or "-" for stdin, a pipe works
+ * as well as a regular file. A Y4M header gives the geometry, the frame
+ * rate and the chroma format: 4:2:0 is read as I420, mono is read with
+ * grey chroma. For raw YUV the caller gives the geometry and the frame
+ * size.
+ *
+ * yuv_input_start() starts a thread reading the frames in order into a
+ * ring, up to `ahead` frames past the highest frame requested so far. A
+ * frame stays in the ring while it is at most `keep` frames below the
+ * highest one requested, which bounds how far back a consumer may look
+ * (a B frame, the previous frame of a difference ...). Both come from the
+ * depth of the caller's pipeline.
+ *
+ * frames is the number of frames of a regular file, for a stream it is
+ * known once its end was read.
+ */
+#ifndef YUV_INPUT_H
+#define YUV_INPUT_H
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <errno.h>
+#include <fcntl.h>
+#include <pthread.h>
+#include <unistd.h>
+#include <sys/stat.h>
+#include <sys/types.h>
+#include "time_us.h"
+
+#define YUV_INPUT_BUFFER_SIZE   4096    /* Y4M headers, frame data is read in place */
+#define YUV_INPUT_LINE_MAX      1024
+
+struct yuv_input {
+    int fd;
+    int y4m;
+    int width, height;
+    int fps_num, fps_den;               /* 0/0 without a Y4M frame rate */
+    int mono;                           /* Y4M mono, the ring holds I420 */
+    unsigned int frame_size;            /* in the ring */
+    unsigned long long frames;          /* 0 while unknown */
+    off_t data_offset;                  /* regular file: frame n at data_offset + n * frame_stride */
+    unsigned int frame_stride;          /* 0 if the frames can't be located */
+    unsigned int frame_header;          /* "FRAME\n" before each frame of a Y4M file */
+
+    unsigned char buf[YUV_INPUT_BUFFER_SIZE];
+    unsigned int buf_pos, buf_len;
+
+    pthread_t thread;
+    pthread_mutex_t mutex;
+    pthread_cond_t cond;
+    unsigned char *ring;
+    unsigned int depth, ahead;          /* depth: keep + ahead + 1 frames */
+    unsigned long long read;            /* frames read, (read - depth, read) in the ring */
+    unsigned long long requested;       /* highest frame requested + 1 */
+    int started, eof;
+    int stop;                           /* yuv_input_close(), the reader leaves */
+    int reading;                        /* the reader is in read(), only there it may be cancelled */
+    unsigned long long wait_us;         /* consumers waited for the reader */
+};
+
+/* next header byte, -1 at the end of the input */
+static inline int
+yuv_input_getc(struct yuv_input *in)
+{
+    ssize_t n;
+
+    if (in->buf_pos == in->buf_len) {
+        do {
+            n = read(in->fd, in->buf, sizeof(in->buf));
+        } while (n < 0 && errno == EINTR);
+        if (n <= 0)
+            return -1;
+        in->buf_pos = 0;
+        in->buf_len = n;
+    }
+
+    return in->buf[in->buf_pos++];
+}
+
+/* a header line without its '\n', -1 if the input ends before */
+static inline int
+yuv_input_line(struct yuv_input *in, char *line, unsigned int size)
+{
+    unsigned int n = 0;
+    int c;
+
+    while ((c = yuv_input_getc(in)) != '\n') {
+        if (c < 0 || n + 1 == size)
+            return -1;
+        line[n++] = c;
+    }
+    line[n] = 0;
+
+    return n;
+}
+
+/* size bytes, what is left in the buffer first, fewer at the end of the input */
+static inline long long
+yuv_input_read(struct yuv_input *in, unsigned char *data, unsigned int size)
+{
+    unsigned int done = in->buf_len - in->buf_pos;
+    ssize_t n;
+
+    if (done > size)
+        done = size;
+    memcpy(data, in->buf + in->buf_pos, done);
+    in->buf_pos += done;
+
+    while (done < size) {
+        n = read(in->fd, data + done, size - done);
+        if (n < 0) {
+            if (errno == EINTR)
+                continue;
+            return -1;
+        }
+        if (n == 0)
+            break;
+        done += n;
+    }
+
+    return done;
+}
+
+static inline int
+yuv_input_parse_y4m(struct yuv_input *in)
+{
+    char line[YUV_INPUT_LINE_MAX], *tag, *save;
+
+    if (yuv_input_line(in, line, sizeof(line)) < 0) {
+        fprintf(stderr, "Y4M: the stream header is truncated\n");
+        return -1;
+    }
+
+    for (tag = strtok_r(line + 9, " ", &save); tag; tag = strtok_r(NULL, " ", &save)) {
+        switch (tag[0]) {
+        case 'W':
+            in->width = atoi(tag + 1);
+            break;
+        case 'H':
+            in->height = atoi(tag + 1);
+            break;
+        case 'F':
+            if (sscanf(tag + 1, "%d:%d", &in->fps_num, &in->fps_den) != 2 ||
+                in->fps_num <= 0 || in->fps_den <= 0)
+                in->fps_num = in->fps_den = 0;
+            break;
+        case 'C':
+            if (!strcmp(tag + 1, "mono"))
+                in->mono = 1;
+            else if (strcmp(tag + 1, "420") && strcmp(tag + 1, "420jpeg") &&
+                     strcmp(tag + 1, "420paldv") && strcmp(tag + 1, "420mpeg2")) {
+                fprintf(stderr, "Y4M: chroma %s isn't supported, only 4:2:0 and mono\n", tag + 1);
+                return -1;
+            }
+            break;
+        default:
+            /* interlacing, aspect ratio and extensions don't matter here */
+            break;
+        }
+    }
+
+    return 0;
+}
+
+/*
+ * name is a file or "-" for stdin, width/height/frame_size are for raw YUV
+ * (frame_size 0 for a 4:2:0 frame), returns 0 or -1 with errno set
+ */
+static inline int
+yuv_input_open(struct yuv_input *in, const char *name, int width, int height,
+               unsigned int frame_size)
+{
+    struct stat st;
+    off_t pos;
+    ssize_t n;
+
+    memset(in, 0, sizeof(*in));
+    in->width = width;
+    in->height = height;
+    in->fd = strcmp(name, "-") ? open(name, O_RDONLY) : dup(STDIN_FILENO);
+    if (in->fd < 0)
+        return -1;
+
+    /* the start of a raw frame stays in the buffer */
+    while (in->buf_len < 10) {
+        n = read(in->fd, in->buf + in->buf_len, sizeof(in->buf) - in->buf_len);
+        if (n < 0 && errno == EINTR)
+            continue;
+        if (n <= 0)
+            break;
+        in->buf_len += n;
+    }
+    if (in->buf_len >= 10 && !memcmp(in->buf, "YUV4MPEG2 ", 10)) {
+        in->y4m = 1;
+        frame_size = 0;
+        if (yuv_input_parse_y4m(in))
+            goto invalid;
+    }
+    if (in->width <= 0 || in->height <= 0) {
+        fprintf(stderr, "%s: the frame size is unknown\n", name);
+        goto invalid;
+    }
+    in->frame_size = frame_size ? frame_size : in->width * in->height * 3 / 2;
+
+    pos = lseek(in->fd, 0, SEEK_CUR);
+    if (fstat(in->fd, &st) == 0 && S_ISREG(st.st_mode) && pos >= 0) {
+        in->data_offset = pos - (in->buf_len - in->buf_pos);
+        /* the first FRAME header tells the size of all of them */
+        if (in->y4m && in->buf_len - in->buf_pos >= 6 &&
+            !memcmp(in->buf + in->buf_pos, "FRAME\n", 6))
+            in->frame_header = 6;
+        if (!in->y4m || in->frame_header) {
+            in->frame_stride = in->frame_header +
+                (in->mono ? in->width * in->height : in->frame_size);
+            in->frames = (st.st_size - in->data_offset) / in->frame_stride;
+        }
+    }
+
+    return 0;
+
+invalid:
+    close(in->fd);
+    in->fd = -1;
+    errno = EINVAL;
+    return -1;
+}
+
+static inline void *
+yuv_input_thread(void *data)
+{
+    struct yuv_input *in = (struct yuv_input *)data;
+    unsigned int luma = in->width * in->height;
+    unsigned int size = in->mono ? luma : in->frame_size;
+    char line[YUV_INPUT_LINE_MAX];
+    unsigned char *frame;
+    long long n = 0;
+    int header = 0;
+
+    pthread_setcancelstate(PTHREAD_CANCEL_DISABLE, NULL);
+    for (;;) {
+        pthread_mutex_lock(&in->mutex);
+        while (!in->stop && in->read >= in->requested + in->ahead)
+            pthread_cond_wait(&in->cond, &in->mutex);
+        in->reading = !in->stop;
+        pthread_mutex_unlock(&in->mutex);
+        if (!in->reading)
+            break;
+
+        /* the slot of frame read - depth, no longer kept */
+        frame = in->ring + (in->read % in->depth) * in->frame_size;
+        /* a live stream may block here, yuv_input_close() cancels the read */
+        pthread_setcancelstate(PTHREAD_CANCEL_ENABLE, NULL);
+        if (in->y4m)
+            header = yuv_input_line(in, line, sizeof(line));
+        if (header >= 0 && (!in->y4m || !strncmp(line, "FRAME", 5)))
+            n = yuv_input_read(in, frame, size);
+        pthread_setcancelstate(PTHREAD_CANCEL_DISABLE, NULL);
+
+        pthread_mutex_lock(&in->mutex);
+        in->reading = 0;
+        pthread_mutex_unlock(&in->mutex);
+        if (header < 0)
+            break;
+        if (in->y4m && strncmp(line, "FRAME", 5)) {
+            fprintf(stderr, "Y4M: no FRAME header for frame %llu\n", in->read);
+            break;
+        }
+        if (n != size) {
+            if (n != 0)
+                fprintf(stderr, "The source ends with a truncated frame, dropped\n");
+            break;
+        }
+        if (in->mono)
+            memset(frame + luma, 0x80, in->frame_size - luma);
+
+        pthread_mutex_lock(&in->mutex);
+        in->read++;
+        pthread_cond_broadcast(&in->cond);
+        pthread_mutex_unlock(&in->mutex);
+    }
+
+    pthread_mutex_lock(&in->mutex);
+    in->frames = in->read;
+    in->eof = 1;
+    pthread_cond_broadcast(&in->cond);
+    pthread_mutex_unlock(&in->mutex);
+
+    return NULL;
+}
+
+/* 0 or -1 with errno set */
+static inline int
+yuv_input_start(struct yuv_input *in, unsigned int keep, unsigned int ahead)
+{
+    in->ahead = ahead ? ahead : 1;
+    in->depth = keep + in->ahead + 1;
+    in->ring = (unsigned char *)malloc((size_t)in->depth * in->frame_size);
+    if (in->ring == NULL)
+        return -1;
+
+    pthread_mutex_init(&in->mutex, NULL);
+    pthread_cond_init(&in->cond, NULL);
+    errno = pthread_create(&in->thread, NULL, yuv_input_thread, in);
+    if (errno)
+        return -1;
+    in->started = 1;
+
+    return 0;
+}
+
+/*
+ * frame n in the ring, valid until the highest frame requested is more
+ * than keep frames above it; NULL with errno ENODATA past the end of the
+ * input, ERANGE if the frame already left the ring
+ */
+static inline unsigned char *
+yuv_input_frame(struct yuv_input *in, unsigned long long n)
+{
+    unsigned char *frame = NULL;
+    unsigned long long begin;
+
+    pthread_mutex_lock(&in->mutex);
+    if (n >= in->requested && !(in->eof && n >= in->read)) {
+        in->requested = n + 1;
+        pthread_cond_broadcast(&in->cond);
+    }
+    if (n >= in->read && !in->eof) {
+        begin = time_us_monotonic();
+        while (n >= in->read && !in->eof)
+            pthread_cond_wait(&in->cond, &in->mutex);
+        in->wait_us += time_us_monotonic() - begin;
+    }
+    if (n >= in->read)
+        errno = ENODATA;
+    else if (in->read >= n + in->depth)
+        errno = ERANGE;
+    else
+        frame = in->ring + (n % in->depth) * in->frame_size;
+    pthread_mutex_unlock(&in->mutex);
+
+    return frame;
+}
+
+static inline void
+yuv_input_close(struct yuv_input *in)
+{
+    if (in->started) {
+        pthread_mutex_lock(&in->mutex);
+        in->stop = 1;
+        pthread_cond_broadcast(&in->cond);
+        /* blocked on a live stream, it holds no lock and no stdio in there */
+        if (in->reading)
+            pthread_cancel(in->thread);
+        pthread_mutex_unlock(&in->mutex);
+        pthread_join(in->thread, NULL);
+        pthread_cond_destroy(&in->cond);
+        pthread_mutex_destroy(&in->mutex);
+        in->started = 0;
+    }
+    free(in->ring);
+    in->ring = NULL;
+    if (in->fd >= 0)
+        close(in->fd);
+    in->fd = -1;
+}
+
+#endif /* YUV_INPUT_H */
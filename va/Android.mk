@@ -41,7 +41,8 @@ include $(CLEAR_VARS)
 LOCAL_SRC_FILES := \
 	va.c \
 	va_trace.c \
-	va_fool.c
+	va_fool.c \
+	va_track.c
 
 LOCAL_CFLAGS_32 += \
 	-DANDROID \
@@ -29,6 +29,7 @@
 #include "va_backend_vpp.h"
 #include "va_trace.h"
 #include "va_fool.h"
+#include "va_track.h"
 
 #include <assert.h>
 #include <stdarg.h>
@@ -187,6 +188,21 @@ va_getDriverInitName(char *name, int namelen, int major, int minor)
     return ret > 0 && ret < namelen;
 }
 
+static inline int
+va_getLayerInitName(char *name, int namelen, int major, int minor)
+{
+    int ret = snprintf(name, namelen, "__vaLayerInit_%d_%d", major, minor);
+    return ret > 0 && ret < namelen;
+}
+
+static VAStatus
+va_impl_query_surface_attributes(
+    VADriverContextP    ctx,
+    VAConfigID          config,
+    VASurfaceAttrib    *out_attribs,
+    unsigned int       *out_num_attribs_ptr
+);
+
 static VAStatus va_getDriverName(VADisplay dpy, char **driver_name)
 {
     VADisplayContextP pDisplayContext = (VADisplayContextP)dpy;
@@ -501,6 +517,75 @@ VAStatus vaSetDriverName(
     return VA_STATUS_SUCCESS;
 }
 
+/*
+ * Install the layers on top of the driver vtable, innermost first:
+ * track, fool, trace, then the libraries listed in LIBVA_LAYERS. The vtable
+ * is left untouched when no layer is active, so va.c calls the driver
+ * directly
+ */
+static void va_openLayers(VADisplay dpy)
+{
+    VADriverContextP ctx = CTX(dpy);
+    char *layer_list = NULL;
+    char *saveptr;
+    char *layer_path;
+
+    ctx->va_dpy = dpy;
+
+    /* layers only hook the entries which are set */
+    if (!ctx->vtable->vaQuerySurfaceAttributes)
+        ctx->vtable->vaQuerySurfaceAttributes = va_impl_query_surface_attributes;
+
+    va_TrackInitLayer(dpy);
+    va_FoolInitLayer(dpy);
+    va_TraceInitLayer(dpy);
+
+    if (geteuid() == getuid())
+        /* don't allow setuid apps to use LIBVA_LAYERS */
+        layer_list = getenv("LIBVA_LAYERS");
+    if (!layer_list)
+        return;
+
+    layer_list = strdup(layer_list);
+    if (!layer_list) {
+        va_errorMessage("%s L%d Out of memory!\n",
+                        __FUNCTION__, __LINE__);
+        return;
+    }
+
+    layer_path = strtok_r(layer_list, ":", &saveptr);
+    while (layer_path) {
+        VALayerInit init_func;
+        char init_func_s[256];
+        void *handle;
+        VAStatus vaStatus;
+
+        va_infoMessage("Trying to open layer %s\n", layer_path);
+#ifndef ANDROID
+        handle = dlopen(layer_path, RTLD_NOW | RTLD_GLOBAL | RTLD_NODELETE);
+#else
+        handle = dlopen(layer_path, RTLD_NOW | RTLD_GLOBAL);
+#endif
+        if (!handle) {
+            va_errorMessage("dlopen of %s failed: %s\n", layer_path, dlerror());
+        } else if (!va_getLayerInitName(init_func_s, sizeof(init_func_s),
+                                        VA_MAJOR_VERSION, VA_MINOR_VERSION) ||
+                   !(init_func = (VALayerInit)dlsym(handle, init_func_s))) {
+            va_errorMessage("%s has no function %s\n", layer_path, init_func_s);
+            dlclose(handle);
+        } else {
+            /* the layer stays loaded until the process exits */
+            vaStatus = (*init_func)(ctx);
+            if (vaStatus != VA_STATUS_SUCCESS)
+                va_errorMessage("%s returns %s\n", init_func_s, vaErrorStr(vaStatus));
+        }
+
+        layer_path = strtok_r(NULL, ":", &saveptr);
+    }
+
+    free(layer_list);
+}
+
 VAStatus vaInitialize (
     VADisplay dpy,
     int *major_version,	 /* out */
@@ -520,6 +605,8 @@ VAStatus vaInitialize (
 
     va_FoolInit(dpy);
 
+    va_TrackInit(dpy);
+
     va_infoMessage("VA-API version %s\n", VA_VERSION_S);
 
     vaStatus = va_getDriverName(dpy, &driver_name);
@@ -557,6 +644,9 @@ VAStatus vaInitialize (
         vaStatus = va_openDriver(dpy, driver_name);
         va_infoMessage("va_openDriver() returns %d\n", vaStatus);
 
+        if (VA_STATUS_SUCCESS == vaStatus)
+            va_openLayers(dpy);
+
         *major_version = VA_MAJOR_VERSION;
         *minor_version = VA_MINOR_VERSION;
     } else
@@ -607,12 +697,24 @@ VAStatus vaTerminate (
 
   va_FoolEnd(dpy);
 
+  va_TrackEnd(dpy);
+
   if (VA_STATUS_SUCCESS == vaStatus)
       pDisplayContext->vaDestroy(pDisplayContext);
 
   return vaStatus;
 }
 
+VAStatus vaQueryObjectStats (
+    VADisplay dpy,
+    VAObjectStats *stats	/* out */
+)
+{
+  CHECK_DISPLAY(dpy);
+
+  return va_TrackQueryObjectStats(dpy, stats);
+}
+
 /*
  * vaQueryVendorString returns a pointer to a zero-terminated string
  * describing some aspects of the VA implemenation on a specific
@@ -725,10 +827,6 @@ VAStatus vaCreateConfig (
 
   vaStatus = ctx->vtable->vaCreateConfig ( ctx, profile, entrypoint, attrib_list, num_attribs, config_id );
 
-  /* record the current entrypoint for further trace/fool determination */
-  VA_TRACE_ALL(va_TraceCreateConfig, dpy, profile, entrypoint, attrib_list, num_attribs, config_id);
-  VA_FOOL_FUNC(va_FoolCreateConfig, dpy, profile, entrypoint, attrib_list, num_attribs, config_id);
-  
   return vaStatus;
 }
 
@@ -933,8 +1031,6 @@ vaQuerySurfaceAttributes(
         vaStatus = ctx->vtable->vaQuerySurfaceAttributes(ctx, config,
                                                          attrib_list, num_attribs);
 
-    VA_TRACE_LOG(va_TraceQuerySurfaceAttributes, dpy, config, attrib_list, num_attribs);
-
     return vaStatus;
 }
 
@@ -967,9 +1063,6 @@ vaCreateSurfaces(
     else
         vaStatus = ctx->vtable->vaCreateSurfaces(ctx, width, height, format,
                                                  num_surfaces, surfaces);
-    VA_TRACE_LOG(va_TraceCreateSurfaces,
-                 dpy, width, height, format, num_surfaces, surfaces,
-                 attrib_list, num_attribs);
 
     return vaStatus;
 }
@@ -987,11 +1080,8 @@ VAStatus vaDestroySurfaces (
   CHECK_DISPLAY(dpy);
   ctx = CTX(dpy);
 
-  VA_TRACE_LOG(va_TraceDestroySurfaces,
-               dpy, surface_list, num_surfaces);
-  
   vaStatus = ctx->vtable->vaDestroySurfaces( ctx, surface_list, num_surfaces );
-  
+
   return vaStatus;
 }
 
@@ -1015,9 +1105,6 @@ VAStatus vaCreateContext (
   vaStatus = ctx->vtable->vaCreateContext( ctx, config_id, picture_width, picture_height,
                                       flag, render_targets, num_render_targets, context );
 
-  /* keep current encode/decode resoluton */
-  VA_TRACE_ALL(va_TraceCreateContext, dpy, config_id, picture_width, picture_height, flag, render_targets, num_render_targets, context);
-
   return vaStatus;
 }
 
@@ -1049,13 +1136,8 @@ VAStatus vaCreateBuffer (
   CHECK_DISPLAY(dpy);
   ctx = CTX(dpy);
 
-  VA_FOOL_FUNC(va_FoolCreateBuffer, dpy, context, type, size, num_elements, data, buf_id);
-
   vaStatus = ctx->vtable->vaCreateBuffer( ctx, context, type, size, num_elements, data, buf_id);
 
-  VA_TRACE_LOG(va_TraceCreateBuffer,
-               dpy, context, type, size, num_elements, data, buf_id);
-  
   return vaStatus;
 }
 
@@ -1069,8 +1151,6 @@ VAStatus vaBufferSetNumElements (
   CHECK_DISPLAY(dpy);
   ctx = CTX(dpy);
 
-  VA_FOOL_FUNC(va_FoolCheckContinuity, dpy);
-  
   return ctx->vtable->vaBufferSetNumElements( ctx, buf_id, num_elements );
 }
 
@@ -1086,13 +1166,9 @@ VAStatus vaMapBuffer (
   
   CHECK_DISPLAY(dpy);
   ctx = CTX(dpy);
-  
-  VA_FOOL_FUNC(va_FoolMapBuffer, dpy, buf_id, pbuf);
-  
+
   va_status = ctx->vtable->vaMapBuffer( ctx, buf_id, pbuf );
 
-  VA_TRACE_ALL(va_TraceMapBuffer, dpy, buf_id, pbuf);
-  
   return va_status;
 }
 
@@ -1105,8 +1181,6 @@ VAStatus vaUnmapBuffer (
   CHECK_DISPLAY(dpy);
   ctx = CTX(dpy);
 
-  VA_FOOL_FUNC(va_FoolCheckContinuity, dpy);
-
   return ctx->vtable->vaUnmapBuffer( ctx, buf_id );
 }
 
@@ -1116,15 +1190,14 @@ VAStatus vaDestroyBuffer (
 )
 {
   VADriverContextP ctx;
+  VAStatus va_status;
+
   CHECK_DISPLAY(dpy);
   ctx = CTX(dpy);
 
-  VA_FOOL_FUNC(va_FoolCheckContinuity, dpy);
+  va_status = ctx->vtable->vaDestroyBuffer( ctx, buffer_id );
 
-  VA_TRACE_LOG(va_TraceDestroyBuffer,
-               dpy, buffer_id);
-  
-  return ctx->vtable->vaDestroyBuffer( ctx, buffer_id );
+  return va_status;
 }
 
 VAStatus vaBufferInfo (
@@ -1141,8 +1214,6 @@ VAStatus vaBufferInfo (
   CHECK_DISPLAY(dpy);
   ctx = CTX(dpy);
 
-  VA_FOOL_FUNC(va_FoolBufferInfo, dpy, buf_id, type, size, num_elements);
-  
   return ctx->vtable->vaBufferInfo( ctx, buf_id, type, size, num_elements );
 }
 
@@ -1186,11 +1257,8 @@ VAStatus vaBeginPicture (
   CHECK_DISPLAY(dpy);
   ctx = CTX(dpy);
 
-  VA_TRACE_ALL(va_TraceBeginPicture, dpy, context, render_target);
-  VA_FOOL_FUNC(va_FoolCheckContinuity, dpy);
-  
   va_status = ctx->vtable->vaBeginPicture( ctx, context, render_target );
-  
+
   return va_status;
 }
 
@@ -1202,14 +1270,14 @@ VAStatus vaRenderPicture (
 )
 {
   VADriverContextP ctx;
+  VAStatus va_status;
 
   CHECK_DISPLAY(dpy);
   ctx = CTX(dpy);
 
-  VA_TRACE_LOG(va_TraceRenderPicture, dpy, context, buffers, num_buffers);
-  VA_FOOL_FUNC(va_FoolCheckContinuity, dpy);
+  va_status = ctx->vtable->vaRenderPicture( ctx, context, buffers, num_buffers );
 
-  return ctx->vtable->vaRenderPicture( ctx, context, buffers, num_buffers );
+  return va_status;
 }
 
 VAStatus vaEndPicture (
@@ -1223,13 +1291,8 @@ VAStatus vaEndPicture (
   CHECK_DISPLAY(dpy);
   ctx = CTX(dpy);
 
-  VA_FOOL_FUNC(va_FoolCheckContinuity, dpy);
-
   va_status = ctx->vtable->vaEndPicture( ctx, context );
 
-  /* dump surface content */
-  VA_TRACE_ALL(va_TraceEndPicture, dpy, context, 1);
-
   return va_status;
 }
 
@@ -1245,7 +1308,6 @@ VAStatus vaSyncSurface (
   ctx = CTX(dpy);
 
   va_status = ctx->vtable->vaSyncSurface( ctx, render_target );
-  VA_TRACE_LOG(va_TraceSyncSurface, dpy, render_target);
 
   return va_status;
 }
@@ -1263,8 +1325,6 @@ VAStatus vaQuerySurfaceStatus (
 
   va_status = ctx->vtable->vaQuerySurfaceStatus( ctx, render_target, status );
 
-  VA_TRACE_LOG(va_TraceQuerySurfaceStatus, dpy, render_target, status);
-
   return va_status;
 }
 
@@ -1282,8 +1342,6 @@ VAStatus vaQuerySurfaceError (
 
   va_status = ctx->vtable->vaQuerySurfaceError( ctx, surface, error_status, error_info );
 
-  VA_TRACE_LOG(va_TraceQuerySurfaceError, dpy, surface, error_status, error_info);
-
   return va_status;
 }
 
@@ -1657,8 +1715,6 @@ VAStatus vaQueryDisplayAttributes (
   ctx = CTX(dpy);
   va_status = ctx->vtable->vaQueryDisplayAttributes ( ctx, attr_list, num_attributes );
 
-  VA_TRACE_LOG(va_TraceQueryDisplayAttributes, dpy, attr_list, num_attributes);
-
   return va_status;
   
 }
@@ -1682,8 +1738,6 @@ VAStatus vaGetDisplayAttributes (
   ctx = CTX(dpy);
   va_status = ctx->vtable->vaGetDisplayAttributes ( ctx, attr_list, num_attributes );
 
-  VA_TRACE_LOG(va_TraceGetDisplayAttributes, dpy, attr_list, num_attributes);
-  
   return va_status;
 }
 
@@ -1705,7 +1759,6 @@ VAStatus vaSetDisplayAttributes (
   ctx = CTX(dpy);
 
   va_status = ctx->vtable->vaSetDisplayAttributes ( ctx, attr_list, num_attributes );
-  VA_TRACE_LOG(va_TraceSetDisplayAttributes, dpy, attr_list, num_attributes);
   
   return va_status;
 }
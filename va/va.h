@@ -295,6 +295,49 @@ VAStatus vaTerminate (
     VADisplay dpy
 );
 
+/** \brief Object types accounted by vaQueryObjectStats(). */
+typedef enum
+{
+    VAObjectConfig              = 0,
+    VAObjectContext,
+    VAObjectSurface,
+    VAObjectBuffer,
+    VAObjectImage,
+    VAObjectTypeCount
+} VAObjectType;
+
+/** \brief Objects alive on a display, indexed by #VAObjectType. */
+typedef struct _VAObjectStats
+{
+    /** \brief Objects created and not destroyed yet. */
+    unsigned int live_count[VAObjectTypeCount];
+    /** \brief Bytes held by the live objects. */
+    unsigned long long live_bytes[VAObjectTypeCount];
+    /** \brief Highest value of \c live_bytes since vaInitialize(). */
+    unsigned long long peak_bytes[VAObjectTypeCount];
+} VAObjectStats;
+
+/**
+ * \brief Queries the configs, contexts, surfaces, buffers and images
+ * alive on the display.
+ *
+ * Object accounting is enabled by setting LIBVA_TRACK_OBJECTS before
+ * vaInitialize(), vaTerminate() then reports the objects that were not
+ * destroyed together with the call site that created them. Surface
+ * bytes are estimated from the render target format and dimensions,
+ * buffer bytes are size * num_elements, image bytes are the image
+ * data_size (0 for derived images, which share the surface memory).
+ *
+ * @param[in] dpy               the VA display
+ * @param[out] stats            the object counts and bytes
+ * @return VA_STATUS_SUCCESS if successful, VA_STATUS_ERROR_UNIMPLEMENTED
+ *     if object accounting is not enabled
+ */
+VAStatus vaQueryObjectStats (
+    VADisplay dpy,
+    VAObjectStats *stats	/* out */
+);
+
 /**
  * vaQueryVendorString returns a pointer to a zero-terminated string
  * describing some aspects of the VA implemenation on a specific    
@@ -532,7 +532,15 @@ struct VADriverContext
 
     char *override_driver_name;
 
-    unsigned long reserved[41];         /* reserve for future add-ins, decrease the subscript accordingly */
+    /**
+     * \brief The VADisplay this driver context belongs to.
+     *
+     * Set by libva before any layer is installed, so that layer hooks
+     * called with the driver context can get back to their display.
+     */
+    VADisplay va_dpy;
+
+    unsigned long reserved[40];         /* reserve for future add-ins, decrease the subscript accordingly */
 };
 
 #define VA_DISPLAY_MAGIC 0x56414430 /* VAD0 */
@@ -559,10 +567,25 @@ struct VADisplayContext
     void *opaque; /* opaque for display extensions (e.g. GLX) */
     void *vatrace; /* opaque for VA trace context */
     void *vafool; /* opaque for VA fool context */
+    void *vatrack; /* opaque for VA object tracking context */
 };
 
 typedef VAStatus (*VADriverInit) (
     VADriverContextP driver_context
 );
 
+/**
+ * \brief Layer between libva and the driver.
+ *
+ * Layers listed in LIBVA_LAYERS are loaded by vaInitialize() once the
+ * driver is initialized, and their __vaLayerInit_<major>_<minor>()
+ * function is called with the driver context. A layer hooks the calls
+ * it is interested in by saving the entries of driver_context->vtable
+ * (and vtable_vpp) it replaces and calling down to them from its hooks.
+ * Calls which are not hooked go straight to the driver.
+ */
+typedef VAStatus (*VALayerInit) (
+    VADriverContextP driver_context
+);
+
 #endif /* _VA_BACKEND_H_ */
@@ -88,6 +88,8 @@ struct fool_context {
     unsigned int fool_buf_element[VABufferTypeMax]; /* element count of created buffers */
     unsigned int fool_buf_count[VABufferTypeMax]; /* count of created buffers */
     VAContextID context;
+
+    struct VADriverVTable vtable; /* layer below, called by the fool hooks */
 };
 
 #define FOOL_CTX(dpy) ((struct fool_context *)((VADisplayContextP)dpy)->vafool)
@@ -373,3 +375,185 @@ VAStatus va_FoolCheckContinuity(VADisplay dpy)
     return 1; /* fool is valid */
 }
 
+
+/*
+ * Fool layer: the hooks are put into the driver vtable by va_FoolInitLayer()
+ * only when one of LIBVA_FOOL_DECODE/ENCODE/JPEG is set
+ */
+#define CTX2FOOLCTX(ctx) FOOL_CTX((ctx)->va_dpy)
+
+static VAStatus va_FoolHookCreateConfig(
+    VADriverContextP ctx,
+    VAProfile profile,
+    VAEntrypoint entrypoint,
+    VAConfigAttrib *attrib_list,
+    int num_attribs,
+    VAConfigID *config_id /* out */
+)
+{
+    struct fool_context *fool_ctx = CTX2FOOLCTX(ctx);
+    VAStatus va_status;
+
+    va_status = fool_ctx->vtable.vaCreateConfig(ctx, profile, entrypoint, attrib_list, num_attribs, config_id);
+    va_FoolCreateConfig(ctx->va_dpy, profile, entrypoint, attrib_list, num_attribs, config_id);
+
+    return va_status;
+}
+
+static VAStatus va_FoolHookCreateBuffer(
+    VADriverContextP ctx,
+    VAContextID context,	/* in */
+    VABufferType type,		/* in */
+    unsigned int size,		/* in */
+    unsigned int num_elements,	/* in */
+    void *data,			/* in */
+    VABufferID *buf_id		/* out */
+)
+{
+    struct fool_context *fool_ctx = CTX2FOOLCTX(ctx);
+
+    if (va_FoolCreateBuffer(ctx->va_dpy, context, type, size, num_elements, data, buf_id))
+        return VA_STATUS_SUCCESS;
+
+    return fool_ctx->vtable.vaCreateBuffer(ctx, context, type, size, num_elements, data, buf_id);
+}
+
+static VAStatus va_FoolHookBufferSetNumElements(
+    VADriverContextP ctx,
+    VABufferID buf_id,	/* in */
+    unsigned int num_elements /* in */
+)
+{
+    struct fool_context *fool_ctx = CTX2FOOLCTX(ctx);
+
+    if (fool_ctx->enabled)
+        return VA_STATUS_SUCCESS;
+
+    return fool_ctx->vtable.vaBufferSetNumElements(ctx, buf_id, num_elements);
+}
+
+static VAStatus va_FoolHookMapBuffer(
+    VADriverContextP ctx,
+    VABufferID buf_id,	/* in */
+    void **pbuf 	/* out */
+)
+{
+    struct fool_context *fool_ctx = CTX2FOOLCTX(ctx);
+
+    if (va_FoolMapBuffer(ctx->va_dpy, buf_id, pbuf))
+        return VA_STATUS_SUCCESS;
+
+    return fool_ctx->vtable.vaMapBuffer(ctx, buf_id, pbuf);
+}
+
+static VAStatus va_FoolHookUnmapBuffer(
+    VADriverContextP ctx,
+    VABufferID buf_id	/* in */
+)
+{
+    struct fool_context *fool_ctx = CTX2FOOLCTX(ctx);
+
+    if (fool_ctx->enabled)
+        return VA_STATUS_SUCCESS;
+
+    return fool_ctx->vtable.vaUnmapBuffer(ctx, buf_id);
+}
+
+static VAStatus va_FoolHookDestroyBuffer(
+    VADriverContextP ctx,
+    VABufferID buffer_id
+)
+{
+    struct fool_context *fool_ctx = CTX2FOOLCTX(ctx);
+
+    if (fool_ctx->enabled)
+        return VA_STATUS_SUCCESS;
+
+    return fool_ctx->vtable.vaDestroyBuffer(ctx, buffer_id);
+}
+
+static VAStatus va_FoolHookBufferInfo(
+    VADriverContextP ctx,
+    VABufferID buf_id,  /* in */
+    VABufferType *type, /* out */
+    unsigned int *size,         /* out */
+    unsigned int *num_elements /* out */
+)
+{
+    struct fool_context *fool_ctx = CTX2FOOLCTX(ctx);
+
+    if (va_FoolBufferInfo(ctx->va_dpy, buf_id, type, size, num_elements))
+        return VA_STATUS_SUCCESS;
+
+    return fool_ctx->vtable.vaBufferInfo(ctx, buf_id, type, size, num_elements);
+}
+
+static VAStatus va_FoolHookBeginPicture(
+    VADriverContextP ctx,
+    VAContextID context,
+    VASurfaceID render_target
+)
+{
+    struct fool_context *fool_ctx = CTX2FOOLCTX(ctx);
+
+    if (fool_ctx->enabled)
+        return VA_STATUS_SUCCESS;
+
+    return fool_ctx->vtable.vaBeginPicture(ctx, context, render_target);
+}
+
+static VAStatus va_FoolHookRenderPicture(
+    VADriverContextP ctx,
+    VAContextID context,
+    VABufferID *buffers,
+    int num_buffers
+)
+{
+    struct fool_context *fool_ctx = CTX2FOOLCTX(ctx);
+
+    if (fool_ctx->enabled)
+        return VA_STATUS_SUCCESS;
+
+    return fool_ctx->vtable.vaRenderPicture(ctx, context, buffers, num_buffers);
+}
+
+static VAStatus va_FoolHookEndPicture(
+    VADriverContextP ctx,
+    VAContextID context
+)
+{
+    struct fool_context *fool_ctx = CTX2FOOLCTX(ctx);
+
+    if (fool_ctx->enabled)
+        return VA_STATUS_SUCCESS;
+
+    return fool_ctx->vtable.vaEndPicture(ctx, context);
+}
+
+/* hook an entry of the vtable, if the layer below implements it */
+#define FOOL_HOOK(vtable, func)                         \
+    if (vtable->va##func)                               \
+        vtable->va##func = va_FoolHook##func;
+
+void va_FoolInitLayer(VADisplay dpy)
+{
+    VADriverContextP ctx = ((VADisplayContextP)dpy)->pDriverContext;
+    struct VADriverVTable *vtable = ctx->vtable;
+    struct fool_context *fool_ctx = FOOL_CTX(dpy);
+
+    if ((fool_ctx == NULL) || (fool_codec == 0))
+        return;
+
+    fool_ctx->vtable = *vtable;
+
+    FOOL_HOOK(vtable, CreateConfig);
+    FOOL_HOOK(vtable, CreateBuffer);
+    FOOL_HOOK(vtable, BufferSetNumElements);
+    FOOL_HOOK(vtable, MapBuffer);
+    FOOL_HOOK(vtable, UnmapBuffer);
+    FOOL_HOOK(vtable, DestroyBuffer);
+    FOOL_HOOK(vtable, BufferInfo);
+    FOOL_HOOK(vtable, BeginPicture);
+    FOOL_HOOK(vtable, RenderPicture);
+    FOOL_HOOK(vtable, EndPicture);
+}
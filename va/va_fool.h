@@ -39,14 +39,9 @@ extern int fool_postp;
 #define VA_FOOL_FLAG_ENCODE  0x2
 #define VA_FOOL_FLAG_JPEG    0x4
 
-#define VA_FOOL_FUNC(fool_func,...)            \
-    if (fool_codec) {                          \
-        if (fool_func(__VA_ARGS__))            \
-            return VA_STATUS_SUCCESS;          \
-    }
-    
 void va_FoolInit(VADisplay dpy);
 int va_FoolEnd(VADisplay dpy);
+void va_FoolInitLayer(VADisplay dpy);
 
 int va_FoolCreateConfig(
         VADisplay dpy,
@@ -48,16 +48,28 @@
 #include <unistd.h>
 #include <time.h>
 #include <errno.h>
+#include <fcntl.h>
+#include <limits.h>
+#include <sys/uio.h>
 
 /*
  * Env. to debug some issue, e.g. the decode/encode issue in a video conference scenerio:
  * .LIBVA_TRACE=log_file: general VA parameters saved into log_file
  * .LIBVA_TRACE_BUFDATA: dump all VA data buffer into log_file
- * .LIBVA_TRACE_CODEDBUF=coded_clip_file: save the coded clip into file coded_clip_file
+ * .LIBVA_TRACE_DURATION: log how long each traced call takes, in ns
+ * .LIBVA_TRACE_CODEDBUF=coded_clip_file: save the coded clip into file coded_clip_file. The clip is
+ *                                wrapped per profile: IVF for VP8/VP9, Annex-B for H.264/HEVC,
+ *                                and concatenated JFIF pictures for JPEG
  * .LIBVA_TRACE_SURFACE=yuv_file: save surface YUV into file yuv_file. Use file name to determine
  *                                decode/encode or jpeg surfaces
  * .LIBVA_TRACE_SURFACE_GEOMETRY=WIDTHxHEIGHT+XOFF+YOFF: only save part of surface context into file
  *                                due to storage bandwidth limitation
+ * .LIBVA_TRACE_FILE_SIZE=size[K|M|G]: cap each of the above files to size bytes. The space is
+ *                                preallocated when the file is opened, and the file is rotated
+ *                                (overwritten from the start) once full. The log is only rotated
+ *                                between two traced calls, so it may go a little over the size
+ * .LIBVA_TRACE_FILE_COUNT=count: with LIBVA_TRACE_FILE_SIZE, rotate through count segment files
+ *                                named file.0 .. file.<count-1>, overwriting the oldest one
  */
 
 /* global settings */
@@ -70,14 +82,27 @@ struct trace_context {
     /* LIBVA_TRACE */
     FILE *trace_fp_log; /* save the log into a file */
     char *trace_log_fn; /* file name */
+    unsigned int trace_log_segment; /* current segment file */
+    struct timespec trace_ts; /* CLOCK_MONOTONIC time of the current call */
+    int trace_ts_valid; /* trace_ts is taken for the current call */
+    int trace_call_active; /* nesting of va_TraceCallBegin/va_TraceCallEnd */
     
     /* LIBVA_TRACE_CODEDBUF */
-    FILE *trace_fp_codedbuf; /* save the encode result into a file */
+    int trace_fd_codedbuf; /* save the encode result into a file */
     char *trace_codedbuf_fn; /* file name */
+    int trace_codedbuf_container; /* TRACE_CONTAINER_xxx, from the profile */
+    unsigned int trace_codedbuf_segment; /* current segment file */
+    unsigned long long trace_codedbuf_size; /* bytes in current segment */
+    unsigned int trace_codedbuf_frames; /* frames in current segment */
     
     /* LIBVA_TRACE_SURFACE */
     FILE *trace_fp_surface; /* save the surface YUV into a file */
     char *trace_surface_fn; /* file name */
+    unsigned int trace_surface_segment; /* current segment file */
+
+    /* LIBVA_TRACE_FILE_SIZE/LIBVA_TRACE_FILE_COUNT */
+    unsigned long long trace_file_size; /* max size of one segment, 0 for no limit */
+    unsigned int trace_file_count; /* segments to rotate through */
 
     VAContextID  trace_context; /* current context */
     
@@ -97,9 +122,20 @@ struct trace_context {
     unsigned int trace_frame_width; /* current frame width */
     unsigned int trace_frame_height; /* current frame height */
 
-    unsigned int pts; /* IVF header information */
+    unsigned int pts; /* frame count of the coded clip, IVF timestamp */
+
+    struct VADriverVTable vtable; /* layer below, called by the trace hooks */
 };
 
+/* container of the coded clip saved by LIBVA_TRACE_CODEDBUF */
+#define TRACE_CONTAINER_RAW     0 /* segments written as is */
+#define TRACE_CONTAINER_IVF     1 /* VP8/VP9 */
+#define TRACE_CONTAINER_ANNEXB  2 /* H.264/HEVC elementary stream */
+#define TRACE_CONTAINER_JFIF    3 /* one JFIF picture per frame */
+
+/* iovec slots gathered per writev of one coded frame */
+#define TRACE_CODEDBUF_IOV      16
+
 #define TRACE_CTX(dpy) ((struct trace_context *)((VADisplayContextP)dpy)->vatrace)
 
 #define DPY2TRACECTX(dpy)                               \
@@ -108,7 +144,12 @@ struct trace_context {
     if (trace_ctx == NULL)                              \
         return;                                         \
 
-#define TRACE_FUNCNAME(idx)    va_TraceMsg(trace_ctx, "==========%s\n", __func__); 
+/* a new call is traced, its lines share one timestamp */
+#define TRACE_FUNCNAME(idx)    do {                             \
+        if (!trace_ctx->trace_call_active)                      \
+            trace_ctx->trace_ts_valid = 0;                      \
+        va_TraceMsg(trace_ctx, "==========%s\n", __func__);     \
+    } while (0)
 
 /* Prototype declarations (functions defined in va.c) */
 
@@ -155,6 +196,98 @@ do {                                                    \
              (unsigned long)trace_ctx);                 \
 } while (0)
 
+/*
+ * Open segment "segment" of a trace file, and reserve trace_file_size
+ * bytes for it so that it isn't extended block by block while tracing
+ */
+static int va_TraceOpenFile(
+    struct trace_context *trace_ctx,
+    const char *fn,
+    unsigned int segment
+)
+{
+    char segment_fn[1024];
+    int fd;
+
+    if (trace_ctx->trace_file_count > 1) {
+        snprintf(segment_fn, sizeof(segment_fn), "%s.%u", fn, segment);
+        fn = segment_fn;
+    }
+
+    fd = open(fn, O_WRONLY | O_CREAT | O_TRUNC, 0644);
+    if (fd == -1) {
+        va_errorMessage("Open file %s failed (%s)\n", fn, strerror(errno));
+        return -1;
+    }
+
+#ifdef FALLOC_FL_KEEP_SIZE
+    if (trace_ctx->trace_file_size &&
+        fallocate(fd, FALLOC_FL_KEEP_SIZE, 0, trace_ctx->trace_file_size) != 0)
+        va_infoMessage("Preallocate file %s failed (%s)\n", fn, strerror(errno));
+#endif
+
+    return fd;
+}
+
+/* give back the preallocated space which wasn't used */
+static void va_TraceCloseFile(int fd, off_t size)
+{
+    if (ftruncate(fd, size) != 0)
+        va_errorMessage("Truncate trace file failed (%s)\n", strerror(errno));
+    close(fd);
+}
+
+static FILE *va_TraceOpenStream(
+    struct trace_context *trace_ctx,
+    const char *fn,
+    unsigned int segment
+)
+{
+    int fd = va_TraceOpenFile(trace_ctx, fn, segment);
+    FILE *fp;
+
+    if (fd == -1)
+        return NULL;
+
+    fp = fdopen(fd, "w");
+    if (fp == NULL)
+        close(fd);
+
+    return fp;
+}
+
+static void va_TraceCloseStream(FILE *fp)
+{
+    fflush(fp);
+    if (ftruncate(fileno(fp), ftello(fp)) != 0)
+        va_errorMessage("Truncate trace file failed (%s)\n", strerror(errno));
+    fclose(fp);
+}
+
+/*
+ * Move a full log/surface file to its next segment, "next" is the
+ * size of the data about to be written
+ */
+static FILE *va_TraceRotateStream(
+    struct trace_context *trace_ctx,
+    FILE *fp,
+    const char *fn,
+    unsigned int *segment,
+    unsigned long long next
+)
+{
+    off_t size = ftello(fp);
+
+    if ((trace_ctx->trace_file_size == 0) || (size == 0) ||
+        (size + next <= trace_ctx->trace_file_size))
+        return fp;
+
+    va_TraceCloseStream(fp);
+
+    *segment = (*segment + 1) % trace_ctx->trace_file_count;
+    return va_TraceOpenStream(trace_ctx, fn, *segment);
+}
+
 void va_TraceInit(VADisplay dpy)
 {
     char env_value[1024];
@@ -165,18 +298,46 @@ void va_TraceInit(VADisplay dpy)
 
     if (trace_ctx == NULL)
         return;
+
+    trace_ctx->trace_fd_codedbuf = -1;
+    trace_ctx->trace_file_count = 1;
+
+    if (va_parseConfig("LIBVA_TRACE_FILE_SIZE", &env_value[0]) == 0) {
+        char *p;
+
+        trace_ctx->trace_file_size = strtoull(env_value, &p, 0);
+        switch (*p) {
+        case 'G': case 'g':
+            trace_ctx->trace_file_size <<= 10;
+            /* fall through */
+        case 'M': case 'm':
+            trace_ctx->trace_file_size <<= 10;
+            /* fall through */
+        case 'K': case 'k':
+            trace_ctx->trace_file_size <<= 10;
+        default:
+            break;
+        }
+
+        if (va_parseConfig("LIBVA_TRACE_FILE_COUNT", &env_value[0]) == 0)
+            trace_ctx->trace_file_count = atoi(env_value);
+        if (trace_ctx->trace_file_count < 1)
+            trace_ctx->trace_file_count = 1;
+
+        va_infoMessage("LIBVA_TRACE_FILE_SIZE is on, rotate %u trace file(s) of %llu bytes\n",
+                       trace_ctx->trace_file_count, trace_ctx->trace_file_size);
+    }
     
     if (va_parseConfig("LIBVA_TRACE", &env_value[0]) == 0) {
         FILE_NAME_SUFFIX(env_value);
         trace_ctx->trace_log_fn = strdup(env_value);
         
-        tmp = fopen(env_value, "w");
+        tmp = va_TraceOpenStream(trace_ctx, env_value, 0);
         if (tmp) {
             trace_ctx->trace_fp_log = tmp;
             va_infoMessage("LIBVA_TRACE is on, save log into %s\n", trace_ctx->trace_log_fn);
             trace_flag = VA_TRACE_FLAG_LOG;
-        } else
-            va_errorMessage("Open file %s failed (%s)\n", env_value, strerror(errno));
+        }
     }
 
     /* may re-get the global settings for multiple context */
@@ -185,6 +346,11 @@ void va_TraceInit(VADisplay dpy)
         va_infoMessage("LIBVA_TRACE_BUFDATA is on, dump buffer into log file\n");
     }
 
+    if ((trace_flag & VA_TRACE_FLAG_LOG) && (va_parseConfig("LIBVA_TRACE_DURATION", NULL) == 0)) {
+        trace_flag |= VA_TRACE_FLAG_DURATION;
+        va_infoMessage("LIBVA_TRACE_DURATION is on, log the duration of each call\n");
+    }
+
     /* per-context setting */
     if (va_parseConfig("LIBVA_TRACE_CODEDBUF", &env_value[0]) == 0) {
         FILE_NAME_SUFFIX(env_value);
@@ -237,18 +403,51 @@ void va_TraceInit(VADisplay dpy)
 }
 
 
+static void mem_put_le16(char *mem, unsigned int val)
+{
+    mem[0] = val;
+    mem[1] = val>>8;
+}
+
+static void mem_put_le32(char *mem, unsigned int val)
+{
+    mem[0] = val;
+    mem[1] = val>>8;
+    mem[2] = val>>16;
+    mem[3] = val>>24;
+}
+
+static void va_TraceCloseCodedBuf(struct trace_context *trace_ctx)
+{
+    /* the IVF file header was written before the frame count was known */
+    if ((trace_ctx->trace_codedbuf_container == TRACE_CONTAINER_IVF) &&
+        trace_ctx->trace_codedbuf_frames) {
+        char length[4];
+
+        mem_put_le32(length, trace_ctx->trace_codedbuf_frames);
+        if (pwrite(trace_ctx->trace_fd_codedbuf, length, 4, 24) != 4)
+            va_errorMessage("Update IVF header of %s failed (%s)\n",
+                            trace_ctx->trace_codedbuf_fn, strerror(errno));
+    }
+    va_TraceCloseFile(trace_ctx->trace_fd_codedbuf, trace_ctx->trace_codedbuf_size);
+
+    trace_ctx->trace_fd_codedbuf = -1;
+    trace_ctx->trace_codedbuf_size = 0;
+    trace_ctx->trace_codedbuf_frames = 0;
+}
+
 void va_TraceEnd(VADisplay dpy)
 {
     DPY2TRACECTX(dpy);
     
     if (trace_ctx->trace_fp_log)
-        fclose(trace_ctx->trace_fp_log);
+        va_TraceCloseStream(trace_ctx->trace_fp_log);
     
-    if (trace_ctx->trace_fp_codedbuf)
-        fclose(trace_ctx->trace_fp_codedbuf);
+    if (trace_ctx->trace_fd_codedbuf != -1)
+        va_TraceCloseCodedBuf(trace_ctx);
     
     if (trace_ctx->trace_fp_surface)
-        fclose(trace_ctx->trace_fp_surface);
+        va_TraceCloseStream(trace_ctx->trace_fp_surface);
 
     if (trace_ctx->trace_log_fn)
         free(trace_ctx->trace_log_fn);
@@ -271,16 +470,57 @@ static void va_TraceMsg(struct trace_context *trace_ctx, const char *msg, ...)
         return;
 
     if (msg)  {
-        struct timeval tv;
+        if (!trace_ctx->trace_ts_valid &&
+            clock_gettime(CLOCK_MONOTONIC, &trace_ctx->trace_ts) == 0)
+            trace_ctx->trace_ts_valid = 1;
 
-        if (gettimeofday(&tv, NULL) == 0)
-            fprintf(trace_ctx->trace_fp_log, "[%04d.%06d] ",
-                    (unsigned int)tv.tv_sec & 0xffff, (unsigned int)tv.tv_usec);
+        fprintf(trace_ctx->trace_fp_log, "[%lu.%09lu] ",
+                (unsigned long)trace_ctx->trace_ts.tv_sec,
+                (unsigned long)trace_ctx->trace_ts.tv_nsec);
         va_start(args, msg);
         vfprintf(trace_ctx->trace_fp_log, msg, args);
         va_end(args);
-    } else
+    } else {
         fflush(trace_ctx->trace_fp_log);
+
+        /* the trace of one call is done, a good point to rotate the log */
+        trace_ctx->trace_fp_log = va_TraceRotateStream(trace_ctx,
+                                                       trace_ctx->trace_fp_log,
+                                                       trace_ctx->trace_log_fn,
+                                                       &trace_ctx->trace_log_segment,
+                                                       0);
+        if (trace_ctx->trace_fp_log == NULL)
+            trace_flag &= ~(VA_TRACE_FLAG_LOG | VA_TRACE_FLAG_BUFDATA);
+    }
+}
+
+
+static void va_TraceCallBegin(struct trace_context *trace_ctx)
+{
+    /* calls made by the trace itself, e.g. vaSyncSurface, are part of the outer call */
+    if (trace_ctx->trace_call_active++)
+        return;
+
+    trace_ctx->trace_ts_valid = (clock_gettime(CLOCK_MONOTONIC, &trace_ctx->trace_ts) == 0);
+}
+
+static void va_TraceCallEnd(struct trace_context *trace_ctx, const char *func)
+{
+    struct timespec end;
+    unsigned long long duration;
+
+    if ((trace_ctx->trace_call_active == 0) || --trace_ctx->trace_call_active)
+        return;
+
+    if (trace_ctx->trace_ts_valid && (clock_gettime(CLOCK_MONOTONIC, &end) == 0)) {
+        duration = (end.tv_sec - trace_ctx->trace_ts.tv_sec) * 1000000000ULL +
+            end.tv_nsec - trace_ctx->trace_ts.tv_nsec;
+
+        va_TraceMsg(trace_ctx, "==========%s duration = %llu ns\n", func, duration);
+        va_TraceMsg(trace_ctx, NULL);
+    }
+
+    trace_ctx->trace_ts_valid = 0;
 }
 
 
@@ -299,6 +539,7 @@ static void va_TraceSurface(VADisplay dpy)
     unsigned char *Y_data, *UV_data, *tmp;
     VAStatus va_status;
     unsigned char check_sum = 0;
+    unsigned long long frame_size;
     DPY2TRACECTX(dpy);
 
     if (!trace_ctx->trace_fp_surface)
@@ -341,6 +582,19 @@ static void va_TraceSurface(VADisplay dpy)
     va_TraceMsg(trace_ctx, "\tbuffer location = 0x%08x\n", buffer);
     va_TraceMsg(trace_ctx, NULL);
 
+    frame_size = trace_ctx->trace_surface_width * trace_ctx->trace_surface_height;
+    if (fourcc == VA_FOURCC_NV12)
+        frame_size += frame_size / 2;
+    trace_ctx->trace_fp_surface = va_TraceRotateStream(trace_ctx,
+                                                       trace_ctx->trace_fp_surface,
+                                                       trace_ctx->trace_surface_fn,
+                                                       &trace_ctx->trace_surface_segment,
+                                                       frame_size);
+    if (!trace_ctx->trace_fp_surface) {
+        vaUnlockSurface(dpy, trace_ctx->trace_rendertarget);
+        return;
+    }
+
     Y_data = (unsigned char*)buffer;
     UV_data = (unsigned char*)buffer + chroma_u_offset;
 
@@ -424,31 +678,60 @@ void va_TraceCreateConfig(
     if ((encode && (trace_flag & VA_TRACE_FLAG_SURFACE_ENCODE)) ||
         (decode && (trace_flag & VA_TRACE_FLAG_SURFACE_DECODE)) ||
         (jpeg && (trace_flag & VA_TRACE_FLAG_SURFACE_JPEG))) {
-        FILE *tmp = fopen(trace_ctx->trace_surface_fn, "w");
+        FILE *tmp;
+
+        if (trace_ctx->trace_fp_surface)
+            va_TraceCloseStream(trace_ctx->trace_fp_surface);
+
+        trace_ctx->trace_surface_segment = 0;
+        tmp = va_TraceOpenStream(trace_ctx, trace_ctx->trace_surface_fn, 0);
         
         if (tmp)
             trace_ctx->trace_fp_surface = tmp;
         else {
-            va_errorMessage("Open file %s failed (%s)\n",
-                            trace_ctx->trace_surface_fn,
-                            strerror(errno));
             trace_ctx->trace_fp_surface = NULL;
             trace_flag &= ~(VA_TRACE_FLAG_SURFACE);
         }
     }
 
-    if (encode && (trace_flag & VA_TRACE_FLAG_CODEDBUF)) {
-        FILE *tmp = fopen(trace_ctx->trace_codedbuf_fn, "w");
+    if ((encode || jpeg) && (trace_flag & VA_TRACE_FLAG_CODEDBUF) &&
+        (trace_ctx->trace_fd_codedbuf == -1)) {
+        int fd = va_TraceOpenFile(trace_ctx, trace_ctx->trace_codedbuf_fn, 0);
         
-        if (tmp)
-            trace_ctx->trace_fp_codedbuf = tmp;
-        else {
-            va_errorMessage("Open file %s failed (%s)\n",
-                            trace_ctx->trace_codedbuf_fn,
-                            strerror(errno));
-            trace_ctx->trace_fp_codedbuf = NULL;
+        if (fd != -1)
+            trace_ctx->trace_fd_codedbuf = fd;
+        else
             trace_flag &= ~VA_TRACE_FLAG_CODEDBUF;
-        }
+    }
+
+    /* only the encode configs write coded buffers, decode and VPP ones keep the container */
+    if (!encode && !jpeg)
+        return;
+
+    switch (profile) {
+    case VAProfileVP8Version0_3:
+    case VAProfileVP9Profile0:
+    case VAProfileVP9Profile1:
+    case VAProfileVP9Profile2:
+    case VAProfileVP9Profile3:
+        trace_ctx->trace_codedbuf_container = TRACE_CONTAINER_IVF;
+        break;
+    case VAProfileH264Baseline:
+    case VAProfileH264Main:
+    case VAProfileH264High:
+    case VAProfileH264ConstrainedBaseline:
+    case VAProfileH264MultiviewHigh:
+    case VAProfileH264StereoHigh:
+    case VAProfileHEVCMain:
+    case VAProfileHEVCMain10:
+        trace_ctx->trace_codedbuf_container = TRACE_CONTAINER_ANNEXB;
+        break;
+    case VAProfileJPEGBaseline:
+        trace_ctx->trace_codedbuf_container = TRACE_CONTAINER_JFIF;
+        break;
+    default:
+        trace_ctx->trace_codedbuf_container = TRACE_CONTAINER_RAW;
+        break;
     }
 }
 
@@ -703,55 +986,154 @@ void va_TraceDestroyBuffer (
 }
 
 
-static void mem_put_le16(char *mem, unsigned int val)
+static int va_TraceCodedBufferIVFHeader(
+    struct trace_context *trace_ctx,
+    unsigned int frame_length,
+    char *header
+)
 {
-    mem[0] = val;
-    mem[1] = val>>8;
-}
+    int len = 0;
 
-static void mem_put_le32(char *mem, unsigned int val)
-{
-    mem[0] = val;
-    mem[1] = val>>8;
-    mem[2] = val>>16;
-    mem[3] = val>>24;
-}
-
-static void va_TraceCodedBufferIVFHeader(struct trace_context *trace_ctx, void **pbuf)
-{
-    VACodedBufferSegment *buf_list;
-    unsigned int frame_length = 0;
-    char header[32];
+    if (trace_ctx->trace_codedbuf_frames == 0) { /* write ivf header of the segment */
+        unsigned int fourcc = 0x30385056; /* VP80 */
 
-    buf_list = (VACodedBufferSegment *)(*pbuf);
+        if (trace_ctx->trace_profile != VAProfileVP8Version0_3)
+            fourcc = 0x30395056; /* VP90 */
 
-    if (ftell(trace_ctx->trace_fp_codedbuf) == 0) { /* write ivf header */
         header[0] = 'D';
         header[1] = 'K';
         header[2] = 'I';
         header[3] = 'F';
         mem_put_le16(header+4,  0);                     /* version */
         mem_put_le16(header+6,  32);                    /* headersize */
-        mem_put_le32(header+8,  0x30385056);            /* headersize */
+        mem_put_le32(header+8,  fourcc);                /* fourcc */
         /* write width and height of the first rc_param to IVF file header */
         mem_put_le16(header+12, trace_ctx->trace_frame_width);  /* width */
         mem_put_le16(header+14, trace_ctx->trace_frame_height); /* height */
         mem_put_le32(header+16, 30);            /* rate */
         mem_put_le32(header+20, 1);                     /* scale */
-        mem_put_le32(header+24, 0xffffffff);            /* length */
+        mem_put_le32(header+24, 0xffffffff);            /* length, fixed at close */
         mem_put_le32(header+28, 0);                     /* unused */
-        fwrite(header, 1, 32, trace_ctx->trace_fp_codedbuf);
+        len = 32;
     }
 
     /* write frame header */
-    while (buf_list != NULL) {
-        frame_length += buf_list->size;
-        buf_list = (VACodedBufferSegment *) buf_list->next;
+    mem_put_le32(header+len, frame_length);
+    mem_put_le32(header+len+4, trace_ctx->pts&0xFFFFFFFF);
+    mem_put_le32(header+len+8, 0);
+
+    return len + 12;
+}
+
+static int va_TraceWritev(int fd, struct iovec *iov, int iovcnt)
+{
+    while (iovcnt > 0) {
+        ssize_t n = writev(fd, iov, iovcnt);
+
+        if (n < 0) {
+            if (errno == EINTR)
+                continue;
+            return -1;
+        }
+        /* short write, skip what is done and go on with the rest */
+        while (iovcnt > 0 && (size_t)n >= iov->iov_len) {
+            n -= iov->iov_len;
+            iov++;
+            iovcnt--;
+        }
+        if (iovcnt > 0) {
+            iov->iov_base = (char *)iov->iov_base + n;
+            iov->iov_len -= n;
+        }
+    }
+
+    return 0;
+}
+
+/*
+ * Save one coded frame into the container of the current profile.
+ * The container header and the whole VACodedBufferSegment chain are
+ * gathered into one writev
+ */
+static void va_TraceCodedBufferSave(
+    struct trace_context *trace_ctx,
+    VACodedBufferSegment *buf_list
+)
+{
+    static char start_code[4] = { 0, 0, 0, 1 };
+    struct iovec iov[TRACE_CODEDBUF_IOV];
+    char header[32 + 12];
+    VACodedBufferSegment *seg;
+    unsigned char *p = buf_list->buf;
+    unsigned int frame_length = 0, header_length = 0;
+    int iovcnt = 0;
+
+    for (seg = buf_list; seg != NULL; seg = seg->next)
+        frame_length += seg->size;
+
+    /* start the next segment, it gets its own IVF file header */
+    if (trace_ctx->trace_file_size && trace_ctx->trace_codedbuf_size &&
+        (trace_ctx->trace_codedbuf_size + frame_length > trace_ctx->trace_file_size)) {
+        va_TraceCloseCodedBuf(trace_ctx);
+
+        trace_ctx->trace_codedbuf_segment = (trace_ctx->trace_codedbuf_segment + 1) %
+            trace_ctx->trace_file_count;
+        trace_ctx->trace_fd_codedbuf = va_TraceOpenFile(trace_ctx,
+                                                        trace_ctx->trace_codedbuf_fn,
+                                                        trace_ctx->trace_codedbuf_segment);
+        if (trace_ctx->trace_fd_codedbuf == -1)
+            return;
+    }
+
+    switch (trace_ctx->trace_codedbuf_container) {
+    case TRACE_CONTAINER_IVF:
+        iov[0].iov_base = header;
+        header_length = va_TraceCodedBufferIVFHeader(trace_ctx, frame_length, header);
+        iov[0].iov_len = header_length;
+        iovcnt = 1;
+        break;
+    case TRACE_CONTAINER_ANNEXB:
+        /* the driver may return the first NAL unit without its start code */
+        if (buf_list->size < 4 || p[0] != 0 || p[1] != 0 ||
+            (p[2] != 1 && (p[2] != 0 || p[3] != 1))) {
+            iov[0].iov_base = start_code;
+            header_length = sizeof(start_code);
+            iov[0].iov_len = header_length;
+            iovcnt = 1;
+        }
+        break;
+    case TRACE_CONTAINER_JFIF:
+        if (buf_list->size < 2 || p[0] != 0xff || p[1] != 0xd8)
+            va_TraceMsg(trace_ctx, "\tJPEG picture doesn't start with SOI marker\n");
+        break;
+    default:
+        break;
+    }
+
+    for (seg = buf_list; seg != NULL; seg = seg->next) {
+        if (seg->size == 0)
+            continue;
+
+        if (iovcnt == TRACE_CODEDBUF_IOV) {
+            if (va_TraceWritev(trace_ctx->trace_fd_codedbuf, iov, iovcnt))
+                break;
+            iovcnt = 0;
+        }
+        iov[iovcnt].iov_base = seg->buf;
+        iov[iovcnt].iov_len = seg->size;
+        iovcnt++;
+    }
+
+    if (seg || va_TraceWritev(trace_ctx->trace_fd_codedbuf, iov, iovcnt)) {
+        va_errorMessage("Write coded buffer to %s failed (%s)\n",
+                        trace_ctx->trace_codedbuf_fn, strerror(errno));
+        return;
     }
-    mem_put_le32(header, frame_length);
-    mem_put_le32(header+4, trace_ctx->pts&0xFFFFFFFF);
-    mem_put_le32(header+8, 0);
-    fwrite(header, 1, 12, trace_ctx->trace_fp_codedbuf);
+
+    va_TraceMsg(trace_ctx, "\tDump the content to file, pts = %u, frame_size = %u\n",
+                trace_ctx->pts, frame_length);
+    trace_ctx->trace_codedbuf_size += header_length + frame_length;
+    trace_ctx->trace_codedbuf_frames++;
     trace_ctx->pts++;
 }
 
@@ -782,11 +1164,6 @@ void va_TraceMapBuffer (
     if ((pbuf == NULL) || (*pbuf == NULL))
         return;
 
-    if (trace_ctx->trace_profile == VAProfileVP8Version0_3) {
-        va_TraceMsg(trace_ctx, "\tAdd IVF header information\n");
-        va_TraceCodedBufferIVFHeader(trace_ctx, pbuf);
-    }
-
     buf_list = (VACodedBufferSegment *)(*pbuf);
     while (buf_list != NULL) {
         va_TraceMsg(trace_ctx, "\tCodedbuf[%d] =\n", i++);
@@ -797,13 +1174,12 @@ void va_TraceMapBuffer (
         va_TraceMsg(trace_ctx, "\t   reserved = 0x%08x\n", buf_list->reserved);
         va_TraceMsg(trace_ctx, "\t   buf = 0x%08x\n", buf_list->buf);
 
-        if (trace_ctx->trace_fp_codedbuf) {
-            va_TraceMsg(trace_ctx, "\tDump the content to file\n");
-            fwrite(buf_list->buf, buf_list->size, 1, trace_ctx->trace_fp_codedbuf);
-        }
-        
         buf_list = buf_list->next;
     }
+
+    if (trace_ctx->trace_fd_codedbuf != -1)
+        va_TraceCodedBufferSave(trace_ctx, (VACodedBufferSegment *)(*pbuf));
+
     va_TraceMsg(trace_ctx, NULL);
 }
 
@@ -4256,3 +4632,397 @@ void va_TracePutSurface (
     va_TraceMsg(trace_ctx, "\tflags = 0x%08x\n", flags);
     va_TraceMsg(trace_ctx, NULL);
 }
+
+
+/*
+ * Trace layer: the trace hooks are put into the driver vtable by
+ * va_TraceInitLayer() only when tracing is on, so that va.c calls the
+ * driver directly otherwise
+ */
+#define CTX2TRACECTX(ctx) TRACE_CTX((ctx)->va_dpy)
+
+#define TRACE_CALL_BEGIN(trace_ctx)                     \
+    if (trace_flag & VA_TRACE_FLAG_DURATION) {          \
+        va_TraceCallBegin(trace_ctx);                   \
+    }
+#define TRACE_CALL_END(trace_ctx, func)                 \
+    if (trace_flag & VA_TRACE_FLAG_DURATION) {          \
+        va_TraceCallEnd(trace_ctx, #func);              \
+    }
+
+static VAStatus va_TraceHookCreateConfig(
+    VADriverContextP ctx,
+    VAProfile profile,
+    VAEntrypoint entrypoint,
+    VAConfigAttrib *attrib_list,
+    int num_attribs,
+    VAConfigID *config_id /* out */
+)
+{
+    struct trace_context *trace_ctx = CTX2TRACECTX(ctx);
+    VAStatus va_status;
+
+    TRACE_CALL_BEGIN(trace_ctx);
+    va_status = trace_ctx->vtable.vaCreateConfig(ctx, profile, entrypoint, attrib_list, num_attribs, config_id);
+
+    /* record the current entrypoint for further trace determination */
+    VA_TRACE_ALL(va_TraceCreateConfig, ctx->va_dpy, profile, entrypoint, attrib_list, num_attribs, config_id);
+    TRACE_CALL_END(trace_ctx, vaCreateConfig);
+
+    return va_status;
+}
+
+static VAStatus va_TraceHookQuerySurfaceAttributes(
+    VADriverContextP ctx,
+    VAConfigID config,
+    VASurfaceAttrib *attrib_list,
+    unsigned int *num_attribs
+)
+{
+    struct trace_context *trace_ctx = CTX2TRACECTX(ctx);
+    VAStatus va_status;
+
+    TRACE_CALL_BEGIN(trace_ctx);
+    va_status = trace_ctx->vtable.vaQuerySurfaceAttributes(ctx, config, attrib_list, num_attribs);
+    VA_TRACE_LOG(va_TraceQuerySurfaceAttributes, ctx->va_dpy, config, attrib_list, num_attribs);
+    TRACE_CALL_END(trace_ctx, vaQuerySurfaceAttributes);
+
+    return va_status;
+}
+
+static VAStatus va_TraceHookCreateSurfaces(
+    VADriverContextP ctx,
+    int width,
+    int height,
+    int format,
+    int num_surfaces,
+    VASurfaceID *surfaces /* out */
+)
+{
+    struct trace_context *trace_ctx = CTX2TRACECTX(ctx);
+    VAStatus va_status;
+
+    TRACE_CALL_BEGIN(trace_ctx);
+    va_status = trace_ctx->vtable.vaCreateSurfaces(ctx, width, height, format, num_surfaces, surfaces);
+    VA_TRACE_LOG(va_TraceCreateSurfaces,
+                 ctx->va_dpy, width, height, format, num_surfaces, surfaces,
+                 NULL, 0);
+    TRACE_CALL_END(trace_ctx, vaCreateSurfaces);
+
+    return va_status;
+}
+
+static VAStatus va_TraceHookCreateSurfaces2(
+    VADriverContextP ctx,
+    unsigned int format,
+    unsigned int width,
+    unsigned int height,
+    VASurfaceID *surfaces,
+    unsigned int num_surfaces,
+    VASurfaceAttrib *attrib_list,
+    unsigned int num_attribs
+)
+{
+    struct trace_context *trace_ctx = CTX2TRACECTX(ctx);
+    VAStatus va_status;
+
+    TRACE_CALL_BEGIN(trace_ctx);
+    va_status = trace_ctx->vtable.vaCreateSurfaces2(ctx, format, width, height,
+                                                    surfaces, num_surfaces,
+                                                    attrib_list, num_attribs);
+    VA_TRACE_LOG(va_TraceCreateSurfaces,
+                 ctx->va_dpy, width, height, format, num_surfaces, surfaces,
+                 attrib_list, num_attribs);
+    TRACE_CALL_END(trace_ctx, vaCreateSurfaces);
+
+    return va_status;
+}
+
+static VAStatus va_TraceHookDestroySurfaces(
+    VADriverContextP ctx,
+    VASurfaceID *surface_list,
+    int num_surfaces
+)
+{
+    struct trace_context *trace_ctx = CTX2TRACECTX(ctx);
+    VAStatus va_status;
+
+    TRACE_CALL_BEGIN(trace_ctx);
+    VA_TRACE_LOG(va_TraceDestroySurfaces, ctx->va_dpy, surface_list, num_surfaces);
+    va_status = trace_ctx->vtable.vaDestroySurfaces(ctx, surface_list, num_surfaces);
+    TRACE_CALL_END(trace_ctx, vaDestroySurfaces);
+
+    return va_status;
+}
+
+static VAStatus va_TraceHookCreateContext(
+    VADriverContextP ctx,
+    VAConfigID config_id,
+    int picture_width,
+    int picture_height,
+    int flag,
+    VASurfaceID *render_targets,
+    int num_render_targets,
+    VAContextID *context /* out */
+)
+{
+    struct trace_context *trace_ctx = CTX2TRACECTX(ctx);
+    VAStatus va_status;
+
+    TRACE_CALL_BEGIN(trace_ctx);
+    va_status = trace_ctx->vtable.vaCreateContext(ctx, config_id, picture_width, picture_height,
+                                                  flag, render_targets, num_render_targets, context);
+
+    /* keep current encode/decode resoluton */
+    VA_TRACE_ALL(va_TraceCreateContext, ctx->va_dpy, config_id, picture_width, picture_height,
+                 flag, render_targets, num_render_targets, context);
+    TRACE_CALL_END(trace_ctx, vaCreateContext);
+
+    return va_status;
+}
+
+static VAStatus va_TraceHookCreateBuffer(
+    VADriverContextP ctx,
+    VAContextID context,        /* in */
+    VABufferType type,          /* in */
+    unsigned int size,          /* in */
+    unsigned int num_elements,  /* in */
+    void *data,                 /* in */
+    VABufferID *buf_id          /* out */
+)
+{
+    struct trace_context *trace_ctx = CTX2TRACECTX(ctx);
+    VAStatus va_status;
+
+    TRACE_CALL_BEGIN(trace_ctx);
+    va_status = trace_ctx->vtable.vaCreateBuffer(ctx, context, type, size, num_elements, data, buf_id);
+    VA_TRACE_LOG(va_TraceCreateBuffer,
+                 ctx->va_dpy, context, type, size, num_elements, data, buf_id);
+    TRACE_CALL_END(trace_ctx, vaCreateBuffer);
+
+    return va_status;
+}
+
+static VAStatus va_TraceHookMapBuffer(
+    VADriverContextP ctx,
+    VABufferID buf_id,  /* in */
+    void **pbuf         /* out */
+)
+{
+    struct trace_context *trace_ctx = CTX2TRACECTX(ctx);
+    VAStatus va_status;
+
+    TRACE_CALL_BEGIN(trace_ctx);
+    va_status = trace_ctx->vtable.vaMapBuffer(ctx, buf_id, pbuf);
+    VA_TRACE_ALL(va_TraceMapBuffer, ctx->va_dpy, buf_id, pbuf);
+    TRACE_CALL_END(trace_ctx, vaMapBuffer);
+
+    return va_status;
+}
+
+static VAStatus va_TraceHookDestroyBuffer(
+    VADriverContextP ctx,
+    VABufferID buffer_id
+)
+{
+    struct trace_context *trace_ctx = CTX2TRACECTX(ctx);
+    VAStatus va_status;
+
+    TRACE_CALL_BEGIN(trace_ctx);
+    VA_TRACE_LOG(va_TraceDestroyBuffer, ctx->va_dpy, buffer_id);
+    va_status = trace_ctx->vtable.vaDestroyBuffer(ctx, buffer_id);
+    TRACE_CALL_END(trace_ctx, vaDestroyBuffer);
+
+    return va_status;
+}
+
+static VAStatus va_TraceHookBeginPicture(
+    VADriverContextP ctx,
+    VAContextID context,
+    VASurfaceID render_target
+)
+{
+    struct trace_context *trace_ctx = CTX2TRACECTX(ctx);
+    VAStatus va_status;
+
+    TRACE_CALL_BEGIN(trace_ctx);
+    VA_TRACE_ALL(va_TraceBeginPicture, ctx->va_dpy, context, render_target);
+    va_status = trace_ctx->vtable.vaBeginPicture(ctx, context, render_target);
+    TRACE_CALL_END(trace_ctx, vaBeginPicture);
+
+    return va_status;
+}
+
+static VAStatus va_TraceHookRenderPicture(
+    VADriverContextP ctx,
+    VAContextID context,
+    VABufferID *buffers,
+    int num_buffers
+)
+{
+    struct trace_context *trace_ctx = CTX2TRACECTX(ctx);
+    VAStatus va_status;
+
+    TRACE_CALL_BEGIN(trace_ctx);
+    VA_TRACE_LOG(va_TraceRenderPicture, ctx->va_dpy, context, buffers, num_buffers);
+    va_status = trace_ctx->vtable.vaRenderPicture(ctx, context, buffers, num_buffers);
+    TRACE_CALL_END(trace_ctx, vaRenderPicture);
+
+    return va_status;
+}
+
+static VAStatus va_TraceHookEndPicture(
+    VADriverContextP ctx,
+    VAContextID context
+)
+{
+    struct trace_context *trace_ctx = CTX2TRACECTX(ctx);
+    VAStatus va_status;
+
+    TRACE_CALL_BEGIN(trace_ctx);
+    va_status = trace_ctx->vtable.vaEndPicture(ctx, context);
+
+    /* dump surface content */
+    VA_TRACE_ALL(va_TraceEndPicture, ctx->va_dpy, context, 1);
+    TRACE_CALL_END(trace_ctx, vaEndPicture);
+
+    return va_status;
+}
+
+static VAStatus va_TraceHookSyncSurface(
+    VADriverContextP ctx,
+    VASurfaceID render_target
+)
+{
+    struct trace_context *trace_ctx = CTX2TRACECTX(ctx);
+    VAStatus va_status;
+
+    TRACE_CALL_BEGIN(trace_ctx);
+    va_status = trace_ctx->vtable.vaSyncSurface(ctx, render_target);
+    VA_TRACE_LOG(va_TraceSyncSurface, ctx->va_dpy, render_target);
+    TRACE_CALL_END(trace_ctx, vaSyncSurface);
+
+    return va_status;
+}
+
+static VAStatus va_TraceHookQuerySurfaceStatus(
+    VADriverContextP ctx,
+    VASurfaceID render_target,
+    VASurfaceStatus *status     /* out */
+)
+{
+    struct trace_context *trace_ctx = CTX2TRACECTX(ctx);
+    VAStatus va_status;
+
+    TRACE_CALL_BEGIN(trace_ctx);
+    va_status = trace_ctx->vtable.vaQuerySurfaceStatus(ctx, render_target, status);
+    VA_TRACE_LOG(va_TraceQuerySurfaceStatus, ctx->va_dpy, render_target, status);
+    TRACE_CALL_END(trace_ctx, vaQuerySurfaceStatus);
+
+    return va_status;
+}
+
+static VAStatus va_TraceHookQuerySurfaceError(
+    VADriverContextP ctx,
+    VASurfaceID surface,
+    VAStatus error_status,
+    void **error_info           /* out */
+)
+{
+    struct trace_context *trace_ctx = CTX2TRACECTX(ctx);
+    VAStatus va_status;
+
+    TRACE_CALL_BEGIN(trace_ctx);
+    va_status = trace_ctx->vtable.vaQuerySurfaceError(ctx, surface, error_status, error_info);
+    VA_TRACE_LOG(va_TraceQuerySurfaceError, ctx->va_dpy, surface, error_status, error_info);
+    TRACE_CALL_END(trace_ctx, vaQuerySurfaceError);
+
+    return va_status;
+}
+
+static VAStatus va_TraceHookQueryDisplayAttributes(
+    VADriverContextP ctx,
+    VADisplayAttribute *attr_list,      /* out */
+    int *num_attributes                 /* out */
+)
+{
+    struct trace_context *trace_ctx = CTX2TRACECTX(ctx);
+    VAStatus va_status;
+
+    TRACE_CALL_BEGIN(trace_ctx);
+    va_status = trace_ctx->vtable.vaQueryDisplayAttributes(ctx, attr_list, num_attributes);
+    VA_TRACE_LOG(va_TraceQueryDisplayAttributes, ctx->va_dpy, attr_list, num_attributes);
+    TRACE_CALL_END(trace_ctx, vaQueryDisplayAttributes);
+
+    return va_status;
+}
+
+static VAStatus va_TraceHookGetDisplayAttributes(
+    VADriverContextP ctx,
+    VADisplayAttribute *attr_list,      /* in/out */
+    int num_attributes
+)
+{
+    struct trace_context *trace_ctx = CTX2TRACECTX(ctx);
+    VAStatus va_status;
+
+    TRACE_CALL_BEGIN(trace_ctx);
+    va_status = trace_ctx->vtable.vaGetDisplayAttributes(ctx, attr_list, num_attributes);
+    VA_TRACE_LOG(va_TraceGetDisplayAttributes, ctx->va_dpy, attr_list, num_attributes);
+    TRACE_CALL_END(trace_ctx, vaGetDisplayAttributes);
+
+    return va_status;
+}
+
+static VAStatus va_TraceHookSetDisplayAttributes(
+    VADriverContextP ctx,
+    VADisplayAttribute *attr_list,
+    int num_attributes
+)
+{
+    struct trace_context *trace_ctx = CTX2TRACECTX(ctx);
+    VAStatus va_status;
+
+    TRACE_CALL_BEGIN(trace_ctx);
+    va_status = trace_ctx->vtable.vaSetDisplayAttributes(ctx, attr_list, num_attributes);
+    VA_TRACE_LOG(va_TraceSetDisplayAttributes, ctx->va_dpy, attr_list, num_attributes);
+    TRACE_CALL_END(trace_ctx, vaSetDisplayAttributes);
+
+    return va_status;
+}
+
+/* hook an entry of the vtable, if the layer below implements it */
+#define TRACE_HOOK(vtable, func)                        \
+    if (vtable->va##func)                               \
+        vtable->va##func = va_TraceHook##func;
+
+void va_TraceInitLayer(VADisplay dpy)
+{
+    VADriverContextP ctx = ((VADisplayContextP)dpy)->pDriverContext;
+    struct VADriverVTable *vtable = ctx->vtable;
+    DPY2TRACECTX(dpy);
+
+    if (trace_flag == 0)
+        return;
+
+    trace_ctx->vtable = *vtable;
+
+    TRACE_HOOK(vtable, CreateConfig);
+    TRACE_HOOK(vtable, QuerySurfaceAttributes);
+    TRACE_HOOK(vtable, CreateSurfaces);
+    TRACE_HOOK(vtable, CreateSurfaces2);
+    TRACE_HOOK(vtable, DestroySurfaces);
+    TRACE_HOOK(vtable, CreateContext);
+    TRACE_HOOK(vtable, CreateBuffer);
+    TRACE_HOOK(vtable, MapBuffer);
+    TRACE_HOOK(vtable, DestroyBuffer);
+    TRACE_HOOK(vtable, BeginPicture);
+    TRACE_HOOK(vtable, RenderPicture);
+    TRACE_HOOK(vtable, EndPicture);
+    TRACE_HOOK(vtable, SyncSurface);
+    TRACE_HOOK(vtable, QuerySurfaceStatus);
+    TRACE_HOOK(vtable, QuerySurfaceError);
+    TRACE_HOOK(vtable, QueryDisplayAttributes);
+    TRACE_HOOK(vtable, GetDisplayAttributes);
+    TRACE_HOOK(vtable, SetDisplayAttributes);
+}
@@ -39,6 +39,7 @@ extern int trace_flag;
 #define VA_TRACE_FLAG_SURFACE_DECODE  0x8
 #define VA_TRACE_FLAG_SURFACE_ENCODE  0x10
 #define VA_TRACE_FLAG_SURFACE_JPEG    0x20
+#define VA_TRACE_FLAG_DURATION        0x40
 #define VA_TRACE_FLAG_SURFACE         (VA_TRACE_FLAG_SURFACE_DECODE | \
                                        VA_TRACE_FLAG_SURFACE_ENCODE | \
                                        VA_TRACE_FLAG_SURFACE_JPEG)
@@ -57,6 +58,9 @@ void va_TraceInit(VADisplay dpy);
 DLL_HIDDEN
 void va_TraceEnd(VADisplay dpy);
 
+DLL_HIDDEN
+void va_TraceInitLayer(VADisplay dpy);
+
 DLL_HIDDEN
 void va_TraceInitialize (
     VADisplay dpy,
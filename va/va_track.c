@@ -0,0 +1,737 @@
+/*
+ * Copyright (c) 2016 Intel Corporation. All Rights Reserved.
+ *
+ * Permission is hereby granted, free of charge, to any person obtaining a
+ * copy of this software and associated documentation files (the
+ * "Software"), to deal in the Software without restriction, including
+ * without limitation the rights to use, copy, modify, merge, publish,
+ * distribute, sub license, and/or sell copies of the Software, and to
+ * permit persons to whom the Software is furnished to do so, subject to
+ * the following conditions:
+ *
+ * The above copyright notice and this permission notice (including the
+ * next paragraph) shall be included in all copies or substantial portions
+ * of the Software.
+ *
+ * THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND, EXPRESS
+ * OR IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF
+ * MERCHANTABILITY, FITNESS FOR A PARTICULAR PURPOSE AND NON-INFRINGEMENT.
+ * IN NO EVENT SHALL PRECISION INSIGHT AND/OR ITS SUPPLIERS BE LIABLE FOR
+ * ANY CLAIM, DAMAGES OR OTHER LIABILITY, WHETHER IN AN ACTION OF CONTRACT,
+ * TORT OR OTHERWISE, ARISING FROM, OUT OF OR IN CONNECTION WITH THE
+ * SOFTWARE OR THE USE OR OTHER DEALINGS IN THE SOFTWARE.
+ */
+
+#define _GNU_SOURCE 1
+#include "sysdeps.h"
+#include "va.h"
+#include "va_backend.h"
+#include "va_track.h"
+
+#include <stdlib.h>
+#include <stdio.h>
+#include <string.h>
+#include <dlfcn.h>
+#include <pthread.h>
+#ifndef ANDROID
+#include <execinfo.h>
+#include <link.h>
+#endif
+
+/*
+ * Account the objects created through the display, to find the leaks
+ * of long running applications:
+ *
+ * LIBVA_TRACK_OBJECTS:
+ * . if set, every config, context, surface, buffer and image is recorded
+ *   with its size and the call site which created it, see
+ *   vaQueryObjectStats(). vaTerminate reports the objects left alive
+ *
+ * The tracking layer sits right on top of the driver, below fool and
+ * trace, so it only sees the objects the driver really allocated.
+ */
+
+/* frames walked back to find the caller of libva */
+#define TRACK_FRAMES            16
+/* initial slots of the object table, a power of 2 */
+#define TRACK_TABLE_MIN         256
+
+struct track_entry {
+    unsigned long long key;     /* (type + 1) << 32 | id, 0 for a free slot */
+    unsigned long long size;    /* bytes held by the object */
+    const void *site;           /* return address in the code calling libva */
+};
+
+struct track_context {
+    pthread_mutex_t lock;
+
+    /* open addressing, linear probing, at most half full */
+    struct track_entry *table;
+    unsigned int table_size;
+    unsigned int table_used;
+
+    VAObjectStats stats;
+
+    struct VADriverVTable vtable; /* layer below, called by the track hooks */
+};
+
+#define TRACK_CTX(dpy) ((struct track_context *)((VADisplayContextP)dpy)->vatrack)
+#define CTX2TRACKCTX(ctx) TRACK_CTX((ctx)->va_dpy)
+
+#define TRACK_KEY(type, id) ((((unsigned long long)(type) + 1) << 32) | (unsigned int)(id))
+#define TRACK_KEY_TYPE(key) ((VAObjectType)(((key) >> 32) - 1))
+#define TRACK_KEY_ID(key)   ((unsigned int)(key))
+
+static const char *track_type_name[VAObjectTypeCount] = {
+    "config", "context", "surface", "buffer", "image"
+};
+
+/* Prototype declarations (functions defined in va.c) */
+
+void va_errorMessage(const char *msg, ...);
+void va_infoMessage(const char *msg, ...);
+
+int  va_parseConfig(char *env, char *env_value);
+
+#ifndef ANDROID
+/* address range of libva itself, frames in it are skipped for the call site */
+static unsigned long track_self_start;
+static unsigned long track_self_end;
+
+static int va_TrackFindSelf(struct dl_phdr_info *info, size_t size, void *data)
+{
+    unsigned long addr = (unsigned long)data;
+    unsigned long start = ~0UL, end = 0;
+    int i;
+
+    for (i = 0; i < info->dlpi_phnum; i++) {
+        const ElfW(Phdr) *phdr = &info->dlpi_phdr[i];
+
+        if (phdr->p_type != PT_LOAD)
+            continue;
+        if (info->dlpi_addr + phdr->p_vaddr < start)
+            start = info->dlpi_addr + phdr->p_vaddr;
+        if (info->dlpi_addr + phdr->p_vaddr + phdr->p_memsz > end)
+            end = info->dlpi_addr + phdr->p_vaddr + phdr->p_memsz;
+    }
+    if (addr < start || addr >= end)
+        return 0;
+
+    track_self_start = start;
+    track_self_end = end;
+    return 1;
+}
+#endif
+
+/* first return address outside libva, NULL if it cannot be found */
+static const void *va_TrackCallSite(void)
+{
+#ifndef ANDROID
+    void *frames[TRACK_FRAMES];
+    int i, n;
+
+    n = backtrace(frames, TRACK_FRAMES);
+    for (i = 1; i < n; i++) {
+        unsigned long addr = (unsigned long)frames[i];
+
+        if (addr < track_self_start || addr >= track_self_end)
+            return frames[i];
+    }
+#endif
+    return NULL;
+}
+
+static inline unsigned int va_TrackHash(unsigned long long key, unsigned int mask)
+{
+    key *= 0x9e3779b97f4a7c15ULL;
+    return (unsigned int)(key >> 32) & mask;
+}
+
+static void va_TrackPut(struct track_entry *table, unsigned int mask, const struct track_entry *entry)
+{
+    unsigned int i = va_TrackHash(entry->key, mask);
+
+    while (table[i].key)
+        i = (i + 1) & mask;
+    table[i] = *entry;
+}
+
+static int va_TrackGrow(struct track_context *track_ctx)
+{
+    unsigned int size = track_ctx->table_size ? track_ctx->table_size * 2 : TRACK_TABLE_MIN;
+    struct track_entry *table = calloc(size, sizeof(*table));
+    unsigned int i;
+
+    if (table == NULL)
+        return -1;
+
+    for (i = 0; i < track_ctx->table_size; i++) {
+        if (track_ctx->table[i].key)
+            va_TrackPut(table, size - 1, &track_ctx->table[i]);
+    }
+    free(track_ctx->table);
+    track_ctx->table = table;
+    track_ctx->table_size = size;
+
+    return 0;
+}
+
+/* must be called with the lock held */
+static struct track_entry *va_TrackFind(struct track_context *track_ctx, unsigned long long key)
+{
+    unsigned int mask = track_ctx->table_size - 1;
+    unsigned int i;
+
+    if (track_ctx->table_size == 0)
+        return NULL;
+
+    for (i = va_TrackHash(key, mask); track_ctx->table[i].key; i = (i + 1) & mask) {
+        if (track_ctx->table[i].key == key)
+            return &track_ctx->table[i];
+    }
+    return NULL;
+}
+
+static void va_TrackStatsAdd(struct track_context *track_ctx, VAObjectType type, unsigned long long size)
+{
+    VAObjectStats *stats = &track_ctx->stats;
+
+    stats->live_count[type]++;
+    stats->live_bytes[type] += size;
+    if (stats->live_bytes[type] > stats->peak_bytes[type])
+        stats->peak_bytes[type] = stats->live_bytes[type];
+}
+
+static void va_TrackStatsSub(struct track_context *track_ctx, VAObjectType type, unsigned long long size)
+{
+    VAObjectStats *stats = &track_ctx->stats;
+
+    stats->live_count[type]--;
+    stats->live_bytes[type] -= size;
+}
+
+static void va_TrackCreate(
+    struct track_context *track_ctx,
+    VAObjectType type,
+    VAGenericID id,
+    unsigned long long size,
+    const void *site
+)
+{
+    struct track_entry *entry;
+
+    pthread_mutex_lock(&track_ctx->lock);
+
+    entry = va_TrackFind(track_ctx, TRACK_KEY(type, id));
+    if (entry) {
+        /* the ID is reused, the old object went away unseen */
+        va_TrackStatsSub(track_ctx, type, entry->size);
+    } else {
+        struct track_entry new_entry;
+
+        if ((track_ctx->table_used + 1) * 2 > track_ctx->table_size &&
+            va_TrackGrow(track_ctx)) {
+            pthread_mutex_unlock(&track_ctx->lock);
+            va_errorMessage("%s L%d Out of memory!\n", __FUNCTION__, __LINE__);
+            return;
+        }
+
+        new_entry.key = TRACK_KEY(type, id);
+        va_TrackPut(track_ctx->table, track_ctx->table_size - 1, &new_entry);
+        track_ctx->table_used++;
+        entry = va_TrackFind(track_ctx, new_entry.key);
+    }
+    entry->size = size;
+    entry->site = site;
+    va_TrackStatsAdd(track_ctx, type, size);
+
+    pthread_mutex_unlock(&track_ctx->lock);
+}
+
+static void va_TrackDestroy(struct track_context *track_ctx, VAObjectType type, VAGenericID id)
+{
+    struct track_entry *entry;
+    unsigned int mask, i, j, k;
+
+    pthread_mutex_lock(&track_ctx->lock);
+
+    entry = va_TrackFind(track_ctx, TRACK_KEY(type, id));
+    if (entry == NULL) {
+        pthread_mutex_unlock(&track_ctx->lock);
+        return;
+    }
+    va_TrackStatsSub(track_ctx, type, entry->size);
+
+    /* backward shift deletion, no tombstones are left in the table */
+    mask = track_ctx->table_size - 1;
+    i = entry - track_ctx->table;
+    j = i;
+    for (;;) {
+        track_ctx->table[i].key = 0;
+        do {
+            j = (j + 1) & mask;
+            if (track_ctx->table[j].key == 0)
+                goto out;
+            k = va_TrackHash(track_ctx->table[j].key, mask);
+        } while (i <= j ? (i < k && k <= j) : (i < k || k <= j));
+        track_ctx->table[i] = track_ctx->table[j];
+        i = j;
+    }
+out:
+    track_ctx->table_used--;
+
+    pthread_mutex_unlock(&track_ctx->lock);
+}
+
+static void va_TrackResize(struct track_context *track_ctx, VAObjectType type, VAGenericID id, unsigned long long size)
+{
+    struct track_entry *entry;
+
+    pthread_mutex_lock(&track_ctx->lock);
+
+    entry = va_TrackFind(track_ctx, TRACK_KEY(type, id));
+    if (entry) {
+        va_TrackStatsSub(track_ctx, type, entry->size);
+        entry->size = size;
+        va_TrackStatsAdd(track_ctx, type, size);
+    }
+
+    pthread_mutex_unlock(&track_ctx->lock);
+}
+
+/* estimated from the render target format, without driver alignment */
+static unsigned long long va_TrackSurfaceSize(unsigned int format, unsigned int width, unsigned int height)
+{
+    unsigned long long pixels = (unsigned long long)width * height;
+
+    switch (format & ~VA_RT_FORMAT_PROTECTED) {
+    case VA_RT_FORMAT_YUV400:
+        return pixels;
+    case VA_RT_FORMAT_YUV422:
+    case VA_RT_FORMAT_RGB16:
+        return pixels * 2;
+    case VA_RT_FORMAT_YUV444:
+    case VA_RT_FORMAT_RGBP:
+    case VA_RT_FORMAT_YUV420_10BPP:
+        return pixels * 3;
+    case VA_RT_FORMAT_RGB32:
+    case VA_RT_FORMAT_RGB32_10BPP:
+        return pixels * 4;
+    case VA_RT_FORMAT_YUV420:
+    case VA_RT_FORMAT_YUV411:
+    default:
+        return pixels * 3 / 2;
+    }
+}
+
+void va_TrackInit(VADisplay dpy)
+{
+    struct track_context *track_ctx;
+
+    if (va_parseConfig("LIBVA_TRACK_OBJECTS", NULL) != 0)
+        return;
+
+    track_ctx = calloc(sizeof(struct track_context), 1);
+    if (track_ctx == NULL)
+        return;
+
+    pthread_mutex_init(&track_ctx->lock, NULL);
+
+#ifndef ANDROID
+    if (track_self_end == 0)
+        dl_iterate_phdr(va_TrackFindSelf, (void *)(unsigned long)va_TrackInit);
+#endif
+
+    va_infoMessage("LIBVA_TRACK_OBJECTS is on, account the objects of the display\n");
+
+    ((VADisplayContextP)dpy)->vatrack = track_ctx;
+}
+
+static int va_TrackCompareLeak(const void *a, const void *b)
+{
+    const struct track_entry *ea = a, *eb = b;
+
+    if (TRACK_KEY_TYPE(ea->key) != TRACK_KEY_TYPE(eb->key))
+        return TRACK_KEY_TYPE(ea->key) < TRACK_KEY_TYPE(eb->key) ? -1 : 1;
+    if (ea->site != eb->site)
+        return (unsigned long)ea->site < (unsigned long)eb->site ? -1 : 1;
+    return 0;
+}
+
+static void va_TrackReportLeak(const struct track_entry *entry, unsigned int count, unsigned long long size)
+{
+    VAObjectType type = TRACK_KEY_TYPE(entry->key);
+    Dl_info info;
+
+    if (entry->site && dladdr(entry->site, &info) && info.dli_fname) {
+        const char *fname = strrchr(info.dli_fname, '/');
+
+        va_errorMessage("vaTerminate: %u %s(s) of %llu bytes leaked, first %#x, created at %s+%#lx (%s)\n",
+                        count, track_type_name[type], size, TRACK_KEY_ID(entry->key),
+                        fname ? fname + 1 : info.dli_fname,
+                        (unsigned long)entry->site - (unsigned long)info.dli_fbase,
+                        info.dli_sname ? info.dli_sname : "??");
+    } else
+        va_errorMessage("vaTerminate: %u %s(s) of %llu bytes leaked, first %#x, created at %p\n",
+                        count, track_type_name[type], size, TRACK_KEY_ID(entry->key),
+                        entry->site);
+}
+
+/* group the live objects by type and call site */
+static void va_TrackReport(struct track_context *track_ctx)
+{
+    struct track_entry *leaks;
+    unsigned int i, n, first;
+    unsigned long long size;
+
+    if (track_ctx->table_used == 0)
+        return;
+
+    leaks = malloc(track_ctx->table_used * sizeof(*leaks));
+    if (leaks == NULL)
+        return;
+
+    for (i = 0, n = 0; i < track_ctx->table_size; i++) {
+        if (track_ctx->table[i].key)
+            leaks[n++] = track_ctx->table[i];
+    }
+    qsort(leaks, n, sizeof(*leaks), va_TrackCompareLeak);
+
+    for (first = 0; first < n; first = i) {
+        size = 0;
+        for (i = first; i < n && va_TrackCompareLeak(&leaks[first], &leaks[i]) == 0; i++)
+            size += leaks[i].size;
+        va_TrackReportLeak(&leaks[first], i - first, size);
+    }
+
+    for (i = 0; i < VAObjectTypeCount; i++) {
+        if (track_ctx->stats.live_count[i])
+            va_errorMessage("vaTerminate: %u %s(s) not destroyed, %llu bytes, peak %llu bytes\n",
+                            track_ctx->stats.live_count[i], track_type_name[i],
+                            track_ctx->stats.live_bytes[i], track_ctx->stats.peak_bytes[i]);
+    }
+
+    free(leaks);
+}
+
+void va_TrackEnd(VADisplay dpy)
+{
+    struct track_context *track_ctx = TRACK_CTX(dpy);
+
+    if (track_ctx == NULL)
+        return;
+
+    va_TrackReport(track_ctx);
+
+    pthread_mutex_destroy(&track_ctx->lock);
+    free(track_ctx->table);
+    free(track_ctx);
+    ((VADisplayContextP)dpy)->vatrack = NULL;
+}
+
+VAStatus va_TrackQueryObjectStats(
+    VADisplay dpy,
+    VAObjectStats *stats /* out */
+)
+{
+    struct track_context *track_ctx = TRACK_CTX(dpy);
+
+    if (track_ctx == NULL)
+        return VA_STATUS_ERROR_UNIMPLEMENTED;
+    if (stats == NULL)
+        return VA_STATUS_ERROR_INVALID_PARAMETER;
+
+    pthread_mutex_lock(&track_ctx->lock);
+    *stats = track_ctx->stats;
+    pthread_mutex_unlock(&track_ctx->lock);
+
+    return VA_STATUS_SUCCESS;
+}
+
+
+/*
+ * Track layer: the hooks record the objects once the layer below
+ * created them, and forget them once it destroyed them
+ */
+static VAStatus va_TrackHookCreateConfig(
+    VADriverContextP ctx,
+    VAProfile profile,
+    VAEntrypoint entrypoint,
+    VAConfigAttrib *attrib_list,
+    int num_attribs,
+    VAConfigID *config_id /* out */
+)
+{
+    struct track_context *track_ctx = CTX2TRACKCTX(ctx);
+    VAStatus va_status;
+
+    va_status = track_ctx->vtable.vaCreateConfig(ctx, profile, entrypoint, attrib_list, num_attribs, config_id);
+    if (va_status == VA_STATUS_SUCCESS)
+        va_TrackCreate(track_ctx, VAObjectConfig, *config_id, 0, va_TrackCallSite());
+
+    return va_status;
+}
+
+static VAStatus va_TrackHookDestroyConfig(
+    VADriverContextP ctx,
+    VAConfigID config_id
+)
+{
+    struct track_context *track_ctx = CTX2TRACKCTX(ctx);
+    VAStatus va_status;
+
+    va_status = track_ctx->vtable.vaDestroyConfig(ctx, config_id);
+    if (va_status == VA_STATUS_SUCCESS)
+        va_TrackDestroy(track_ctx, VAObjectConfig, config_id);
+
+    return va_status;
+}
+
+static VAStatus va_TrackHookCreateSurfaces(
+    VADriverContextP ctx,
+    int width,
+    int height,
+    int format,
+    int num_surfaces,
+    VASurfaceID *surfaces /* out */
+)
+{
+    struct track_context *track_ctx = CTX2TRACKCTX(ctx);
+    VAStatus va_status;
+    int i;
+
+    va_status = track_ctx->vtable.vaCreateSurfaces(ctx, width, height, format, num_surfaces, surfaces);
+    if (va_status == VA_STATUS_SUCCESS) {
+        unsigned long long size = va_TrackSurfaceSize(format, width, height);
+        const void *site = va_TrackCallSite();
+
+        for (i = 0; i < num_surfaces; i++)
+            va_TrackCreate(track_ctx, VAObjectSurface, surfaces[i], size, site);
+    }
+
+    return va_status;
+}
+
+static VAStatus va_TrackHookCreateSurfaces2(
+    VADriverContextP ctx,
+    unsigned int format,
+    unsigned int width,
+    unsigned int height,
+    VASurfaceID *surfaces,
+    unsigned int num_surfaces,
+    VASurfaceAttrib *attrib_list,
+    unsigned int num_attribs
+)
+{
+    struct track_context *track_ctx = CTX2TRACKCTX(ctx);
+    VAStatus va_status;
+    unsigned int i;
+
+    va_status = track_ctx->vtable.vaCreateSurfaces2(ctx, format, width, height,
+                                                    surfaces, num_surfaces,
+                                                    attrib_list, num_attribs);
+    if (va_status == VA_STATUS_SUCCESS) {
+        unsigned long long size = va_TrackSurfaceSize(format, width, height);
+        const void *site = va_TrackCallSite();
+
+        for (i = 0; i < num_surfaces; i++)
+            va_TrackCreate(track_ctx, VAObjectSurface, surfaces[i], size, site);
+    }
+
+    return va_status;
+}
+
+static VAStatus va_TrackHookDestroySurfaces(
+    VADriverContextP ctx,
+    VASurfaceID *surface_list,
+    int num_surfaces
+)
+{
+    struct track_context *track_ctx = CTX2TRACKCTX(ctx);
+    VAStatus va_status;
+    int i;
+
+    va_status = track_ctx->vtable.vaDestroySurfaces(ctx, surface_list, num_surfaces);
+    if (va_status == VA_STATUS_SUCCESS) {
+        for (i = 0; i < num_surfaces; i++)
+            va_TrackDestroy(track_ctx, VAObjectSurface, surface_list[i]);
+    }
+
+    return va_status;
+}
+
+static VAStatus va_TrackHookCreateContext(
+    VADriverContextP ctx,
+    VAConfigID config_id,
+    int picture_width,
+    int picture_height,
+    int flag,
+    VASurfaceID *render_targets,
+    int num_render_targets,
+    VAContextID *context /* out */
+)
+{
+    struct track_context *track_ctx = CTX2TRACKCTX(ctx);
+    VAStatus va_status;
+
+    va_status = track_ctx->vtable.vaCreateContext(ctx, config_id, picture_width, picture_height,
+                                                  flag, render_targets, num_render_targets, context);
+    if (va_status == VA_STATUS_SUCCESS)
+        va_TrackCreate(track_ctx, VAObjectContext, *context, 0, va_TrackCallSite());
+
+    return va_status;
+}
+
+static VAStatus va_TrackHookDestroyContext(
+    VADriverContextP ctx,
+    VAContextID context
+)
+{
+    struct track_context *track_ctx = CTX2TRACKCTX(ctx);
+    VAStatus va_status;
+
+    va_status = track_ctx->vtable.vaDestroyContext(ctx, context);
+    if (va_status == VA_STATUS_SUCCESS)
+        va_TrackDestroy(track_ctx, VAObjectContext, context);
+
+    return va_status;
+}
+
+static VAStatus va_TrackHookCreateBuffer(
+    VADriverContextP ctx,
+    VAContextID context,        /* in */
+    VABufferType type,          /* in */
+    unsigned int size,          /* in */
+    unsigned int num_elements,  /* in */
+    void *data,                 /* in */
+    VABufferID *buf_id          /* out */
+)
+{
+    struct track_context *track_ctx = CTX2TRACKCTX(ctx);
+    VAStatus va_status;
+
+    va_status = track_ctx->vtable.vaCreateBuffer(ctx, context, type, size, num_elements, data, buf_id);
+    if (va_status == VA_STATUS_SUCCESS)
+        va_TrackCreate(track_ctx, VAObjectBuffer, *buf_id,
+                       (unsigned long long)size * num_elements, va_TrackCallSite());
+
+    return va_status;
+}
+
+static VAStatus va_TrackHookBufferSetNumElements(
+    VADriverContextP ctx,
+    VABufferID buf_id,          /* in */
+    unsigned int num_elements   /* in */
+)
+{
+    struct track_context *track_ctx = CTX2TRACKCTX(ctx);
+    VABufferType type;
+    unsigned int size, elements;
+    VAStatus va_status;
+
+    va_status = track_ctx->vtable.vaBufferSetNumElements(ctx, buf_id, num_elements);
+    if (va_status == VA_STATUS_SUCCESS &&
+        track_ctx->vtable.vaBufferInfo &&
+        track_ctx->vtable.vaBufferInfo(ctx, buf_id, &type, &size, &elements) == VA_STATUS_SUCCESS)
+        va_TrackResize(track_ctx, VAObjectBuffer, buf_id, (unsigned long long)size * elements);
+
+    return va_status;
+}
+
+static VAStatus va_TrackHookDestroyBuffer(
+    VADriverContextP ctx,
+    VABufferID buffer_id
+)
+{
+    struct track_context *track_ctx = CTX2TRACKCTX(ctx);
+    VAStatus va_status;
+
+    va_status = track_ctx->vtable.vaDestroyBuffer(ctx, buffer_id);
+    if (va_status == VA_STATUS_SUCCESS)
+        va_TrackDestroy(track_ctx, VAObjectBuffer, buffer_id);
+
+    return va_status;
+}
+
+static VAStatus va_TrackHookCreateImage(
+    VADriverContextP ctx,
+    VAImageFormat *format,
+    int width,
+    int height,
+    VAImage *image      /* out */
+)
+{
+    struct track_context *track_ctx = CTX2TRACKCTX(ctx);
+    VAStatus va_status;
+
+    va_status = track_ctx->vtable.vaCreateImage(ctx, format, width, height, image);
+    if (va_status == VA_STATUS_SUCCESS)
+        va_TrackCreate(track_ctx, VAObjectImage, image->image_id,
+                       image->data_size, va_TrackCallSite());
+
+    return va_status;
+}
+
+static VAStatus va_TrackHookDeriveImage(
+    VADriverContextP ctx,
+    VASurfaceID surface,
+    VAImage *image      /* out */
+)
+{
+    struct track_context *track_ctx = CTX2TRACKCTX(ctx);
+    VAStatus va_status;
+
+    va_status = track_ctx->vtable.vaDeriveImage(ctx, surface, image);
+
+    /* the image shares the memory of the surface */
+    if (va_status == VA_STATUS_SUCCESS)
+        va_TrackCreate(track_ctx, VAObjectImage, image->image_id, 0, va_TrackCallSite());
+
+    return va_status;
+}
+
+static VAStatus va_TrackHookDestroyImage(
+    VADriverContextP ctx,
+    VAImageID image
+)
+{
+    struct track_context *track_ctx = CTX2TRACKCTX(ctx);
+    VAStatus va_status;
+
+    va_status = track_ctx->vtable.vaDestroyImage(ctx, image);
+    if (va_status == VA_STATUS_SUCCESS)
+        va_TrackDestroy(track_ctx, VAObjectImage, image);
+
+    return va_status;
+}
+
+/* hook an entry of the vtable, if the layer below implements it */
+#define TRACK_HOOK(vtable, func)                        \
+    if (vtable->va##func)                               \
+        vtable->va##func = va_TrackHook##func;
+
+void va_TrackInitLayer(VADisplay dpy)
+{
+    VADriverContextP ctx = ((VADisplayContextP)dpy)->pDriverContext;
+    struct VADriverVTable *vtable = ctx->vtable;
+    struct track_context *track_ctx = TRACK_CTX(dpy);
+
+    if (track_ctx == NULL)
+        return;
+
+    track_ctx->vtable = *vtable;
+
+    TRACK_HOOK(vtable, CreateConfig);
+    TRACK_HOOK(vtable, DestroyConfig);
+    TRACK_HOOK(vtable, CreateSurfaces);
+    TRACK_HOOK(vtable, CreateSurfaces2);
+    TRACK_HOOK(vtable, DestroySurfaces);
+    TRACK_HOOK(vtable, CreateContext);
+    TRACK_HOOK(vtable, DestroyContext);
+    TRACK_HOOK(vtable, CreateBuffer);
+    TRACK_HOOK(vtable, BufferSetNumElements);
+    TRACK_HOOK(vtable, DestroyBuffer);
+    TRACK_HOOK(vtable, CreateImage);
+    TRACK_HOOK(vtable, DeriveImage);
+    TRACK_HOOK(vtable, DestroyImage);
+}